@@ -26,6 +26,7 @@ int *__error();
 #define EACCES		0x1BAD0011
 #define EPERM		0x1BAD0012
 #define ENOSPC		0x1BAD0013
+#define ESRCH		0x1BAD0014
 
 #define EAFNOSUPPORT	0x1BAD0020
 #define ENOPROTOOPT	0x1BAD0021
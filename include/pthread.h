@@ -2,6 +2,7 @@
 #ifndef __PTHREAD_H__
 #define __PTHREAD_H__
 
+#include <sched.h>
 #include <time.h>
 
 #define PTHREAD_MUTEX_INITIALIZER	NULL
@@ -22,6 +23,18 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 void pthread_exit(void *value_ptr);
 int pthread_join(pthread_t thread, void **value_ptr);
 void pthread_yield(void);
+int pthread_setschedprio(pthread_t thread, int prio);
+
+/*
+ * Attributes
+ */
+
+int pthread_attr_init(pthread_attr_t *attr);
+int pthread_attr_destroy(pthread_attr_t *attr);
+int pthread_attr_getschedparam(const pthread_attr_t *attr,
+			       struct sched_param *param);
+int pthread_attr_setschedparam(pthread_attr_t *attr,
+			       const struct sched_param *param);
 
 /*
  * Barriers
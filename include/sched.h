@@ -0,0 +1,12 @@
+
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include <sys/priority.h>
+
+struct sched_param {
+    int		sched_priority;
+};
+
+#endif /* __SCHED_H__ */
+
@@ -35,6 +35,9 @@ int OSGetTID();
 int OSThreadExit(uint64_t status);
 int OSThreadSleep(uint64_t time);
 int OSThreadWait(uint64_t tid);
+uint64_t OSThreadPriority(uint64_t tid, int priority);
+int OSFutexWait(uint64_t *addr, uint64_t val, uint64_t timeout);
+uint64_t OSFutexWake(uint64_t *addr, uint64_t count);
 
 // Network
 int OSNICStat(uint64_t nicNo, NIC *nic);
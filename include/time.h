@@ -26,6 +26,7 @@ struct tm *gmtime_r(const time_t *timep, struct tm *result);
 struct tm *localtime(const time_t *timep);
 struct tm *localtime_r(const time_t *timep, struct tm *result);
 time_t mktime(struct tm *tm);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 
 #endif /* __TIME_H__ */
 
@@ -10,6 +10,7 @@ struct timeval;
 
 int syscall(int number, ...);
 unsigned int sleep(unsigned int seconds);
+int usleep(unsigned int usec);
 pid_t spawn(const char *path, const char *argv[]);
 
 #endif /* __UNISTD_H__ */
@@ -5,34 +5,64 @@
 #include <syscall.h>
 #include <core/mutex.h>
 
+/*
+ * The lock word is UNLOCKED, LOCKED or CONTENDED.  The uncontended paths never
+ * enter the kernel, a waiter marks the mutex CONTENDED before sleeping on the
+ * word so that the owner knows to wake it on unlock.
+ */
+#define COREMUTEX_UNLOCKED	0
+#define COREMUTEX_LOCKED	1
+#define COREMUTEX_CONTENDED	2
+
+#define COREMUTEX_SPIN		100
+
 void
 CoreMutex_Init(CoreMutex *mtx)
 {
-    mtx->lock = 0;
+    mtx->lock = COREMUTEX_UNLOCKED;
 }
 
 
 void
 CoreMutex_Lock(CoreMutex *mtx)
 {
-    while (__sync_lock_test_and_set(&mtx->lock, 1) == 1) {
-	OSThreadSleep(0);
+    int i;
+    uint64_t c;
+
+    // Spin briefly in case the owner is about to release the lock
+    for (i = 0; i < COREMUTEX_SPIN; i++) {
+	c = __sync_val_compare_and_swap(&mtx->lock, COREMUTEX_UNLOCKED,
+					COREMUTEX_LOCKED);
+	if (c == COREMUTEX_UNLOCKED)
+	    return;
+	if (c == COREMUTEX_CONTENDED)
+	    break;
+	asm volatile("pause");
+    }
+
+    /*
+     * We cannot tell whether anyone else is asleep, so we take the lock in the
+     * CONTENDED state and wake a waiter when we release it.
+     */
+    while (__sync_lock_test_and_set(&mtx->lock, COREMUTEX_CONTENDED) !=
+	   COREMUTEX_UNLOCKED) {
+	OSFutexWait(&mtx->lock, COREMUTEX_CONTENDED, 0);
     }
 }
 
 bool
 CoreMutex_TryLock(CoreMutex *mtx)
 {
-    if (__sync_lock_test_and_set(&mtx->lock, 1) == 1) {
-	return false;
-    } else {
-	return true;
-    }
+    return __sync_bool_compare_and_swap(&mtx->lock, COREMUTEX_UNLOCKED,
+					COREMUTEX_LOCKED);
 }
 
 void
 CoreMutex_Unlock(CoreMutex *mtx)
 {
-    __sync_lock_release(&mtx->lock);
+    if (__sync_fetch_and_sub(&mtx->lock, 1) != COREMUTEX_LOCKED) {
+	__sync_lock_release(&mtx->lock);
+	OSFutexWake(&mtx->lock, 1);
+    }
 }
 
@@ -19,6 +19,7 @@ typedef struct Header {
 #define HEAP_POOLS			(12)
 
 #define PGSIZE		4096
+#define LARGE_PGSIZE	(2 * 1024 * 1024)
 #define HEAP_INCREMENT	(PGSIZE / 64)
 
 typedef struct HeapPool {
@@ -124,9 +125,15 @@ static void *
 malloc_large(size_t sz)
 {
     uintptr_t ptr = largePool.top;
-    uintptr_t realSz = ROUNDUP(sz, 4096);
+    uintptr_t realSz = ROUNDUP(sz + sizeof(Header), PGSIZE);
     Header *addr;
 
+    // Align big allocations so the kernel can back them with large pages
+    if (realSz >= LARGE_PGSIZE) {
+	ptr = ROUNDUP(ptr, LARGE_PGSIZE);
+	realSz = ROUNDUP(realSz, LARGE_PGSIZE);
+    }
+
     addr = (Header *)mmap((void *)ptr, realSz,
 			  PROT_READ|PROT_WRITE, MAP_ANON|MAP_FIXED,
 			  -1, 0);
@@ -139,7 +146,7 @@ malloc_large(size_t sz)
     addr->size = realSz;
     addr->next = 0;
 
-    largePool.top += realSz;
+    largePool.top = ptr + realSz;
 
     return (void *)(addr + 1);
 }
@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 
@@ -54,17 +55,33 @@ mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
 int
 munmap(void *addr, size_t len)
 {
+    int status;
+
     // XXX: Update mappings
 
-    return OSMemUnmap(addr, len);
+    status = OSMemUnmap(addr, len);
+    if (status != 0) {
+	errno = status;
+	return -1;
+    }
+
+    return 0;
 }
 
 int
 mprotect(void *addr, size_t len, int prot)
 {
+    int status;
+
     // XXX: Update mappings
 
-    return OSMemProtect(addr, len, prot);
+    status = OSMemProtect(addr, len, prot);
+    if (status != 0) {
+	errno = status;
+	return -1;
+    }
+
+    return 0;
 }
 
 int
@@ -15,7 +15,8 @@
 #include <sys/syscall.h>
 
 struct pthread_attr {
-    uint64_t	_unused;
+    bool	setPriority;		    // Otherwise inherited
+    int		priority;
 };
 
 struct pthread {
@@ -26,9 +27,12 @@ struct pthread {
     // Initialization
     void	*(*entry)(void *);
     void	*arg;
+    bool	setPriority;		    // Otherwise inherited
+    int		priority;
 
     // Termination
     void	*result;
+    uint64_t	exited;			    // Futex for pthread_join
 
     // Condition Variables
     TAILQ_ENTRY(pthread)    cvTable;
@@ -67,6 +71,7 @@ __pthread_init(void)
     thr->error = 0;
     thr->entry = NULL;
     thr->arg = 0;
+    thr->exited = 0;
 
     CoreMutex_Init(&__threadTableLock);
 
@@ -94,14 +99,28 @@ pthread_self(void)
     abort();
 }
 
+static void
+pthreadExit(struct pthread *thr, void *result)
+{
+    thr->result = result;
+
+    // The joiner may free thr as soon as it sees exited set
+    __sync_lock_test_and_set(&thr->exited, 1);
+    OSFutexWake(&thr->exited, FUTEX_WAKE_ALL);
+
+    OSThreadExit(0);
+}
+
 void
 pthreadCreateHelper(void *arg)
 {
     struct pthread *thr = (struct pthread *)arg;
 
-    thr->result = (thr->entry)(thr->arg);
+    // pthread_create has validated the priority so this cannot fail
+    if (thr->setPriority)
+	OSThreadPriority(0, thr->priority);
 
-    OSThreadExit(0);
+    pthreadExit(thr, (thr->entry)(thr->arg));
 }
 
 int
@@ -121,6 +140,16 @@ pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     thr->entry = start_routine;
     thr->arg = arg;
 
+    // The new thread applies its priority before running start_routine
+    if (attr != NULL && *attr != NULL && (*attr)->setPriority) {
+	if ((*attr)->priority < PRIO_IDLE || (*attr)->priority > PRIO_MAX) {
+	    free(thr);
+	    return EINVAL;
+	}
+	thr->setPriority = true;
+	thr->priority = (*attr)->priority;
+    }
+
     status = OSThreadCreate((uintptr_t)&pthreadCreateHelper, (uint64_t)thr);
     if (SYSCALL_ERRCODE(status) != 0) {
 	free(thr);
@@ -141,18 +170,21 @@ pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 void
 pthread_exit(void *value_ptr)
 {
-    struct pthread *thr = pthread_self();
-
-    thr->result = value_ptr;
-
-    OSThreadExit(0);
+    pthreadExit(pthread_self(), value_ptr);
 }
 
 int
 pthread_join(pthread_t thread, void **value_ptr)
 {
     struct pthread *thr = thread;
-    uint64_t status = OSThreadWait(0);//thr->tid);
+    uint64_t status;
+
+    while (thr->exited == 0) {
+	OSFutexWait(&thr->exited, 0, 0);
+    }
+
+    // Reap the kernel thread, which is exiting or already a zombie
+    status = OSThreadWait(0);//thr->tid);
     if (SYSCALL_ERRCODE(status) != 0) {
 	return status;
     }
@@ -175,6 +207,90 @@ pthread_yield(void)
     OSThreadSleep(0);
 }
 
+int
+pthread_setschedprio(pthread_t thread, int prio)
+{
+    uint64_t status;
+
+    if (prio < PRIO_IDLE || prio > PRIO_MAX)
+	return EINVAL;
+
+    status = OSThreadPriority(thread->tid, prio);
+
+    return SYSCALL_ERRCODE(status);
+}
+
+/*
+ * Attributes
+ */
+
+int
+pthread_attr_init(pthread_attr_t *attr)
+{
+    struct pthread_attr *pattr = malloc(sizeof(*pattr));
+
+    if (pattr == NULL) {
+	return ENOMEM;
+    }
+
+    pattr->setPriority = false;
+    pattr->priority = PRIO_NORMAL;
+    *attr = pattr;
+
+    return 0;
+}
+
+int
+pthread_attr_destroy(pthread_attr_t *attr)
+{
+    struct pthread_attr *pattr = *attr;
+
+    if (pattr == NULL) {
+	return EINVAL;
+    }
+
+    *attr = NULL;
+    free(pattr);
+
+    return 0;
+}
+
+int
+pthread_attr_getschedparam(const pthread_attr_t *attr,
+			   struct sched_param *param)
+{
+    struct pthread_attr *pattr = *attr;
+
+    if (pattr == NULL) {
+	return EINVAL;
+    }
+
+    param->sched_priority = pattr->priority;
+
+    return 0;
+}
+
+int
+pthread_attr_setschedparam(pthread_attr_t *attr,
+			   const struct sched_param *param)
+{
+    struct pthread_attr *pattr = *attr;
+
+    if (pattr == NULL) {
+	return EINVAL;
+    }
+
+    if (param->sched_priority < PRIO_IDLE ||
+	param->sched_priority > PRIO_MAX) {
+	return EINVAL;
+    }
+
+    pattr->setPriority = true;
+    pattr->priority = param->sched_priority;
+
+    return 0;
+}
+
 /*
  * Barriers
  */
@@ -208,7 +324,7 @@ struct pthread_mutexattr {
 };
 
 struct pthread_mutex {
-    uint64_t	lock;
+    CoreMutex	mtx;
 };
 
 int
@@ -220,7 +336,7 @@ pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
 	return ENOMEM;
     }
 
-    mtx->lock = 0;
+    CoreMutex_Init(&mtx->mtx);
     *mutex = mtx;
 
     return 0;
@@ -233,7 +349,7 @@ pthread_mutex_destroy(pthread_mutex_t *mutex)
 
     if (mtx == NULL) {
 	return EINVAL;
-    } else if (mtx->lock == 1) {
+    } else if (mtx->mtx.lock != 0) {
 	return EBUSY;
     } else {
 	*mutex = NULL;
@@ -255,10 +371,7 @@ pthread_mutex_lock(pthread_mutex_t *mutex)
 
     mtx = *mutex;
 
-    // XXX: Should have the kernel wait kernel instead of yielding
-    while (__sync_lock_test_and_set(&mtx->lock, 1) == 1) {
-	OSThreadSleep(0);
-    }
+    CoreMutex_Lock(&mtx->mtx);
 
     return 0;
 }
@@ -276,11 +389,10 @@ pthread_mutex_trylock(pthread_mutex_t *mutex)
 
     mtx = *mutex;
 
-    if (__sync_lock_test_and_set(&mtx->lock, 1) == 1) {
-	return EBUSY;
-    } else {
-	// Lock acquired
+    if (CoreMutex_TryLock(&mtx->mtx)) {
 	return 0;
+    } else {
+	return EBUSY;
     }
 }
 
@@ -297,8 +409,7 @@ pthread_mutex_unlock(pthread_mutex_t *mutex)
 
     mtx = *mutex;
 
-    __sync_lock_release(&mtx->lock);
-    // XXX: Wakeup a sleeping thread
+    CoreMutex_Unlock(&mtx->mtx);
 
     return 0;
 }
@@ -316,8 +427,13 @@ struct pthread_condattr {
     uint64_t	_unused;
 };
 
+/*
+ * Each waiter takes a ticket from enter and may leave once exit has moved past
+ * it, so a signal is remembered even if nobody is waiting yet.  Waiters sleep
+ * on exit.  Tickets need not match the kernel's queue order, so a signal wakes
+ * every sleeper and those whose ticket has not come up go back to sleep.
+ */
 struct pthread_cond {
-    CoreMutex	mtx;
     uint64_t	enter;
     uint64_t	exit;
 };
@@ -331,7 +447,6 @@ pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
 	return ENOMEM;
     }
 
-    CoreMutex_Init(&cnd->mtx);
     cnd->enter = 0;
     cnd->exit = 0;
 
@@ -351,12 +466,16 @@ pthread_cond_destroy(pthread_cond_t *cond)
     return 0;
 }
 
-int
-pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+static int
+pthreadCondWait(pthread_cond_t *cond, pthread_mutex_t *mutex, uint64_t endtime)
 {
     int status;
+    int rstatus = 0;
     struct pthread_cond *cnd;
     uint64_t level;
+    uint64_t out;
+    uint64_t now;
+    uint64_t timeout = 0;
 
     if (*cond == NULL) {
 	status = pthread_cond_init(cond, NULL);
@@ -371,13 +490,21 @@ pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 	    return status;
     }
 
-    CoreMutex_Lock(&cnd->mtx);
-    level = cnd->enter;
-    cnd->enter++;
-    CoreMutex_Unlock(&cnd->mtx);
+    // The locked add orders our ticket before reading exit
+    level = __sync_fetch_and_add(&cnd->enter, 1);
+
+    while (level >= (out = cnd->exit)) {
+	if (endtime != 0) {
+	    now = OSTime();
+	    if (endtime <= now) {
+		rstatus = ETIMEDOUT;
+		break;
+	    }
+	    timeout = endtime - now;
+	}
 
-    while (level >= cnd->exit) {
-	OSThreadSleep(0);
+	// Returns immediately if a signal has already moved exit
+	OSFutexWait(&cnd->exit, out, timeout);
     }
 
     if (mutex) {
@@ -386,53 +513,26 @@ pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
 	    return status;
     }
 
-    return 0;
+    return rstatus;
+}
+
+int
+pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    return pthreadCondWait(cond, mutex, 0);
 }
 
 int
 pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
 		       const struct timespec *abstime)
 {
-    int status = 0;
-    int rstatus = 0;
-    struct pthread_cond *cnd;
-    uint64_t level;
     uint64_t endtime = abstime->tv_sec * 1000000000 + abstime->tv_nsec;
 
-    if (*cond == NULL) {
-	status = pthread_cond_init(cond, NULL);
-	if (status != 0)
-	    return status;
-    }
-    cnd = *cond;
-
-    if (mutex) {
-	status = pthread_mutex_unlock(mutex);
-	if (status != 0)
-	    return status;
-    }
-
-    CoreMutex_Lock(&cnd->mtx);
-    level = cnd->enter;
-    cnd->enter++;
-    CoreMutex_Unlock(&cnd->mtx);
-
-    while (level >= cnd->exit) {
-	OSThreadSleep(0);
+    // Zero tells pthreadCondWait to wait forever
+    if (endtime == 0)
+	endtime = 1;
 
-	if (endtime < OSTime()) {
-	    rstatus = ETIMEDOUT;
-	    break;
-	}
-    }
-
-    if (mutex) {
-	status = pthread_mutex_lock(mutex);
-	if (status != 0)
-	    return status;
-    }
-
-    return rstatus;
+    return pthreadCondWait(cond, mutex, endtime);
 }
 
 
@@ -440,6 +540,7 @@ int
 pthread_cond_signal(pthread_cond_t *cond)
 {
     struct pthread_cond *cnd;
+    uint64_t out;
 
     if (*cond == NULL) {
 	int status = pthread_cond_init(cond, NULL);
@@ -448,9 +549,10 @@ pthread_cond_signal(pthread_cond_t *cond)
     }
     cnd = *cond;
 
-    CoreMutex_Lock(&cnd->mtx);
-    cnd->exit++;
-    CoreMutex_Unlock(&cnd->mtx);
+    // Skip the system call unless somebody holds a ticket we just released
+    out = __sync_fetch_and_add(&cnd->exit, 1);
+    if (cnd->enter > out)
+	OSFutexWake(&cnd->exit, FUTEX_WAKE_ALL);
 
     return 0;
 }
@@ -459,6 +561,8 @@ int
 pthread_cond_broadcast(pthread_cond_t *cond)
 {
     struct pthread_cond *cnd;
+    uint64_t enter;
+    uint64_t out;
 
     if (*cond == NULL) {
 	int status = pthread_cond_init(cond, NULL);
@@ -467,9 +571,14 @@ pthread_cond_broadcast(pthread_cond_t *cond)
     }
     cnd = *cond;
 
-    CoreMutex_Lock(&cnd->mtx);
-    cnd->exit = cnd->enter;
-    CoreMutex_Unlock(&cnd->mtx);
+    do {
+	out = cnd->exit;
+	enter = cnd->enter;
+	if (out >= enter)
+	    return 0;
+    } while (!__sync_bool_compare_and_swap(&cnd->exit, out, enter));
+
+    OSFutexWake(&cnd->exit, FUTEX_WAKE_ALL);
 
     return 0;
 }
@@ -4,6 +4,7 @@
 #include <sys/cdefs.h>
 #include <sys/wait.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <syscall.h>
@@ -11,12 +12,39 @@
 unsigned int
 sleep(unsigned int seconds)
 {
-    OSThreadSleep(seconds);
+    OSThreadSleep((uint64_t)seconds * 1000000000ULL);
 
     // Should return left over time if woke up early
     return 0;
 }
 
+int
+usleep(unsigned int usec)
+{
+    OSThreadSleep((uint64_t)usec * 1000ULL);
+
+    return 0;
+}
+
+int
+nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= 1000000000) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    OSThreadSleep((uint64_t)req->tv_sec * 1000000000ULL + req->tv_nsec);
+
+    // Should return left over time if woke up early
+    if (rem) {
+	rem->tv_sec = 0;
+	rem->tv_nsec = 0;
+    }
+
+    return 0;
+}
+
 pid_t
 spawn(const char *path, const char *argv[])
 {
@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include <sys/syscall.h>
+#include <sys/timepage.h>
 #include <syscall.h>
 
 uint64_t syscall(int num, ...);
@@ -10,7 +11,8 @@ uint64_t syscall(int num, ...);
 uint64_t
 OSTime()
 {
-    return syscall(SYSCALL_TIME);
+    // The kernel maps the time page into every process
+    return TimePage_GetNS((const volatile TimePage *)TIMEPAGE_ADDR);
 }
 
 void
@@ -46,13 +48,17 @@ OSMemMap(void *addr, uint64_t len, int flags)
 int
 OSMemUnmap(void *addr, uint64_t len)
 {
-    return syscall(SYSCALL_MUNMAP, addr, len);
+    uint64_t result = syscall(SYSCALL_MUNMAP, addr, len);
+
+    return SYSCALL_ERRCODE(result);
 }
 
 int
 OSMemProtect(void *addr, uint64_t len, int flags)
 {
-    return syscall(SYSCALL_MPROTECT, addr, len, flags);
+    uint64_t result = syscall(SYSCALL_MPROTECT, addr, len, flags);
+
+    return SYSCALL_ERRCODE(result);
 }
 
 int
@@ -133,6 +139,28 @@ OSThreadWait(uint64_t tid)
     return syscall(SYSCALL_THREADWAIT, tid);
 }
 
+uint64_t
+OSThreadPriority(uint64_t tid, int priority)
+{
+    return syscall(SYSCALL_THREADPRIORITY, tid, priority);
+}
+
+int
+OSFutexWait(uint64_t *addr, uint64_t val, uint64_t timeout)
+{
+    uint64_t result = syscall(SYSCALL_FUTEX, addr, FUTEX_WAIT, val, timeout);
+
+    return SYSCALL_ERRCODE(result);
+}
+
+uint64_t
+OSFutexWake(uint64_t *addr, uint64_t count)
+{
+    uint64_t result = syscall(SYSCALL_FUTEX, addr, FUTEX_WAKE, count);
+
+    return SYSCALL_VALUE(result);
+}
+
 int
 OSNICStat(uint64_t nicNo, NIC *nic)
 {
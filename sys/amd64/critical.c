@@ -10,8 +10,7 @@
 
 #include <machine/amd64.h>
 #include <machine/amd64op.h>
-
-uint32_t lockLevel[MAX_CPUS];
+#include <machine/percpu.h>
 
 void
 Critical_Init()
@@ -20,7 +19,7 @@ Critical_Init()
 
     for (c = 0; c < MAX_CPUS; c++)
     {
-	lockLevel[c] = 0;
+	percpu[c].lockLevel = 0;
     }
 }
 
@@ -28,14 +27,16 @@ void
 Critical_Enter()
 {
     disable_interrupts();
-    lockLevel[CPU()]++;
+    PERCPU_SET(lockLevel, PERCPU_GET(lockLevel) + 1);
 }
 
 void
 Critical_Exit()
 {
-    lockLevel[CPU()]--;
-    if (lockLevel[CPU()] == 0)
+    uint32_t level = PERCPU_GET(lockLevel) - 1;
+
+    PERCPU_SET(lockLevel, level);
+    if (level == 0)
     {
 	enable_interrupts();
     }
@@ -44,7 +45,7 @@ Critical_Exit()
 uint32_t
 Critical_Level()
 {
-    return lockLevel[CPU()];
+    return PERCPU_GET(lockLevel);
 }
 
 static void
@@ -53,7 +54,7 @@ Debug_Critical(int argc, const char *argv[])
     int c;
 
     for (c = 0; c < MAX_CPUS; c++) {
-	kprintf("CPU%d: %u\n", c, lockLevel[c]);
+	kprintf("CPU%d: %u\n", c, percpu[c].lockLevel);
     }
 }
 
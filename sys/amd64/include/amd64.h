@@ -12,7 +12,7 @@
  * Page Tables
  */
 
-#define PGNUMMASK	0xFFFFFFFFFFFFF000ULL
+#define PGNUMMASK	0x000FFFFFFFFFF000ULL
 
 #define PGIDXSHIFT	9
 #define PGIDXMASK       (512 - 1)
@@ -157,6 +157,9 @@ typedef struct XSAVEArea
 #define CR0_CD      0x40000000 /* Cache Disable */
 #define CR0_PG      0x80000000 /* Paging */
 
+#define CR3_PCIDMASK 0x0000000000000FFFULL /* Process-Context Identifier */
+#define CR3_NOFLUSH 0x8000000000000000ULL /* Preserve TLB entries of the PCID */
+
 #define CR4_VME     0x00000001 /* Virtual 8086 Mode Enable */
 #define CR4_PVI     0x00000002 /* Protected-Mode Virtual Interupts */
 #define CR4_TSD     0x00000004 /* Time Stamp Diable */
@@ -169,6 +172,7 @@ typedef struct XSAVEArea
 #define CR4_OSFXSR  0x00000200 /* OS FXSAVE/FXRSTOR Support */
 #define CR4_OSXMMEXCPT 0x00000400 /* OS Unmasked Exception Support */
 #define CR4_FSGSBASE 0x00010000 /* Enable FS/GS read/write Instructions */
+#define CR4_PCIDE   0x00020000 /* Process-Context Identifiers Enable */
 #define CR4_OSXSAVE 0x00040000 /* XSAVE and Processor Extended States Enable */
 
 #define RFLAGS_CF   0x00000001 /* Carry Flag */
@@ -223,6 +227,14 @@ typedef struct XSAVEArea
 #define MSR_CSTAR   0xC0000083
 #define MSR_SFMASK  0xC0000084
 
+// Segment Bases
+#define MSR_FSBASE	    0xC0000100
+#define MSR_GSBASE	    0xC0000101
+#define MSR_KERNELGSBASE    0xC0000102
+
+// LAPIC Timer
+#define MSR_TSCDEADLINE	    0x000006E0
+
 #include "amd64op.h"
 
 #endif /* __AMD64_H__ */
@@ -170,6 +170,14 @@ static INLINE void write_cr3(uint64_t val)
         : "r" (val));
 }
 
+static INLINE void invlpg(uint64_t va)
+{
+    asm volatile("invlpg (%0)"
+        :
+        : "r" (va)
+        : "memory");
+}
+
 static INLINE uint64_t read_cr4()
 {
     uint64_t val;
@@ -20,6 +20,53 @@ atomic_swap_uint64(volatile uint64_t *dst, uint64_t newval)
     return newval;
 }
 
+/*
+ * Returns the previous value of *dst, the swap succeeded if it equals oldval.
+ */
+static INLINE uint64_t
+atomic_cas_uint64(volatile uint64_t *dst, uint64_t oldval, uint64_t newval)
+{
+    asm volatile("lock; cmpxchgq %2, %1;"
+	    : "+a" (oldval), "+m" (*dst)
+	    : "r" (newval)
+	    : "memory");
+
+    return oldval;
+}
+
+static INLINE uint32_t
+atomic_fetchadd_uint32(volatile uint32_t *dst, uint32_t val)
+{
+    asm volatile("lock; xaddl %0, %1;"
+	    : "+r" (val), "+m" (*dst)
+	    :
+	    : "memory");
+
+    return val;
+}
+
+/*
+ * x86 loads and stores already have acquire and release semantics, so these
+ * only need to stop the compiler from moving accesses across them.
+ */
+static INLINE uint32_t
+atomic_load_acq_uint32(volatile uint32_t *src)
+{
+    uint32_t val = *src;
+
+    asm volatile("" ::: "memory");
+
+    return val;
+}
+
+static INLINE void
+atomic_store_rel_uint32(volatile uint32_t *dst, uint32_t val)
+{
+    asm volatile("" ::: "memory");
+
+    *dst = val;
+}
+
 static inline void
 atomic_set_uint64(volatile uint64_t *dst, uint64_t newval)
 {
@@ -9,9 +9,12 @@ void LAPIC_Init();
 uint32_t LAPIC_CPU();
 void LAPIC_SendEOI();
 void LAPIC_StartAP(uint8_t apicid, uint32_t addr);
+int LAPIC_SendIPI(int cpu, int vector);
+int LAPIC_Multicast(uint64_t mask, int vector);
 int LAPIC_Broadcast(int vector);
 int LAPIC_BroadcastNMI(int vector);
-void LAPIC_Periodic(uint64_t rate);
+void LAPIC_SetDeadline(uint64_t deadline);
+void LAPIC_StopTimer();
 
 #endif /* __LAPIC_H__ */
 
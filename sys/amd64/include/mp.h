@@ -2,6 +2,8 @@
 #ifndef __MACHINE_MP_H__
 #define __MACHINE_MP_H__
 
+#include <machine/percpu.h>
+
 #define CPUSTATE_NOT_PRESENT	0
 #define CPUSTATE_BOOTED		1
 #define CPUSTATE_HALTED		2
@@ -11,14 +13,42 @@ void MP_Init();
 void MP_InitAP();
 void MP_SetState(int state);
 int MP_GetCPUs();
+void MP_Wakeup(int cpu);
+
+/* CPU Masks */
+typedef uint64_t CPUMask;
+#define CPUMASK_CPU(_c)		(1ULL << (_c))
+CPUMask MP_AllCPUs();
 
 /* Cross Calls */
 typedef int (*CrossCallCB)(void *);
+
+/*
+ * Cross call frames are owned by the caller.  The frame passed to 
+ * MP_CrossCallAsync is the completion handle and must stay valid until 
+ * MP_CrossCallWait returns.
+ */
+typedef struct CrossCallFrame {
+    CrossCallCB		cb;
+    void		*arg;
+    CPUMask		mask;
+    int			targets;
+    volatile int	count;
+    volatile int	status[MAX_CPUS];
+} CrossCallFrame;
+
 void MP_CrossCallTrap();
+void MP_CrossCallService();
 int MP_CrossCall(CrossCallCB cb, void *arg);
+int MP_CrossCallCPU(int cpu, CrossCallCB cb, void *arg);
+int MP_CrossCallMask(CPUMask mask, CrossCallCB cb, void *arg);
+int MP_CrossCallAsync(CPUMask mask, CrossCallCB cb, void *arg,
+		      CrossCallFrame *frame);
+bool MP_CrossCallDone(CrossCallFrame *frame);
+int MP_CrossCallWait(CrossCallFrame *frame);
 
 uint32_t LAPIC_CPU();
-#define THISCPU	    LAPIC_CPU
+#define THISCPU()   PERCPU_GET(cpu)
 
 #endif /* __MACHINE_MP__ */
 
@@ -0,0 +1,59 @@
+/*
+ * Per-CPU Data
+ */
+
+#ifndef __MACHINE_PERCPU_H__
+#define __MACHINE_PERCPU_H__
+
+#include <stdint.h>
+
+#include <sys/cdefs.h>
+#include <sys/kconfig.h>
+#include <sys/queue.h>
+
+struct AS;
+struct Spinlock;
+struct Thread;
+
+/*
+ * Each CPU's block is reached through the GS base while in the kernel, the 
+ * user GS base is swapped in on the way back to userspace.  Fields are only 
+ * modified by the owning CPU, other CPUs may read them through percpu[].
+ */
+typedef struct PerCPU {
+    struct PerCPU		*self;
+    uint32_t			cpu;
+    uint32_t			lockLevel;
+    struct Thread		*curProc;
+    struct AS			*currentAS;
+    TAILQ_HEAD(LockStack, Spinlock) lockStack;
+} CACHELINE_ALIGNED PerCPU;
+
+extern PerCPU percpu[MAX_CPUS];
+
+/*
+ * Accessors compile to a single GS relative instruction so they are safe 
+ * against migration without entering a critical section.
+ */
+#define __PERCPU_TYPE(_m)	__typeof__(((PerCPU *)0)->_m)
+#define __PERCPU_OFF(_m)	__builtin_offsetof(PerCPU, _m)
+
+#define PERCPU_GET(_m) ({						\
+	__PERCPU_TYPE(_m) __getval;					\
+	asm volatile("mov %%gs:%1, %0"					\
+		     : "=r" (__getval)					\
+		     : "m" (*(__PERCPU_TYPE(_m) *)__PERCPU_OFF(_m)));	\
+	__getval;							\
+    })
+
+#define PERCPU_SET(_m, _v) do {						\
+	__PERCPU_TYPE(_m) __setval = (_v);				\
+	asm volatile("mov %1, %%gs:%0"					\
+		     : "=m" (*(__PERCPU_TYPE(_m) *)__PERCPU_OFF(_m))	\
+		     : "r" (__setval));					\
+    } while (0)
+
+#define PERCPU_SELF()		PERCPU_GET(self)
+#define PERCPU_PTR(_m)		(&PERCPU_SELF()->_m)
+
+#endif /* __MACHINE_PERCPU_H__ */
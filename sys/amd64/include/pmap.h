@@ -2,6 +2,11 @@
 #ifndef __PMAP_H__
 #define __PMAP_H__
 
+#include <sys/kconfig.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/vm.h>
+
 #include <machine/amd64.h>
 
 /*
@@ -48,13 +53,60 @@
 #define DMPA2VA(pa)		((pa) + MEM_DIRECTMAP_BASE)
 #define VA2PA(va)		PMap_Translate(PMap_CurrentAS(), va)
 
+// Read-only user page that is copied on the first write
+#define PTE_COW			PTE_OS1
+
+/*
+ * Per-CPU TLB state of an address space.  PCIDs are allocated per-CPU and are 
+ * valid while pcidGen matches the CPU's generation.  tlbGen records the 
+ * shootdown generation of the address space the last time the TLB entries of 
+ * the PCID were known to be valid on this CPU.
+ */
+typedef struct ASCPUState
+{
+    uint64_t	pcidGen;
+    uint64_t	tlbGen;
+    uint64_t	pcid;
+} ASCPUState;
+
 typedef struct AS
 {
     PageTable	*root;
     uint64_t	tables;
     uint64_t	mappings;
+    // TLB state
+    uint64_t	tlbGen;
+    ASCPUState	cpu[MAX_CPUS];
+    // Virtual memory regions
+    Spinlock	regionLock;
+    VMRegionQueue regions;
 } AS;
 
+/*
+ * A batch of TLB invalidations.  Batches larger than PMAP_INVLPG_MAX pages or 
+ * with more than PMAP_SHOOTDOWN_RANGES discontiguous ranges are turned into a 
+ * full flush.
+ */
+#define PMAP_INVLPG_MAX		32
+#define PMAP_SHOOTDOWN_RANGES	8
+#define PMAP_SHOOTDOWN_FREE	32
+
+typedef struct PMapShootdown
+{
+    AS		*as;
+    int		ranges;
+    bool	full;
+    uint64_t	pages;
+    volatile int pending;
+    struct {
+	uint64_t va;
+	uint64_t pages;
+    } range[PMAP_SHOOTDOWN_RANGES];
+    // Pages released once the invalidation completes
+    int		nfree;
+    void	*free[PMAP_SHOOTDOWN_FREE];
+} PMapShootdown;
+
 void PMap_Init();
 void PMap_InitAP();
 
@@ -69,7 +121,23 @@ uintptr_t PMap_Translate(AS *space, uintptr_t va);
 // Manipulate User Memory
 bool PMap_Map(AS *as, uint64_t phys, uint64_t virt, uint64_t pages, uint64_t flags);
 bool PMap_AllocMap(AS *as, uint64_t virt, uint64_t len, uint64_t flags);
-bool PMap_Unmap(AS *as, uint64_t virt, uint64_t pages);
+bool PMap_AllocMapLarge(AS *as, uint64_t virt, uint64_t flags);
+bool PMap_MapShared(AS *as, uint64_t virt, void *pg, uint64_t flags);
+bool PMap_CloneAS(AS *dst, AS *src);
+bool PMap_CopyOnWrite(AS *as, uint64_t va, PMapShootdown *sd);
+
+// TLB Shootdown
+void PMap_ShootdownInit(PMapShootdown *sd, AS *as);
+void PMap_ShootdownAdd(PMapShootdown *sd, uint64_t va, uint64_t pages);
+void PMap_ShootdownFlush(PMapShootdown *sd);
+void PMap_Shootdown(AS *as, uint64_t va, uint64_t pages);
+void PMap_ShootdownService();
+
+// Unmap and protect user memory, the caller flushes the shootdown batch
+bool PMap_Demote(AS *as, uint64_t va, PMapShootdown *sd);
+uint64_t PMap_Unmap(AS *as, uint64_t va, uint64_t end, PMapShootdown *sd);
+void PMap_Protect(AS *as, uint64_t va, uint64_t end, uint64_t flags,
+		  PMapShootdown *sd);
 
 // Manipulate Kernel Memory
 void PMap_SystemLookup(uint64_t va, PageEntry **entry, int size);
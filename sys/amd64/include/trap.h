@@ -39,13 +39,21 @@
 #define T_IRQ_ERROR	(T_IRQ_BASE + 25)
 #define T_IRQ_THERMAL	(T_IRQ_BASE + 26)
 
+#define T_TLBSHOOTDOWN	59	/* TLB Shootdown (IPI) */
 #define T_SYSCALL	60	/* System Call */
 #define T_CROSSCALL	61	/* Cross Call (IPI) */
 #define T_DEBUGIPI	62	/* Kernel Debugger Halt (IPI) */
+#define T_WAKEUP	63	/* Wakeup Idle CPU (IPI) */
 
-#define T_UNKNOWN	63	/* Unknown Trap */
+#define T_UNKNOWN	64	/* Unknown Trap */
 
-#define T_MAX		64
+#define T_MAX		65
+
+// Page fault error code
+#define PFERR_P		0x0001	/* Protection violation (page present) */
+#define PFERR_W		0x0002	/* Write access */
+#define PFERR_U		0x0004	/* User mode access */
+#define PFERR_I		0x0010	/* Instruction fetch */
 
 typedef struct TrapFrame
 {
@@ -7,6 +7,8 @@
 
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
+#include <sys/ktime.h>
+#include <sys/spinlock.h>
 
 #include <machine/amd64.h>
 #include <machine/amd64op.h>
@@ -14,6 +16,7 @@
 #include <machine/trap.h>
 
 #define CPUID_FLAG_APIC             0x100
+#define CPUID_FLAG_TSCDEADLINE      0x01000000
 
 #define IA32_APIC_BASE_MSR          0x1B
 #define IA32_APIC_BASE_MSR_BSP      0x100
@@ -25,6 +28,9 @@
 #define LAPIC_VERSION_LVTSHIFT		0x10
 #define LAPIC_TPR           0x0080 /* Task Priority Register */
 #define LAPIC_EOI           0x00B0 /* End of Interrupt */
+#define LAPIC_LDR           0x00D0 /* Logical Destination Register */
+#define LAPIC_DFR           0x00E0 /* Destination Format Register */
+#define LAPIC_DFR_FLAT			0xFFFFFFFF
 #define LAPIC_SIV           0x00F0 /* Spurious Interrupt Vector */
 #define LAPIC_SIV_ENABLE            0x100
 
@@ -37,12 +43,20 @@
 #define LAPIC_ICR_NMI			0x0400
 #define LAPIC_ICR_INIT			0x0500
 #define LAPIC_ICR_STARTUP		0x0600
+#define LAPIC_ICR_LOGICAL		0x0800 /* Destination Mode */
 #define LAPIC_ICR_ASSERT		0x4000
 #define LAPIC_ICR_TRIG			0x8000
 #define LAPIC_ICR_SELF			0x00080000 /* Destination */
 #define LAPIC_ICR_INCSELF		0x00080000
 #define LAPIC_ICR_EXCSELF		0x000C0000
 #define LAPIC_ICR_DELIVERY_PENDING	0x1000 /* Delivery Pending */
+#define LAPIC_ICR_TIMEOUT		1000000
+
+/*
+ * The flat logical destination model gives each of the first 8 CPUs one bit in 
+ * the logical destination, so a single IPI can target any subset of them.
+ */
+#define LAPIC_LOGICAL_CPUS		8
 
 #define LAPIC_LVT_TIMER     0x0320 /* LVT Timer */
 #define LAPIC_LVT_TIMER_ONESHOT     0x00000000
@@ -61,8 +75,14 @@
 #define LAPIC_TCCR          0x0390 /* Timer Currnet Count Register */
 #define LAPIC_TDCR          0x03E0 /* Time Divide Configuration Register */
 #define LAPIC_TDCR_X1               0x000B /* Divide counts by 1 */
+#define LAPIC_TIMER_MAXCOUNT	    0xFFFFFFFF
+#define LAPIC_TIMER_CALIBRATE	    100 /* Calibrate over 1/100th of a second */
 
 bool lapicInitialized = false;
+static bool lapicTSCDeadline = false;
+static uint64_t lapicTimerFreq = 0;
+
+extern uint64_t ticksPerSecond;
 
 static uint32_t *
 LAPIC_GetBase()
@@ -104,12 +124,97 @@ LAPIC_SendEOI()
     LAPIC_Write(LAPIC_EOI, 0);
 }
 
-void
-LAPIC_Periodic(uint64_t rate)
+/**
+ * LAPICTimerInit --
+ *
+ * Configure the local timer for one-shot operation.  We prefer the TSC 
+ * deadline mode when the processor supports it, otherwise the first CPU 
+ * calibrates the timer's count rate against the TSC.  The timer is left 
+ * disarmed.
+ */
+static void
+LAPICTimerInit()
 {
+    uint32_t ecx;
+    uint64_t startTSC;
+
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    lapicTSCDeadline = (ecx & CPUID_FLAG_TSCDEADLINE) != 0;
+
+    if (lapicTSCDeadline) {
+	LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_LVT_TIMER_TSCDEADLINE | T_IRQ_TIMER);
+	wrmsr(MSR_TSCDEADLINE, 0);
+	return;
+    }
+
     LAPIC_Write(LAPIC_TDCR, LAPIC_TDCR_X1);
-    LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_LVT_TIMER_PERIODIC | T_IRQ_TIMER);
-    LAPIC_Write(LAPIC_TICR, rate);
+
+    if (lapicTimerFreq == 0) {
+	LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_LVT_FLAG_MASKED |
+		    LAPIC_LVT_TIMER_ONESHOT | T_IRQ_TIMER);
+
+	startTSC = Time_GetTSC();
+	LAPIC_Write(LAPIC_TICR, LAPIC_TIMER_MAXCOUNT);
+	while (Time_GetTSC() - startTSC < ticksPerSecond / LAPIC_TIMER_CALIBRATE)
+	    pause();
+	lapicTimerFreq = (uint64_t)(LAPIC_TIMER_MAXCOUNT -
+				    LAPIC_Read(LAPIC_TCCR)) * LAPIC_TIMER_CALIBRATE;
+	LAPIC_Write(LAPIC_TICR, 0);
+    }
+
+    LAPIC_Write(LAPIC_LVT_TIMER, LAPIC_LVT_TIMER_ONESHOT | T_IRQ_TIMER);
+}
+
+/**
+ * LAPIC_SetDeadline --
+ *
+ * Arm the local timer to interrupt at or shortly before the given TSC value.  
+ * In one-shot mode the longest interval is clamped to a second, and the 
+ * caller rearms the timer if it fires before the deadline.
+ *
+ * @param [in] deadline Absolute TSC value.
+ */
+void
+LAPIC_SetDeadline(uint64_t deadline)
+{
+    uint64_t now;
+    uint64_t count;
+
+    if (lapicTSCDeadline) {
+	// Writing zero disarms the timer
+	wrmsr(MSR_TSCDEADLINE, deadline == 0 ? 1 : deadline);
+	return;
+    }
+
+    now = Time_GetTSC();
+    if (deadline <= now) {
+	count = 1;
+    } else {
+	count = deadline - now;
+	if (count > ticksPerSecond)
+	    count = ticksPerSecond;
+	count = count * lapicTimerFreq / ticksPerSecond;
+	if (count == 0)
+	    count = 1;
+	if (count > LAPIC_TIMER_MAXCOUNT)
+	    count = LAPIC_TIMER_MAXCOUNT;
+    }
+
+    LAPIC_Write(LAPIC_TICR, count);
+}
+
+/**
+ * LAPIC_StopTimer --
+ *
+ * Disarm the local timer.
+ */
+void
+LAPIC_StopTimer()
+{
+    if (lapicTSCDeadline)
+	wrmsr(MSR_TSCDEADLINE, 0);
+    else
+	LAPIC_Write(LAPIC_TICR, 0);
 }
 
 void
@@ -139,16 +244,15 @@ LAPIC_StartAP(uint8_t apicid, uint32_t addr)
     // XXX: Delay
 }
 
-int
-LAPIC_Broadcast(int vector)
+static int
+LAPICWaitICR()
 {
     int i = 0;
-    LAPIC_Write(LAPIC_ICR_LO, LAPIC_ICR_EXCSELF | vector);
 
     while ((LAPIC_Read(LAPIC_ICR_LO) & LAPIC_ICR_DELIVERY_PENDING) != 0) {
 	pause();
 
-	if (i > 1000000) {
+	if (++i > LAPIC_ICR_TIMEOUT) {
 	    kprintf("IPI not delivered?\n");
 	    return -1;
 	}
@@ -157,22 +261,82 @@ LAPIC_Broadcast(int vector)
     return 0;
 }
 
+/**
+ * LAPIC_SendIPI --
+ *
+ * Send an IPI to a single CPU.  Interrupts are disabled while we program the 
+ * ICR so that an interrupt handler sending its own IPI cannot change the 
+ * destination between the two writes.
+ *
+ * @param [in] cpu Destination CPU.
+ * @param [in] vector Interrupt vector.
+ * @retval 0 on success, -1 if the IPI was not delivered.
+ */
+int
+LAPIC_SendIPI(int cpu, int vector)
+{
+    int status;
+
+    Critical_Enter();
+    LAPIC_Write(LAPIC_ICR_HI, cpu << 24);
+    LAPIC_Write(LAPIC_ICR_LO, LAPIC_ICR_ASSERT | vector);
+    status = LAPICWaitICR();
+    Critical_Exit();
+
+    return status;
+}
+
+/**
+ * LAPIC_Multicast --
+ *
+ * Send an IPI to a set of CPUs.  CPUs with a logical destination are reached 
+ * with a single logical mode IPI, the rest are sent unicast IPIs.
+ *
+ * @param [in] mask Bitmask of destination CPUs.
+ * @param [in] vector Interrupt vector.
+ * @retval 0 on success, -1 if an IPI was not delivered.
+ */
 int
-LAPIC_BroadcastNMI(int vector)
+LAPIC_Multicast(uint64_t mask, int vector)
 {
-    int i = 0;
-    LAPIC_Write(LAPIC_ICR_LO, LAPIC_ICR_EXCSELF | LAPIC_ICR_NMI | vector);
+    int c;
+    int status = 0;
+    uint32_t logical = mask & ((1 << LAPIC_LOGICAL_CPUS) - 1);
+
+    if (logical != 0) {
+	// See LAPIC_SendIPI
+	Critical_Enter();
+	LAPIC_Write(LAPIC_ICR_HI, logical << 24);
+	LAPIC_Write(LAPIC_ICR_LO, LAPIC_ICR_LOGICAL | LAPIC_ICR_ASSERT | vector);
+	status = LAPICWaitICR();
+	Critical_Exit();
+    }
 
-    while ((LAPIC_Read(LAPIC_ICR_LO) & LAPIC_ICR_DELIVERY_PENDING) != 0) {
-	pause();
+    for (c = LAPIC_LOGICAL_CPUS; c < 64; c++) {
+	if ((mask & (1ULL << c)) == 0)
+	    continue;
 
-	if (i > 1000000) {
-	    kprintf("IPI not delivered?\n");
-	    return -1;
-	}
+	if (LAPIC_SendIPI(c, vector) < 0)
+	    status = -1;
     }
 
-    return 0;
+    return status;
+}
+
+int
+LAPIC_Broadcast(int vector)
+{
+    LAPIC_Write(LAPIC_ICR_LO, LAPIC_ICR_EXCSELF | vector);
+
+    return LAPICWaitICR();
+}
+
+int
+LAPIC_BroadcastNMI(int vector)
+{
+    LAPIC_Write(LAPIC_ICR_LO, LAPIC_ICR_EXCSELF | LAPIC_ICR_NMI | vector);
+
+    return LAPICWaitICR();
 }
 
 void
@@ -213,6 +377,13 @@ LAPIC_Init()
     // Error Interrupt
     LAPIC_Write(LAPIC_LVT_ERROR, T_IRQ_ERROR);
 
+    // Logical destinations for multicast IPIs
+    LAPIC_Write(LAPIC_DFR, LAPIC_DFR_FLAT);
+    if (LAPIC_CPU() < LAPIC_LOGICAL_CPUS)
+	LAPIC_Write(LAPIC_LDR, (1 << LAPIC_CPU()) << 24);
+    else
+	LAPIC_Write(LAPIC_LDR, 0);
+
     // Setup LINT0/1
     if (LAPIC_CPU() == 0) {
 	LAPIC_Write(LAPIC_LVT_LINT0, LAPIC_LVT_FLAG_EXTINT);
@@ -237,7 +408,8 @@ LAPIC_Init()
 	LAPIC_Write(LAPIC_LVT_CMCI, LAPIC_LVT_FLAG_MASKED);
     }
 
-    LAPIC_Periodic(10000000); // XXX: 100 Hz (changes must update trap.c as well)
+    // Timer is armed later by the clock event layer
+    LAPICTimerInit();
 
     // Clear any remaining errors
     LAPIC_Write(LAPIC_ESR, 0);
@@ -267,7 +439,16 @@ Debug_LAPIC(int argc, const char *argv[])
     kprintf("ICRLO:      %08x\n", LAPIC_Read(LAPIC_ICR_LO));
     kprintf("ICRHI:      %08x\n", LAPIC_Read(LAPIC_ICR_HI));
     kprintf("SIV:        %08x\n", LAPIC_Read(LAPIC_SIV));
+    kprintf("LDR:        %08x\n", LAPIC_Read(LAPIC_LDR));
     kprintf("ERROR:      %08x\n", LAPIC_Read(LAPIC_LVT_ERROR));
+    kprintf("TIMER:      %08x (%s)\n", LAPIC_Read(LAPIC_LVT_TIMER),
+	    lapicTSCDeadline ? "TSC deadline" : "one-shot");
+    if (lapicTSCDeadline) {
+	kprintf("DEADLINE:   %016llx\n", rdmsr(MSR_TSCDEADLINE));
+    } else {
+	kprintf("TIMERFREQ:  %llu Hz\n", lapicTimerFreq);
+	kprintf("TCCR:       %08x\n", LAPIC_Read(LAPIC_TCCR));
+    }
     if (lvts >= 5) {
 	kprintf("THERMAL:    %08x\n", LAPIC_Read(LAPIC_LVT_THERMAL));
     }
@@ -4,9 +4,13 @@
 #include <sys/kconfig.h>
 #include <sys/kassert.h>
 #include <sys/kmem.h>
+#include <sys/clockevent.h>
+#include <sys/epoch.h>
+#include <sys/futex.h>
 #include <sys/mp.h>
 #include <sys/irq.h>
 #include <sys/spinlock.h>
+#include <sys/vm.h>
 
 #include <machine/amd64.h>
 #include <machine/ioapic.h>
@@ -14,6 +18,7 @@
 #include <machine/trap.h>
 #include <machine/pmap.h>
 #include <machine/mp.h>
+#include <machine/percpu.h>
 
 #include <sys/thread.h>
 #include <sys/disk.h>
@@ -30,6 +35,7 @@ extern void PS2_Init();
 extern void PCI_Init();
 extern void IDE_Init();
 extern void MachineBoot_AddMem();
+extern void Loader_Init();
 extern void Loader_LoadInit();
 extern void PAlloc_LateInit();
 
@@ -38,6 +44,7 @@ extern void PAlloc_LateInit();
 static SegmentDescriptor GDT[MAX_CPUS][GDT_MAX];
 static PseudoDescriptor GDTDescriptor[MAX_CPUS];
 TaskStateSegment64 TSS[MAX_CPUS];
+PerCPU percpu[MAX_CPUS];
 
 static char df_stack[4096];
  
@@ -84,6 +91,23 @@ Machine_GDTInit()
     kprintf("Done!\n");
 }
 
+/**
+ * Machine_PerCPUInit --
+ *
+ * Point the GS base at this CPU's per-CPU data.  This must run before any 
+ * code that uses CPU() or enters a critical section.  The kernel GS base holds 
+ * the user GS base while we are in the kernel.
+ */
+static void
+Machine_PerCPUInit(int c)
+{
+    percpu[c].self = &percpu[c];
+    percpu[c].cpu = c;
+
+    wrmsr(MSR_GSBASE, (uint64_t)&percpu[c]);
+    wrmsr(MSR_KERNELGSBASE, 0);
+}
+
 /**
  * Machine_TSSInit --
  *
@@ -145,8 +169,10 @@ Machine_SyscallInit()
 void
 Machine_EarlyInit()
 {
+    Machine_PerCPUInit(0);
     Spinlock_EarlyInit();
     Critical_Init();
+    Epoch_Init();
     Critical_Enter();
     WaitChannel_EarlyInit();
     Console_Init();
@@ -156,7 +182,13 @@ Machine_EarlyInit()
 static void
 Machine_IdleThread(void *test)
 {
-    while (1) { enable_interrupts(); hlt(); }
+    while (1) {
+	disable_interrupts();
+	Epoch_Idle();
+	ClockEvent_Idle();
+	enable_interrupts();
+	hlt();
+    }
 }
 
 /**
@@ -185,6 +217,9 @@ void Machine_Init()
     XMem_Init();
     PAlloc_LateInit();
     MachineBoot_AddMem();
+    Malloc_Init();
+    VM_Init();
+    Loader_Init();
 
     /*
      * Initialize Time Keeping
@@ -200,8 +235,10 @@ void Machine_Init()
     IOAPIC_Init();
     IOAPIC_Enable(0); // Enable timer interrupts
     Thread_Init();
+    Futex_Init();
 
     KTimer_Init(); // Depends on RTC and KTime
+    ClockEvent_Init(); // Depends on LAPIC and KTimer
 
     /*
      * Initialize Additional Processors
@@ -217,7 +254,8 @@ void Machine_Init()
     BufCache_Init();
 
     /*
-     * Open the primary disk and mount the root file system
+     * Open the primary disk and mount the root file system, which keeps our 
+     * reference to the disk
      */
     Disk *root = Disk_GetByID(0, 0);
     if (!root)
@@ -233,7 +271,12 @@ void Machine_Init()
     if (thr == NULL) {
 	kprintf("Couldn't create idle thread!\n");
     }
-    Sched_SetRunnable(thr);
+    Sched_SetIdle(thr);
+
+    /*
+     * Start the background page zeroing thread
+     */
+    PAlloc_StartZeroThread();
 
     /*
      * Load the init processor
@@ -250,6 +293,7 @@ void Machine_Init()
  */
 void Machine_InitAP()
 {
+    Machine_PerCPUInit(LAPIC_CPU());
     Critical_Enter();
 
     // Setup CPU state
@@ -266,6 +310,7 @@ void Machine_InitAP()
     // Boot processor
     MP_InitAP();
     Thread_InitAP();
+    ClockEvent_InitAP();
     Critical_Exit();
 
     Machine_IdleThread(NULL);
@@ -23,14 +23,7 @@ extern uint8_t mpstart_end[];
 extern AS systemAS;
 
 #define MP_WAITTIME	250000000ULL
-
-typedef struct CrossCallFrame {
-    CrossCallCB		cb;
-    void		*arg;
-    volatile int	count;
-    volatile int	done[MAX_CPUS];
-    volatile int	status[MAX_CPUS];
-} CrossCallFrame;
+#define MP_WAITCHECK	1024
 
 const char *CPUStateToString[] = {
     "NOT PRESENT",
@@ -41,7 +34,6 @@ const char *CPUStateToString[] = {
 typedef struct CPUState {
     int			state;
     UnixEpochNS		heartbeat;
-    CrossCallFrame	*frame;
 } CPUState;
 
 volatile static bool booted;
@@ -94,11 +86,9 @@ MP_Init()
     kprintf("Booting on CPU %u\n", CPU());
 
     cpus[CPU()].state = CPUSTATE_BOOTED;
-    cpus[CPU()].frame = NULL;
 
     for (i = 1; i < MAX_CPUS; i++) {
 	cpus[i].state = CPUSTATE_NOT_PRESENT;
-	cpus[i].frame = NULL;
     }
 
     /*
@@ -136,69 +126,245 @@ MP_GetCPUs()
     return lastCPU;
 }
 
+/**
+ * MP_AllCPUs --
+ *
+ * @retval Mask of all CPUs that have been started.
+ */
+CPUMask
+MP_AllCPUs()
+{
+    return CPUMASK_CPU(lastCPU) - 1;
+}
+
+/*
+ * Cross Calls
+ *
+ * Cross calls are delivered through a per-CPU mailbox with one slot per 
+ * initiating CPU, so calls from different CPUs never overwrite each other.  
+ * Targets clear their slot before running the callback, which lets the 
+ * initiator reuse the slot for its next call while the previous one is still 
+ * being acknowledged.  CPUs spinning with interrupts disabled service their own 
+ * mailbox to avoid deadlocks.
+ */
+static volatile CrossCallFrame *mpMailbox[MAX_CPUS][MAX_CPUS];
+
+/**
+ * MP_CrossCallService --
+ *
+ * Run the cross calls sent to this CPU.  This is called from the T_CROSSCALL 
+ * handler and by CPUs that spin waiting on other CPUs with interrupts disabled.
+ */
 void
-MP_CrossCallTrap()
+MP_CrossCallService()
 {
     int c;
+    int cpu = CPU();
+    volatile CrossCallFrame *frame;
+
+    for (c = 0; c < lastCPU; c++) {
+	frame = mpMailbox[cpu][c];
+	if (frame == NULL)
+	    continue;
+
+	mpMailbox[cpu][c] = NULL;
+
+	frame->status[cpu] = (frame->cb)(frame->arg);
+	__sync_fetch_and_add(&frame->count, 1);
+    }
+}
 
+void
+MP_CrossCallTrap()
+{
     cpuid(0, 0, 0, 0, 0);
 
     Critical_Enter();
+    MP_CrossCallService();
+    Critical_Exit();
+}
 
-    for (c = 0; c <= lastCPU; c++) {
-	CrossCallFrame *frame = cpus[c].frame;
-	if (frame == NULL)
-	    continue;
+/**
+ * MP_CrossCallAsync --
+ *
+ * Start a cross call on a set of CPUs without waiting for it to complete.  If 
+ * the current CPU is in the mask the callback is run locally before 
+ * returning.
+ *
+ * @param [in] mask CPUs to run the callback on.
+ * @param [in] cb Callback.
+ * @param [in] arg Argument passed to the callback.
+ * @param [out] frame Completion handle, must remain valid until 
+ *     MP_CrossCallWait returns.
+ * @retval 0 on success, -1 if an IPI could not be delivered.
+ */
+int
+MP_CrossCallAsync(CPUMask mask, CrossCallCB cb, void *arg,
+		  CrossCallFrame *frame)
+{
+    int c;
+    int cpu;
+    int status = 0;
+    CPUMask remote;
+
+    mask &= MP_AllCPUs();
+
+    memset(frame, 0, sizeof(*frame));
+    frame->cb = cb;
+    frame->arg = arg;
+    frame->mask = mask;
+    for (c = 0; c < lastCPU; c++) {
+	if (mask & CPUMASK_CPU(c))
+	    frame->targets++;
+    }
+
+    Critical_Enter();
 
-	if (frame->done[CPU()] == 1)
+    cpu = CPU();
+    remote = mask & ~CPUMASK_CPU(cpu);
+    for (c = 0; c < lastCPU; c++) {
+	if ((remote & CPUMASK_CPU(c)) == 0)
 	    continue;
 
-	frame->status[CPU()] = (frame->cb)(frame->arg);
-	frame->done[CPU()] = 1;
+	// Our previous call may not have been picked up yet
+	while (mpMailbox[c][cpu] != NULL) {
+	    MP_CrossCallService();
+	    PMap_ShootdownService();
+	    pause();
+	}
+	mpMailbox[c][cpu] = frame;
+    }
+    __sync_synchronize();
 
-	// Increment
-	__sync_add_and_fetch(&frame->count, 1);
+    if (remote == (MP_AllCPUs() & ~CPUMASK_CPU(cpu))) {
+	status = LAPIC_Broadcast(T_CROSSCALL);
+    } else if (remote != 0) {
+	status = LAPIC_Multicast(remote, T_CROSSCALL);
+    }
+
+    // Run on the local CPU
+    if (mask & CPUMASK_CPU(cpu)) {
+	frame->status[cpu] = cb(arg);
+	__sync_fetch_and_add(&frame->count, 1);
     }
 
     Critical_Exit();
+
+    return status;
 }
 
-// XXX: The thread should not be migrated in the middle of this call.
-int
-MP_CrossCall(CrossCallCB cb, void *arg)
+/**
+ * MP_CrossCallDone --
+ *
+ * @param [in] frame Completion handle from MP_CrossCallAsync.
+ * @retval true if all targets have run the callback.
+ */
+bool
+MP_CrossCallDone(CrossCallFrame *frame)
 {
-    volatile CrossCallFrame frame;
+    return frame->count == frame->targets;
+}
 
-    // Setup frame
-    memset((void *)&frame, 0, sizeof(frame));
-    frame.cb = cb;
-    frame.arg = arg;
-    frame.count = 1;
+/**
+ * MP_CrossCallWait --
+ *
+ * Wait for all targets of a cross call to run the callback.  Targets that do 
+ * not respond within MP_WAITTIME are reported, but we keep waiting since they 
+ * may still dereference the frame.
+ *
+ * @param [in] frame Completion handle from MP_CrossCallAsync.
+ * @retval 0 if all callbacks returned 0, otherwise the first non-zero status.
+ */
+int
+MP_CrossCallWait(CrossCallFrame *frame)
+{
+    int c;
+    uint64_t spins = 0;
+    bool reported = false;
+    UnixEpochNS startTS = 0;
 
     Critical_Enter();
+    while (!MP_CrossCallDone(frame)) {
+	// Other CPUs may be waiting on us to run a cross call or flush our TLB
+	MP_CrossCallService();
+	PMap_ShootdownService();
+	pause();
 
-    cpus[CPU()].frame = (CrossCallFrame *)&frame;
-    cpuid(0, 0, 0, 0, 0);
+	if (reported || (++spins % MP_WAITCHECK) != 0)
+	    continue;
 
-    if (LAPIC_Broadcast(T_CROSSCALL) < 0)
-	return -1;
+	if (startTS == 0) {
+	    startTS = KTime_GetEpochNS();
+	} else if ((KTime_GetEpochNS() - startTS) > MP_WAITTIME) {
+	    kprintf("CPU %d: CrossCall %p not picked up by", CPU(), frame->cb);
+	    for (c = 0; c < lastCPU; c++) {
+		if (mpMailbox[c][CPU()] == frame)
+		    kprintf(" %d", c);
+	    }
+	    kprintf(" (%d/%d done)\n", frame->count, frame->targets);
+	    reported = true;
+	}
+    }
+    Critical_Exit();
 
-    // Run on the local CPU
-    frame.status[CPU()] = cb(arg);
-    frame.done[CPU()] = 1;
+    for (c = 0; c < lastCPU; c++) {
+	if ((frame->mask & CPUMASK_CPU(c)) && frame->status[c] != 0)
+	    return frame->status[c];
+    }
 
-    // Wait for all to respond
-    while (frame.count < lastCPU) {
-	// Check for timeout
+    return 0;
+}
 
-	// XXX: Should dump the crosscall frame
-    }
-    cpus[CPU()].frame = NULL;
-    cpuid(0, 0, 0, 0, 0);
+/**
+ * MP_CrossCallMask --
+ *
+ * Run a callback on a set of CPUs and wait for it to complete.
+ *
+ * @param [in] mask CPUs to run the callback on.
+ * @param [in] cb Callback.
+ * @param [in] arg Argument passed to the callback.
+ * @retval 0 on success, -1 if an IPI could not be delivered, otherwise the 
+ *     first non-zero callback status.
+ */
+int
+MP_CrossCallMask(CPUMask mask, CrossCallCB cb, void *arg)
+{
+    int status, cbStatus;
+    CrossCallFrame frame;
 
-    Critical_Exit();
+    status = MP_CrossCallAsync(mask, cb, arg, &frame);
+    cbStatus = MP_CrossCallWait(&frame);
 
-    return 0;
+    return (status != 0) ? status : cbStatus;
+}
+
+int
+MP_CrossCallCPU(int cpu, CrossCallCB cb, void *arg)
+{
+    return MP_CrossCallMask(CPUMASK_CPU(cpu), cb, arg);
+}
+
+int
+MP_CrossCall(CrossCallCB cb, void *arg)
+{
+    return MP_CrossCallMask(MP_AllCPUs(), cb, arg);
+}
+
+/**
+ * MP_Wakeup --
+ *
+ * Interrupt another CPU so that it reprograms its clock and checks for 
+ * preemption.  Idle CPUs stop ticking so this is how they learn about new 
+ * work or earlier timer deadlines.
+ *
+ * @param [in] cpu Target CPU.
+ */
+void
+MP_Wakeup(int cpu)
+{
+    ASSERT(cpu != CPU());
+
+    LAPIC_SendIPI(cpu, T_WAKEUP);
 }
 
 static int
@@ -208,26 +374,56 @@ MPPing(void *arg)
     return 0;
 }
 
+#define MP_PINGSAMPLES	128
+
 static void
 Debug_CrossCall(int argc, const char *argv[])
 {
-    int i;
-    UnixEpochNS startTS, stopTS;
-
-    startTS = KTime_GetEpochNS();
-    for (i = 0; i < 32; i++) {
-	MP_CrossCall(&MPPing, NULL);
+    int i, j, n, c;
+    CPUMask mask;
+    uint64_t startTSC, tmp, total;
+    uint64_t samples[MP_PINGSAMPLES];
+
+    if (lastCPU == 1) {
+	kprintf("No other CPUs\n");
+	return;
     }
-    stopTS = KTime_GetEpochNS();
 
-    // XXX: Print min and max
-    kprintf("Average CrossCall Latency: %llu ns\n",
-	    (stopTS - startTS) / 32ULL);
+    kprintf("Targets     Min     Avg     Max     P99 (cycles)\n");
+    for (n = 1; n < lastCPU; n++) {
+	// First n CPUs other than ourselves
+	mask = 0;
+	for (c = 0, i = 0; c < lastCPU && i < n; c++) {
+	    if (c == CPU())
+		continue;
+	    mask |= CPUMASK_CPU(c);
+	    i++;
+	}
+
+	total = 0;
+	for (i = 0; i < MP_PINGSAMPLES; i++) {
+	    startTSC = Time_GetTSC();
+	    MP_CrossCallMask(mask, &MPPing, NULL);
+	    samples[i] = Time_GetTSC() - startTSC;
+	    total += samples[i];
+	}
+
+	for (i = 1; i < MP_PINGSAMPLES; i++) {
+	    tmp = samples[i];
+	    for (j = i; j > 0 && samples[j - 1] > tmp; j--)
+		samples[j] = samples[j - 1];
+	    samples[j] = tmp;
+	}
+
+	kprintf("%7d %7llu %7llu %7llu %7llu\n", n, samples[0],
+		total / MP_PINGSAMPLES, samples[MP_PINGSAMPLES - 1],
+		samples[(MP_PINGSAMPLES * 99 + 99) / 100 - 1]);
+    }
 
     return;
 }
 
-REGISTER_DBGCMD(crosscall, "Ping crosscall", Debug_CrossCall);
+REGISTER_DBGCMD(crosscall, "Cross call latency per target count", Debug_CrossCall);
 
 static void
 Debug_CPUS(int argc, const char *argv[])
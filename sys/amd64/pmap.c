@@ -1,6 +1,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <sys/kconfig.h>
 #include <sys/kassert.h>
@@ -9,11 +10,55 @@
 
 #include <machine/amd64.h>
 #include <machine/amd64op.h>
+#include <machine/lapic.h>
 #include <machine/mp.h>
+#include <machine/trap.h>
 #include <machine/pmap.h>
 
+#define CPUID_FLAG_PCID		0x20000
+
+// PCID 0 is used before the first address space is loaded
+#define PCID_MAX		CR3_PCIDMASK
+
+typedef struct PMapCPU {
+    uint64_t	pcidGen;
+    uint64_t	nextPCID;
+    uint64_t	rollovers;
+    uint64_t	flushLoads;
+    uint64_t	noflushLoads;
+} PMapCPU;
+
 AS systemAS;
-AS *currentAS[MAX_CPUS];
+static bool pmapPCID;
+static PMapCPU pmapCPU[MAX_CPUS];
+static uint64_t pmapLargeMaps;
+static uint64_t pmapLargeFailed;
+
+/**
+ * PMapInitCPU --
+ *
+ * Enable PCIDs on the current CPU if they are supported.  Must be called while 
+ * the PCID bits of CR3 are zero.
+ */
+static void
+PMapInitCPU()
+{
+    uint32_t ecx;
+    PMapCPU *pc = &pmapCPU[THISCPU()];
+
+    pc->pcidGen = 1;
+    pc->nextPCID = 1;
+
+    cpuid(1, NULL, NULL, &ecx, NULL);
+    if ((ecx & CPUID_FLAG_PCID) == 0) {
+	ASSERT(!pmapPCID);
+	return;
+    }
+
+    write_cr4(read_cr4() | CR4_PCIDE);
+    if (THISCPU() == 0)
+	pmapPCID = true;
+}
 
 void
 PMap_Init()
@@ -24,7 +69,7 @@ PMap_Init()
 
     // Setup global state
     for (i = 0; i < MAX_CPUS; i++) {
-	currentAS[i] = 0;
+	percpu[i].currentAS = 0;
     }
 
     // Allocate system page table
@@ -33,6 +78,7 @@ PMap_Init()
     systemAS.mappings = 0;
     if (!systemAS.root)
 	PANIC("Cannot allocate system page table");
+    VM_InitAS(&systemAS);
 
     for (i = 0; i < PAGETABLE_ENTRIES / 2; i++)
 	systemAS.root->entries[i] = 0;
@@ -58,6 +104,7 @@ PMap_Init()
     PMap_SystemLMap(0x100000000, MEM_DIRECTMAP_BASE + 0x100000000,
 		    60*512, 0); // 60GB RWX
 
+    PMapInitCPU();
     PMap_LoadAS(&systemAS);
 
     kprintf("Done!\n");
@@ -66,6 +113,7 @@ PMap_Init()
 void
 PMap_InitAP()
 {
+    PMapInitCPU();
     PMap_LoadAS(&systemAS);
 }
 
@@ -93,6 +141,7 @@ PMap_NewAS()
 	PAlloc_Release(as);
 	return NULL;
     }
+    VM_InitAS(as);
 
     for (i = 0; i < PAGETABLE_ENTRIES / 2; i++)
     {
@@ -115,6 +164,8 @@ PMap_NewAS()
 void
 PMap_DestroyAS(AS *space)
 {
+    VM_DestroyAS(space);
+
     // Only free the userspace portion (bottom half)
     for (int i = 0; i < PAGETABLE_ENTRIES / 2; i++)
     {
@@ -128,8 +179,10 @@ PMap_DestroyAS(AS *space)
 		    PageTable *tbl3 = (PageTable *)DMPA2VA(pte2 & PGNUMMASK);
 		    for (int k = 0; k < PAGETABLE_ENTRIES; k++) {
 			PageEntry pte3 = tbl3->entries[k];
-			if (pte3 & PTE_P) {
-			    ASSERT((pte3 & PTE_PS) == 0); // XXX: Large pages not supported
+			if ((pte3 & PTE_P) && (pte3 & PTE_PS)) {
+			    // Free userspace large page
+			    PAlloc_Release((void *)DMPA2VA(pte3 & PGNUMMASK));
+			} else if (pte3 & PTE_P) {
 			    PageTable *tbl4 = (PageTable *)DMPA2VA(pte3 & PGNUMMASK);
 			    for (int l = 0; l < PAGETABLE_ENTRIES; l++) {
 				PageEntry pte4 = tbl4->entries[l];
@@ -154,6 +207,7 @@ PMap_DestroyAS(AS *space)
 	}
     }
 
+    PAlloc_Release(space->root);
     PAlloc_Release(space);
 }
 
@@ -167,22 +221,80 @@ PMap_DestroyAS(AS *space)
 AS *
 PMap_CurrentAS()
 {
-    return currentAS[THISCPU()];
+    return PERCPU_GET(currentAS);
 }
 
 /**
  * PMap_LoadAS --
  *
  * Load an address space into the CPU.  Reloads the CR3 register in x86-64 that 
- * points the physical page tables and flushes the TLB entries.
+ * points the physical page tables.  When the CPU supports PCIDs each address 
+ * space is tagged with a per-CPU PCID and its TLB entries are preserved unless 
+ * the address space had a TLB shootdown since it was last loaded here.  The 
+ * kernel half is mapped global and is never flushed by a reload.
  *
  * @param [in] space Address space to load.
  */
 void
 PMap_LoadAS(AS *space)
 {
-    write_cr3(DMVA2PA((uint64_t)space->root));
-    currentAS[THISCPU()] = space;
+    int c;
+    uint64_t gen;
+    uint64_t cr3 = DMVA2PA((uint64_t)space->root);
+    AS *prev;
+    ASCPUState *state;
+    PMapCPU *pc;
+
+    Critical_Enter();
+    c = THISCPU();
+    state = &space->cpu[c];
+    pc = &pmapCPU[c];
+
+    /*
+     * Publish the address space before sampling its shootdown generation.  
+     * PMap_Shootdown does the opposite so either we see the new generation or 
+     * it sees us and interrupts this CPU.
+     */
+    prev = PERCPU_GET(currentAS);
+    PERCPU_SET(currentAS, space);
+    __sync_synchronize();
+    gen = space->tlbGen;
+
+    // Switching between threads of the same process
+    if (prev == space) {
+	Critical_Exit();
+	return;
+    }
+
+    if (!pmapPCID) {
+	write_cr3(cr3);
+	Critical_Exit();
+	return;
+    }
+
+    if (state->pcidGen != pc->pcidGen) {
+	if (pc->nextPCID > PCID_MAX) {
+	    // Out of PCIDs, flush all contexts and start a new generation
+	    write_cr4(read_cr4() & ~CR4_PGE);
+	    write_cr4(read_cr4() | CR4_PGE);
+	    pc->pcidGen++;
+	    pc->nextPCID = 1;
+	    pc->rollovers++;
+	}
+	state->pcid = pc->nextPCID++;
+	state->pcidGen = pc->pcidGen;
+	write_cr3(cr3 | state->pcid);
+	pc->flushLoads++;
+    } else if (state->tlbGen != gen) {
+	write_cr3(cr3 | state->pcid);
+	pc->flushLoads++;
+    } else {
+	write_cr3(cr3 | state->pcid | CR3_NOFLUSH);
+	pc->noflushLoads++;
+    }
+    state->tlbGen = gen;
+
+    Critical_Exit();
 }
 
 /**
@@ -267,7 +379,8 @@ PMap_Translate(AS *space, uintptr_t va)
  *
  * Lookup a virtual address in a page table and return a pointer to the page 
  * entry.  This function allocates page tables as necessary to fill in the 
- * 4-level heirarchy.
+ * 4-level heirarchy.  A 4KB lookup that hits a 2MB page returns the large page 
+ * entry, callers must check for PTE_PS.
  *
  * @param [in] space Address space to search.
  * @param [in] va Virtual address to lookup.
@@ -316,7 +429,7 @@ PMapLookupEntry(AS *space, uint64_t va, PageEntry **entry, int size)
     table = (PageTable *)DMPA2VA(pte & PGNUMMASK);
 
     pte = table->entries[k];
-    if (size == LARGE_PGSIZE) {
+    if (size == LARGE_PGSIZE || (pte & PTE_PS)) {
 	// Handle 2MB pages
 	*entry = &table->entries[k];
 	return;
@@ -365,6 +478,7 @@ PMap_Map(AS *as, uint64_t phys, uint64_t virt, uint64_t pages, uint64_t flags)
 	    return false;
 	}
 
+	ASSERT((*entry & PTE_PS) == 0);
 	*entry = (phys + PGSIZE * i) | PTE_P | PTE_W | PTE_U | flags;
     }
 
@@ -372,39 +486,252 @@ PMap_Map(AS *as, uint64_t phys, uint64_t virt, uint64_t pages, uint64_t flags)
 }
 
 /**
- * PMap_Unmap --
+ * PMapWalk --
  *
- * Unmap a range of addresses.
+ * Walk the page tables without allocating.  Returns the deepest present 
+ * table on the path to va and the index of va in it.
  *
- * @param [in] as Address space.
- * @param [in] va Virtual address.
- * @param [in] pages Pages to map in.
+ * @param [out] tables Page tables from the root down to level.
  *
- * @retval true On success
- * @retval false On failure
+ * @return Level of the last table (0 = root, 3 = 4KB page table).
  */
-bool
-PMap_Unmap(AS *as, uint64_t va, uint64_t pages)
+static int
+PMapWalk(AS *as, uint64_t va, PageTable *tables[4])
+{
+    int level;
+    PageEntry pte;
+    int shift = HUGE_PGSHIFT + PGIDXSHIFT;
+
+    tables[0] = as->root;
+    for (level = 0; level < 3; level++) {
+	pte = tables[level]->entries[(va >> shift) & PGIDXMASK];
+	if ((pte & PTE_P) == 0 || (pte & PTE_PS))
+	    return level;
+
+	tables[level + 1] = (PageTable *)DMPA2VA(pte & PGNUMMASK);
+	shift -= PGIDXSHIFT;
+    }
+
+    return level;
+}
+
+static bool
+PMapTableEmpty(PageTable *table)
 {
     int i;
-    PageEntry *entry;
 
-    for (i = 0; i < pages; i++) {
-	uint64_t vai = va + PGSIZE * i;
-	PMapLookupEntry(as, vai, &entry, PGSIZE);
-	if (!entry) {
-	    kprintf("Unmap tried to allocate memory!\n");
+    for (i = 0; i < PAGETABLE_ENTRIES; i++) {
+	if (table->entries[i] != 0)
 	    return false;
+    }
+
+    return true;
+}
+
+static void
+PMapDeferFree(PMapShootdown *sd, void *pg)
+{
+    ASSERT(sd->nfree < PMAP_SHOOTDOWN_FREE);
+    sd->free[sd->nfree++] = pg;
+}
+
+/**
+ * PMap_Demote --
+ *
+ * Replace a 2MB page with a table of 4KB pages so that part of it can be 
+ * unmapped or reprotected.  The region lock must be held.
+ *
+ * A page we own is split in place, other CPUs may keep writing through stale 
+ * 2MB TLB entries until the shootdown since they reach the same memory.  A 
+ * shared page is copy on write, so no CPU can write it and we make private 
+ * copies.  Our reference to the old page is released by the shootdown.
+ *
+ * @retval true On success or if va is not mapped by a large page.
+ * @retval false Out of memory.
+ */
+bool
+PMap_Demote(AS *as, uint64_t va, PMapShootdown *sd)
+{
+    int l;
+    PageTable *tables[4];
+    PageTable *tbl;
+    PageEntry *entry;
+    PageEntry pte;
+    void *oldpg;
+    void *newpg;
+    int level = PMapWalk(as, va, tables);
+
+    if (level != 2)
+	return true;
+    entry = &tables[2]->entries[(va >> LARGE_PGSHIFT) & PGIDXMASK];
+    pte = *entry;
+    if ((pte & PTE_PS) == 0)
+	return true;
+
+    oldpg = (void *)DMPA2VA(pte & PGNUMMASK);
+    tbl = PMapAllocPageTable();
+    if (!tbl)
+	return false;
+
+    // The pages are private so copy on write is resolved here
+    if (pte & PTE_COW)
+	pte = (pte & ~(uint64_t)PTE_COW) | PTE_W;
+    pte &= ~(PGNUMMASK | PTE_PS | PTE_G);
+
+    if (PAlloc_RefCount(oldpg) == 1) {
+	PAlloc_Split(oldpg);
+	for (l = 0; l < PAGETABLE_ENTRIES; l++) {
+	    tbl->entries[l] = DMVA2PA((uint64_t)oldpg + PGSIZE * l) | pte;
 	}
 
-	NOT_IMPLEMENTED();
+	*entry = DMVA2PA((uint64_t)tbl) | PTE_P | PTE_W | PTE_U;
+	PMap_ShootdownAdd(sd, va & ~LARGE_PGMASK, LARGE_PGSIZE / PGSIZE);
 
-	*entry = 0;
+	return true;
     }
 
+    ASSERT((*entry & PTE_W) == 0);
+    for (l = 0; l < PAGETABLE_ENTRIES; l++) {
+	newpg = PAlloc_AllocPageNoZero();
+	if (!newpg) {
+	    while (--l >= 0)
+		PAlloc_Release((void *)DMPA2VA(tbl->entries[l] & PGNUMMASK));
+	    PAlloc_Release(tbl);
+	    return false;
+	}
+
+	memcpy(newpg, (char *)oldpg + PGSIZE * l, PGSIZE);
+	tbl->entries[l] = DMVA2PA((uint64_t)newpg) | pte;
+    }
+
+    *entry = DMVA2PA((uint64_t)tbl) | PTE_P | PTE_W | PTE_U;
+    PMap_ShootdownAdd(sd, va & ~LARGE_PGMASK, LARGE_PGSIZE / PGSIZE);
+    PMapDeferFree(sd, oldpg);
+
     return true;
 }
 
+/**
+ * PMap_Unmap --
+ *
+ * Unmap a range of addresses.  The pages and any page tables that become 
+ * empty are released by PMap_ShootdownFlush once no CPU can access them.  
+ * Large pages must be entirely inside the range (see PMap_Demote).  The 
+ * region lock must be held.
+ *
+ * @param [in] as Address space.
+ * @param [in] va Page aligned start of the range.
+ * @param [in] end End of the range.
+ * @param [in] sd Shootdown batch that collects the invalidations.
+ *
+ * @return Address where we stopped because the batch is full, the caller 
+ * should flush the batch and call us again if it is less than end.
+ */
+uint64_t
+PMap_Unmap(AS *as, uint64_t va, uint64_t end, PMapShootdown *sd)
+{
+    int level;
+    PageTable *tables[4];
+    PageEntry *entry;
+    static const uint64_t span[4] = {
+	1ULL << (HUGE_PGSHIFT + PGIDXSHIFT), HUGE_PGSIZE, LARGE_PGSIZE, PGSIZE
+    };
+
+    ASSERT((va & PGMASK) == 0);
+
+    // Each step frees a page and at most three page tables
+    while (va < end && sd->nfree + 4 <= PMAP_SHOOTDOWN_FREE) {
+	level = PMapWalk(as, va, tables);
+	entry = &tables[level]->entries[(va / span[level]) & PGIDXMASK];
+
+	if (*entry & PTE_P) {
+	    ASSERT(level == 3 || (*entry & PTE_PS));
+	    ASSERT(level == 3 || (va & LARGE_PGMASK) == 0);
+	    ASSERT(level == 3 || va + LARGE_PGSIZE <= end);
+
+	    PMapDeferFree(sd, (void *)DMPA2VA(*entry & PGNUMMASK));
+	    PMap_ShootdownAdd(sd, va, span[level] / PGSIZE);
+	    *entry = 0;
+	}
+	va = (va & ~(span[level] - 1)) + span[level];
+
+	/*
+	 * Release page tables that are empty once we are done with them.  The 
+	 * root is never freed.
+	 */
+	while (level > 0 &&
+	       ((va & (span[level - 1] - 1)) == 0 || va >= end) &&
+	       PMapTableEmpty(tables[level])) {
+	    PageEntry *parent = &tables[level - 1]->entries[
+		((va - 1) / span[level - 1]) & PGIDXMASK];
+	    PMapDeferFree(sd, tables[level]);
+	    PMap_ShootdownAdd(sd, (va - 1) & ~PGMASK, 1);
+	    *parent = 0;
+	    level--;
+	}
+    }
+
+    return va < end ? va : end;
+}
+
+/**
+ * PMap_Protect --
+ *
+ * Change the protection of the pages in a range.  Pages that are shared are 
+ * marked copy on write instead of writable.  Large pages must be entirely 
+ * inside the range.  The region lock must be held.
+ *
+ * @param [in] as Address space.
+ * @param [in] va Page aligned start of the range.
+ * @param [in] end End of the range.
+ * @param [in] flags PTE_W, PTE_NX and PTE_U to apply.
+ * @param [in] sd Shootdown batch that collects the invalidations.
+ */
+void
+PMap_Protect(AS *as, uint64_t va, uint64_t end, uint64_t flags,
+	     PMapShootdown *sd)
+{
+    int level;
+    PageTable *tables[4];
+    PageEntry *entry;
+    PageEntry pte;
+    static const uint64_t span[4] = {
+	1ULL << (HUGE_PGSHIFT + PGIDXSHIFT), HUGE_PGSIZE, LARGE_PGSIZE, PGSIZE
+    };
+
+    ASSERT((va & PGMASK) == 0);
+
+    while (va < end) {
+	level = PMapWalk(as, va, tables);
+	entry = &tables[level]->entries[(va / span[level]) & PGIDXMASK];
+	pte = *entry;
+
+	if ((pte & PTE_P) == 0) {
+	    va = (va & ~(span[level] - 1)) + span[level];
+	    continue;
+	}
+
+	ASSERT(level == 3 || (va & LARGE_PGMASK) == 0);
+	ASSERT(level == 3 || va + LARGE_PGSIZE <= end);
+
+	pte = (pte & ~(uint64_t)(PTE_W | PTE_NX | PTE_U)) |
+	      (flags & (PTE_NX | PTE_U));
+	if (flags & PTE_W) {
+	    if ((pte & PTE_COW) ||
+		PAlloc_RefCount((void *)DMPA2VA(pte & PGNUMMASK)) > 1)
+		pte |= PTE_COW;
+	    else
+		pte |= PTE_W;
+	}
+
+	if (pte != *entry) {
+	    *entry = pte;
+	    PMap_ShootdownAdd(sd, va, span[level] / PGSIZE);
+	}
+	va += span[level];
+    }
+}
+
 /**
  * PMap_AllocMap --
  *
@@ -438,6 +765,10 @@ PMap_AllocMap(AS *as, uint64_t virt, uint64_t len, uint64_t flags)
 
 	if ((*entry & PTE_P) != PTE_P) {
 	    void *pg = PAlloc_AllocPage();
+	    if (!pg) {
+		kprintf("Map failed to allocate memory!\n");
+		return false;
+	    }
 	    *entry = (uint64_t)DMVA2PA(pg) | PTE_P | PTE_U | flags;
 	}
     }
@@ -445,6 +776,284 @@ PMap_AllocMap(AS *as, uint64_t virt, uint64_t len, uint64_t flags)
     return true;
 }
 
+/**
+ * PMap_MapShared --
+ *
+ * Map an existing page into an address space without write access.  A 
+ * reference is taken on the page and dropped when it is unmapped.
+ *
+ * @param [in] as Address space.
+ * @param [in] virt Virtual address.
+ * @param [in] pg Page allocated with PAlloc.
+ * @param [in] flags Flags to apply to the mapping.
+ *
+ * @retval true On success
+ * @retval false On failure
+ */
+bool
+PMap_MapShared(AS *as, uint64_t virt, void *pg, uint64_t flags)
+{
+    PageEntry *entry;
+
+    ASSERT((virt & PGMASK) == 0);
+    ASSERT((flags & PTE_W) == 0);
+
+    PMapLookupEntry(as, virt, &entry, PGSIZE);
+    if (!entry) {
+	kprintf("Map failed to allocate memory!\n");
+	return false;
+    }
+
+    ASSERT((*entry & PTE_P) == 0);
+    PAlloc_Retain(pg);
+    *entry = (uint64_t)DMVA2PA(pg) | PTE_P | PTE_U | flags;
+
+    return true;
+}
+
+static uint64_t
+AddrFromIJKL(uint64_t i, uint64_t j, uint64_t k, uint64_t l)
+{
+    return (i << 39) | (j << HUGE_PGSHIFT) | (k << LARGE_PGSHIFT) | (l << PGSHIFT);
+}
+
+/**
+ * PMap_AllocMapLarge --
+ *
+ * Back a 2MB aligned range of an address space with a newly allocated large 
+ * page.
+ *
+ * @param [in] as Address space.
+ * @param [in] virt Virtual address aligned to LARGE_PGSIZE.
+ * @param [in] flags Flags to apply to the mapping.
+ *
+ * @retval true On success or if a large page is already mapped.
+ * @retval false The range already has 4KB pages or there is no contiguous 
+ * memory available, the caller should fall back to 4KB pages.
+ */
+bool
+PMap_AllocMapLarge(AS *as, uint64_t virt, uint64_t flags)
+{
+    PageEntry *entry;
+    void *pg;
+
+    ASSERT((virt & LARGE_PGMASK) == 0);
+
+    PMapLookupEntry(as, virt, &entry, LARGE_PGSIZE);
+    if (!entry)
+	return false;
+    if (*entry & PTE_P)
+	return (*entry & PTE_PS) == PTE_PS;
+
+    pg = PAlloc_AllocPages(LARGE_PGSHIFT - PGSHIFT);
+    if (!pg) {
+	__sync_fetch_and_add(&pmapLargeFailed, 1);
+	return false;
+    }
+
+    *entry = (uint64_t)DMVA2PA(pg) | PTE_P | PTE_U | PTE_PS | flags;
+    __sync_fetch_and_add(&pmapLargeMaps, 1);
+
+    return true;
+}
+
+/**
+ * PMap_CloneAS --
+ *
+ * Copy the user half of an address space into a new address space using copy 
+ * on write.  Writable pages are made read-only and marked PTE_COW in both 
+ * address spaces, while read-only pages (e.g. program text) are simply shared.  
+ * The caller must hold the region lock of the source and flush its TLB with 
+ * PMap_Shootdown afterwards.
+ *
+ * @param [in] dst Newly created address space.
+ * @param [in] src Address space to clone.
+ *
+ * @retval true On success
+ * @retval false Out of memory, dst may be partially populated.
+ */
+bool
+PMap_CloneAS(AS *dst, AS *src)
+{
+    PageEntry *entry;
+
+    for (int i = 0; i < PAGETABLE_ENTRIES / 2; i++) {
+	PageEntry pte = src->root->entries[i];
+	if ((pte & PTE_P) == 0)
+	    continue;
+
+	PageTable *tbl2 = (PageTable *)DMPA2VA(pte & PGNUMMASK);
+	for (int j = 0; j < PAGETABLE_ENTRIES; j++) {
+	    PageEntry pte2 = tbl2->entries[j];
+	    if ((pte2 & PTE_P) == 0)
+		continue;
+
+	    PageTable *tbl3 = (PageTable *)DMPA2VA(pte2 & PGNUMMASK);
+	    for (int k = 0; k < PAGETABLE_ENTRIES; k++) {
+		PageEntry pte3 = tbl3->entries[k];
+		if ((pte3 & PTE_P) == 0)
+		    continue;
+
+		if (pte3 & PTE_PS) {
+		    if (pte3 & PTE_W) {
+			pte3 = (pte3 & ~(uint64_t)PTE_W) | PTE_COW;
+			tbl3->entries[k] = pte3;
+		    }
+
+		    PMapLookupEntry(dst, AddrFromIJKL(i, j, k, 0), &entry,
+				    LARGE_PGSIZE);
+		    if (!entry)
+			return false;
+
+		    PAlloc_Retain((void *)DMPA2VA(pte3 & PGNUMMASK));
+		    *entry = pte3;
+		    continue;
+		}
+
+		PageTable *tbl4 = (PageTable *)DMPA2VA(pte3 & PGNUMMASK);
+		for (int l = 0; l < PAGETABLE_ENTRIES; l++) {
+		    PageEntry pte4 = tbl4->entries[l];
+		    if ((pte4 & PTE_P) == 0)
+			continue;
+
+		    if (pte4 & PTE_W) {
+			pte4 = (pte4 & ~(uint64_t)PTE_W) | PTE_COW;
+			tbl4->entries[l] = pte4;
+		    }
+
+		    PMapLookupEntry(dst, AddrFromIJKL(i, j, k, l), &entry,
+				    PGSIZE);
+		    if (!entry)
+			return false;
+
+		    PAlloc_Retain((void *)DMPA2VA(pte4 & PGNUMMASK));
+		    *entry = pte4;
+		}
+	    }
+	}
+    }
+
+    return true;
+}
+
+/**
+ * PMapCopyOnWriteLarge --
+ *
+ * Resolve a write fault on a copy on write 2MB page.  If no contiguous memory 
+ * is available the copy is split into 4KB pages.
+ */
+static bool
+PMapCopyOnWriteLarge(PageEntry *entry, uint64_t va, PMapShootdown *sd)
+{
+    int l;
+    PageEntry pte = (*entry & ~(uint64_t)PTE_COW) | PTE_W;
+    void *oldpg = (void *)DMPA2VA(pte & PGNUMMASK);
+    void *newpg;
+    PageTable *tbl;
+
+    va &= ~LARGE_PGMASK;
+
+    if (PAlloc_RefCount(oldpg) == 1) {
+	*entry = pte;
+	PMap_ShootdownAdd(sd, va, LARGE_PGSIZE / PGSIZE);
+	return true;
+    }
+
+    newpg = PAlloc_AllocPages(LARGE_PGSHIFT - PGSHIFT);
+    if (newpg) {
+	memcpy(newpg, oldpg, LARGE_PGSIZE);
+	*entry = DMVA2PA((uint64_t)newpg) | (pte & ~PGNUMMASK);
+	PMap_ShootdownAdd(sd, va, LARGE_PGSIZE / PGSIZE);
+	PMapDeferFree(sd, oldpg);
+	return true;
+    }
+
+    tbl = PMapAllocPageTable();
+    if (!tbl)
+	return false;
+
+    for (l = 0; l < PAGETABLE_ENTRIES; l++) {
+	newpg = PAlloc_AllocPageNoZero();
+	if (!newpg) {
+	    while (--l >= 0)
+		PAlloc_Release((void *)DMPA2VA(tbl->entries[l] & PGNUMMASK));
+	    PAlloc_Release(tbl);
+	    return false;
+	}
+
+	memcpy(newpg, (char *)oldpg + PGSIZE * l, PGSIZE);
+	tbl->entries[l] = DMVA2PA((uint64_t)newpg) | PTE_P | PTE_W | PTE_U |
+			  (pte & PTE_NX);
+    }
+
+    *entry = DMVA2PA((uint64_t)tbl) | PTE_P | PTE_W | PTE_U;
+    PMap_ShootdownAdd(sd, va, LARGE_PGSIZE / PGSIZE);
+    PMapDeferFree(sd, oldpg);
+
+    return true;
+}
+
+/**
+ * PMap_CopyOnWrite --
+ *
+ * Resolve a write fault on a copy on write page.  If we hold the last 
+ * reference the page is made writable in place, otherwise the contents are 
+ * copied into a new page.  The invalidation is queued on sd and the old page 
+ * is only released once the caller flushes it, as other CPUs may still reach 
+ * it through their TLBs.  The region lock of the address space must be held.
+ *
+ * @param [in] as Address space.
+ * @param [in] va Page aligned virtual address that faulted.
+ * @param [in] sd Shootdown batch the caller flushes after dropping its locks.
+ *
+ * @retval true The page is writable.
+ * @retval false The page is not a copy on write page or we ran out of memory.
+ */
+bool
+PMap_CopyOnWrite(AS *as, uint64_t va, PMapShootdown *sd)
+{
+    PageEntry *entry;
+    PageEntry pte;
+    void *oldpg;
+    void *newpg;
+
+    ASSERT((va & PGMASK) == 0);
+
+    PMapLookupEntry(as, va, &entry, PGSIZE);
+    if (!entry)
+	return false;
+
+    pte = *entry;
+    if ((pte & PTE_P) == 0)
+	return false;
+    // Another thread resolved the fault first
+    if (pte & PTE_W)
+	return true;
+    if ((pte & PTE_COW) == 0)
+	return false;
+
+    if (pte & PTE_PS)
+	return PMapCopyOnWriteLarge(entry, va, sd);
+
+    oldpg = (void *)DMPA2VA(pte & PGNUMMASK);
+    pte = (pte & ~(uint64_t)PTE_COW) | PTE_W;
+    if (PAlloc_RefCount(oldpg) == 1) {
+	*entry = pte;
+    } else {
+	newpg = PAlloc_AllocPageNoZero();
+	if (!newpg)
+	    return false;
+
+	memcpy(newpg, oldpg, PGSIZE);
+	*entry = DMVA2PA((uint64_t)newpg) | (pte & ~PGNUMMASK);
+	PMapDeferFree(sd, oldpg);
+    }
+
+    PMap_ShootdownAdd(sd, va, 1);
+
+    return true;
+}
+
 /**
  * PMap_SystemLookup --
  *
@@ -466,7 +1075,8 @@ PMap_SystemLookup(uint64_t va, PageEntry **entry, int size)
  * PMap_SystemLMap --
  *
  * Map a range of large (2MB) physical pages to virtual pages in the kernel 
- * address space that is shared by all processes.
+ * address space that is shared by all processes.  Kernel mappings are global 
+ * so they survive address space switches.
  *
  * @param [in] phys Physical address.
  * @param [in] virt Virtual address.
@@ -490,7 +1100,8 @@ PMap_SystemLMap(uint64_t phys, uint64_t virt, uint64_t lpages, uint64_t flags)
 	    return false;
 	}
 
-	*entry = (phys + LARGE_PGSIZE * i) | PTE_P | PTE_W | PTE_PS | flags;
+	*entry = (phys + LARGE_PGSIZE * i) | PTE_P | PTE_W | PTE_PS | PTE_G |
+		 flags;
     }
 
     return true;
@@ -524,28 +1135,262 @@ PMap_SystemMap(uint64_t phys, uint64_t virt, uint64_t pages, uint64_t flags)
 	    return false;
 	}
 
-	*entry = (phys + PGSIZE * i) | PTE_P | PTE_W | flags;
+	*entry = (phys + PGSIZE * i) | PTE_P | PTE_W | PTE_G | flags;
     }
 
     return true;
 }
 
+/*
+ * TLB Shootdown
+ *
+ * Invalidations are batched into a PMapShootdown that is delivered to the CPUs 
+ * that have the address space loaded through a per-CPU mailbox and the 
+ * T_TLBSHOOTDOWN IPI.  Every CPU has one mailbox slot per initiating CPU, so 
+ * concurrent shootdowns never block each other.  CPUs waiting for 
+ * acknowledgements service their own mailbox to avoid deadlocks.
+ */
+static volatile PMapShootdown *pmapMailbox[MAX_CPUS][MAX_CPUS];
+static uint64_t pmapShootdowns;
+static uint64_t pmapShootdownIPIs;
+static uint64_t pmapShootdownFull;
+
+/**
+ * PMapInvalidate --
+ *
+ * Apply a shootdown request to the local TLB.
+ */
+static void
+PMapInvalidate(volatile PMapShootdown *sd)
+{
+    int r;
+    uint64_t i;
+
+    if (sd->full) {
+	if (sd->as == &systemAS) {
+	    // Kernel mappings are global and survive a CR3 reload
+	    write_cr4(read_cr4() & ~CR4_PGE);
+	    write_cr4(read_cr4() | CR4_PGE);
+	} else {
+	    write_cr3(read_cr3());
+	}
+	return;
+    }
+
+    for (r = 0; r < sd->ranges; r++) {
+	for (i = 0; i < sd->range[r].pages; i++) {
+	    invlpg(sd->range[r].va + PGSIZE * i);
+	}
+    }
+}
+
+/**
+ * PMap_ShootdownService --
+ *
+ * Process the shootdown requests sent to this CPU.  This is called from the 
+ * T_TLBSHOOTDOWN handler and by CPUs that spin waiting on other CPUs with 
+ * interrupts disabled.
+ */
+void
+PMap_ShootdownService()
+{
+    int c;
+    int cpu = THISCPU();
+    volatile PMapShootdown *sd;
+
+    for (c = 0; c < MP_GetCPUs(); c++) {
+	sd = pmapMailbox[cpu][c];
+	if (sd == NULL)
+	    continue;
+
+	pmapMailbox[cpu][c] = NULL;
+
+	/*
+	 * CPUs that switched away already see the bumped generation and flush 
+	 * the PCID when the address space is loaded again.
+	 */
+	if (sd->as == &systemAS || PERCPU_GET(currentAS) == sd->as)
+	    PMapInvalidate(sd);
+
+	__sync_fetch_and_sub(&sd->pending, 1);
+    }
+}
+
+/**
+ * PMap_ShootdownInit --
+ *
+ * Start a batch of TLB invalidations for an address space.
+ */
+void
+PMap_ShootdownInit(PMapShootdown *sd, AS *as)
+{
+    sd->as = as;
+    sd->ranges = 0;
+    sd->pages = 0;
+    sd->full = false;
+    sd->pending = 0;
+    sd->nfree = 0;
+}
+
+/**
+ * PMap_ShootdownAdd --
+ *
+ * Add a range to the batch.  Adjacent ranges are merged and the batch turns 
+ * into a full flush if it grows beyond PMAP_INVLPG_MAX pages or runs out of 
+ * ranges.
+ */
+void
+PMap_ShootdownAdd(PMapShootdown *sd, uint64_t va, uint64_t pages)
+{
+    if (sd->full || pages == 0)
+	return;
+
+    sd->pages += pages;
+    if (sd->pages > PMAP_INVLPG_MAX) {
+	sd->full = true;
+	return;
+    }
+
+    if (sd->ranges > 0) {
+	uint64_t end = sd->range[sd->ranges - 1].va +
+		       sd->range[sd->ranges - 1].pages * PGSIZE;
+	if (end == va) {
+	    sd->range[sd->ranges - 1].pages += pages;
+	    return;
+	}
+    }
+
+    if (sd->ranges == PMAP_SHOOTDOWN_RANGES) {
+	sd->full = true;
+	return;
+    }
+
+    sd->range[sd->ranges].va = va;
+    sd->range[sd->ranges].pages = pages;
+    sd->ranges++;
+}
+
+/**
+ * PMap_ShootdownFlush --
+ *
+ * Invalidate the batched ranges on every CPU that has the address space 
+ * loaded, or on all CPUs for kernel mappings, and wait for them to finish.  
+ * Pages queued by PMap_Unmap are released afterwards.  
+ * Must not be called with spinlocks held as the page tables need to be 
+ * consistent and other CPUs may be waiting on us.
+ *
+ * @param [in] sd Batch of invalidations, it is reset on return.
+ */
+void
+PMap_ShootdownFlush(PMapShootdown *sd)
+{
+    int c;
+    int cpu;
+    bool local = false;
+    bool kernel = (sd->as == &systemAS);
+
+    if (!sd->full && sd->ranges == 0) {
+	ASSERT(sd->nfree == 0);
+	return;
+    }
+
+    /*
+     * The page table updates must be visible before we sample currentAS.  CPUs 
+     * that load the address space later or still hold TLB entries tagged with 
+     * its PCID will see the new generation and flush.
+     */
+    __sync_fetch_and_add(&sd->as->tlbGen, 1);
+    __sync_synchronize();
+
+    Critical_Enter();
+    cpu = THISCPU();
+    for (c = 0; c < MP_GetCPUs(); c++) {
+	if (!kernel && percpu[c].currentAS != sd->as)
+	    continue;
+	if (c == cpu) {
+	    local = true;
+	    continue;
+	}
+
+	__sync_fetch_and_add(&sd->pending, 1);
+	pmapMailbox[c][cpu] = sd;
+	LAPIC_SendIPI(c, T_TLBSHOOTDOWN);
+	__sync_fetch_and_add(&pmapShootdownIPIs, 1);
+    }
+
+    if (local)
+	PMapInvalidate(sd);
+
+    while (sd->pending != 0) {
+	PMap_ShootdownService();
+	pause();
+    }
+    Critical_Exit();
+
+    __sync_fetch_and_add(&pmapShootdowns, 1);
+    if (sd->full)
+	__sync_fetch_and_add(&pmapShootdownFull, 1);
+
+    // No CPU can reach these pages anymore
+    for (c = 0; c < sd->nfree; c++)
+	PAlloc_Release(sd->free[c]);
+
+    PMap_ShootdownInit(sd, sd->as);
+}
+
+/**
+ * PMap_Shootdown --
+ *
+ * Invalidate a single range of TLB entries, see PMap_ShootdownFlush.
+ *
+ * @param [in] as Address space that was modified.
+ * @param [in] va Virtual address.
+ * @param [in] pages Pages to invalidate.
+ */
+void
+PMap_Shootdown(AS *as, uint64_t va, uint64_t pages)
+{
+    PMapShootdown sd;
+
+    PMap_ShootdownInit(&sd, as);
+    PMap_ShootdownAdd(&sd, va, pages);
+    PMap_ShootdownFlush(&sd);
+}
+
 /**
  * PMap_SystemUnmap --
  *
- * We do not currently use this!
+ * Unmap a range of pages from the kernel address space and invalidate the TLB 
+ * entries on all CPUs.  The caller owns the physical pages and may only free 
+ * them once this returns.  Must not be called with spinlocks held as other 
+ * CPUs are interrupted to flush their TLBs.
+ *
+ * @param [in] virt Virtual address.
+ * @param [in] pages Pages to unmap.
+ *
+ * @retval true On success
+ * @retval false On failure
  */
 bool
 PMap_SystemUnmap(uint64_t virt, uint64_t pages)
 {
-    NOT_IMPLEMENTED();
-    return false;
-}
+    int i;
+    PageEntry *entry;
 
-static uint64_t
-AddrFromIJKL(uint64_t i, uint64_t j, uint64_t k, uint64_t l)
-{
-    return (i << 39) | (j << HUGE_PGSHIFT) | (k << LARGE_PGSHIFT) | (l << PGSHIFT);
+    for (i = 0; i < pages; i++) {
+	uint64_t va = virt + PGSIZE * i;
+	PMapLookupEntry(&systemAS, va, &entry, PGSIZE);
+	if (!entry) {
+	    kprintf("SystemUnmap tried to allocate memory!\n");
+	    return false;
+	}
+
+	*entry = 0;
+    }
+
+    PMap_Shootdown(&systemAS, virt, pages);
+
+    return true;
 }
 
 void
@@ -607,7 +1452,7 @@ PMap_DumpFull(AS *space)
 static void
 Debug_PMapDumpFull(int argc, const char *argv[])
 {
-    PMap_DumpFull(currentAS[THISCPU()]);
+    PMap_DumpFull(PMap_CurrentAS());
 }
 
 REGISTER_DBGCMD(pmapdumpfull, "Dump memory mappings", Debug_PMapDumpFull);
@@ -657,6 +1502,15 @@ PMap_Dump(AS *space)
 				    (pte4 & PTE_A) ? 'A' : ' ',
 				    (pte4 & PTE_D) ? 'D' : ' ');
 		    }
+		} else {
+		    kprintf("0x%016llx: 0x%016llx P%c%c%c%c%cL\n",
+			    AddrFromIJKL(i, j, k, 0),
+			    (uint64_t)pte3,
+			    (pte3 & PTE_W) ? 'W' : ' ',
+			    (pte3 & PTE_NX) ? ' ' : 'X',
+			    (pte3 & PTE_U) ? 'U' : ' ',
+			    (pte3 & PTE_A) ? 'A' : ' ',
+			    (pte3 & PTE_D) ? 'D' : ' ');
 		}
 	    }
 	}
@@ -668,9 +1522,29 @@ PMap_Dump(AS *space)
 static void
 Debug_PMapDump(int argc, const char *argv[])
 {
-    PMap_Dump(currentAS[THISCPU()]);
+    kprintf("Large Pages: %llu (%llu failed)\n", pmapLargeMaps,
+	    pmapLargeFailed);
+    PMap_Dump(PMap_CurrentAS());
 }
 
 REGISTER_DBGCMD(pmapdump, "Dump memory mappings", Debug_PMapDump);
 
+static void
+Debug_TLBStats(int argc, const char *argv[])
+{
+    int c;
+
+    kprintf("PCID: %s\n", pmapPCID ? "Enabled" : "Disabled");
+    kprintf("Shootdowns: %llu (%llu full), IPIs: %llu\n", pmapShootdowns,
+	    pmapShootdownFull, pmapShootdownIPIs);
+    kprintf("%-4s %-16s %-16s %s\n", "CPU", "Flush Loads", "No-Flush Loads",
+	    "Rollovers");
+    for (c = 0; c < MP_GetCPUs(); c++) {
+	kprintf("%-4d %-16llu %-16llu %llu\n", c, pmapCPU[c].flushLoads,
+		pmapCPU[c].noflushLoads, pmapCPU[c].rollovers);
+    }
+}
+
+REGISTER_DBGCMD(tlbstats, "Display TLB flush and shootdown statistics",
+		Debug_TLBStats);
 
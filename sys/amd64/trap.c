@@ -7,15 +7,18 @@
 #include <sys/kdebug.h>
 #include <sys/kmem.h>
 #include <sys/ktime.h>
+#include <sys/clockevent.h>
 #include <sys/spinlock.h>
 #include <sys/irq.h>
 #include <sys/syscall.h>
 #include <sys/mp.h>
+#include <sys/vm.h>
 
 #include <machine/amd64.h>
 #include <machine/lapic.h>
 #include <machine/trap.h>
 #include <machine/mp.h>
+#include <machine/pmap.h>
 
 #include <sys/thread.h>
 
@@ -23,7 +26,6 @@ extern uint64_t trap_table[T_MAX];
 extern void trap_pop(TrapFrame *tf);
 extern void Debug_Breakpoint(TrapFrame *tf);
 extern void Debug_HaltIPI(TrapFrame *tf);
-extern void KTimer_Process();
 
 static InteruptGate64 idt[256];
 static PseudoDescriptor idtdesc;
@@ -49,9 +51,9 @@ Trap_Init()
     }
 
     for (; i < 256; i++) {
-        idt[i].pc_low = trap_table[63] & 0x0000ffff;
-        idt[i].pc_mid = (trap_table[63] >> 16) & 0x0000ffff;
-        idt[i].pc_high = trap_table[63] >> 32;
+        idt[i].pc_low = trap_table[T_UNKNOWN] & 0x0000ffff;
+        idt[i].pc_mid = (trap_table[T_UNKNOWN] >> 16) & 0x0000ffff;
+        idt[i].pc_high = trap_table[T_UNKNOWN] >> 32;
 
         idt[i].cs = 0x0008;
         idt[i].type = 0x8E;
@@ -142,6 +144,30 @@ extern int copystr_unsafe(void *to, void *from, uintptr_t len);
 extern void copystr_unsafe_done(void);
 extern void copystr_unsafe_fault(void);
 
+/**
+ * TrapPageFault --
+ *
+ * Try to resolve a page fault on a user address through the VM layer.
+ *
+ * @retval true The fault was handled and the instruction can be restarted.
+ */
+static bool
+TrapPageFault(TrapFrame *tf)
+{
+    uint64_t va = read_cr2();
+    uint64_t flags = 0;
+
+    if (va >= MEM_USERSPACE_TOP)
+	return false;
+
+    if (tf->errcode & PFERR_W)
+	flags |= VM_FAULT_WRITE;
+    if (tf->errcode & PFERR_P)
+	flags |= VM_FAULT_PROT;
+
+    return VM_Fault(PMap_CurrentAS(), va, flags);
+}
+
 void
 trap_entry(TrapFrame *tf)
 {
@@ -166,6 +192,10 @@ trap_entry(TrapFrame *tf)
 	    return;
 	}
 
+	// Demand paging of user memory accessed by the kernel
+	if ((tf->vector == T_PF) && TrapPageFault(tf))
+	    return;
+
 	// User IO
 	if ((tf->vector == T_PF) &&
 	    (tf->rip >= (uint64_t)&copy_unsafe) &&
@@ -210,6 +240,9 @@ trap_entry(TrapFrame *tf)
 	    return;
 	}
 	case T_PF: {
+	    if (TrapPageFault(tf))
+		return;
+
 	    Trap_Dump(tf);
 	    Trap_StackDump(tf);
 	    Debug_Breakpoint(tf);
@@ -228,8 +261,9 @@ trap_entry(TrapFrame *tf)
 	LAPIC_SendEOI();
 	IRQ_Handler(tf->vector - T_IRQ_BASE);
 	if (tf->vector == T_IRQ_TIMER) {
-	    KTimer_Process();
-	    Sched_Scheduler();
+	    ClockEvent_Interrupt();
+	} else {
+	    Sched_CheckPreempt();
 	}
 
         return;
@@ -241,6 +275,14 @@ trap_entry(TrapFrame *tf)
 	LAPIC_SendEOI();
     }
 
+    // TLB shootdowns
+    if (tf->vector == T_TLBSHOOTDOWN)
+    {
+	PMap_ShootdownService();
+	LAPIC_SendEOI();
+	return;
+    }
+
     // Cross calls
     if (tf->vector == T_CROSSCALL)
     {
@@ -249,6 +291,15 @@ trap_entry(TrapFrame *tf)
 	return;
     }
 
+    // Wakeups (we may switch threads so EOI first)
+    if (tf->vector == T_WAKEUP)
+    {
+	LAPIC_SendEOI();
+	ClockEvent_Reprogram();
+	Sched_CheckPreempt();
+	return;
+    }
+
     // LAPIC Special Vectors
     if (tf->vector == T_IRQ_SPURIOUS)
     {
@@ -278,13 +329,19 @@ static void
 Debug_Traps(int argc, const char *argv[])
 {
     int i;
+    int half = (T_MAX + 1) / 2;
 
     kprintf("Trap    Interrupts    Trap    Interrupts\n");
-    for (i = 0; i < T_MAX / 2; i++)
+    for (i = 0; i < half; i++)
     {
+	if (half + i >= T_MAX) {
+	    kprintf("%-4d    %-12d\n", i, intStats[i]);
+	    continue;
+	}
+
 	kprintf("%-4d    %-12d  %-4d    %-12d\n",
 		i, intStats[i],
-		T_MAX / 2 + i, intStats[T_MAX / 2 + i]);
+		half + i, intStats[half + i]);
     }
 }
 
@@ -2,10 +2,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <sys/cdefs.h>
 #include <sys/kconfig.h>
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
 #include <sys/kmem.h>
+#include <sys/spinlock.h>
 
 #include <machine/amd64.h>
 #include <machine/amd64op.h>
@@ -14,6 +16,9 @@
 
 #define MAX_XMEM_REGIONS 1024
 
+// Pages unmapped per TLB shootdown
+#define XMEM_UNMAP_BATCH 64
+
 typedef struct XMem
 {
     bool	inUse;
@@ -22,6 +27,7 @@ typedef struct XMem
     uintptr_t	length;
 } XMem;
 
+Spinlock xmemLock;
 XMem regions[MAX_XMEM_REGIONS];
 
 void
@@ -32,6 +38,8 @@ XMem_Init()
 
     kprintf("Initializing XMEM ... ");
 
+    Spinlock_Init(&xmemLock, "XMem Lock", SPINLOCK_TYPE_NORMAL);
+
     for (r = 0; r < MAX_XMEM_REGIONS; r++)
     {
 	regions[r].inUse = false;
@@ -48,32 +56,34 @@ XMem_New()
 {
     int r;
 
+    Spinlock_Lock(&xmemLock);
     for (r = 0; r < MAX_XMEM_REGIONS; r++)
     {
 	if (!regions[r].inUse) {
 	    regions[r].inUse = true;
+	    Spinlock_Unlock(&xmemLock);
 	    return &regions[r];
 	}
     }
+    Spinlock_Unlock(&xmemLock);
 
     return NULL;
 }
 
+/**
+ * XMem_Destroy --
+ *
+ * Unmap and free all pages backing the region and return the region to the 
+ * pool of free regions.
+ */
 void
 XMem_Destroy(XMem *xmem)
 {
-    uintptr_t off;
-    PageEntry *entry;
-
-    for (off = 0; off < xmem->length; off += PGSIZE) {
-	PMap_SystemLookup(xmem->base + off, &entry, PGSIZE);
+    XMem_Shrink(xmem, 0);
 
-	// Compute DM
-
-	// Free Page
-    }
-
-    //PMap_SystemUnmap(virt, pages);
+    Spinlock_Lock(&xmemLock);
+    xmem->inUse = false;
+    Spinlock_Unlock(&xmemLock);
 }
 
 uintptr_t
@@ -88,8 +98,35 @@ XMem_GetLength(XMem *xmem)
     return xmem->length;
 }
 
-bool
-XMem_Allocate(XMem *xmem, uintptr_t length)
+/**
+ * XMemMapPage --
+ *
+ * Back a page of the region with a newly allocated page unless it is already 
+ * mapped.
+ */
+static bool
+XMemMapPage(XMem *xmem, uintptr_t off, bool zero)
+{
+    void *pg;
+    PageEntry *entry;
+
+    PMap_SystemLookup(xmem->base + off, &entry, PGSIZE);
+    if (entry == NULL)
+	return false;
+    if (*entry & PTE_P)
+	return true;
+
+    pg = zero ? PAlloc_AllocPage() : PAlloc_AllocPageNoZero();
+    if (pg == NULL)
+	return false;
+
+    PMap_SystemMap(DMVA2PA((uint64_t)pg), xmem->base + off, 1, 0);
+
+    return true;
+}
+
+static bool
+XMemAllocate(XMem *xmem, uintptr_t length, bool zero)
 {
     uint64_t off;
 
@@ -102,18 +139,128 @@ XMem_Allocate(XMem *xmem, uintptr_t length)
 	return false;
 
     for (off = xmem->length; off < length; off += PGSIZE) {
-	void *pg = PAlloc_AllocPage();
-	if (pg == NULL)
+	if (!XMemMapPage(xmem, off, zero))
 	    return false;
 
-	PMap_SystemMap(DMVA2PA((uint64_t)pg), xmem->base + off, 1, 0);
-
 	xmem->length += PGSIZE;
     }
 
     return true;
 }
 
+/**
+ * XMem_Allocate --
+ *
+ * Grow the region to length bytes backed by zeroed pages.
+ */
+bool
+XMem_Allocate(XMem *xmem, uintptr_t length)
+{
+    return XMemAllocate(xmem, length, true);
+}
+
+/**
+ * XMem_AllocateNoZero --
+ *
+ * Grow the region to length bytes without clearing the new pages.
+ */
+bool
+XMem_AllocateNoZero(XMem *xmem, uintptr_t length)
+{
+    return XMemAllocate(xmem, length, false);
+}
+
+/**
+ * XMem_Populate --
+ *
+ * Back any unmapped pages in the range [off, off + length) with zeroed pages.  
+ * This is used to reuse holes left by XMem_Free.
+ *
+ * @retval true On success
+ * @retval false If we ran out of memory
+ */
+bool
+XMem_Populate(XMem *xmem, uintptr_t off, uintptr_t length)
+{
+    uintptr_t end = off + length;
+
+    ASSERT((off & PGMASK) == 0);
+    ASSERT(end <= xmem->length);
+
+    for (; off < end; off += PGSIZE) {
+	if (!XMemMapPage(xmem, off, true))
+	    return false;
+    }
+
+    return true;
+}
+
+/**
+ * XMem_Free --
+ *
+ * Unmap the range [off, off + length) of the region and return the backing 
+ * pages to the page allocator, leaving a hole in the region.  The length of 
+ * the region is unchanged.  This must not be called with spinlocks held 
+ * because it performs a TLB shootdown.
+ *
+ * @return Number of pages freed.
+ */
+uint64_t
+XMem_Free(XMem *xmem, uintptr_t off, uintptr_t length)
+{
+    int i, n;
+    uintptr_t va;
+    uintptr_t end = off + length;
+    uint64_t freed = 0;
+    PageEntry *entry;
+    void *pages[XMEM_UNMAP_BATCH];
+
+    ASSERT((off & PGMASK) == 0);
+    ASSERT(end <= xmem->length);
+
+    while (off < end) {
+	/*
+	 * Unmap in batches and only release the pages once no CPU can still 
+	 * access them through a stale TLB entry.
+	 */
+	va = xmem->base + off;
+	for (n = 0; n < XMEM_UNMAP_BATCH && off < end; n++, off += PGSIZE) {
+	    PMap_SystemLookup(xmem->base + off, &entry, PGSIZE);
+	    if (entry != NULL && (*entry & PTE_P))
+		pages[n] = (void *)DMPA2VA(*entry & ~(PGMASK | PTE_NX));
+	    else
+		pages[n] = NULL;
+	}
+
+	PMap_SystemUnmap(va, n);
+
+	for (i = 0; i < n; i++) {
+	    if (pages[i] != NULL) {
+		PAlloc_Release(pages[i]);
+		freed++;
+	    }
+	}
+    }
+
+    return freed;
+}
+
+/**
+ * XMem_Shrink --
+ *
+ * Shrink the region to length bytes and free the pages past the end.
+ */
+void
+XMem_Shrink(XMem *xmem, uintptr_t length)
+{
+    length = ROUNDUP(length, PGSIZE);
+    if (length >= xmem->length)
+	return;
+
+    XMem_Free(xmem, length, xmem->length - length);
+    xmem->length = length;
+}
+
 static void
 Debug_XMemStats(int argc, const char *argv[])
 {
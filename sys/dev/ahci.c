@@ -163,7 +163,7 @@ typedef struct AHCIRecvFIS
 
 /*
  * AHCI
- * 	Exceeds a single page need to use heap
+ * 	Exceeds a single page so it is allocated from the kernel heap
  */
 typedef struct AHCI
 {
@@ -418,9 +418,15 @@ AHCI_Reset(AHCI *ahci)
 void
 AHCI_Configure(PCIDevice dev)
 {
-    AHCI *ahci = (AHCI *)PAlloc_AllocPage();
+    AHCI *ahci = (AHCI *)Malloc_Alloc(kernelHeap, sizeof(AHCI));
     volatile AHCIHostControl *hc;
 
+    if (!ahci) {
+	kprintf("AHCI: No memory!\n");
+	return;
+    }
+    memset(ahci, 0, sizeof(*ahci));
+
     PCI_Configure(&dev);
 
     kprintf("AHCI: IRQ %d\n", dev.irq);
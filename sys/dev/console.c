@@ -195,7 +195,7 @@ Console_Flush(Handle *handle)
 int
 Console_Close(Handle *handle)
 {
-    Handle_Free(handle);
+    Handle_Retire(handle);
     return 0;
 }
 
@@ -141,16 +141,19 @@ typedef struct E1000Dev {
 
 #define E1000_TX_QLEN		128
 #define E1000_RX_QLEN		128
+// Descriptor rings must be physically contiguous
+#define E1000_RING_ORDER	0
+
+static_assert(E1000_RX_QLEN * sizeof(E1000RXDesc) <= (PGSIZE << E1000_RING_ORDER),
+	      "E1000 RX ring exceeds E1000_RING_ORDER");
+static_assert(E1000_TX_QLEN * sizeof(E1000TXDesc) <= (PGSIZE << E1000_RING_ORDER),
+	      "E1000 TX ring exceeds E1000_RING_ORDER");
 
 #define E1000_MAX_MTU		9000
 
 // Memory Resources
 static bool runOnce = false;
 static Slab rxPool;
-static Slab rxDescPool;
-static Slab txDescPool;
-DEFINE_SLAB(E1000RXDesc, &rxDescPool);
-DEFINE_SLAB(E1000TXDesc, &txDescPool);
 
 void *
 RXPOOL_Alloc()
@@ -375,19 +378,30 @@ E1000_Enqueue(NIC *nic, MBuf *mbuf, NICCB cb, void *arg)
     return 0;
 }
 
-void
+bool
 E1000_RXInit(E1000Dev *dev)
 {
     int i;
+    void *pg;
 
     // Zero out Multicast Table Array
     for (i = 0; i < 128; i++) {
 	MMIO_Write32(dev, E1000_REG_MTABASE + (i * 4), 0);
     }
 
-    dev->rxDesc = (E1000RXDesc *)E1000RXDesc_Alloc();
+    dev->rxDesc = (E1000RXDesc *)PAlloc_AllocPages(E1000_RING_ORDER);
+    if (!dev->rxDesc)
+	return false;
     for (i = 0; i < E1000_RX_QLEN; i++) {
-	dev->rxDesc[i].addr = VA2PA((uintptr_t)PAlloc_AllocPage()); // LOOKUP IN PMAP
+	pg = PAlloc_AllocPage();
+	if (!pg) {
+	    while (--i >= 0)
+		PAlloc_Release((void *)DMPA2VA(dev->rxDesc[i].addr));
+	    PAlloc_Release(dev->rxDesc);
+	    dev->rxDesc = NULL;
+	    return false;
+	}
+	dev->rxDesc[i].addr = VA2PA((uintptr_t)pg); // LOOKUP IN PMAP
 	dev->rxDesc[i].status = 0;
     }
 
@@ -403,16 +417,29 @@ E1000_RXInit(E1000Dev *dev)
 
     MMIO_Write32(dev, E1000_REG_RCTL,
 	    (RCTL_EN | RCTL_UPE | RCTL_MPE | RCTL_BSIZE_4K));
+
+    return true;
 }
 
-void
+bool
 E1000_TXInit(E1000Dev *dev)
 {
     int i;
+    void *pg;
 
-    dev->txDesc = (E1000TXDesc *)E1000RXDesc_Alloc();
+    dev->txDesc = (E1000TXDesc *)PAlloc_AllocPages(E1000_RING_ORDER);
+    if (!dev->txDesc)
+	return false;
     for (i = 0; i < E1000_TX_QLEN; i++) {
-	dev->txDesc[i].addr = VA2PA((uintptr_t)PAlloc_AllocPage()); // LOOKUP IN PMAP
+	pg = PAlloc_AllocPage();
+	if (!pg) {
+	    while (--i >= 0)
+		PAlloc_Release((void *)DMPA2VA(dev->txDesc[i].addr));
+	    PAlloc_Release(dev->txDesc);
+	    dev->txDesc = NULL;
+	    return false;
+	}
+	dev->txDesc[i].addr = VA2PA((uintptr_t)pg); // LOOKUP IN PMAP
 	dev->txDesc[i].cmd = 0;
     }
 
@@ -431,12 +458,19 @@ E1000_TXInit(E1000Dev *dev)
     MMIO_Write32(dev, E1000_REG_TADV, 1);
 
     MMIO_Write32(dev, E1000_REG_TCTL, TCTL_EN | TCTL_PSP);
+
+    return true;
 }
 
 void
 E1000_Configure(PCIDevice dev)
 {
-    E1000Dev *ethDev = (E1000Dev *)PAlloc_AllocPage();
+    E1000Dev *ethDev = (E1000Dev *)Malloc_Alloc(kernelHeap, sizeof(E1000Dev));
+    if (!ethDev) {
+	kprintf("E1000: No memory!\n");
+	return;
+    }
+    memset(ethDev, 0, sizeof(*ethDev));
     PCI_Configure(&dev);
 
     // Ensure that the NIC structure is the first thing inside E1000Dev
@@ -447,8 +481,6 @@ E1000_Configure(PCIDevice dev)
 
 	//E1000_MAX_MTU + 14 + 4, 4096);
 	Slab_Init(&rxPool, "E1000 RX Pool", 4096, 4096);
-	Slab_Init(&rxDescPool, "E1000 RX Descriptors", E1000_RX_QLEN*sizeof(E1000RXDesc), 16);
-	Slab_Init(&txDescPool, "E1000 TX Descriptors", E1000_TX_QLEN*sizeof(E1000TXDesc), 16);
     }
 
     // Copy PCIDevice structure
@@ -495,8 +527,14 @@ E1000_Configure(PCIDevice dev)
     MMIO_Write32(ethDev, E1000_REG_IMS, 0x1F6DC); //ICR_TXDW | ICR_RXO | ICR_RXT0);
     MMIO_Read32(ethDev, E1000_REG_ICR);  // Clear pending interrupts
 
-    E1000_RXInit(ethDev);
-    E1000_TXInit(ethDev);
+    if (!E1000_RXInit(ethDev) || !E1000_TXInit(ethDev)) {
+	kprintf("E1000: Cannot allocate descriptor rings!\n");
+	// Quiesce the device, its memory is leaked as DMA may still be in flight
+	MMIO_Write32(ethDev, E1000_REG_IMC, ~0);
+	MMIO_Write32(ethDev, E1000_REG_RCTL, 0);
+	IRQ_Unregister(dev.irq, &ethDev->irqHandle);
+	return;
+    }
 
     ethDev->nic.handle = ethDev;
     // XXX: Fill in callbacks
@@ -249,10 +249,11 @@ IDE_Identify(IDE *ide, int drive)
     primaryDrives[drive].size = ident.lbaSectors;
 
     // Register Disk
-    Disk *disk = PAlloc_AllocPage();
+    Disk *disk = Malloc_Alloc(kernelHeap, sizeof(Disk));
     if (!disk) {
 	Panic("IDE: No memory!\n");
     }
+    memset(disk, 0, sizeof(*disk));
 
     disk->handle = &primaryDrives[drive];
     disk->ctrlNo = 0;
@@ -240,7 +240,7 @@ O2FSLoadVNode(VFS *fs, ObjID *objid)
 
     vn->op = &O2FSOperations;
     vn->disk = fs->disk;
-    Spinlock_Init(&vn->lock, "VNode Lock", SPINLOCK_TYPE_NORMAL);
+    RWLock_Init(&vn->lock, "VNode Lock");
     vn->refCount = 1;
     vn->fsptr = entry;
     vn->vfs = fs;
@@ -317,7 +317,7 @@ O2FSReleaseVNode(VNode *vn)
     vn->refCount--;
     if (vn->refCount == 0) {
 	BufCache_Release(vn->fsptr);
-	Spinlock_Destroy(&vn->lock);
+	RWLock_Destroy(&vn->lock);
 	VNode_Free(vn);
     }
 }
@@ -385,7 +385,7 @@ O2FS_GetRoot(VFS *fs, VNode **dn)
     vn = VNode_Alloc();
     vn->op = &O2FSOperations;
     vn->disk = fs->disk;
-    Spinlock_Init(&vn->lock, "VNode Lock", SPINLOCK_TYPE_NORMAL);
+    RWLock_Init(&vn->lock, "VNode Lock");
     vn->refCount = 1;
     vn->fsptr = entry;
     vn->vfs = fs;
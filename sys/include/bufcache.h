@@ -3,11 +3,17 @@
 #define __SYS_BUFCACHE_H__
 
 #include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/waitchannel.h>
 
 typedef struct BufCacheEntry {
     Disk				*disk;
     uint64_t				diskOffset;
     uint64_t				refCount;
+    bool				onLRU;
+    bool				filling;	// Disk read in progress
+    int					fillStatus;
+    WaitChannel				fillChan;
     void				*buffer;
     TAILQ_ENTRY(BufCacheEntry)		htEntry;
     TAILQ_ENTRY(BufCacheEntry)		lruEntry;
@@ -6,6 +6,7 @@
 
 #define PACKED		__attribute__((__packed__))
 #define PERCORE		__attribute__((section(".data.percore")))
+#define CACHELINE_ALIGNED __attribute__((__aligned__(CACHELINE_SIZE)))
 
 #define INLINE		inline
 #define ALWAYS_INLINE	__attribute__((__always_inline__))
@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#ifndef __SYS_CLOCKEVENT_H__
+#define __SYS_CLOCKEVENT_H__
+
+#define CLOCKEVENT_NONE		0xFFFFFFFFFFFFFFFFULL
+
+void ClockEvent_Init();
+void ClockEvent_InitAP();
+void ClockEvent_Interrupt();
+void ClockEvent_Idle();
+void ClockEvent_Resume();
+void ClockEvent_Reprogram();
+void ClockEvent_Schedule(int cpu, uint64_t deadline);
+
+#endif /* __SYS_CLOCKEVENT_H__ */
+
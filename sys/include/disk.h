@@ -18,12 +18,14 @@ typedef struct Disk {
     int		(*read)(Disk *, void *, SGArray *, DiskCB, void *);	// Read
     int		(*write)(Disk *, void *, SGArray *, DiskCB, void *);	// Write
     int		(*flush)(Disk *, void *, SGArray *, DiskCB, void *);	// Flush
+    uint64_t	refCount;					// List and lookups
     LIST_ENTRY(Disk) entries;
 } Disk;
 
 void Disk_AddDisk(Disk *disk);
 void Disk_RemoveDisk(Disk *disk);
 Disk *Disk_GetByID(uint64_t ctrlNo, uint64_t diskNo);
+void Disk_Release(Disk *disk);
 int Disk_Read(Disk *disk, void * buf, SGArray *sga, DiskCB cb, void *arg);
 int Disk_Write(Disk *disk, void * buf, SGArray *sga, DiskCB cb, void *arg);
 int Disk_Flush(Disk *disk, void * buf, SGArray *sga, DiskCB cb, void *arg);
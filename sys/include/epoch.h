@@ -0,0 +1,29 @@
+
+#ifndef __SYS_EPOCH_H__
+#define __SYS_EPOCH_H__
+
+#include <sys/queue.h>
+
+typedef void (*EpochCB)(void *);
+
+/*
+ * Embedded in objects that are unlinked from lock-free lists so that their 
+ * release can be deferred until no reader can still reference them.
+ */
+typedef struct EpochEntry {
+    uint64_t			epoch;	    // Epoch that must be observed
+    EpochCB			cb;
+    void			*arg;
+    TAILQ_ENTRY(EpochEntry)	entries;
+} EpochEntry;
+
+void Epoch_Init();
+void Epoch_Enter();
+void Epoch_Exit();
+void Epoch_Defer(EpochEntry *entry, EpochCB cb, void *arg);
+void Epoch_Synchronize();
+void Epoch_Quiescent();
+void Epoch_Idle();
+
+#endif /* __SYS_EPOCH_H__ */
+
@@ -0,0 +1,10 @@
+
+#ifndef __SYS_FUTEX_H__
+#define __SYS_FUTEX_H__
+
+void Futex_Init();
+int Futex_Wait(uintptr_t addr, uint64_t val, uint64_t timeout);
+uint64_t Futex_Wake(uintptr_t addr, uint64_t count);
+
+#endif /* __SYS_FUTEX_H__ */
+
@@ -3,6 +3,7 @@
 #define __SYS_HANDLE_H__
 
 #include <sys/queue.h>
+#include <sys/epoch.h>
 #include <sys/disk.h>
 #include <sys/vfs.h>
 
@@ -19,7 +20,9 @@ typedef struct Handle {
     uint64_t		type;				// Type
     uint64_t		processId;			// Process ID
     VNode		*vnode;				// File VNode
+    uint64_t		refCount;			// Process and lookups
     TAILQ_ENTRY(Handle)	handleList;			// Hash table
+    EpochEntry		epochEntry;			// Deferred free
     int (*read)(Handle *, void *, uint64_t, uint64_t);	// Read
     int (*write)(Handle *, void *, uint64_t, uint64_t);	// Write
     int (*flush)(Handle *);				// Flush
@@ -28,5 +31,7 @@ typedef struct Handle {
 
 DECLARE_SLAB(Handle);
 
+void Handle_Retire(Handle *handle);
+
 #endif /* __SYS_HANDLE_H__ */
 
@@ -6,6 +6,15 @@
 #define __KCONFIG_H__
 
 #define MAX_CPUS        16
+#define CACHELINE_SIZE  64
+
+/*
+ * Spinlock contention accounting (wait/hold times) and per-CPU lock stacks.
+ * These cost several TSC reads per acquisition so RELEASE builds omit them.
+ */
+#if defined(DEBUG) || defined(PERF)
+#define SPINLOCK_STATS  1
+#endif
 
 #endif /* __KCONFIG_H__ */
 
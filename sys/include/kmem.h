@@ -2,6 +2,7 @@
 #ifndef __KMEM_H__
 #define __KMEM_H__
 
+#include <sys/kconfig.h>
 #include <sys/queue.h>
 #include <sys/spinlock.h>
 
@@ -15,11 +16,21 @@ typedef struct Page {
 /*
  * Page Allocator
  */
+#define PALLOC_MAX_ORDER	10
+
 void PAlloc_Init();
 void PAlloc_AddRegion(uintptr_t start, uintptr_t len);
 void *PAlloc_AllocPage();
+void *PAlloc_AllocPageNoZero();
+void *PAlloc_AllocPages(int order);
+void PAlloc_StartZeroThread();
 void PAlloc_Retain(void *pg);
 void PAlloc_Release(void *pg);
+uint64_t PAlloc_RefCount(void *pg);
+void PAlloc_Split(void *pg);
+
+typedef uint64_t (*PAllocReclaimHook)(void);
+void PAlloc_AddReclaimHook(PAllocReclaimHook hook);
 
 /*
  * XMem Memory Mapping Region
@@ -32,6 +43,27 @@ void XMem_Destroy(XMem *xmem);
 uintptr_t XMem_GetBase(XMem *xmem);
 uintptr_t XMem_GetLength(XMem *xmem);
 bool XMem_Allocate(XMem *xmem, uintptr_t length);
+bool XMem_AllocateNoZero(XMem *xmem, uintptr_t length);
+bool XMem_Populate(XMem *xmem, uintptr_t off, uintptr_t length);
+uint64_t XMem_Free(XMem *xmem, uintptr_t off, uintptr_t length);
+void XMem_Shrink(XMem *xmem, uintptr_t length);
+
+/*
+ * Kernel Heap
+ */
+
+#define HEAP_NAMELEN	32
+
+typedef struct Heap Heap;
+
+extern Heap *kernelHeap;
+
+void Malloc_Init();
+Heap *Malloc_Create(const char *name);
+void Malloc_Destroy(Heap *heap);
+void *Malloc_Alloc(Heap *heap, uint64_t len) __attribute__((malloc));
+void Malloc_Free(Heap *heap, void *buf);
+bool Malloc_Realloc(Heap *heap, void *buf, uint64_t newlen);
 
 /*
  * Slab Allocator
@@ -39,10 +71,48 @@ bool XMem_Allocate(XMem *xmem, uintptr_t length);
 
 #define SLAB_NAMELEN	32
 
+#define SLAB_MAGAZINE_SIZE	14
+#define SLAB_MAX_HOLES		32
+
 typedef struct SlabElement {
     LIST_ENTRY(SlabElement)	free;
 } SlabElement;
 
+/*
+ * Each time the slab grows it maps a new chunk that begins with this header.  
+ * Chunks that have all of their objects free can be returned to the page 
+ * allocator.
+ */
+typedef struct SlabChunk {
+    LIST_ENTRY(SlabChunk)	link;
+    LIST_HEAD(SlabElementHead, SlabElement) freeList;
+    uint64_t			objs;
+    uint64_t			freeObjs;
+} SlabChunk;
+
+typedef LIST_HEAD(SlabChunkHead, SlabChunk) SlabChunkHead;
+
+/*
+ * Magazines cache objects per CPU in front of the slab lock.
+ */
+typedef struct SlabMagazine {
+    uint64_t			rounds;
+    LIST_ENTRY(SlabMagazine)	link;
+    void			*objs[SLAB_MAGAZINE_SIZE];
+} SlabMagazine;
+
+typedef LIST_HEAD(SlabMagazineHead, SlabMagazine) SlabMagazineHead;
+
+typedef struct SlabCPUCache {
+    SlabMagazine	*loaded;
+    SlabMagazine	*previous;
+    // Statistics
+    uint64_t		allocs;
+    uint64_t		allocHits;
+    uint64_t		frees;
+    uint64_t		freeHits;
+} CACHELINE_ALIGNED SlabCPUCache;
+
 typedef struct Slab {
     uintptr_t		objsz;
     uintptr_t		align;
@@ -50,17 +120,33 @@ typedef struct Slab {
     Spinlock		lock;
     uint64_t		objs;
     uint64_t		freeObjs;
-    LIST_HEAD(SlabElementHead, SlabElement) freeList;
+    // Chunks (protected by lock)
+    uintptr_t		chunkSize;
+    SlabChunkHead	partialChunks;
+    SlabChunkHead	freeChunks;
+    bool		reclaiming;
+    uint64_t		holes;
+    uintptr_t		hole[SLAB_MAX_HOLES];
+    // Magazine depot (protected by lock)
+    bool		magazines;
+    SlabMagazineHead	fullMagazines;
+    SlabMagazineHead	emptyMagazines;
+    uint64_t		fullCount;
+    uint64_t		emptyCount;
     // Debugging
     uint64_t		allocs;
     uint64_t		frees;
+    uint64_t		reclaimed;
     char		name[SLAB_NAMELEN];
     LIST_ENTRY(Slab)	slabList;
+    // Per-CPU magazines
+    SlabCPUCache	cpuCache[MAX_CPUS];
 } Slab;
 
 void Slab_Init(Slab *slab, const char *name, uintptr_t objsz, uintptr_t align);
 void *Slab_Alloc(Slab *slab) __attribute__((malloc));
 void Slab_Free(Slab *slab, void *obj);
+uint64_t Slab_Reclaim(Slab *slab);
 
 #define DECLARE_SLAB(_type) \
     _type *_type##_Alloc();		\
@@ -25,6 +25,8 @@ void KTime_SetTime(UnixEpoch epoch, uint64_t tsc, uint64_t tps);
 void KTime_Tick(int rate);
 UnixEpoch KTime_GetEpoch();
 UnixEpochNS KTime_GetEpochNS();
+uint64_t KTime_EpochNSToTSC(UnixEpochNS epoch);
+void *KTime_GetPage();
 
 #endif /* __SYS_KTIME_H__ */
 
@@ -8,17 +8,22 @@ typedef void (*KTimerCB)(void *);
 
 typedef struct KTimerEvent {
     uint64_t			refCount;
-    uint64_t			timeout;
+    uint64_t			deadline;	// Absolute time in ns
     KTimerCB			cb;
     void			*arg;
+    int				cpu;		// Wheel that owns the event
+    uint8_t			level;
+    uint8_t			slot;
+    bool			queued;
     LIST_ENTRY(KTimerEvent)	timerQueue;
 } KTimerEvent;
 
 KTimerEvent *KTimer_Create(uint64_t timeout, KTimerCB cb, void *arg);
 void KTimer_Retain(KTimerEvent *evt);
 void KTimer_Release(KTimerEvent *evt);
-void KTimer_Cancel(KTimerEvent *evt);
+bool KTimer_Cancel(KTimerEvent *evt);
 void KTimer_Process();
+uint64_t KTimer_NextDeadline();
 
 #endif /* __SYS_KTIMER_H__ */
 
@@ -4,8 +4,9 @@
 
 #include <sys/elf64.h>
 
+void Loader_Init();
 bool Loader_CheckHeader(const Elf64_Ehdr *ehdr);
 bool Loader_Load(Thread *thr, VNode *vn, void *buf, uint64_t len);
+void Loader_Invalidate(VNode *vn);
 
 #endif /* __SYS_LOADER_H__ */
-
@@ -10,6 +10,7 @@
 #define MAP_FILE	0x0010
 #define MAP_ANON	0x0020
 #define MAP_FIXED	0x0040
+#define MAP_POPULATE	0x0080
 
 
 #ifdef _KERNEL
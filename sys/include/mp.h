@@ -2,9 +2,11 @@
 #ifndef __MP_H__
 #define __MP_H__
 
+#include <machine/percpu.h>
+
 uint32_t LAPIC_CPU();
 
-#define CPU LAPIC_CPU
+#define CPU() PERCPU_GET(cpu)
 
 #endif /* __MP_H__ */
 
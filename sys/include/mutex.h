@@ -4,11 +4,17 @@
 
 #define MTX_STATUS_UNLOCKED	0
 #define MTX_STATUS_LOCKED	1
+#define MTX_STATUS_CONTENDED	2	// Locked with threads sleeping on chan
 
+/*
+ * Adaptive mutex: uncontended lock/unlock is a single compare-and-swap on 
+ * status.  Waiters spin while the owner is running on another CPU and 
+ * otherwise sleep on chan, whose lock also serializes the contended paths.  
+ * Unlocking a contended mutex hands it directly to the oldest waiter.
+ */
 typedef struct Mutex {
-    uint64_t		status;
-    Thread		*owner;
-    Spinlock		lock;
+    volatile uint64_t	status;
+    Thread * volatile	owner;
     WaitChannel		chan;
     LIST_ENTRY(Mutex)	buckets;
 } Mutex;
@@ -15,12 +15,14 @@ typedef struct NIC {
     int		(*tx)(NIC *, MBuf *, NICCB, void *);		// TX
     int		(*rx)(NIC *, MBuf *, NICCB, void *);		// RX
     int		(*poll)();
+    uint64_t	refCount;					// List and lookups
     LIST_ENTRY(NIC) entries;
 } NIC;
 
 void NIC_AddNIC(NIC *nic);
 void NIC_RemoveNIC(NIC *nic);
 NIC *NIC_GetByID(uint64_t nicNo);
+void NIC_Release(NIC *nic);
 int NIC_GetMAC(NIC *nic, void *mac);
 int NIC_TX(NIC *nic, MBuf *mbuf, NICCB cb, void *arg);
 int NIC_RX(NIC *nic, MBuf *mbuf, NICCB cb, void *arg);
@@ -0,0 +1,18 @@
+
+#ifndef __SYS_PRIORITY_H__
+#define __SYS_PRIORITY_H__
+
+/*
+ * Thread priorities, larger values are more important.  Threads at PRIO_IDLE 
+ * only run when no other thread is runnable.
+ */
+#define PRIO_IDLE	0
+#define PRIO_MIN	1
+#define PRIO_NORMAL	3
+#define PRIO_MAX	4
+
+// Passed to SYSCALL_THREADPRIORITY to read the priority without changing it
+#define PRIO_QUERY	(-1)
+
+#endif /* __SYS_PRIORITY_H__ */
+
@@ -0,0 +1,42 @@
+
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include <sys/kconfig.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/waitchannel.h>
+
+/*
+ * Reader counts are kept per-CPU (brlock style) so readers on different CPUs 
+ * never share a cache line.  Writers announce themselves in writers, which 
+ * makes new readers back off, and then wait for the per-CPU counts to drain.
+ */
+typedef struct RWReaderCount
+{
+    volatile int64_t			count;
+    uint8_t				_pad[CACHELINE_SIZE - sizeof(int64_t)];
+} RWReaderCount;
+
+/*
+ * Sleeping reader-writer lock.  Readers and writers may sleep while holding 
+ * the lock, e.g., across disk I/O.  Read locks are not recursive.
+ */
+typedef struct RWLock
+{
+    volatile uint64_t			writers;    // Writers holding or waiting
+    volatile uint64_t			owned;	    // Writer holds the lock
+    WaitChannel				readChan;   // Readers waiting on writers
+    WaitChannel				writeChan;  // Guards owned
+    RWReaderCount			readers[MAX_CPUS];
+} RWLock;
+
+void RWLock_Init(RWLock *rw, const char *name);
+void RWLock_Destroy(RWLock *rw);
+void RWLock_ReadLock(RWLock *rw);
+void RWLock_ReadUnlock(RWLock *rw);
+void RWLock_WriteLock(RWLock *rw);
+void RWLock_WriteUnlock(RWLock *rw);
+
+#endif /* __RWLOCK_H__ */
+
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include <sys/cdefs.h>
+#include <sys/kconfig.h>
 #include <sys/queue.h>
 
 #define SPINLOCK_NAMELEN    32
@@ -12,21 +13,34 @@
 #define SPINLOCK_TYPE_NORMAL		1
 #define SPINLOCK_TYPE_RECURSIVE		2
 
+#define SPINLOCK_NOCPU			((uint64_t)-1)
+
+/*
+ * Spinlocks are FIFO ticket locks: acquirers take the next ticket and wait
+ * until the owner field reaches it.  Only the owner ever writes the owner
+ * field so the uncontended path is a single atomic add.
+ */
 typedef struct Spinlock
 {
-    volatile uint64_t	    lock;
-    uint64_t		    cpu;
-    uint64_t		    count;
+    volatile uint32_t	    next;	// Next ticket to hand out
+    volatile uint32_t	    owner;	// Ticket currently holding the lock
+    uint64_t		    cpu;	// Holder or SPINLOCK_NOCPU
     uint64_t		    rCount;
+    uint64_t		    type;
+#ifdef SPINLOCK_STATS
+    uint64_t		    count;
     uint64_t		    lockTime;
     uint64_t		    waitTime;
     uint64_t		    lockedTSC;
-    uint64_t		    type;
+    TAILQ_ENTRY(Spinlock)   lockStack;
+#endif
     char		    name[SPINLOCK_NAMELEN];
     LIST_ENTRY(Spinlock)    lockList;
-    TAILQ_ENTRY(Spinlock)   lockStack;
 } __LOCKABLE Spinlock;
 
+#define SPINLOCK_INITIALIZER(_name, _type) \
+    { .cpu = SPINLOCK_NOCPU, .type = (_type), .name = _name }
+
 void Critical_Init();
 void Critical_Enter();
 void Critical_Exit();
@@ -37,6 +37,13 @@
 #define SYSCALL_THREADEXIT	0x32
 #define SYSCALL_THREADSLEEP	0x33
 #define SYSCALL_THREADWAIT	0x34
+#define SYSCALL_THREADPRIORITY	0x35
+#define SYSCALL_FUTEX		0x36
+
+// Futex operations
+#define FUTEX_WAIT		0
+#define FUTEX_WAKE		1
+#define FUTEX_WAKE_ALL		0xFFFFFFFFFFFFFFFFULL // Count
 
 // Network
 #define SYSCALL_NICSTAT		0x40
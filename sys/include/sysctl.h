@@ -23,6 +23,13 @@
 #define SYSCTL_LIST \
     SYSCTL_STR(kern_ostype, SYSCTL_FLAG_RO, "OS Type", "Castor") \
     SYSCTL_INT(kern_hz, SYSCTL_FLAG_RW, "Tick frequency", 100) \
+    SYSCTL_BOOL(kern_tickless, SYSCTL_FLAG_RW, "Stop the tick on idle CPUs", true) \
+    SYSCTL_INT(palloc_cache_high, SYSCTL_FLAG_RW, "Per-CPU page cache high watermark", 64) \
+    SYSCTL_INT(palloc_cache_low, SYSCTL_FLAG_RW, "Per-CPU page cache low watermark", 16) \
+    SYSCTL_INT(palloc_zero_target, SYSCTL_FLAG_RW, "Number of pre-zeroed pages to keep", 256) \
+    SYSCTL_BOOL(vm_largepages, SYSCTL_FLAG_RW, "Use 2MB pages for aligned anonymous memory", true) \
+    SYSCTL_INT(sched_balance, SYSCTL_FLAG_RW, "Scheduler load balancing interval in ticks", 10) \
+    SYSCTL_INT(sched_boost, SYSCTL_FLAG_RW, "Scheduler priority boost interval in ticks", 100) \
     SYSCTL_INT(time_tzadj, SYSCTL_FLAG_RW, "Time zone offset in seconds", 0) \
     SYSCTL_INT(log_syscall, SYSCTL_FLAG_RW, "Syscall log level", 1) \
     SYSCTL_INT(log_loader, SYSCTL_FLAG_RW, "Loader log level", 1) \
@@ -2,9 +2,12 @@
 #ifndef __SYS_THREAD_H__
 #define __SYS_THREAD_H__
 
+#include <sys/kconfig.h>
 #include <sys/queue.h>
+#include <sys/epoch.h>
 #include <sys/handle.h>
 #include <sys/ktimer.h>
+#include <sys/priority.h>
 #include <sys/waitchannel.h>
 
 struct Thread;
@@ -17,6 +20,7 @@ typedef struct Process Process;
 #include <sys/cv.h>
 
 #include <machine/pmap.h>
+#include <machine/percpu.h>
 #include <machine/thread.h>
 
 typedef TAILQ_HEAD(ProcessQueue, Process) ProcessQueue;
@@ -28,6 +32,18 @@ typedef TAILQ_HEAD(ThreadQueue, Thread) ThreadQueue;
 #define SCHED_STATE_WAITING	3
 #define SCHED_STATE_ZOMBIE	4
 
+/*
+ * Multilevel feedback queue.  Level 0 is the most important and each level 
+ * doubles the time slice.  A thread's priority sets the highest level it may 
+ * reach, threads at PRIO_IDLE live in their own queue below all levels.
+ */
+#define SCHED_LEVELS		4
+#define SCHED_LEVEL_IDLE	SCHED_LEVELS
+#define SCHED_QUEUES		(SCHED_LEVELS + 1)
+#define SCHED_QUANTUM(_l)	(1 << (_l))
+#define SCHED_TOPLEVEL(_p)	\
+    ((_p) == PRIO_IDLE ? SCHED_LEVEL_IDLE : PRIO_MAX - (_p))
+
 typedef struct Thread {
     ThreadArch		arch;
     AS			*space;
@@ -35,11 +51,17 @@ typedef struct Thread {
     uintptr_t		ustack;
     uint64_t		tid;
     uint64_t		refCount;
+    EpochEntry		epochEntry;	// Deferred free
     // Process
     struct Process	*proc;
-    TAILQ_ENTRY(Thread)	threadList;
+    TAILQ_ENTRY(Thread)	threadList;	// Lock-free readers, see Thread_Lookup
     // Scheduler
     int			schedState;
+    int			lastCPU;	// CPU we last ran on
+    int			priority;	// PRIO_*
+    int			level;		// Current MLFQ level
+    int			quantum;	// Ticks left at this level
+    bool		queued;		// On a runnable queue
     TAILQ_ENTRY(Thread)	schedQueue;
     KTimerEvent		*timerEvt;	// Timer event for wakeups
     uintptr_t		exitValue;
@@ -47,6 +69,8 @@ typedef struct Thread {
     // Wait Channels
     WaitChannel		*chan;
     TAILQ_ENTRY(Thread)	chanQueue;
+    uintptr_t		futexAddr;	// Futex we sleep on, see futex.c
+    bool		futexTimedOut;
     // Statistics
     uint64_t		ctxSwitches;
     uint64_t		userTime;
@@ -55,6 +79,24 @@ typedef struct Thread {
     uint64_t		waitStart;
 } Thread;
 
+/*
+ * Per-CPU scheduler queue.  Each CPU schedules from its own runnable queue and 
+ * only touches remote queues to steal or balance work.
+ */
+typedef struct SchedQueue {
+    Spinlock		lock;
+    ThreadQueue		runnable[SCHED_QUEUES]; // Runnable threads per level
+    ThreadQueue		wait;		// Waiting threads
+    uint64_t		length;		// Number of runnable threads
+    Thread		*idle;		// Idle thread for this CPU
+    uint64_t		balanceTicks;
+    uint64_t		boostTicks;
+    bool		preempt;	// A more important thread is waiting
+    // Statistics
+    uint64_t		steals;
+    uint64_t		migrations;
+} CACHELINE_ALIGNED SchedQueue;
+
 #define PROCESS_HANDLE_SLOTS	128
 #define PROCESS_TITLE_LENGTH	128
 
@@ -69,8 +111,9 @@ typedef struct Process {
     uintptr_t			entrypoint;
     uint64_t			nextThreadID;
     uintptr_t			ustackNext;	// Next user stack
-    TAILQ_ENTRY(Process)	processList;
+    TAILQ_ENTRY(Process)	processList;	// Lock-free readers
     uint64_t			refCount;
+    EpochEntry			epochEntry;	// Deferred free
     char			title[PROCESS_TITLE_LENGTH];
     int				procState;
     uint64_t			exitCode;
@@ -116,9 +159,19 @@ uint64_t Thread_Wait(Thread *thr, uint64_t tid);
 
 // Scheduler functions
 Thread *Sched_Current();
+/*
+ * Borrow the running thread without taking a reference.  The running thread 
+ * cannot be freed while it runs, so the pointer is valid until it returns to 
+ * userspace but must not be stored or handed to another thread.
+ */
+#define Sched_CurrentBorrow()	PERCPU_GET(curProc)
 void Sched_SetRunnable(Thread *thr);
 void Sched_SetWaiting(Thread *thr);
 void Sched_SetZombie(Thread *thr);
+void Sched_SetIdle(Thread *thr);
+int Sched_SetPriority(Thread *thr, int priority);
+void Sched_Tick();
+void Sched_CheckPreempt();
 void Sched_Scheduler();
 
 // Debugging
@@ -136,8 +189,9 @@ void Thread_SwitchArch(Thread *oldthr, Thread *newthr);
 void Handle_Init(Process *proc);
 void Handle_Destroy(Process *proc);
 uint64_t Handle_Add(Process *proc, Handle *handle);
-void Handle_Remove(Process *proc, Handle *handle);
+Handle *Handle_Remove(Process *proc, uint64_t fd);
 Handle *Handle_Lookup(Process *proc, uint64_t fd);
+int Handle_Release(Handle *handle);
 
 // Copy_In/Copy_Out Functions
 int Copy_In(uintptr_t fromuser, void *tokernel, uintptr_t len);
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#ifndef __SYS_TIMEPAGE_H__
+#define __SYS_TIMEPAGE_H__
+
+/*
+ * The time page is mapped read-only into every process so that the time can 
+ * be read without a system call.  The kernel makes the sequence count odd 
+ * while it updates the page, readers retry if it was odd or changed.
+ */
+
+#define TIMEPAGE_ADDR		0x000000006FFFF000ULL
+#define TIMEPAGE_SHIFT		32
+
+typedef struct TimePage {
+    volatile uint64_t	seq;
+    uint64_t		baseTSC;
+    uint64_t		baseNS;		// Time since the epoch at baseTSC
+    uint64_t		nsMult;		// ns = (tsc * nsMult) >> TIMEPAGE_SHIFT
+    uint64_t		tscMult;	// tsc = (ns * tscMult) >> TIMEPAGE_SHIFT
+    uint64_t		ticksPerSecond;
+} TimePage;
+
+#define TIMEPAGE_BARRIER()	__asm__ volatile("" ::: "memory")
+
+static inline uint64_t
+TimePage_Scale(uint64_t value, uint64_t mult)
+{
+    return (uint64_t)(((unsigned __int128)value * mult) >> TIMEPAGE_SHIFT);
+}
+
+/**
+ * TimePage_GetNS --
+ *
+ * Read the time in nanoseconds since the epoch.
+ */
+static inline uint64_t
+TimePage_GetNS(const volatile TimePage *tp)
+{
+    uint64_t seq;
+    uint64_t tsc;
+    uint64_t ns;
+
+    do {
+	seq = tp->seq;
+	TIMEPAGE_BARRIER();
+	tsc = __builtin_ia32_rdtsc();
+	// TSCs may be slightly behind on other CPUs
+	if (tsc < tp->baseTSC)
+	    tsc = tp->baseTSC;
+	ns = tp->baseNS + TimePage_Scale(tsc - tp->baseTSC, tp->nsMult);
+	TIMEPAGE_BARRIER();
+    } while ((seq & 1) != 0 || seq != tp->seq);
+
+    return ns;
+}
+
+#endif /* __SYS_TIMEPAGE_H__ */
+
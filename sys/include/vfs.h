@@ -3,6 +3,7 @@
 #define __SYS_VFS_H__
 
 #include <sys/kmem.h>
+#include <sys/rwlock.h>
 #include <sys/stat.h>
 
 typedef struct VFSOp VFSOp;
@@ -24,7 +25,7 @@ typedef struct VFS {
 typedef struct VNode {
     VFSOp		*op;
     Disk		*disk;
-    Spinlock		lock;
+    RWLock		lock;		// Shared for lookups and reads
     uint64_t		refCount;
     // FS Fields
     void		*fsptr;
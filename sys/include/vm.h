@@ -0,0 +1,45 @@
+
+#ifndef __SYS_VM_H__
+#define __SYS_VM_H__
+
+#include <sys/queue.h>
+
+struct AS;
+
+/*
+ * Virtual memory regions describe the valid ranges of a user address space.  
+ * Pages inside a region are allocated on first touch by the page fault 
+ * handler unless the region was populated when it was mapped.
+ */
+typedef struct VMRegion {
+    uintptr_t			start;
+    uintptr_t			end;
+    uint64_t			prot;		// PROT_*
+    uint64_t			maxProt;	// Limit for VM_Protect
+    TAILQ_ENTRY(VMRegion)	regionList;
+} VMRegion;
+
+typedef TAILQ_HEAD(VMRegionQueue, VMRegion) VMRegionQueue;
+
+// VM_Map flags
+#define VM_MAP_POPULATE		0x0001
+#define VM_MAP_OVERLAP		0x0002	/* Allow overlapping regions */
+
+// VM_Fault flags
+#define VM_FAULT_WRITE		0x0001	/* Write access */
+#define VM_FAULT_PROT		0x0002	/* Protection violation on a present page */
+
+void VM_Init();
+void VM_InitAS(struct AS *as);
+void VM_DestroyAS(struct AS *as);
+bool VM_Map(struct AS *as, uintptr_t start, uintptr_t len, uint64_t prot,
+	    uint64_t flags);
+bool VM_Populate(struct AS *as, uintptr_t start, uintptr_t len);
+bool VM_MapShared(struct AS *as, uintptr_t va, void *pg);
+int VM_Unmap(struct AS *as, uintptr_t start, uintptr_t len);
+int VM_Protect(struct AS *as, uintptr_t start, uintptr_t len, uint64_t prot);
+bool VM_CloneAS(struct AS *dst, struct AS *src);
+bool VM_Fault(struct AS *as, uintptr_t va, uint64_t flags);
+
+#endif /* __SYS_VM_H__ */
+
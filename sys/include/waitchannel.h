@@ -19,8 +19,10 @@ void WaitChannel_EarlyInit();
 void WaitChannel_Init(WaitChannel *wc, const char *name);
 void WaitChannel_Destroy(WaitChannel *wc);
 void WaitChannel_Lock(WaitChannel *wc) __LOCK_EX(wc->lock);
+void WaitChannel_Unlock(WaitChannel *wc) __UNLOCK_EX(wc->lock);
 void WaitChannel_Sleep(WaitChannel *wc) __UNLOCK_EX(wc->lock);
 void WaitChannel_Wake(WaitChannel *wc);
+void WaitChannel_WakeLocked(WaitChannel *wc);
 void WaitChannel_WakeAll(WaitChannel *wc);
 
 #endif /* __WAITCHANNEL_H__ */
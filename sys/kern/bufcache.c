@@ -11,11 +11,24 @@
 #include <sys/kdebug.h>
 #include <sys/kmem.h>
 #include <sys/spinlock.h>
+#include <sys/rwlock.h>
+#include <sys/waitchannel.h>
 #include <sys/disk.h>
 #include <sys/bufcache.h>
 #include <errno.h>
 
-Spinlock cacheLock;
+/*
+ * cacheLock guards the hash table and is only taken exclusively to replace an 
+ * entry, so cache hits on different CPUs proceed in parallel.  lruLock guards 
+ * the LRU list and entries' onLRU flag.  Reference counts are atomic, only 
+ * the transitions to and from zero take lruLock.
+ *
+ * A miss inserts its entry marked as filling and reads the block without 
+ * holding cacheLock.  Lookups that find a filling entry sleep on the entry's 
+ * fillChan until the read completes.
+ */
+RWLock cacheLock;
+Spinlock lruLock;
 XMem *diskBuf;
 
 static TAILQ_HEAD(CacheHashTable, BufCacheEntry) *hashTable;
@@ -41,13 +54,15 @@ BufCache_Init()
 {
     int i;
 
-    Spinlock_Init(&cacheLock, "BufCache Lock", SPINLOCK_TYPE_NORMAL);
+    RWLock_Init(&cacheLock, "BufCache Lock");
+    Spinlock_Init(&lruLock, "BufCache LRU Lock", SPINLOCK_TYPE_NORMAL);
 
     diskBuf = XMem_New();
     if (!diskBuf)
         Panic("BufCache: Cannot create XMem region\n");
 
-    if (!XMem_Allocate(diskBuf, CACHESIZE))
+    // Buffers are always filled from disk before use
+    if (!XMem_AllocateNoZero(diskBuf, CACHESIZE))
         Panic("BufCache: Cannot back XMem region\n");
 
     TAILQ_INIT(&lruList);
@@ -72,6 +87,8 @@ BufCache_Init()
 	memset(e, 0, sizeof(*e));
 	e->disk = NULL;
 	e->buffer = (void *)(bufBase + BLOCKSIZE * i);
+	e->onLRU = true;
+	WaitChannel_Init(&e->fillChan, "BufCache Fill");
 	TAILQ_INSERT_TAIL(&lruList, e, lruEntry);
     }
 
@@ -80,11 +97,39 @@ BufCache_Init()
     cacheAlloc = 0;
 }
 
+/**
+ * BufCacheRetain --
+ *
+ * Take a reference to an entry found in the hash table.  The first reference 
+ * removes the entry from the LRU list.  The caller must hold cacheLock so the 
+ * entry cannot be reused.
+ *
+ * @param [in] e Buffer cache entry.
+ */
+static void
+BufCacheRetain(BufCacheEntry *e)
+{
+    if (__sync_fetch_and_add(&e->refCount, 1) != 0)
+	return;
+
+    /*
+     * A concurrent BufCache_Release may not have queued the entry yet, so 
+     * recheck the count once we hold the LRU lock.
+     */
+    Spinlock_Lock(&lruLock);
+    if (e->refCount != 0 && e->onLRU) {
+	TAILQ_REMOVE(&lruList, e, lruEntry);
+	e->onLRU = false;
+    }
+    Spinlock_Unlock(&lruLock);
+}
+
 /**
  * BufCacheLookup --
  *
  * Looks up a buffer cache entry that can be used by BufCache_Alloc or 
- * BufCache_Read to allocate the underlying buffer.
+ * BufCache_Read to allocate the underlying buffer.  The caller must hold 
+ * cacheLock shared or exclusive.
  *
  * @param [in] disk Disk object
  * @param [in] diskOffset Block offset within the disk
@@ -103,10 +148,7 @@ BufCacheLookup(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
     table = &hashTable[diskOffset % HASHTABLEENTRIES];
     TAILQ_FOREACH(e, table, htEntry) {
 	if (e->disk == disk && e->diskOffset == diskOffset) {
-	    e->refCount++;
-	    if (e->refCount == 1) {
-		TAILQ_REMOVE(&lruList, e, lruEntry);
-	    }
+	    BufCacheRetain(e);
 	    *entry = e;
 	    return 0;
 	}
@@ -120,7 +162,8 @@ BufCacheLookup(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
  * BufCacheAlloc --
  *
  * Allocates a buffer cache entry that can be used by BufCache_Alloc or 
- * BufCache_Read to allocate the underlying buffer..
+ * BufCache_Read to allocate the underlying buffer..  The caller must hold 
+ * cacheLock exclusively.
  *
  * @param [in] disk Disk object
  * @param [in] diskOffset Block offset within the disk
@@ -136,12 +179,18 @@ BufCacheAlloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
     BufCacheEntry *e;
 
     // Allocate from LRU list
+    Spinlock_Lock(&lruLock);
     e = TAILQ_FIRST(&lruList);
     if (e == NULL) {
+	Spinlock_Unlock(&lruLock);
 	kprintf("BufCache: No space left!\n");
 	return ENOMEM;
     }
     TAILQ_REMOVE(&lruList, e, lruEntry);
+    e->onLRU = false;
+    Spinlock_Unlock(&lruLock);
+
+    ASSERT(e->refCount == 0);
 
     // Remove from hash table
     if (e->disk != NULL) {
@@ -153,6 +202,8 @@ BufCacheAlloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
     e->disk = disk;
     e->diskOffset = diskOffset;
     e->refCount = 1;
+    e->filling = false;
+    e->fillStatus = 0;
 
     // Reinsert into hash table
     table = &hashTable[diskOffset % HASHTABLEENTRIES];
@@ -162,6 +213,29 @@ BufCacheAlloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
     return 0;
 }
 
+/**
+ * BufCacheWaitFill --
+ *
+ * Wait for a concurrent BufCache_Read to fill an entry we hold a reference to.
+ *
+ * @param [in] e Buffer cache entry.
+ *
+ * @retval 0 if the buffer is valid.
+ * @return Error code of the failed disk read, the entry is no longer cached.
+ */
+static int
+BufCacheWaitFill(BufCacheEntry *e)
+{
+    WaitChannel_Lock(&e->fillChan);
+    while (e->filling) {
+	WaitChannel_Sleep(&e->fillChan);
+	WaitChannel_Lock(&e->fillChan);
+    }
+    WaitChannel_Unlock(&e->fillChan);
+
+    return e->fillStatus;
+}
+
 /**
  * BufCache_Alloc --
  *
@@ -179,18 +253,32 @@ BufCache_Alloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 {
     int status;
 
-    Spinlock_Lock(&cacheLock);
-
-    status = BufCacheLookup(disk, diskOffset, entry);
-    if (*entry == NULL) {
-        status = BufCacheAlloc(disk, diskOffset, entry);
-    }
-
-    cacheAlloc++;
+    __sync_fetch_and_add(&cacheAlloc, 1);
+
+    while (1) {
+	RWLock_ReadLock(&cacheLock);
+	status = BufCacheLookup(disk, diskOffset, entry);
+	RWLock_ReadUnlock(&cacheLock);
+
+	if (*entry == NULL) {
+	    // Recheck as another thread may have inserted it before we got the lock
+	    RWLock_WriteLock(&cacheLock);
+	    status = BufCacheLookup(disk, diskOffset, entry);
+	    if (*entry == NULL) {
+		status = BufCacheAlloc(disk, diskOffset, entry);
+		RWLock_WriteUnlock(&cacheLock);
+		return status;
+	    }
+	    RWLock_WriteUnlock(&cacheLock);
+	}
 
-    Spinlock_Unlock(&cacheLock);
+	// Our writes must not be overwritten by a read in progress
+	if (BufCacheWaitFill(*entry) == 0)
+	    return 0;
 
-    return status;
+	// The read failed and dropped the entry from the cache, try again
+	BufCache_Release(*entry);
+    }
 }
 
 /**
@@ -204,14 +292,59 @@ BufCache_Alloc(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 void
 BufCache_Release(BufCacheEntry *entry)
 {
-    Spinlock_Lock(&cacheLock);
+    ASSERT(entry->refCount != 0);
+    if (__sync_fetch_and_sub(&entry->refCount, 1) != 1)
+	return;
 
-    entry->refCount--;
-    if (entry->refCount == 0) {
+    // A concurrent lookup may have revived the entry
+    Spinlock_Lock(&lruLock);
+    if (entry->refCount == 0 && !entry->onLRU) {
         TAILQ_INSERT_TAIL(&lruList, entry, lruEntry);
+        entry->onLRU = true;
+    }
+    Spinlock_Unlock(&lruLock);
+}
+
+/**
+ * BufCacheFill --
+ *
+ * Read a block into a newly allocated entry that is marked as filling and wake 
+ * up any lookups waiting for it.  On failure the entry is removed from the 
+ * cache so that later lookups retry the read.
+ *
+ * @param [in] e Buffer cache entry with our reference.
+ * @param [out] entry The entry if successful, otherwise NULL.
+ */
+static int
+BufCacheFill(BufCacheEntry *e, BufCacheEntry **entry)
+{
+    int status;
+    SGArray sga;
+
+    SGArray_Init(&sga);
+    SGArray_Append(&sga, e->diskOffset, BLOCKSIZE);
+
+    status = Disk_Read(e->disk, e->buffer, &sga, NULL, NULL);
+    if (status != 0) {
+	RWLock_WriteLock(&cacheLock);
+	TAILQ_REMOVE(&hashTable[e->diskOffset % HASHTABLEENTRIES], e, htEntry);
+	e->disk = NULL;
+	RWLock_WriteUnlock(&cacheLock);
+    }
+
+    WaitChannel_Lock(&e->fillChan);
+    e->fillStatus = status;
+    e->filling = false;
+    WaitChannel_Unlock(&e->fillChan);
+    WaitChannel_WakeAll(&e->fillChan);
+
+    if (status != 0) {
+	BufCache_Release(e);
+	e = NULL;
     }
 
-    Spinlock_Unlock(&cacheLock);
+    *entry = e;
+    return status;
 }
 
 /**
@@ -229,35 +362,42 @@ int
 BufCache_Read(Disk *disk, uint64_t diskOffset, BufCacheEntry **entry)
 {
     int status;
-    void *buf;
-    SGArray sga;
+    BufCacheEntry *e;
 
-    Spinlock_Lock(&cacheLock);
-    status = BufCacheLookup(disk, diskOffset, entry);
-    if (*entry != NULL) {
-        cacheHit++;
-        Spinlock_Unlock(&cacheLock);
-        return status;
-    }
-    cacheMiss++;
+    RWLock_ReadLock(&cacheLock);
+    BufCacheLookup(disk, diskOffset, &e);
+    RWLock_ReadUnlock(&cacheLock);
 
-    status = BufCacheAlloc(disk, diskOffset, entry);
-    if (status != 0) {
-        Spinlock_Unlock(&cacheLock);
-        return status;
+    if (e == NULL) {
+	// Recheck as another thread may have inserted it before we got the lock
+	RWLock_WriteLock(&cacheLock);
+	BufCacheLookup(disk, diskOffset, &e);
+	if (e == NULL) {
+	    __sync_fetch_and_add(&cacheMiss, 1);
+	    status = BufCacheAlloc(disk, diskOffset, &e);
+	    if (status != 0) {
+		RWLock_WriteUnlock(&cacheLock);
+		*entry = NULL;
+		return status;
+	    }
+	    // Lookups of this block wait until we are done
+	    e->filling = true;
+	    RWLock_WriteUnlock(&cacheLock);
+
+	    return BufCacheFill(e, entry);
+	}
+	RWLock_WriteUnlock(&cacheLock);
     }
 
-    buf = (*entry)->buffer;
-    SGArray_Init(&sga);
-    SGArray_Append(&sga, diskOffset, BLOCKSIZE);
+    __sync_fetch_and_add(&cacheHit, 1);
 
-    /*
-     * XXX: Need to avoid holding cacheLock while reading from the disk, but 
-     * need ensure other cores doesn't issue a read to the same block.
-     */
-    status = Disk_Read(disk, buf, &sga, NULL, NULL);
-    Spinlock_Unlock(&cacheLock);
+    status = BufCacheWaitFill(e);
+    if (status != 0) {
+	BufCache_Release(e);
+	e = NULL;
+    }
 
+    *entry = e;
     return status;
 }
 
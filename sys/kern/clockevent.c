@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+/*
+ * Clock Events
+ *
+ * Each CPU's local timer runs in one-shot mode and is programmed for the 
+ * earlier of its next scheduler tick and the next event on its timer wheel.  
+ * CPUs running their idle thread stop ticking and only wake up for timers, 
+ * device interrupts or a wakeup IPI from another CPU.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/kdebug.h>
+#include <sys/ktime.h>
+#include <sys/ktimer.h>
+#include <sys/mp.h>
+#include <sys/spinlock.h>
+#include <sys/sysctl.h>
+#include <sys/thread.h>
+#include <sys/clockevent.h>
+
+#include <machine/lapic.h>
+#include <machine/mp.h>
+
+typedef struct ClockEvent {
+    bool		tickless;	// Scheduler tick is stopped
+    uint64_t		nextTick;	// TSC of the next scheduler tick
+    uint64_t		deadline;	// Programmed deadline
+    uint64_t		interrupts;
+    uint64_t		ticks;
+    uint64_t		idles;
+} ClockEvent;
+
+static ClockEvent clockEvent[MAX_CPUS];
+
+extern uint64_t ticksPerSecond;
+
+static uint64_t
+ClockEventPeriod()
+{
+    return ticksPerSecond / SYSCTL_GETINT(kern_hz);
+}
+
+/**
+ * ClockEventProgram --
+ *
+ * Arm the local timer for the earliest pending event.  Must be called with 
+ * interrupts disabled.
+ *
+ * @param [in] ce Local clock event state.
+ */
+static void
+ClockEventProgram(ClockEvent *ce)
+{
+    uint64_t deadline = ce->tickless ? CLOCKEVENT_NONE : ce->nextTick;
+    uint64_t timer = KTimer_NextDeadline();
+
+    if (timer < deadline)
+	deadline = timer;
+
+    ce->deadline = deadline;
+    if (deadline == CLOCKEVENT_NONE)
+	LAPIC_StopTimer();
+    else
+	LAPIC_SetDeadline(deadline);
+}
+
+static void
+ClockEventStart()
+{
+    ClockEvent *ce = &clockEvent[CPU()];
+
+    ce->tickless = false;
+    ce->nextTick = Time_GetTSC() + ClockEventPeriod();
+    ce->interrupts = 0;
+    ce->ticks = 0;
+    ce->idles = 0;
+
+    ClockEventProgram(ce);
+}
+
+/**
+ * ClockEvent_Init --
+ *
+ * Start the scheduler tick on the boot processor.  Depends on the LAPIC, KTime 
+ * and KTimer.
+ */
+void
+ClockEvent_Init()
+{
+    Critical_Enter();
+    ClockEventStart();
+    Critical_Exit();
+
+    kprintf("ClockEvent: %lu Hz tick, tickless idle %s\n",
+	    SYSCTL_GETINT(kern_hz),
+	    SYSCTL_GETBOOL(kern_tickless) ? "enabled" : "disabled");
+}
+
+/**
+ * ClockEvent_InitAP --
+ *
+ * Start the scheduler tick on an application processor.
+ */
+void
+ClockEvent_InitAP()
+{
+    Critical_Enter();
+    ClockEventStart();
+    Critical_Exit();
+}
+
+/**
+ * ClockEvent_Interrupt --
+ *
+ * Local timer interrupt handler.  Runs expired timers and the scheduler tick 
+ * if it is due, then rearms the timer.  The timer may fire early because 
+ * one-shot intervals are clamped or because a deadline was moved.
+ */
+void
+ClockEvent_Interrupt()
+{
+    bool tick = false;
+    uint64_t now;
+    uint64_t period;
+    ClockEvent *ce = &clockEvent[CPU()];
+
+    ce->interrupts++;
+
+    KTimer_Process();
+
+    now = Time_GetTSC();
+    if (!ce->tickless && now >= ce->nextTick) {
+	period = ClockEventPeriod();
+	ce->nextTick += period;
+	// Do not try to catch up on missed ticks
+	if (ce->nextTick <= now)
+	    ce->nextTick = now + period;
+	ce->ticks++;
+	tick = true;
+    }
+
+    ClockEventProgram(ce);
+
+    if (tick)
+	Sched_Tick();
+    else
+	Sched_CheckPreempt();
+}
+
+/**
+ * ClockEvent_Idle --
+ *
+ * Called by the idle thread with interrupts disabled before halting.  Stops 
+ * the scheduler tick so that the CPU only wakes up for timers and interrupts.
+ */
+void
+ClockEvent_Idle()
+{
+    ClockEvent *ce = &clockEvent[CPU()];
+
+    if (!SYSCTL_GETBOOL(kern_tickless)) {
+	ClockEvent_Resume();
+	return;
+    }
+
+    if (!ce->tickless)
+	ce->idles++;
+
+    ce->tickless = true;
+    ClockEventProgram(ce);
+}
+
+/**
+ * ClockEvent_Resume --
+ *
+ * Restart the scheduler tick when a CPU leaves its idle thread.  Called by the 
+ * scheduler with the run queue lock held, so we do not look at the timer 
+ * wheel; the currently programmed deadline already accounts for it.
+ */
+void
+ClockEvent_Resume()
+{
+    ClockEvent *ce = &clockEvent[CPU()];
+
+    if (!ce->tickless)
+	return;
+
+    ce->tickless = false;
+    ce->nextTick = Time_GetTSC() + ClockEventPeriod();
+    if (ce->nextTick < ce->deadline) {
+	ce->deadline = ce->nextTick;
+	LAPIC_SetDeadline(ce->deadline);
+    }
+}
+
+/**
+ * ClockEvent_Reprogram --
+ *
+ * Recompute the local deadline, used by the wakeup IPI handler.
+ */
+void
+ClockEvent_Reprogram()
+{
+    ClockEventProgram(&clockEvent[CPU()]);
+}
+
+/**
+ * ClockEvent_Schedule --
+ *
+ * Make sure that a CPU takes a timer interrupt no later than the deadline.  A 
+ * remote CPU is sent a wakeup IPI to reprogram its own timer.
+ *
+ * @param [in] cpu CPU that should handle the event.
+ * @param [in] deadline Absolute TSC value.
+ */
+void
+ClockEvent_Schedule(int cpu, uint64_t deadline)
+{
+    ClockEvent *ce = &clockEvent[cpu];
+
+    Critical_Enter();
+    if (deadline < ce->deadline) {
+	if (cpu == CPU()) {
+	    ce->deadline = deadline;
+	    LAPIC_SetDeadline(deadline);
+	} else {
+	    MP_Wakeup(cpu);
+	}
+    }
+    Critical_Exit();
+}
+
+static void
+Debug_ClockEvents(int argc, const char *argv[])
+{
+    int c;
+    uint64_t now = Time_GetTSC();
+
+    kprintf("CPU  Mode      Interrupts    Ticks         Idles         Deadline\n");
+    for (c = 0; c < MP_GetCPUs(); c++) {
+	ClockEvent *ce = &clockEvent[c];
+
+	kprintf("%-3d  %-8s  %-12lu  %-12lu  %-12lu  ", c,
+		ce->tickless ? "tickless" : "ticking",
+		ce->interrupts, ce->ticks, ce->idles);
+	if (ce->deadline == CLOCKEVENT_NONE)
+	    kprintf("none\n");
+	else if (ce->deadline <= now)
+	    kprintf("expired\n");
+	else
+	    kprintf("+%lu us\n", (ce->deadline - now) * 1000000 / ticksPerSecond);
+    }
+}
+
+REGISTER_DBGCMD(clockevents, "Display per-CPU clock event state", Debug_ClockEvents);
+
@@ -47,7 +47,16 @@ CV_Wait(CV *cv, Mutex *mtx)
 {
     /* Do not go to sleep holding a spinlock! */
     ASSERT(Critical_Level() == 0);
-    /* XXXFILLMEIN */
+
+    /*
+     * Take the channel lock before releasing the mutex so a signal sent 
+     * between the caller's predicate check and our sleep cannot be missed.
+     */
+    WaitChannel_Lock(&cv->chan);
+    Mutex_Unlock(mtx);
+    WaitChannel_Sleep(&cv->chan);
+
+    Mutex_Lock(mtx);
 }
 
 /**
@@ -58,7 +67,7 @@ CV_Wait(CV *cv, Mutex *mtx)
 void
 CV_Signal(CV *cv)
 {
-    /* XXXFILLMEIN */
+    WaitChannel_Wake(&cv->chan);
 }
 
 /**
@@ -69,6 +78,6 @@ CV_Signal(CV *cv)
 void
 CV_Broadcast(CV *cv)
 {
-    /* XXXFILLMEIN */
+    WaitChannel_WakeAll(&cv->chan);
 }
 
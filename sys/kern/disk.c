@@ -12,32 +12,83 @@
 #include <sys/sga.h>
 #include <sys/disk.h>
 #include <sys/spinlock.h>
+#include <sys/epoch.h>
+#include <sys/thread.h>
 
+// diskLock serializes updates, lookups walk the list inside an epoch
+Spinlock diskLock = SPINLOCK_INITIALIZER("Disk List", SPINLOCK_TYPE_NORMAL);
 LIST_HEAD(DiskList, Disk) diskList = LIST_HEAD_INITIALIZER(diskList);
 
 void
 Disk_AddDisk(Disk *disk)
 {
+    // The list holds the first reference
+    disk->refCount = 1;
+
+    Spinlock_Lock(&diskLock);
     LIST_INSERT_HEAD(&diskList, disk, entries);
+    Spinlock_Unlock(&diskLock);
 }
 
+/**
+ * Disk_RemoveDisk --
+ *
+ * Remove a disk from the list.  Returns once all references taken by 
+ * Disk_GetByID have been released so the caller may free the disk.
+ */
 void
 Disk_RemoveDisk(Disk *disk)
 {
+    Spinlock_Lock(&diskLock);
     LIST_REMOVE(disk, entries);
+    Spinlock_Unlock(&diskLock);
+
+    // After the grace period lookups can no longer take new references
+    Epoch_Synchronize();
+
+    while (disk->refCount != 1) {
+	Sched_Scheduler();
+    }
+    disk->refCount = 0;
 }
 
+/**
+ * Disk_GetByID --
+ *
+ * Find a disk without taking the disk list lock.
+ *
+ * @return The disk with a reference held for the caller, which must be 
+ * dropped with Disk_Release.
+ * @retval NULL if no such disk exists.
+ */
 Disk *
 Disk_GetByID(uint64_t ctrlNo, uint64_t diskNo)
 {
     Disk *d;
 
+    Epoch_Enter();
     LIST_FOREACH(d, &diskList, entries) {
 	if (d->ctrlNo == ctrlNo && d->diskNo == diskNo)
-	    return d;
+	    break;
     }
+    // The list's reference keeps the count from reaching zero here
+    if (d != NULL)
+	__sync_fetch_and_add(&d->refCount, 1);
+    Epoch_Exit();
+
+    return d;
+}
 
-    return NULL;
+/**
+ * Disk_Release --
+ *
+ * Drop a reference taken by Disk_GetByID.
+ */
+void
+Disk_Release(Disk *disk)
+{
+    ASSERT(disk->refCount > 1);
+    __sync_fetch_and_sub(&disk->refCount, 1);
 }
 
 int
@@ -89,6 +140,10 @@ Debug_DumpDisk(int argc, const char *argv[])
     sector = Debug_StrToInt(argv[3]);
 
     Disk *d = Disk_GetByID(ctrlNo, diskNo);
+    if (d == NULL) {
+	kprintf("disk%lld.%lld not found!\n", ctrlNo, diskNo);
+	return;
+    }
 
     sga.len = 1;
     sga.entries[0].offset = sector;
@@ -98,6 +153,8 @@ Debug_DumpDisk(int argc, const char *argv[])
 
     Disk_Read(d, &buf, &sga, NULL, NULL);
     Debug_PrintHex((const char *)&buf, 512, 0, 512);
+
+    Disk_Release(d);
 }
 
 REGISTER_DBGCMD(dumpdisk, "Dump disk sector", Debug_DumpDisk);
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/kdebug.h>
+#include <sys/mp.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/thread.h>
+#include <sys/epoch.h>
+
+#include <machine/atomic.h>
+#include <machine/amd64.h>
+#include <machine/amd64op.h>
+
+/*
+ * Epoch Based Reclamation
+ *
+ * Readers walk lock-free lists between Epoch_Enter and Epoch_Exit, which
+ * disable interrupts so the reader cannot be preempted.  Entering the
+ * scheduler and taking a timer tick are therefore quiescent points, where the
+ * CPU cannot hold any references obtained inside a read section.  At each
+ * quiescent point the CPU records the global epoch it observed.
+ *
+ * Writers unlink an object under their own lock and then advance the global
+ * epoch.  Once every CPU has observed the new epoch no reader can still see
+ * the object and it is safe to free.  Idle CPUs are parked at EPOCH_IDLE so a
+ * halted CPU never holds up a grace period.  Interrupt handlers that enter a
+ * read section on a parked CPU observe the current epoch first, and a CPU
+ * hands its pending callbacks to the orphan queue before parking so that
+ * running CPUs can reclaim them.
+ */
+
+#define EPOCH_IDLE		0xFFFFFFFFFFFFFFFFULL
+
+typedef struct EpochCPU {
+    volatile uint64_t			seen;	    // Last epoch observed
+    TAILQ_HEAD(EpochQueue, EpochEntry)	pending;    // In increasing epoch order
+    uint64_t				deferred;
+    uint64_t				reclaimed;
+} CACHELINE_ALIGNED EpochCPU;
+
+static volatile uint64_t epochGlobal = 1;
+static EpochCPU epochCPU[MAX_CPUS];
+static Spinlock epochOrphanLock;
+static volatile uint64_t epochOrphans;
+static struct EpochQueue epochOrphanQueue;
+
+void
+Epoch_Init()
+{
+    int c;
+
+    Spinlock_Init(&epochOrphanLock, "Epoch Orphans", SPINLOCK_TYPE_NORMAL);
+    TAILQ_INIT(&epochOrphanQueue);
+    epochOrphans = 0;
+
+    for (c = 0; c < MAX_CPUS; c++) {
+	epochCPU[c].seen = EPOCH_IDLE;
+	TAILQ_INIT(&epochCPU[c].pending);
+	epochCPU[c].deferred = 0;
+	epochCPU[c].reclaimed = 0;
+    }
+
+    // The bootstrap CPU is already running, APs join at their first switch
+    epochCPU[CPU()].seen = epochGlobal;
+}
+
+/**
+ * Epoch_Enter --
+ *
+ * Begin a read section.  Objects found inside the section remain valid until
+ * Epoch_Exit, but the section must not sleep.
+ */
+void
+Epoch_Enter()
+{
+    EpochCPU *ec;
+
+    Critical_Enter();
+    ec = &epochCPU[CPU()];
+
+    /*
+     * An interrupt on an idle CPU finds it parked.  The swap publishes the 
+     * epoch before our reads like in Epoch_Quiescent, the idle loop parks 
+     * the CPU again once the handler returns.
+     */
+    if (ec->seen == EPOCH_IDLE)
+	atomic_swap_uint64(&ec->seen, epochGlobal);
+}
+
+/**
+ * Epoch_Exit --
+ *
+ * End a read section.
+ */
+void
+Epoch_Exit()
+{
+    Critical_Exit();
+}
+
+/**
+ * EpochMinSeen --
+ *
+ * Return the oldest epoch that any CPU may still be reading in.
+ */
+static uint64_t
+EpochMinSeen()
+{
+    int c;
+    uint64_t seen;
+    uint64_t min = EPOCH_IDLE;
+
+    for (c = 0; c < MAX_CPUS; c++) {
+	seen = epochCPU[c].seen;
+	if (seen < min)
+	    min = seen;
+    }
+
+    return min;
+}
+
+/**
+ * EpochReclaim --
+ *
+ * Run the callbacks of this CPU and any orphaned callbacks whose grace period
+ * has elapsed.  Must be called with interrupts disabled.
+ */
+static void
+EpochReclaim(EpochCPU *ec)
+{
+    uint64_t min;
+    EpochEntry *entry;
+    EpochEntry *tmp;
+    struct EpochQueue ready;
+
+    if (TAILQ_EMPTY(&ec->pending) && epochOrphans == 0)
+	return;
+
+    min = EpochMinSeen();
+    while ((entry = TAILQ_FIRST(&ec->pending)) != NULL && entry->epoch <= min) {
+	TAILQ_REMOVE(&ec->pending, entry, entries);
+	ec->reclaimed++;
+	entry->cb(entry->arg);
+    }
+
+    if (epochOrphans == 0)
+	return;
+
+    // Orphans from several CPUs are not sorted, collect them and run unlocked
+    TAILQ_INIT(&ready);
+    Spinlock_Lock(&epochOrphanLock);
+    TAILQ_FOREACH_SAFE(entry, &epochOrphanQueue, entries, tmp) {
+	if (entry->epoch <= min) {
+	    TAILQ_REMOVE(&epochOrphanQueue, entry, entries);
+	    TAILQ_INSERT_TAIL(&ready, entry, entries);
+	    epochOrphans--;
+	}
+    }
+    Spinlock_Unlock(&epochOrphanLock);
+
+    while ((entry = TAILQ_FIRST(&ready)) != NULL) {
+	TAILQ_REMOVE(&ready, entry, entries);
+	ec->reclaimed++;
+	entry->cb(entry->arg);
+    }
+}
+
+/**
+ * Epoch_Defer --
+ *
+ * Call cb once all CPUs have passed through a quiescent state.  The object
+ * must already be unlinked from any list readers can reach.  Callbacks run
+ * with interrupts disabled, usually on the CPU that deferred them, and must
+ * not sleep.
+ *
+ * @param [in] entry Entry embedded in the object being released.
+ * @param [in] cb Callback, usually frees the object.
+ * @param [in] arg Argument to cb.
+ */
+void
+Epoch_Defer(EpochEntry *entry, EpochCB cb, void *arg)
+{
+    EpochCPU *ec;
+
+    entry->cb = cb;
+    entry->arg = arg;
+
+    Critical_Enter();
+    ec = &epochCPU[CPU()];
+    // The locked add orders the caller's unlink before the new epoch
+    entry->epoch = __sync_add_and_fetch(&epochGlobal, 1);
+    TAILQ_INSERT_TAIL(&ec->pending, entry, entries);
+    ec->deferred++;
+    Critical_Exit();
+}
+
+/**
+ * Epoch_Synchronize --
+ *
+ * Wait until every reader that might have seen an object unlinked before this
+ * call has left its read section.
+ */
+void
+Epoch_Synchronize()
+{
+    uint64_t target;
+
+    ASSERT(Critical_Level() == 0);
+
+    target = __sync_add_and_fetch(&epochGlobal, 1);
+    Epoch_Quiescent();
+
+    while (EpochMinSeen() < target) {
+	// Other CPUs observe the epoch on their next tick or context switch
+	Sched_Scheduler();
+	pause();
+    }
+}
+
+/**
+ * Epoch_Quiescent --
+ *
+ * Called from the scheduler and the timer tick when the current CPU cannot be
+ * inside a read section.  Observes the global epoch and runs any callbacks
+ * whose grace period has elapsed.
+ */
+void
+Epoch_Quiescent()
+{
+    EpochCPU *ec;
+
+    Critical_Enter();
+    ec = &epochCPU[CPU()];
+    /*
+     * The swap orders our new epoch before any reads in later read sections,
+     * which matters when leaving EPOCH_IDLE.
+     */
+    atomic_swap_uint64(&ec->seen, epochGlobal);
+    EpochReclaim(ec);
+    Critical_Exit();
+}
+
+/**
+ * Epoch_Idle --
+ *
+ * Called with interrupts disabled before the idle thread halts.  Parks this
+ * CPU so that it does not delay grace periods while halted.  Callbacks that
+ * are not ready yet go to the orphan queue as a tickless CPU may not run
+ * again for a long time.  The next call to Epoch_Quiescent or Epoch_Enter
+ * brings it back.
+ */
+void
+Epoch_Idle()
+{
+    uint64_t count = 0;
+    EpochEntry *entry;
+    EpochCPU *ec = &epochCPU[CPU()];
+
+    ec->seen = epochGlobal;
+    EpochReclaim(ec);
+
+    if (!TAILQ_EMPTY(&ec->pending)) {
+	Spinlock_Lock(&epochOrphanLock);
+	while ((entry = TAILQ_FIRST(&ec->pending)) != NULL) {
+	    TAILQ_REMOVE(&ec->pending, entry, entries);
+	    TAILQ_INSERT_TAIL(&epochOrphanQueue, entry, entries);
+	    count++;
+	}
+	epochOrphans += count;
+	Spinlock_Unlock(&epochOrphanLock);
+    }
+
+    ec->seen = EPOCH_IDLE;
+}
+
+static void
+Debug_Epoch(int argc, const char *argv[])
+{
+    int c;
+
+    kprintf("Global Epoch: %llu\n", epochGlobal);
+    for (c = 0; c < MAX_CPUS; c++) {
+	EpochCPU *ec = &epochCPU[c];
+
+	if (percpu[c].curProc == NULL)
+	    continue;
+
+	if (ec->seen == EPOCH_IDLE) {
+	    kprintf("CPU %d: Seen: idle", c);
+	} else {
+	    kprintf("CPU %d: Seen: %llu", c, ec->seen);
+	}
+	kprintf(" Deferred: %llu Reclaimed: %llu\n",
+		ec->deferred, ec->reclaimed);
+    }
+    kprintf("Orphans: %llu\n", epochOrphans);
+}
+
+REGISTER_DBGCMD(epoch, "Display epoch reclamation state", Debug_Epoch);
+
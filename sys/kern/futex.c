@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <errno.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/kdebug.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/thread.h>
+#include <sys/waitchannel.h>
+#include <sys/ktimer.h>
+#include <sys/futex.h>
+
+#include <machine/amd64.h>
+#include <machine/amd64op.h>
+
+/*
+ * Futexes
+ *
+ * User space keeps the state of its locks in a 64-bit word and only enters the
+ * kernel to sleep when the word says the lock is contended.  Sleeping threads
+ * are kept in a fixed table of wait channels hashed by address space and
+ * virtual address.  Collisions are allowed, each sleeping thread records the
+ * address it waits on and wakeups only pick threads with a matching key.
+ */
+
+#define FUTEX_HASHBITS		6
+#define FUTEX_BUCKETS		(1 << FUTEX_HASHBITS)
+
+typedef struct FutexBucket {
+    WaitChannel		chan;
+} CACHELINE_ALIGNED FutexBucket;
+
+static FutexBucket futexTable[FUTEX_BUCKETS];
+
+void
+Futex_Init()
+{
+    int i;
+
+    for (i = 0; i < FUTEX_BUCKETS; i++) {
+	WaitChannel_Init(&futexTable[i].chan, "Futex");
+    }
+}
+
+static FutexBucket *
+FutexHash(AS *space, uintptr_t addr)
+{
+    uint64_t h = ((uintptr_t)space >> 6) ^ (addr >> 3);
+
+    h *= 0x9E3779B97F4A7C15ULL;
+
+    return &futexTable[h >> (64 - FUTEX_HASHBITS)];
+}
+
+/**
+ * FutexDequeue --
+ *
+ * Remove a sleeping thread from its bucket and make it runnable.  The caller
+ * must hold the bucket lock.
+ *
+ * Side Effects:
+ * Releases the reference taken by WaitChannel_Sleep.
+ */
+static void
+FutexDequeue(FutexBucket *b, Thread *thr)
+{
+    ASSERT(Spinlock_IsHeld(&b->chan.lock));
+
+    TAILQ_REMOVE(&b->chan.chanQueue, thr, chanQueue);
+    thr->futexAddr = 0;
+    Sched_SetRunnable(thr);
+    Thread_Release(thr);
+}
+
+static void
+FutexTimeout(void *arg)
+{
+    Thread *thr = (Thread *)arg;
+    FutexBucket *b = FutexHash(thr->space, thr->futexAddr);
+
+    WaitChannel_Lock(&b->chan);
+    // A wakeup may have beaten us here
+    if (thr->futexAddr != 0) {
+	thr->futexTimedOut = true;
+	FutexDequeue(b, thr);
+    }
+    WaitChannel_Unlock(&b->chan);
+
+    // Tells the waiter we are done with its futex state
+    thr->timerEvt = NULL;
+    Thread_Release(thr);
+}
+
+/**
+ * Futex_Wait --
+ *
+ * Sleep on a user address as long as it holds the expected value.
+ *
+ * @param [in] addr 64-bit aligned user address.
+ * @param [in] val Value the caller last observed at addr.
+ * @param [in] timeout Relative timeout in nanoseconds or 0 to wait forever.
+ *
+ * @retval 0 if we were woken up by Futex_Wake.
+ * @retval EAGAIN if addr no longer holds val.
+ * @retval ETIMEDOUT if the timeout expired.
+ */
+int
+Futex_Wait(uintptr_t addr, uint64_t val, uint64_t timeout)
+{
+    int status;
+    uint64_t cur;
+    FutexBucket *b;
+    KTimerEvent *evt = NULL;
+    Thread *thr = Sched_CurrentBorrow();
+
+    if (addr == 0 || (addr & (sizeof(uint64_t) - 1)) != 0)
+	return EINVAL;
+
+    b = FutexHash(thr->space, addr);
+
+    /*
+     * Read the word under the bucket lock so that a waker who updates the word
+     * before calling Futex_Wake either makes us return EAGAIN or finds us on
+     * the queue.  Demand faults only take the address space's region lock.
+     */
+    WaitChannel_Lock(&b->chan);
+    status = Copy_In(addr, &cur, sizeof(cur));
+    if (status == 0 && cur != val)
+	status = EAGAIN;
+    if (status != 0) {
+	WaitChannel_Unlock(&b->chan);
+	return status;
+    }
+
+    thr->futexAddr = addr;
+    thr->futexTimedOut = false;
+    if (timeout != 0) {
+	// The timer holds a reference until it fires
+	Thread_Retain(thr);
+	evt = KTimer_Create(timeout, FutexTimeout, thr);
+	if (evt == NULL) {
+	    thr->futexAddr = 0;
+	    WaitChannel_Unlock(&b->chan);
+	    Thread_Release(thr);
+	    return ENOMEM;
+	}
+	// Interrupts are off so the timer cannot fire on this CPU yet
+	thr->timerEvt = evt;
+    }
+
+    WaitChannel_Sleep(&b->chan);
+
+    if (evt != NULL) {
+	if (KTimer_Cancel(evt)) {
+	    thr->timerEvt = NULL;
+	    Thread_Release(thr);
+	} else {
+	    // The callback may still be running on another CPU
+	    while (*(KTimerEvent * volatile *)&thr->timerEvt != NULL) {
+		pause();
+	    }
+	}
+	KTimer_Release(evt);
+    }
+
+    return thr->futexTimedOut ? ETIMEDOUT : 0;
+}
+
+/**
+ * Futex_Wake --
+ *
+ * Wake up threads of the current address space sleeping on a user address.
+ *
+ * @param [in] addr User address.
+ * @param [in] count Maximum number of threads to wake.
+ *
+ * @return Number of threads woken up.
+ */
+uint64_t
+Futex_Wake(uintptr_t addr, uint64_t count)
+{
+    uint64_t woken = 0;
+    Thread *thr;
+    Thread *thrTemp;
+    Thread *cur = Sched_CurrentBorrow();
+    FutexBucket *b = FutexHash(cur->space, addr);
+
+    WaitChannel_Lock(&b->chan);
+    TAILQ_FOREACH_SAFE(thr, &b->chan.chanQueue, chanQueue, thrTemp) {
+	if (woken == count)
+	    break;
+	if (thr->space == cur->space && thr->futexAddr == addr) {
+	    FutexDequeue(b, thr);
+	    woken++;
+	}
+    }
+    WaitChannel_Unlock(&b->chan);
+
+    return woken;
+}
+
+static void
+Debug_Futex(int argc, const char *argv[])
+{
+    int i;
+    Thread *thr;
+
+    for (i = 0; i < FUTEX_BUCKETS; i++) {
+	TAILQ_FOREACH(thr, &futexTable[i].chan.chanQueue, chanQueue) {
+	    kprintf("Bucket %2d: TID %llu AS %016llx Addr %016llx\n",
+		    i, thr->tid, thr->space, thr->futexAddr);
+	}
+    }
+}
+
+REGISTER_DBGCMD(futex, "Display threads sleeping on futexes", Debug_Futex);
+
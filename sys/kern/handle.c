@@ -5,6 +5,8 @@
 #include <sys/kassert.h>
 #include <sys/queue.h>
 #include <sys/kmem.h>
+#include <sys/epoch.h>
+#include <sys/spinlock.h>
 #include <sys/handle.h>
 #include <sys/thread.h>
 #include <sys/syscall.h>
@@ -38,7 +40,7 @@ Handle_Destroy(Process *proc)
     for (i = 0; i < PROCESS_HANDLE_SLOTS; i++) {
 	TAILQ_FOREACH_SAFE(handle, &proc->handles[i], handleList, handle_tmp) {
 	    TAILQ_REMOVE(&proc->handles[i], handle, handleList);
-	    (handle->close)(handle);
+	    Handle_Release(handle);
 	}
     }
 }
@@ -48,6 +50,10 @@ Handle_Add(Process *proc, Handle *handle)
 {
     int slot;
 
+    // The process holds the first reference
+    handle->refCount = 1;
+
+    Spinlock_Lock(&proc->lock);
     handle->fd = proc->nextFD;
     proc->nextFD++;
     handle->processId = proc->pid;
@@ -55,29 +61,120 @@ Handle_Add(Process *proc, Handle *handle)
     slot = handle->fd % PROCESS_HANDLE_SLOTS;
 
     TAILQ_INSERT_HEAD(&proc->handles[slot], handle, handleList);
+    Spinlock_Unlock(&proc->lock);
 
     return handle->fd;
 }
 
-void
-Handle_Remove(Process *proc, Handle *handle)
+/**
+ * Handle_Remove --
+ *
+ * Find and unlink a handle in one step under the process lock, so that of 
+ * several threads closing the same descriptor only one removes it.
+ *
+ * @param [in] proc Process that owns the handle.
+ * @param [in] fd File descriptor.
+ *
+ * @return The handle along with the process' reference, which the caller must 
+ * drop with Handle_Release.
+ * @retval NULL if no such handle exists.
+ */
+Handle *
+Handle_Remove(Process *proc, uint64_t fd)
+{
+    int slot = fd % PROCESS_HANDLE_SLOTS;
+    Handle *handle;
+
+    Spinlock_Lock(&proc->lock);
+    TAILQ_FOREACH(handle, &proc->handles[slot], handleList) {
+	if (handle->fd == fd) {
+	    TAILQ_REMOVE(&proc->handles[slot], handle, handleList);
+	    break;
+	}
+    }
+    Spinlock_Unlock(&proc->lock);
+
+    return handle;
+}
+
+/**
+ * Handle_Release --
+ *
+ * Drop a reference to a handle and close it once the last reference is gone.
+ *
+ * @param [in] handle Handle returned by Handle_Lookup or Handle_Remove.
+ *
+ * @return Status of the close routine, or 0 if the handle is still in use.
+ */
+int
+Handle_Release(Handle *handle)
 {
-    int slot = handle->fd % PROCESS_HANDLE_SLOTS;
+    ASSERT(handle->refCount != 0);
+    if (__sync_fetch_and_sub(&handle->refCount, 1) == 1) {
+	return (handle->close)(handle);
+    }
 
-    TAILQ_REMOVE(&proc->handles[slot], handle, handleList);
+    return 0;
+}
+
+static void
+HandleFree(void *arg)
+{
+    Handle_Free((Handle *)arg);
 }
 
+/**
+ * Handle_Retire --
+ *
+ * Free a handle once concurrent calls to Handle_Lookup can no longer reach it.  
+ * Close routines use this in place of Handle_Free.
+ *
+ * @param [in] handle Handle that has been removed from its process.
+ */
+void
+Handle_Retire(Handle *handle)
+{
+    Epoch_Defer(&handle->epochEntry, HandleFree, handle);
+}
+
+/**
+ * Handle_Lookup --
+ *
+ * Find a handle by file descriptor without taking the process lock.  The 
+ * epoch keeps the handle's memory valid while we take a reference, a handle 
+ * that has already dropped to zero is being closed and is skipped.
+ *
+ * @param [in] proc Process that owns the handle.
+ * @param [in] fd File descriptor.
+ *
+ * @return The handle with a reference held for the caller, which must be 
+ * dropped with Handle_Release.
+ * @retval NULL if no such handle exists.
+ */
 Handle *
 Handle_Lookup(Process *proc, uint64_t fd)
 {
     int slot = fd % PROCESS_HANDLE_SLOTS;
+    uint64_t refs;
     Handle *handle;
 
+    Epoch_Enter();
     TAILQ_FOREACH(handle, &proc->handles[slot], handleList) {
 	if (handle->fd == fd)
-	    return handle;
+	    break;
+    }
+    if (handle != NULL) {
+	do {
+	    refs = handle->refCount;
+	    if (refs == 0) {
+		handle = NULL;
+		break;
+	    }
+	} while (!__sync_bool_compare_and_swap(&handle->refCount, refs,
+					       refs + 1));
     }
+    Epoch_Exit();
 
-    return NULL;
+    return handle;
 }
 
@@ -8,12 +8,17 @@
 
 #include <sys/kassert.h>
 #include <sys/kdebug.h>
+#include <sys/kmem.h>
 #include <sys/ktime.h>
 #include <sys/spinlock.h>
+#include <sys/timepage.h>
 
+/*
+ * The time page is protected by a sequence count so that readers never take 
+ * a lock, ktimeLock only serializes updates.
+ */
 static Spinlock ktimeLock;
-static uint64_t ktimeLastEpoch;
-static uint64_t ktimeLastTSC;
+static TimePage *ktimePage;
 uint64_t ticksPerSecond;
 
 static const char *dayOfWeek[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
@@ -26,11 +31,27 @@ void
 KTime_Init()
 {
     Spinlock_Init(&ktimeLock, "KTime Lock", SPINLOCK_TYPE_NORMAL);
-    ktimeLastEpoch = 0;
-    ktimeLastTSC = 0;
+
+    // Shared with user processes so it must be a page of its own
+    ktimePage = PAlloc_AllocPage();
+    if (!ktimePage)
+	Panic("KTime: Unable to allocate time page!\n");
+
+    ktimePage->seq = 0;
     ticksPerSecond = 0;
 }
 
+/**
+ * KTime_GetPage --
+ *
+ * @return The time page for mapping into user processes.
+ */
+void *
+KTime_GetPage()
+{
+    return ktimePage;
+}
+
 static bool
 KTimeIsLeapYear(uint64_t year)
 {
@@ -163,11 +184,21 @@ void
 KTime_SetTime(UnixEpoch epoch, uint64_t tsc, uint64_t tps)
 {
     Spinlock_Lock(&ktimeLock);
-    ktimeLastEpoch = epoch;
-    ktimeLastTSC = tsc;
+    ktimePage->seq++;
+    __sync_synchronize();
+
+    ktimePage->baseTSC = tsc;
+    ktimePage->baseNS = epoch * 1000000000ULL;
+    ktimePage->nsMult = (1000000000ULL << TIMEPAGE_SHIFT) / tps;
+    // Split to avoid overflowing for TSCs faster than 4 GHz
+    ktimePage->tscMult = ((tps / 1000000000ULL) << TIMEPAGE_SHIFT) +
+	((tps % 1000000000ULL) << TIMEPAGE_SHIFT) / 1000000000ULL;
+    ktimePage->ticksPerSecond = tps;
     ticksPerSecond = tps;
-    Spinlock_Unlock(&ktimeLock);
 
+    __sync_synchronize();
+    ktimePage->seq++;
+    Spinlock_Unlock(&ktimeLock);
 }
 
 void
@@ -179,34 +210,41 @@ KTime_GetTime(KTime *tm)
 UnixEpoch
 KTime_GetEpoch()
 {
-    uint64_t tscDiff;
-    uint64_t epoch;
-
-    Spinlock_Lock(&ktimeLock);
-    tscDiff = Time_GetTSC() - ktimeLastTSC;
-    epoch = ktimeLastEpoch + tscDiff / ticksPerSecond;
-    Spinlock_Unlock(&ktimeLock);
-
-    return epoch;
+    return KTime_GetEpochNS() / 1000000000ULL;
 }
 
 UnixEpochNS
 KTime_GetEpochNS()
 {
-    uint64_t tscDiff;
-    uint64_t epoch;
+    return TimePage_GetNS(ktimePage);
+}
 
-    Spinlock_Lock(&ktimeLock);
-    tscDiff = Time_GetTSC() - ktimeLastTSC;
-    /*
-     * This is ugly but it avoids overflowing tscDiff to time computation.  
-     * Note that the bottom bits of ticksPerSecond are not significant so it is 
-     * okay to discard them.
-     */
-    epoch = (ktimeLastEpoch * 1000000000ULL) + (tscDiff * 1000000ULL / ticksPerSecond * 1000ULL);
-    Spinlock_Unlock(&ktimeLock);
+/**
+ * KTime_EpochNSToTSC --
+ *
+ * Convert a wall clock time into the TSC value at which it is reached.
+ *
+ * @param [in] epoch Time in nanoseconds since the epoch.
+ * @return TSC value, times in the past return the last synchronization point.
+ */
+uint64_t
+KTime_EpochNSToTSC(UnixEpochNS epoch)
+{
+    uint64_t seq;
+    uint64_t tsc;
+
+    do {
+	seq = ktimePage->seq;
+	TIMEPAGE_BARRIER();
+	if (epoch <= ktimePage->baseNS)
+	    tsc = ktimePage->baseTSC;
+	else
+	    tsc = ktimePage->baseTSC +
+		  TimePage_Scale(epoch - ktimePage->baseNS, ktimePage->tscMult);
+	TIMEPAGE_BARRIER();
+    } while ((seq & 1) != 0 || seq != ktimePage->seq);
 
-    return epoch;
+    return tsc;
 }
 
 static void
@@ -230,6 +268,9 @@ static void
 Debug_Ticks()
 {
     kprintf("Ticks Per Second: %lu\n", ticksPerSecond);
+    kprintf("NS Multiplier: %lu (>> %d)\n", ktimePage->nsMult, TIMEPAGE_SHIFT);
+    kprintf("TSC Multiplier: %lu (>> %d)\n", ktimePage->tscMult, TIMEPAGE_SHIFT);
+    kprintf("Sequence: %lu\n", ktimePage->seq);
 }
 
 REGISTER_DBGCMD(ticks, "Print ticks per second", Debug_Ticks);
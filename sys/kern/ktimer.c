@@ -4,19 +4,53 @@
 #include <stdint.h>
 
 #include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/kdebug.h>
 #include <sys/queue.h>
 #include <sys/spinlock.h>
 #include <sys/kmem.h>
 #include <sys/mp.h>
 #include <sys/ktime.h>
 #include <sys/ktimer.h>
+#include <sys/clockevent.h>
 
-#define TIMER_WHEEL_LENGTH	256
+#include <machine/mp.h>
 
-static int timerHead = 0;
-static uint64_t timerNow = 0;
-static LIST_HEAD(TimerWheelHead, KTimerEvent) timerSlot[TIMER_WHEEL_LENGTH];
-static Spinlock timerLock;
+/*
+ * Timer Wheels
+ *
+ * Each CPU has a hierarchical timer wheel and timer callbacks run on the CPU 
+ * that created the event.  Time is divided into wheel ticks of 
+ * 2^KTIMER_SHIFT ns.  Level 0 has one slot per tick, and each slot of level n 
+ * covers all of level n-1.  Events are placed in the lowest level that can 
+ * hold them and are cascaded down a level whenever the wheel reaches the start 
+ * of their slot.  The occupancy bitmaps let us find the next event, and skip 
+ * over idle periods, without visiting empty slots.
+ */
+
+#define KTIMER_SHIFT		16	/* 65.536 us per wheel tick */
+#define KTIMER_LEVELBITS	6
+#define KTIMER_SLOTS		(1 << KTIMER_LEVELBITS)
+#define KTIMER_MASK		(KTIMER_SLOTS - 1)
+#define KTIMER_LEVELS		5	/* Spans about 19.5 hours */
+#define KTIMER_SPAN		(1ULL << (KTIMER_LEVELS * KTIMER_LEVELBITS))
+#define KTIMER_NEVER		0xFFFFFFFFFFFFFFFFULL
+
+// Round up so that events never fire before their deadline
+#define KTIMER_TICKS(_ns)	(((_ns) + (1ULL << KTIMER_SHIFT) - 1) >> KTIMER_SHIFT)
+
+LIST_HEAD(KTimerQueue, KTimerEvent);
+
+typedef struct KTimerWheel {
+    Spinlock		lock;
+    uint64_t		base;			// Next wheel tick to process
+    uint64_t		occupied[KTIMER_LEVELS];
+    struct KTimerQueue	slot[KTIMER_LEVELS][KTIMER_SLOTS];
+    uint64_t		fired;
+    uint64_t		cascaded;
+} KTimerWheel;
+
+static KTimerWheel timerWheel[MAX_CPUS];
 static Slab timerSlab;
 
 DEFINE_SLAB(KTimerEvent, &timerSlab);
@@ -24,35 +58,167 @@ DEFINE_SLAB(KTimerEvent, &timerSlab);
 void
 KTimer_Init()
 {
-    int i;
+    int c, l, s;
+    uint64_t now;
 
-    Spinlock_Init(&timerLock, "KTimer Lock", SPINLOCK_TYPE_NORMAL);
     Slab_Init(&timerSlab, "KTimerEvent Slab", sizeof(KTimerEvent), 16);
 
-    // Initialize wheel
-    timerHead = 0;
-    timerNow = KTime_GetEpoch();
-    for (i = 0; i < TIMER_WHEEL_LENGTH; i++) {
-	LIST_INIT(&timerSlot[i]);
+    now = KTime_GetEpochNS() >> KTIMER_SHIFT;
+    for (c = 0; c < MAX_CPUS; c++) {
+	KTimerWheel *w = &timerWheel[c];
+
+	Spinlock_Init(&w->lock, "KTimer Wheel Lock", SPINLOCK_TYPE_NORMAL);
+	w->base = now;
+	w->fired = 0;
+	w->cascaded = 0;
+	for (l = 0; l < KTIMER_LEVELS; l++) {
+	    w->occupied[l] = 0;
+	    for (s = 0; s < KTIMER_SLOTS; s++) {
+		LIST_INIT(&w->slot[l][s]);
+	    }
+	}
+    }
+}
+
+/**
+ * KTimerInsert --
+ *
+ * Place an event in the lowest level whose range covers its deadline.  Events 
+ * beyond the range of the wheel wait in the last slot of the top level and are 
+ * reinserted when it cascades.
+ */
+static void
+KTimerInsert(KTimerWheel *w, KTimerEvent *evt)
+{
+    int l;
+    uint64_t expires = KTIMER_TICKS(evt->deadline);
+    uint64_t delta;
+
+    if (expires < w->base)
+	expires = w->base;
+    delta = expires - w->base;
+    if (delta >= KTIMER_SPAN)
+	expires = w->base + KTIMER_SPAN - 1;
+
+    for (l = 0; l < KTIMER_LEVELS - 1; l++) {
+	if (delta < (1ULL << ((l + 1) * KTIMER_LEVELBITS)))
+	    break;
+    }
+
+    evt->level = l;
+    evt->slot = (expires >> (l * KTIMER_LEVELBITS)) & KTIMER_MASK;
+    evt->queued = true;
+    LIST_INSERT_HEAD(&w->slot[l][evt->slot], evt, timerQueue);
+    w->occupied[l] |= 1ULL << evt->slot;
+}
+
+static void
+KTimerRemove(KTimerWheel *w, KTimerEvent *evt)
+{
+    LIST_REMOVE(evt, timerQueue);
+    evt->queued = false;
+    if (LIST_EMPTY(&w->slot[evt->level][evt->slot]))
+	w->occupied[evt->level] &= ~(1ULL << evt->slot);
+}
+
+/**
+ * KTimerNextTick --
+ *
+ * Find the next wheel tick at which a level 0 slot must run or a higher level 
+ * slot must be cascaded.  Slots before the current index belong to the next 
+ * rotation.  Higher level slots are cascaded at the start of their range, so 
+ * the current slot is only due if we are exactly at that boundary.
+ *
+ * @return Wheel tick or KTIMER_NEVER if the wheel is empty.
+ */
+static uint64_t
+KTimerNextTick(KTimerWheel *w)
+{
+    int l;
+    int shift;
+    uint64_t pos, cur, ahead, tick;
+    uint64_t next = KTIMER_NEVER;
+
+    for (l = 0; l < KTIMER_LEVELS; l++) {
+	if (w->occupied[l] == 0)
+	    continue;
+
+	shift = l * KTIMER_LEVELBITS;
+	pos = w->base >> shift;
+	cur = pos & KTIMER_MASK;
+
+	ahead = w->occupied[l] & (~0ULL << cur);
+	if (l != 0 && (w->base & ((1ULL << shift) - 1)) != 0)
+	    ahead &= ~(1ULL << cur);
+
+	if (ahead != 0) {
+	    tick = (pos & ~(uint64_t)KTIMER_MASK) | __builtin_ctzll(ahead);
+	} else {
+	    tick = ((pos & ~(uint64_t)KTIMER_MASK) + KTIMER_SLOTS) |
+		   __builtin_ctzll(w->occupied[l]);
+	}
+	tick <<= shift;
+
+	if (tick < next)
+	    next = tick;
     }
+
+    return next;
 }
 
+static void
+KTimerCascade(KTimerWheel *w, int level, int slot)
+{
+    KTimerEvent *evt;
+    struct KTimerQueue *q = &w->slot[level][slot];
+
+    while ((evt = LIST_FIRST(q)) != NULL) {
+	LIST_REMOVE(evt, timerQueue);
+	KTimerInsert(w, evt);
+	w->cascaded++;
+    }
+
+    // Reinsertion never targets the slot being cascaded
+    w->occupied[level] &= ~(1ULL << slot);
+}
+
+/**
+ * KTimer_Create --
+ *
+ * Create a timer event on the current CPU's wheel.
+ *
+ * @param [in] timeout Time from now in nanoseconds.
+ * @param [in] cb Callback to run on this CPU when the timer expires.
+ * @param [in] arg Callback argument.
+ *
+ * @return Timer event with a reference held for the caller.
+ */
 KTimerEvent *
 KTimer_Create(uint64_t timeout, KTimerCB cb, void *arg)
 {
-    int slot;
+    uint64_t deadline;
+    KTimerWheel *w;
     KTimerEvent *evt = KTimerEvent_Alloc();
 
+    if (evt == NULL)
+	return NULL;
+
     evt->refCount = 2; // One for the wheel and one for the callee
-    evt->timeout = timerNow + timeout;
+    evt->deadline = KTime_GetEpochNS() + timeout;
     evt->cb = cb;
     evt->arg = arg;
 
-    Spinlock_Lock(&timerLock);
-    slot = (timerHead + timeout + TIMER_WHEEL_LENGTH - 1) % TIMER_WHEEL_LENGTH;
-    // XXX: should insert into tail
-    LIST_INSERT_HEAD(&timerSlot[slot], evt, timerQueue);
-    Spinlock_Unlock(&timerLock);
+    Critical_Enter();
+    evt->cpu = CPU();
+    w = &timerWheel[evt->cpu];
+
+    Spinlock_Lock(&w->lock);
+    KTimerInsert(w, evt);
+    Spinlock_Unlock(&w->lock);
+
+    deadline = KTime_EpochNSToTSC(KTIMER_TICKS(evt->deadline) << KTIMER_SHIFT);
+    ClockEvent_Schedule(evt->cpu, deadline);
+    Critical_Exit();
 
     return evt;
 }
@@ -73,47 +239,130 @@ KTimer_Release(KTimerEvent *evt)
     }
 }
 
-void
+/**
+ * KTimer_Cancel --
+ *
+ * Cancel a pending timer.  Only the owning CPU's wheel is locked.
+ *
+ * @param [in] evt Timer event.
+ *
+ * @retval true if the timer was cancelled before it fired.
+ * @retval false if the callback has run or is about to run.
+ */
+bool
 KTimer_Cancel(KTimerEvent *evt)
 {
-    Spinlock_Lock(&timerLock);
+    bool cancelled = false;
+    KTimerWheel *w = &timerWheel[evt->cpu];
 
-    LIST_REMOVE(evt, timerQueue);
-    KTimer_Release(evt);
+    Spinlock_Lock(&w->lock);
+    if (evt->queued) {
+	KTimerRemove(w, evt);
+	cancelled = true;
+    }
+    Spinlock_Unlock(&w->lock);
+
+    if (cancelled)
+	KTimer_Release(evt);
 
-    Spinlock_Unlock(&timerLock);
+    return cancelled;
 }
 
+/**
+ * KTimer_Process --
+ *
+ * Advance the local wheel to the current time and run expired callbacks.  
+ * Callbacks run without the wheel lock held so they may create or cancel 
+ * timers.
+ */
 void
 KTimer_Process()
 {
     uint64_t now;
+    uint64_t next;
+    int l;
+    KTimerEvent *evt;
+    struct KTimerQueue expired;
+    KTimerWheel *w = &timerWheel[CPU()];
 
-    if (CPU() != 0) {
-	return;
-    }
+    LIST_INIT(&expired);
+    now = KTime_GetEpochNS() >> KTIMER_SHIFT;
 
-    now = KTime_GetEpoch();
+    Spinlock_Lock(&w->lock);
+    while (w->base <= now) {
+	next = KTimerNextTick(w);
+	if (next > now) {
+	    w->base = now + 1;
+	    break;
+	}
+	w->base = next;
 
-    Spinlock_Lock(&timerLock);
+	// Cascade every level whose slot starts at this tick
+	for (l = 1; l < KTIMER_LEVELS; l++) {
+	    int shift = l * KTIMER_LEVELBITS;
 
-    while (now > timerNow) {
-	KTimerEvent *it, *tmp;
+	    if ((w->base & ((1ULL << shift) - 1)) != 0)
+		break;
+	    KTimerCascade(w, l, (w->base >> shift) & KTIMER_MASK);
+	}
 
-	// Dispatch pending timer events
-	LIST_FOREACH_SAFE(it, &timerSlot[timerHead], timerQueue, tmp) {
-	    if (it->timeout <= now) {
-		(it->cb)(it->arg);
-		LIST_REMOVE(it, timerQueue);
-		KTimer_Release(it);
-	    }
+	while ((evt = LIST_FIRST(&w->slot[0][w->base & KTIMER_MASK])) != NULL) {
+	    KTimerRemove(w, evt);
+	    LIST_INSERT_HEAD(&expired, evt, timerQueue);
 	}
 
-	// Rotate wheel forward
-	timerNow = timerNow + 1;
-	timerHead = (timerHead + 1) % TIMER_WHEEL_LENGTH;
+	w->base++;
     }
+    Spinlock_Unlock(&w->lock);
 
-    Spinlock_Unlock(&timerLock);
+    while ((evt = LIST_FIRST(&expired)) != NULL) {
+	LIST_REMOVE(evt, timerQueue);
+	w->fired++;
+	(evt->cb)(evt->arg);
+	KTimer_Release(evt);
+    }
+}
+
+/**
+ * KTimer_NextDeadline --
+ *
+ * Find when the local wheel next needs to be processed.  This is the start of 
+ * the next occupied slot, so it may be slightly before the earliest event or 
+ * be a cascade that fires nothing.
+ *
+ * @return TSC value of the next deadline or CLOCKEVENT_NONE if no timers are 
+ * pending.
+ */
+uint64_t
+KTimer_NextDeadline()
+{
+    uint64_t next;
+    KTimerWheel *w = &timerWheel[CPU()];
+
+    Spinlock_Lock(&w->lock);
+    next = KTimerNextTick(w);
+    Spinlock_Unlock(&w->lock);
+
+    if (next == KTIMER_NEVER)
+	return CLOCKEVENT_NONE;
+
+    return KTime_EpochNSToTSC(next << KTIMER_SHIFT);
 }
 
+static void
+Debug_KTimer(int argc, const char *argv[])
+{
+    int c, l;
+
+    for (c = 0; c < MP_GetCPUs(); c++) {
+	KTimerWheel *w = &timerWheel[c];
+
+	kprintf("CPU %d: Fired %lu Cascaded %lu\n", c, w->fired, w->cascaded);
+	for (l = 0; l < KTIMER_LEVELS; l++) {
+	    kprintf("    Level %d: %016llx\n", l, w->occupied[l]);
+	}
+    }
+}
+
+REGISTER_DBGCMD(ktimer, "Display per-CPU timer wheels", Debug_KTimer);
+
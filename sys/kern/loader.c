@@ -8,11 +8,16 @@
 #include <string.h>
 
 #include <sys/kassert.h>
+#include <sys/kdebug.h>
 #include <sys/sysctl.h>
 #include <sys/kmem.h>
 #include <sys/queue.h>
 #include <sys/disk.h>
 #include <sys/elf64.h>
+#include <sys/mman.h>
+#include <sys/vm.h>
+#include <sys/ktime.h>
+#include <sys/timepage.h>
 
 #include <machine/amd64.h>
 #include <machine/trap.h>
@@ -122,26 +127,75 @@ LoaderZeroSegment(AS *as, uintptr_t vaddr, uintptr_t len)
     }
 }
 
+/*
+ * Executable images are kept in a small cache of preloaded address spaces.  
+ * Spawning a program that is already cached clones the image instead of 
+ * reading the binary from disk, read-only text is shared by all processes and 
+ * writable data is copy on write.  Images are identified by their inode and 
+ * size, since the file system does not track modification times.
+ */
+#define LOADER_MAX_IMAGES	8
+
+typedef struct LoaderImage {
+    VFS			*vfs;
+    ino_t		ino;
+    off_t		size;
+    uintptr_t		entry;
+    uint64_t		pages;
+    uint64_t		refCount;
+    uint64_t		lastUse;
+    AS			*space;
+} LoaderImage;
+
+static Spinlock imageLock;
+static LoaderImage *imageCache[LOADER_MAX_IMAGES];
+static uint64_t imageClock;
+static uint64_t imageGen;	    // Bumped by Loader_Invalidate
+static uint64_t imageHits;
+static uint64_t imageMisses;
+
+static uint64_t LoaderImageReclaim();
+
+void
+Loader_Init()
+{
+    Spinlock_Init(&imageLock, "Loader Image Lock", SPINLOCK_TYPE_NORMAL);
+    PAlloc_AddReclaimHook(&LoaderImageReclaim);
+}
+
+static uint64_t
+LoaderProtFromFlags(Elf64_Word flags)
+{
+    uint64_t prot = PROT_NONE;
+
+    if (flags & PF_R)
+	prot |= PROT_READ;
+    if (flags & PF_W)
+	prot |= PROT_WRITE;
+    if (flags & PF_X)
+	prot |= PROT_EXEC;
+
+    return prot;
+}
+
 /**
- * Loader_Load --
+ * LoaderLoadImage --
  *
- * Load the ELF binary into the process belonging to the thread.
+ * Load the segments of an ELF binary into an address space.  All regions are 
+ * mapped before any page is populated so that pages shared by two segments 
+ * receive the combined permissions.
  */
-bool
-Loader_Load(Thread *thr, VNode *vn, void *buf, uint64_t len)
+static bool
+LoaderLoadImage(AS *as, VNode *vn, void *buf, uint64_t *pages)
 {
     int i;
     const Elf64_Ehdr *ehdr;
     const Elf64_Phdr *phdr;
-    AS *as = thr->space;
 
     ehdr = (const Elf64_Ehdr *)(buf);
     phdr = (const Elf64_Phdr *)(buf + ehdr->e_phoff);
 
-    if (!Loader_CheckHeader(ehdr)) {
-	Log(loader, "Not a valid executable!\n");
-	return false;
-    }
+    *pages = 0;
 
     Log(loader, "%8s %16s %8s %8s\n", "Offset", "VAddr", "FileSize", "MemSize");
     for (i = 0; i < ehdr->e_phnum; i++)
@@ -157,32 +211,307 @@ Loader_Load(Thread *thr, VNode *vn, void *buf, uint64_t len)
 	    va = va & ~(uint64_t)PGMASK;
 	    memsz += phdr[i].p_vaddr - va;
 
-	    Log(loader, "AllocMap %016llx %08llx\n", va, memsz);
-	    if (!PMap_AllocMap(as, va, memsz, PTE_W)) {
-		// XXX: Cleanup!
-		ASSERT(false);
+	    Log(loader, "Map %016llx %08llx\n", va, memsz);
+	    // Adjacent segments may share a page
+	    if (!VM_Map(as, va, memsz, LoaderProtFromFlags(phdr[i].p_flags),
+			VM_MAP_OVERLAP))
+		return false;
+	    *pages += ROUNDUP(memsz, PGSIZE) / PGSIZE;
+	}
+    }
+
+    for (i = 0; i < ehdr->e_phnum; i++) {
+	if (phdr[i].p_type == PT_LOAD) {
+	    if (!VM_Populate(as, phdr[i].p_vaddr, phdr[i].p_memsz))
 		return false;
+	    LoaderLoadSegment(as, vn, phdr[i].p_vaddr, phdr[i].p_offset,
+			      phdr[i].p_filesz);
+	    if (phdr[i].p_filesz <= phdr[i].p_memsz) {
+		LoaderZeroSegment(as, phdr[i].p_filesz+phdr[i].p_vaddr,
+				  phdr[i].p_memsz - phdr[i].p_filesz);
 	    }
 	}
     }
 
-    PMap_AllocMap(as, MEM_USERSPACE_STKBASE, MEM_USERSPACE_STKLEN, PTE_W);
+    return true;
+}
 
-    for (i = 0; i < ehdr->e_phnum; i++) {
-    if (phdr[i].p_type == PT_LOAD) {
-        LoaderLoadSegment(as, vn, phdr[i].p_vaddr, phdr[i].p_offset, phdr[i].p_filesz);
-        if (phdr[i].p_filesz <= phdr[i].p_memsz) {
-            LoaderZeroSegment(as, phdr[i].p_filesz+phdr[i].p_vaddr, phdr[i].p_memsz - phdr[i].p_filesz);
-        }
-        }
+/**
+ * LoaderImageRelease --
+ *
+ * Drop a reference to an image and destroy it once it is unused.
+ *
+ * @return Number of pages the image held if it was destroyed, otherwise 0.
+ */
+static uint64_t
+LoaderImageRelease(LoaderImage *img)
+{
+    uint64_t pages = img->pages;
+
+    if (__sync_sub_and_fetch(&img->refCount, 1) != 0)
+	return 0;
+
+    PMap_DestroyAS(img->space);
+    Malloc_Free(kernelHeap, img);
+
+    return pages;
+}
+
+/**
+ * LoaderImageLookup --
+ *
+ * Find a cached image and take a reference to it.
+ *
+ * @retval NULL if the image is not cached.
+ */
+static LoaderImage *
+LoaderImageLookup(VFS *vfs, const struct stat *sb)
+{
+    int i;
+    LoaderImage *img = NULL;
+
+    Spinlock_Lock(&imageLock);
+    for (i = 0; i < LOADER_MAX_IMAGES; i++) {
+	LoaderImage *it = imageCache[i];
+	if (it != NULL && it->vfs == vfs && it->ino == sb->st_ino &&
+	    it->size == sb->st_size) {
+	    img = it;
+	    __sync_fetch_and_add(&img->refCount, 1);
+	    img->lastUse = ++imageClock;
+	    break;
+	}
+    }
+    Spinlock_Unlock(&imageLock);
+
+    return img;
+}
+
+/**
+ * LoaderImageInsert --
+ *
+ * Add an image to the cache evicting the least recently used image if the 
+ * cache is full.  If another thread raced us to load the same image, or a 
+ * file was written since gen was sampled, ours is left uncached.
+ */
+static void
+LoaderImageInsert(LoaderImage *img, uint64_t gen)
+{
+    int i;
+    int slot = -1;
+    LoaderImage *victim = NULL;
+
+    Spinlock_Lock(&imageLock);
+    if (gen != imageGen) {
+	Spinlock_Unlock(&imageLock);
+	return;
+    }
+    for (i = 0; i < LOADER_MAX_IMAGES; i++) {
+	LoaderImage *it = imageCache[i];
+	// Prefer empty slots
+	if (it == NULL) {
+	    slot = i;
+	    continue;
+	}
+	if (it->vfs == img->vfs && it->ino == img->ino &&
+	    it->size == img->size) {
+	    Spinlock_Unlock(&imageLock);
+	    return;
+	}
+	if (slot == -1 ||
+	    (imageCache[slot] != NULL && it->lastUse < imageCache[slot]->lastUse))
+	    slot = i;
+    }
+
+    victim = imageCache[slot];
+    __sync_fetch_and_add(&img->refCount, 1);
+    img->lastUse = ++imageClock;
+    imageCache[slot] = img;
+    Spinlock_Unlock(&imageLock);
+
+    if (victim)
+	LoaderImageRelease(victim);
+}
+
+/**
+ * LoaderImageCreate --
+ *
+ * Load an executable into a new image that is never run itself.
+ *
+ * @retval NULL if we ran out of memory.
+ */
+static LoaderImage *
+LoaderImageCreate(VNode *vn, const struct stat *sb, void *buf)
+{
+    LoaderImage *img;
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)buf;
+
+    img = Malloc_Alloc(kernelHeap, sizeof(*img));
+    if (!img)
+	return NULL;
+
+    memset(img, 0, sizeof(*img));
+    img->vfs = vn->vfs;
+    img->ino = sb->st_ino;
+    img->size = sb->st_size;
+    img->entry = ehdr->e_entry;
+    img->refCount = 1;
+    img->space = PMap_NewAS();
+    if (!img->space) {
+	Malloc_Free(kernelHeap, img);
+	return NULL;
+    }
+
+    if (!LoaderLoadImage(img->space, vn, buf, &img->pages)) {
+	Log(loader, "Failed to load image!\n");
+	LoaderImageRelease(img);
+	return NULL;
+    }
+
+    return img;
+}
+
+/**
+ * LoaderImageReclaim --
+ *
+ * PAlloc reclaim hook that drops all cached images.
+ */
+static uint64_t
+LoaderImageReclaim()
+{
+    int i;
+    uint64_t pages = 0;
+    LoaderImage *imgs[LOADER_MAX_IMAGES];
+
+    Spinlock_Lock(&imageLock);
+    for (i = 0; i < LOADER_MAX_IMAGES; i++) {
+	imgs[i] = imageCache[i];
+	imageCache[i] = NULL;
+    }
+    Spinlock_Unlock(&imageLock);
+
+    for (i = 0; i < LOADER_MAX_IMAGES; i++) {
+	if (imgs[i])
+	    pages += LoaderImageRelease(imgs[i]);
+    }
+
+    return pages;
+}
+
+/**
+ * Loader_Invalidate --
+ *
+ * Drop the cached image of a file that has been modified.  Called by 
+ * VFS_Write with the vnode locked, loads that are already reading the file 
+ * will not cache their image.
+ */
+void
+Loader_Invalidate(VNode *vn)
+{
+    int i;
+    struct stat sb;
+    LoaderImage *victim = NULL;
+
+    if (vn->op->stat(vn, &sb) < 0)
+	return;
+
+    Spinlock_Lock(&imageLock);
+    imageGen++;
+    for (i = 0; i < LOADER_MAX_IMAGES; i++) {
+	LoaderImage *it = imageCache[i];
+	if (it != NULL && it->vfs == vn->vfs && it->ino == sb.st_ino) {
+	    victim = it;
+	    imageCache[i] = NULL;
+	    break;
+	}
+    }
+    Spinlock_Unlock(&imageLock);
+
+    if (victim)
+	LoaderImageRelease(victim);
+}
+
+/**
+ * Loader_Load --
+ *
+ * Load the ELF binary into the process belonging to the thread.  The binary is 
+ * loaded into a cached image once and then cloned into the process.
+ */
+bool
+Loader_Load(Thread *thr, VNode *vn, void *buf, uint64_t len)
+{
+    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)buf;
+    AS *as = thr->space;
+    LoaderImage *img;
+    struct stat sb;
+    uint64_t gen;
+
+    if (!Loader_CheckHeader(ehdr)) {
+	Log(loader, "Not a valid executable!\n");
+	return false;
+    }
+
+    // An image read across a write to any file is not cached
+    gen = imageGen;
+    __sync_synchronize();
+
+    if (vn->op->stat(vn, &sb) < 0)
+	return false;
+
+    img = LoaderImageLookup(vn->vfs, &sb);
+    if (img) {
+	__sync_fetch_and_add(&imageHits, 1);
+    } else {
+	__sync_fetch_and_add(&imageMisses, 1);
+	img = LoaderImageCreate(vn, &sb, buf);
+	if (!img)
+	    return false;
+	LoaderImageInsert(img, gen);
+    }
+
+    if (!VM_CloneAS(as, img->space)) {
+	LoaderImageRelease(img);
+	return false;
     }
 
     /* Save the process entry point (i.e., _start) */
-    thr->proc->entrypoint = ehdr->e_entry;
+    thr->proc->entrypoint = img->entry;
+    LoaderImageRelease(img);
 
-    return true;
+    /*
+     * The stack is demand paged except for the top page where the kernel 
+     * places the program arguments.
+     */
+    if (!VM_Map(as, MEM_USERSPACE_STKBASE, MEM_USERSPACE_STKLEN,
+		PROT_READ|PROT_WRITE, 0))
+	return false;
+
+    // Lets libc read the time without a system call
+    if (!VM_MapShared(as, TIMEPAGE_ADDR, KTime_GetPage()))
+	return false;
+
+    return VM_Populate(as, MEM_USERSPACE_STKTOP - PGSIZE, PGSIZE);
 }
 
+static void
+Debug_LoaderImages(int argc, const char *argv[])
+{
+    int i;
+
+    kprintf("Image Cache Hits: %llu, Misses: %llu\n", imageHits, imageMisses);
+    kprintf("%-16s %-8s %-8s %-8s %s\n", "VFS", "Inode", "Size", "Pages",
+	    "Refs");
+    for (i = 0; i < LOADER_MAX_IMAGES; i++) {
+	LoaderImage *img = imageCache[i];
+	if (img == NULL)
+	    continue;
+	kprintf("%016llx %08llx %08llx %08llx %llu\n", img->vfs, img->ino,
+		img->size, img->pages, img->refCount);
+    }
+}
+
+REGISTER_DBGCMD(loaderimages, "Display the executable image cache",
+		Debug_LoaderImages);
+
 /**
  * Loader_LoadInit --
  *
@@ -197,7 +526,7 @@ Loader_LoadInit()
     void *pg;
     VNode *initvn;
 
-    pg = PAlloc_AllocPage();
+    pg = PAlloc_AllocPageNoZero();
     if (!pg)
 	Panic("Not enough memory!");
 
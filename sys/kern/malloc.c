@@ -3,10 +3,49 @@
  * All rights reserved.
  */
 
-#include <stdarg.h>
+/*
+ * Two-Level Segregated Fit (TLSF) Heap
+ *
+ * Free blocks are kept in segregated lists indexed by a first level (power of
+ * two size class) and a second level (linear subdivision of the size class).
+ * Two bitmaps record which lists are non-empty so that allocation and free
+ * are O(1).  Each heap lives in its own XMem region and grows on demand.
+ */
+
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/kdebug.h>
+#include <sys/kmem.h>
+#include <sys/ktime.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+
+#include <machine/amd64.h>
 
-#include <kassert.h>
+/* 'TLSFHEAP' */
+#define HEAP_MAGIC		0x544c534648454150ULL
+
+#define ALIGN_LOG2		4
+#define ALIGN_SIZE		(1 << ALIGN_LOG2)
+#define SL_LOG2			5
+#define SL_SIZE			(1 << SL_LOG2)
+#define FL_SHIFT		(SL_LOG2 + ALIGN_LOG2)
+#define FL_MAX			32
+#define FL_SIZE			(FL_MAX - FL_SHIFT + 1)
+#define SMALL_BLOCK_SIZE	(1 << FL_SHIFT)
+
+// Minimum growth of the heap
+#define HEAP_GROW_SIZE		(64 * 1024)
+// Largest allocation that maps to a valid first level index
+#define HEAP_MAX_ALLOC		(1ULL << (FL_MAX - 1))
+
+#define BLOCK_FLAG_FREE		0x1
+#define BLOCK_FLAGS		(ALIGN_SIZE - 1)
 
 typedef struct TLSFBlock
 {
@@ -17,44 +56,567 @@ typedef struct TLSFBlock
     struct TLSFBlock	*next;
 } TLSFBlock;
 
+#define BLOCK_HDRSIZE		__builtin_offsetof(TLSFBlock, prev)
+#define BLOCK_MINSIZE		(sizeof(TLSFBlock) - BLOCK_HDRSIZE)
+
 typedef struct Heap
 {
     uint64_t		magic;
+    XMem		*xmem;
+    char		name[HEAP_NAMELEN];
+    LIST_ENTRY(Heap)	heapList;
 
-    // Lock
+    Spinlock		lock;
 
     // Debug statistics
     uint64_t		poolSize;
     uint64_t		poolAllocs;
+    uint64_t		inUse;
+    uint64_t		peakInUse;
+    uint64_t		allocs;
+    uint64_t		frees;
+    uint64_t		failures;
+    uint64_t		allocTicks;
+    uint64_t		allocMaxTicks;
+    uint64_t		freeTicks;
+    uint64_t		freeMaxTicks;
 
     // Free list
     uint32_t		flVector;
     uint32_t		slVector[FL_SIZE];
-    struct TLSFBlock	*blocks[SL_SIZE][FL_SIZE];
+    struct TLSFBlock	*blocks[FL_SIZE][SL_SIZE];
+
+    // Sentinel block at the end of the heap
+    struct TLSFBlock	*lastBlock;
 } Heap;
 
+static Spinlock heapListLock;
+LIST_HEAD(HeapListHead, Heap) heapList = LIST_HEAD_INITIALIZER(heapList);
+
+Heap *kernelHeap;
+
+static inline int
+MallocFLS(uint64_t x)
+{
+    return 63 - __builtin_clzll(x);
+}
+
+static inline int
+MallocFFS(uint32_t x)
+{
+    return __builtin_ctz(x);
+}
+
+static inline uint64_t
+BlockSize(TLSFBlock *b)
+{
+    return b->size & ~(uint64_t)BLOCK_FLAGS;
+}
+
+static inline bool
+BlockIsFree(TLSFBlock *b)
+{
+    return (b->size & BLOCK_FLAG_FREE) != 0;
+}
+
+static inline TLSFBlock *
+BlockNext(TLSFBlock *b)
+{
+    return (TLSFBlock *)((uintptr_t)b + BLOCK_HDRSIZE + BlockSize(b));
+}
+
+static inline void *
+BlockToPtr(TLSFBlock *b)
+{
+    return (void *)((uintptr_t)b + BLOCK_HDRSIZE);
+}
+
+static inline TLSFBlock *
+PtrToBlock(void *buf)
+{
+    return (TLSFBlock *)((uintptr_t)buf - BLOCK_HDRSIZE);
+}
+
+/**
+ * MallocMapping --
+ *
+ * Compute the first and second level indices of a block size.
+ */
+static inline void
+MallocMapping(uint64_t size, int *fl, int *sl)
+{
+    int f;
+
+    if (size < SMALL_BLOCK_SIZE) {
+	*fl = 0;
+	*sl = size / (SMALL_BLOCK_SIZE / SL_SIZE);
+    } else {
+	f = MallocFLS(size);
+	*sl = (int)(size >> (f - SL_LOG2)) ^ SL_SIZE;
+	*fl = f - (FL_SHIFT - 1);
+    }
+}
+
+/**
+ * MallocMappingSearch --
+ *
+ * Round the size up to the next list boundary so that any block on the
+ * resulting list is large enough.
+ */
+static inline void
+MallocMappingSearch(uint64_t size, int *fl, int *sl)
+{
+    if (size >= SMALL_BLOCK_SIZE)
+	size += (1ULL << (MallocFLS(size) - SL_LOG2)) - 1;
+
+    MallocMapping(size, fl, sl);
+}
+
+static void
+MallocInsertBlock(Heap *heap, TLSFBlock *b)
+{
+    int fl, sl;
+
+    MallocMapping(BlockSize(b), &fl, &sl);
+
+    b->prev = NULL;
+    b->next = heap->blocks[fl][sl];
+    if (b->next)
+	b->next->prev = b;
+    heap->blocks[fl][sl] = b;
+
+    heap->flVector |= (1U << fl);
+    heap->slVector[fl] |= (1U << sl);
+}
+
+static void
+MallocRemoveBlock(Heap *heap, TLSFBlock *b)
+{
+    int fl, sl;
+
+    MallocMapping(BlockSize(b), &fl, &sl);
+
+    if (b->next)
+	b->next->prev = b->prev;
+    if (b->prev)
+	b->prev->next = b->next;
+    else
+	heap->blocks[fl][sl] = b->next;
+
+    if (heap->blocks[fl][sl] == NULL) {
+	heap->slVector[fl] &= ~(1U << sl);
+	if (heap->slVector[fl] == 0)
+	    heap->flVector &= ~(1U << fl);
+    }
+}
+
+/**
+ * MallocFindBlock --
+ *
+ * Find a free block at least size bytes long and remove it from the free
+ * lists.
+ */
+static TLSFBlock *
+MallocFindBlock(Heap *heap, uint64_t size)
+{
+    int fl, sl;
+    uint32_t slMap, flMap;
+    TLSFBlock *b;
+
+    MallocMappingSearch(size, &fl, &sl);
+    if (fl >= FL_SIZE)
+	return NULL;
+
+    slMap = heap->slVector[fl] & (~0U << sl);
+    if (slMap == 0) {
+	if (fl + 1 >= FL_SIZE)
+	    return NULL;
+	flMap = heap->flVector & (~0U << (fl + 1));
+	if (flMap == 0)
+	    return NULL;
+
+	fl = MallocFFS(flMap);
+	slMap = heap->slVector[fl];
+    }
+    sl = MallocFFS(slMap);
+
+    b = heap->blocks[fl][sl];
+    ASSERT(b != NULL && BlockSize(b) >= size);
+    MallocRemoveBlock(heap, b);
+
+    return b;
+}
+
+/**
+ * MallocSplitBlock --
+ *
+ * Trim a used block to size bytes and return the remainder to the free lists
+ * if it is large enough to hold a block.
+ */
+static void
+MallocSplitBlock(Heap *heap, TLSFBlock *b, uint64_t size)
+{
+    TLSFBlock *rest;
+    TLSFBlock *next;
+    uint64_t avail = BlockSize(b);
+
+    if (avail < size + BLOCK_HDRSIZE + BLOCK_MINSIZE)
+	return;
+
+    b->size = size | (b->size & BLOCK_FLAGS);
+
+    rest = BlockNext(b);
+    rest->prevBlock = b;
+    rest->size = (avail - size - BLOCK_HDRSIZE) | BLOCK_FLAG_FREE;
+
+    // Merge with the following block if it is free
+    next = BlockNext(rest);
+    if (BlockIsFree(next)) {
+	MallocRemoveBlock(heap, next);
+	rest->size += BLOCK_HDRSIZE + BlockSize(next);
+	next = BlockNext(rest);
+    }
+    next->prevBlock = rest;
+
+    MallocInsertBlock(heap, rest);
+}
+
+/**
+ * MallocGrow --
+ *
+ * Extend the XMem region backing the heap.  The old sentinel becomes the
+ * header of the new free block.
+ */
+static bool
+MallocGrow(Heap *heap, uint64_t size)
+{
+    uintptr_t base = XMem_GetBase(heap->xmem);
+    uintptr_t oldLen = XMem_GetLength(heap->xmem);
+    uintptr_t inc;
+    TLSFBlock *b;
+    TLSFBlock *prev;
+
+    /*
+     * The new block must be large enough to land in the list that
+     * MallocFindBlock searches, which is rounded up by one second level step.
+     */
+    inc = ROUNDUP(size + (size >> SL_LOG2) + 2 * BLOCK_HDRSIZE, PGSIZE);
+
+    if (inc < HEAP_GROW_SIZE)
+	inc = HEAP_GROW_SIZE;
+
+    if (!XMem_AllocateNoZero(heap->xmem, oldLen + inc))
+	return false;
+
+    b = heap->lastBlock;
+    ASSERT((uintptr_t)b == base + oldLen - BLOCK_HDRSIZE);
+    b->size = (inc - BLOCK_HDRSIZE) | BLOCK_FLAG_FREE;
+
+    heap->lastBlock = BlockNext(b);
+    heap->lastBlock->prevBlock = b;
+    heap->lastBlock->size = 0;
+
+    prev = b->prevBlock;
+    if (prev != NULL && BlockIsFree(prev)) {
+	MallocRemoveBlock(heap, prev);
+	prev->size += BLOCK_HDRSIZE + BlockSize(b);
+	heap->lastBlock->prevBlock = prev;
+	b = prev;
+    }
+
+    MallocInsertBlock(heap, b);
+
+    heap->poolSize += inc;
+    heap->poolAllocs++;
+
+    return true;
+}
+
+/**
+ * Malloc_Init --
+ *
+ * Create the general purpose kernel heap.
+ */
+void
+Malloc_Init()
+{
+    Spinlock_Init(&heapListLock, "Heap List Lock", SPINLOCK_TYPE_NORMAL);
+
+    kernelHeap = Malloc_Create("Kernel Heap");
+    if (kernelHeap == NULL)
+	Panic("Malloc: Cannot create the kernel heap!");
+}
+
+/**
+ * Malloc_Create --
+ *
+ * Create a new heap in its own XMem region.  The heap header is stored at the
+ * start of the region.
+ *
+ * @param [in] name Developer friendly name for debugging purposes.
+ *
+ * @retval NULL if we are out of memory or XMem regions.
+ * @return Newly created heap.
+ */
 Heap*
-Malloc_Create()
+Malloc_Create(const char *name)
 {
+    Heap *heap;
+    XMem *xmem;
+    TLSFBlock *b;
+    uintptr_t hdrLen = ROUNDUP(sizeof(Heap), ALIGN_SIZE);
+    uintptr_t len = ROUNDUP(hdrLen + HEAP_GROW_SIZE, PGSIZE);
+
+    xmem = XMem_New();
+    if (xmem == NULL)
+	return NULL;
+
+    if (!XMem_Allocate(xmem, len)) {
+	XMem_Destroy(xmem);
+	return NULL;
+    }
+
+    heap = (Heap *)XMem_GetBase(xmem);
+    memset(heap, 0, sizeof(*heap));
+    heap->magic = HEAP_MAGIC;
+    heap->xmem = xmem;
+    strncpy(&heap->name[0], name, HEAP_NAMELEN);
+    Spinlock_Init(&heap->lock, name, SPINLOCK_TYPE_NORMAL);
+    heap->poolSize = len;
+    heap->poolAllocs = 1;
+
+    // One free block spanning the region followed by the sentinel
+    b = (TLSFBlock *)((uintptr_t)heap + hdrLen);
+    b->prevBlock = NULL;
+    b->size = (len - hdrLen - 2 * BLOCK_HDRSIZE) | BLOCK_FLAG_FREE;
+
+    heap->lastBlock = BlockNext(b);
+    heap->lastBlock->prevBlock = b;
+    heap->lastBlock->size = 0;
+
+    MallocInsertBlock(heap, b);
+
+    Spinlock_Lock(&heapListLock);
+    LIST_INSERT_HEAD(&heapList, heap, heapList);
+    Spinlock_Unlock(&heapListLock);
+
+    return heap;
 }
 
+/**
+ * Malloc_Destroy --
+ *
+ * Destroy a heap and release all of its memory.  Any outstanding allocations
+ * become invalid.
+ */
 void
 Malloc_Destroy(Heap *heap)
 {
+    XMem *xmem = heap->xmem;
+
+    ASSERT(heap->magic == HEAP_MAGIC);
+
+    Spinlock_Lock(&heapListLock);
+    LIST_REMOVE(heap, heapList);
+    Spinlock_Unlock(&heapListLock);
+
+    Spinlock_Destroy(&heap->lock);
+    heap->magic = 0;
+
+    XMem_Destroy(xmem);
 }
 
+/**
+ * Malloc_Alloc --
+ *
+ * Allocate len bytes from a heap.  The memory is 16 byte aligned and not
+ * cleared.
+ *
+ * @param [in] heap Heap to allocate from.
+ * @param [in] len Length of the allocation in bytes.
+ *
+ * @retval NULL if we are out of memory.
+ * @return Newly allocated buffer.
+ */
 void*
 Malloc_Alloc(Heap *heap, uint64_t len)
 {
+    uint64_t startTSC, ticks;
+    uint64_t size;
+    TLSFBlock *b;
+
+    ASSERT(heap->magic == HEAP_MAGIC);
+
+    if (len == 0 || len > HEAP_MAX_ALLOC)
+	return NULL;
+
+    size = ROUNDUP(len, ALIGN_SIZE);
+    if (size < BLOCK_MINSIZE)
+	size = BLOCK_MINSIZE;
+
+    Spinlock_Lock(&heap->lock);
+    startTSC = Time_GetTSC();
+
+    b = MallocFindBlock(heap, size);
+    if (b == NULL && MallocGrow(heap, size))
+	b = MallocFindBlock(heap, size);
+    if (b == NULL) {
+	heap->failures++;
+	Spinlock_Unlock(&heap->lock);
+	return NULL;
+    }
+
+    b->size &= ~(uint64_t)BLOCK_FLAG_FREE;
+    MallocSplitBlock(heap, b, size);
+
+    heap->allocs++;
+    heap->inUse += BlockSize(b);
+    if (heap->inUse > heap->peakInUse)
+	heap->peakInUse = heap->inUse;
+
+    ticks = Time_GetTSC() - startTSC;
+    heap->allocTicks += ticks;
+    if (ticks > heap->allocMaxTicks)
+	heap->allocMaxTicks = ticks;
+    Spinlock_Unlock(&heap->lock);
+
+    return BlockToPtr(b);
 }
 
+/**
+ * Malloc_Free --
+ *
+ * Free a buffer allocated from the heap and coalesce it with its neighbours.
+ *
+ * @param [in] heap Heap the buffer was allocated from.
+ * @param [in] buf Buffer to free (may be NULL).
+ */
 void
 Malloc_Free(Heap *heap, void *buf)
 {
+    uint64_t startTSC, ticks;
+    TLSFBlock *b;
+    TLSFBlock *next;
+
+    ASSERT(heap->magic == HEAP_MAGIC);
+
+    if (buf == NULL)
+	return;
+
+    b = PtrToBlock(buf);
+
+    Spinlock_Lock(&heap->lock);
+    startTSC = Time_GetTSC();
+
+    ASSERT(!BlockIsFree(b));
+    heap->frees++;
+    heap->inUse -= BlockSize(b);
+    b->size |= BLOCK_FLAG_FREE;
+
+    // Coalesce with neighbouring free blocks
+    if (b->prevBlock != NULL && BlockIsFree(b->prevBlock)) {
+	TLSFBlock *prev = b->prevBlock;
+
+	MallocRemoveBlock(heap, prev);
+	prev->size += BLOCK_HDRSIZE + BlockSize(b);
+	b = prev;
+    }
+    next = BlockNext(b);
+    if (BlockIsFree(next)) {
+	MallocRemoveBlock(heap, next);
+	b->size += BLOCK_HDRSIZE + BlockSize(next);
+	next = BlockNext(b);
+    }
+    next->prevBlock = b;
+
+    MallocInsertBlock(heap, b);
+
+    ticks = Time_GetTSC() - startTSC;
+    heap->freeTicks += ticks;
+    if (ticks > heap->freeMaxTicks)
+	heap->freeMaxTicks = ticks;
+    Spinlock_Unlock(&heap->lock);
 }
 
+/**
+ * Malloc_Realloc --
+ *
+ * Resize a buffer in place.  Shrinking always succeeds, while growing only
+ * succeeds if the following block is free and large enough.  The caller must
+ * allocate a new buffer and copy the data if this fails.
+ *
+ * @param [in] heap Heap the buffer was allocated from.
+ * @param [in] buf Buffer to resize.
+ * @param [in] newlen New length of the buffer.
+ *
+ * @retval true if the buffer was resized.
+ * @retval false if there was no room to grow the buffer in place.
+ */
 bool
 Malloc_Realloc(Heap *heap, void *buf, uint64_t newlen)
 {
+    uint64_t size;
+    uint64_t oldSize;
+    TLSFBlock *b = PtrToBlock(buf);
+    TLSFBlock *next;
+
+    ASSERT(heap->magic == HEAP_MAGIC);
+
+    if (newlen > HEAP_MAX_ALLOC)
+	return false;
+
+    size = ROUNDUP(newlen, ALIGN_SIZE);
+    if (size < BLOCK_MINSIZE)
+	size = BLOCK_MINSIZE;
+
+    Spinlock_Lock(&heap->lock);
+    ASSERT(!BlockIsFree(b));
+    oldSize = BlockSize(b);
+
+    if (size > oldSize) {
+	next = BlockNext(b);
+	if (!BlockIsFree(next) ||
+	    oldSize + BLOCK_HDRSIZE + BlockSize(next) < size) {
+	    Spinlock_Unlock(&heap->lock);
+	    return false;
+	}
+
+	MallocRemoveBlock(heap, next);
+	b->size += BLOCK_HDRSIZE + BlockSize(next);
+	BlockNext(b)->prevBlock = b;
+    }
+
+    MallocSplitBlock(heap, b, size);
+
+    heap->inUse += BlockSize(b) - oldSize;
+    if (heap->inUse > heap->peakInUse)
+	heap->peakInUse = heap->inUse;
+    Spinlock_Unlock(&heap->lock);
+
+    return true;
+}
+
+static void
+Debug_MallocStats(int argc, const char *argv[])
+{
+    Heap *heap;
+
+    LIST_FOREACH(heap, &heapList, heapList) {
+	kprintf("%s\n", heap->name);
+	kprintf("    Pool Size: %llu bytes (%llu extensions)\n",
+		heap->poolSize, heap->poolAllocs);
+	kprintf("    In Use: %llu bytes (Peak %llu)\n",
+		heap->inUse, heap->peakInUse);
+	kprintf("    Allocs: %llu Frees: %llu Failures: %llu\n",
+		heap->allocs, heap->frees, heap->failures);
+	kprintf("    Alloc Latency: avg %llu max %llu ticks\n",
+		heap->allocs ? heap->allocTicks / heap->allocs : 0,
+		heap->allocMaxTicks);
+	kprintf("    Free Latency: avg %llu max %llu ticks\n",
+		heap->frees ? heap->freeTicks / heap->frees : 0,
+		heap->freeMaxTicks);
+    }
 }
 
+REGISTER_DBGCMD(mallocstats, "Kernel heap statistics", Debug_MallocStats);
+
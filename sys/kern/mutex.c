@@ -20,16 +20,23 @@
 #include <sys/mutex.h>
 #include <errno.h>
 
+#include <machine/atomic.h>
+#include <machine/amd64.h>
+#include <machine/amd64op.h>
+
 /*
  * For debugging so we can assert the owner without holding a reference to the 
- * thread.  You can access the current thread through curProc[CPU()].
+ * thread.  You can access the current thread through PERCPU_GET(curProc).
  */
-extern Thread *curProc[MAX_CPUS];
+
+/* Maximum polling rounds before a waiter goes to sleep */
+#define MTX_SPIN_MAX	4096
 
 void
 Mutex_Init(Mutex *mtx, const char *name)
 {
-    Spinlock_Init(&mtx->lock, name, SPINLOCK_TYPE_NORMAL);
+    mtx->status = MTX_STATUS_UNLOCKED;
+    mtx->owner = NULL;
     WaitChannel_Init(&mtx->chan, name);
 
     return;
@@ -38,26 +45,125 @@ Mutex_Init(Mutex *mtx, const char *name)
 void
 Mutex_Destroy(Mutex *mtx)
 {
+    ASSERT(mtx->status == MTX_STATUS_UNLOCKED);
+
     WaitChannel_Destroy(&mtx->chan);
-    Spinlock_Destroy(&mtx->lock);
     return;
 }
 
+/**
+ * MutexSpin --
+ *
+ * Spin while the owner is running on another CPU, since it is likely to 
+ * release the mutex before we could finish going to sleep.
+ *
+ * @param [in] mtx Mutex to acquire.
+ * @param [in] cur Current thread.
+ * @retval true if we acquired the mutex.
+ * @retval false if the owner is not running and we should sleep.
+ */
+static bool
+MutexSpin(Mutex *mtx, Thread *cur)
+{
+    int i;
+    Thread *owner;
+
+    for (i = 0; i < MTX_SPIN_MAX; i++) {
+	if (mtx->status == MTX_STATUS_UNLOCKED &&
+	    atomic_cas_uint64(&mtx->status, MTX_STATUS_UNLOCKED,
+			      MTX_STATUS_LOCKED) == MTX_STATUS_UNLOCKED) {
+	    mtx->owner = cur;
+	    return true;
+	}
+
+	/*
+	 * Threads are allocated from a slab so reading a stale owner is safe.  
+	 * A NULL owner means the mutex is changing hands.
+	 */
+	owner = mtx->owner;
+	if (mtx->status == MTX_STATUS_CONTENDED)
+	    return false;
+	if (owner != NULL && owner->schedState != SCHED_STATE_RUNNING)
+	    return false;
+
+	pause();
+    }
+
+    return false;
+}
+
+/**
+ * MutexLockSlow --
+ *
+ * Mark the mutex contended and sleep until the owner hands it to us.
+ *
+ * @param [in] mtx Mutex to acquire.
+ * @param [in] cur Current thread.
+ */
+static void
+MutexLockSlow(Mutex *mtx, Thread *cur) __NO_LOCK_ANALYSIS
+{
+    uint64_t status;
+
+    WaitChannel_Lock(&mtx->chan);
+    while (1) {
+	status = mtx->status;
+	if (status == MTX_STATUS_UNLOCKED) {
+	    /*
+	     * We cannot tell if other threads are asleep so stay contended and 
+	     * let the unlock take the slow path.
+	     */
+	    if (atomic_cas_uint64(&mtx->status, status,
+				  MTX_STATUS_CONTENDED) == status) {
+		mtx->owner = cur;
+		break;
+	    }
+	    continue;
+	}
+	if (status == MTX_STATUS_LOCKED &&
+	    atomic_cas_uint64(&mtx->status, status,
+			      MTX_STATUS_CONTENDED) != status) {
+	    continue;
+	}
+
+	WaitChannel_Sleep(&mtx->chan);
+
+	// Mutex_Unlock hands the mutex to us before waking us up
+	if (mtx->owner == cur)
+	    return;
+
+	WaitChannel_Lock(&mtx->chan);
+    }
+    WaitChannel_Unlock(&mtx->chan);
+}
+
 /**
  * Mutex_Lock --
  *
- * Acquires the mutex.
+ * Acquires the mutex.  Spins while the owner is running and otherwise sleeps.
  */
 void
 Mutex_Lock(Mutex *mtx)
 {
+    Thread *cur = Sched_CurrentBorrow();
+
     /*
      * You cannot hold a spinlock while trying to acquire a Mutex that may 
      * sleep!
      */
     ASSERT(Critical_Level() == 0);
+    ASSERT(mtx->owner != cur);
+
+    if (atomic_cas_uint64(&mtx->status, MTX_STATUS_UNLOCKED,
+			  MTX_STATUS_LOCKED) == MTX_STATUS_UNLOCKED) {
+	mtx->owner = cur;
+	return;
+    }
+
+    if (MutexSpin(mtx, cur))
+	return;
 
-    /* XXXFILLMEIN */
+    MutexLockSlow(mtx, cur);
 }
 
 /**
@@ -69,7 +175,11 @@ Mutex_Lock(Mutex *mtx)
 int
 Mutex_TryLock(Mutex *mtx)
 {
-    /* XXXFILLMEIN */
+    if (atomic_cas_uint64(&mtx->status, MTX_STATUS_UNLOCKED,
+			  MTX_STATUS_LOCKED) != MTX_STATUS_UNLOCKED)
+	return EBUSY;
+
+    mtx->owner = Sched_CurrentBorrow();
 
     return 0;
 }
@@ -77,12 +187,33 @@ Mutex_TryLock(Mutex *mtx)
 /**
  * Mutex_Unlock --
  *
- * Releases the user mutex.
+ * Releases the user mutex.  If threads are sleeping on the mutex ownership 
+ * passes directly to the oldest one, so a stream of new lockers cannot starve 
+ * it.
  */
 void
-Mutex_Unlock(Mutex *mtx)
+Mutex_Unlock(Mutex *mtx) __NO_LOCK_ANALYSIS
 {
-    /* XXXFILLMEIN */
+    Thread *next;
+
+    ASSERT(mtx->owner == Sched_CurrentBorrow());
+
+    mtx->owner = NULL;
+    if (atomic_cas_uint64(&mtx->status, MTX_STATUS_LOCKED,
+			  MTX_STATUS_UNLOCKED) == MTX_STATUS_LOCKED)
+	return;
+
+    WaitChannel_Lock(&mtx->chan);
+    next = TAILQ_FIRST(&mtx->chan.chanQueue);
+    if (next == NULL) {
+	mtx->status = MTX_STATUS_UNLOCKED;
+    } else {
+	if (TAILQ_NEXT(next, chanQueue) == NULL)
+	    mtx->status = MTX_STATUS_LOCKED;
+	mtx->owner = next;
+	WaitChannel_WakeLocked(&mtx->chan);
+    }
+    WaitChannel_Unlock(&mtx->chan);
 
     return;
 }
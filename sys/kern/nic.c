@@ -12,34 +12,85 @@
 #include <sys/mbuf.h>
 #include <sys/nic.h>
 #include <sys/spinlock.h>
+#include <sys/epoch.h>
+#include <sys/thread.h>
 
+// nicLock serializes updates, lookups walk the list inside an epoch
+Spinlock nicLock = SPINLOCK_INITIALIZER("NIC List", SPINLOCK_TYPE_NORMAL);
 LIST_HEAD(NICList, NIC) nicList = LIST_HEAD_INITIALIZER(nicList);
 uint64_t nextNICNo = 0;
 
 void
 NIC_AddNIC(NIC *nic)
 {
+    // The list holds the first reference
+    nic->refCount = 1;
+
+    Spinlock_Lock(&nicLock);
     nic->nicNo = nextNICNo++;
     LIST_INSERT_HEAD(&nicList, nic, entries);
+    Spinlock_Unlock(&nicLock);
 }
 
+/**
+ * NIC_RemoveNIC --
+ *
+ * Remove a NIC from the list.  Returns once all references taken by 
+ * NIC_GetByID have been released so the caller may free the NIC.
+ */
 void
 NIC_RemoveNIC(NIC *nic)
 {
+    Spinlock_Lock(&nicLock);
     LIST_REMOVE(nic, entries);
+    Spinlock_Unlock(&nicLock);
+
+    // After the grace period lookups can no longer take new references
+    Epoch_Synchronize();
+
+    while (nic->refCount != 1) {
+	Sched_Scheduler();
+    }
+    nic->refCount = 0;
 }
 
+/**
+ * NIC_GetByID --
+ *
+ * Find a NIC without taking the NIC list lock.
+ *
+ * @return The NIC with a reference held for the caller, which must be dropped 
+ * with NIC_Release.
+ * @retval NULL if no such NIC exists.
+ */
 NIC *
 NIC_GetByID(uint64_t nicNo)
 {
     NIC *n;
 
+    Epoch_Enter();
     LIST_FOREACH(n, &nicList, entries) {
 	if (n->nicNo == nicNo)
-	    return n;
+	    break;
     }
+    // The list's reference keeps the count from reaching zero here
+    if (n != NULL)
+	__sync_fetch_and_add(&n->refCount, 1);
+    Epoch_Exit();
 
-    return NULL;
+    return n;
+}
+
+/**
+ * NIC_Release --
+ *
+ * Drop a reference taken by NIC_GetByID.
+ */
+void
+NIC_Release(NIC *nic)
+{
+    ASSERT(nic->refCount > 1);
+    __sync_fetch_and_sub(&nic->refCount, 1);
 }
 
 void
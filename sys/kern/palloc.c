@@ -10,10 +10,15 @@
 
 #include <sys/cdefs.h>
 #include <sys/kassert.h>
+#include <sys/kconfig.h>
 #include <sys/kdebug.h>
 #include <sys/kmem.h>
+#include <sys/mp.h>
 #include <sys/queue.h>
 #include <sys/spinlock.h>
+#include <sys/sysctl.h>
+#include <sys/thread.h>
+#include <sys/waitchannel.h>
 
 // PGSIZE
 #include <machine/amd64.h>
@@ -34,15 +39,78 @@ typedef struct FreePage
     LIST_ENTRY(FreePage)	entries;
 } FreePage;
 
+/*
+ * Only the first page of a multi-page allocation carries the reference count 
+ * and the order of the allocation.  Free blocks in the buddy allocator are 
+ * marked by the PAGEINFO_FLAG_FREE flag on their first page.
+ */
+#define PAGEINFO_FLAG_FREE	0x0001
+
 typedef struct PageInfo
 {
     uint64_t			refCount;
+    uint32_t			flags;
+    uint32_t			order;
 } PageInfo;
 
 XMem *pageInfoXMem;
 PageInfo *pageInfoTable;
 uint64_t pageInfoLength;
-LIST_HEAD(FreeListHead, FreePage) freeList;
+uint64_t pageInfoEntries;
+
+/*
+ * Buddy allocator free lists indexed by order.  A block of order N is 2^N 
+ * physically contiguous pages aligned to its size.
+ */
+LIST_HEAD(FreeListHead, FreePage) freeList[PALLOC_MAX_ORDER + 1];
+uint64_t freeBlocks[PALLOC_MAX_ORDER + 1];
+
+/*
+ * Pre-zeroed pages.  The zero thread takes pages from the buddy allocator, 
+ * clears them and places them on this list.  Only the FreePage header at the 
+ * start of each page is dirty and must be cleared on allocation.
+ */
+struct FreeListHead zeroList;
+uint64_t zeroPages;
+static WaitChannel zeroChan;
+static volatile bool zeroSleeping;
+static uint64_t zeroTotal;
+
+extern void pagezero_nt(void *pg);
+
+/*
+ * Reclaim hooks are called when the allocator runs dry to ask other 
+ * subsystems (e.g. the slab allocator) to return memory.
+ */
+#define PALLOC_MAX_RECLAIM_HOOKS	4
+
+static PAllocReclaimHook reclaimHooks[PALLOC_MAX_RECLAIM_HOOKS];
+static int reclaimHookCount;
+static uint64_t reclaimCalls;
+static uint64_t reclaimPages;
+
+/*
+ * Per-CPU page cache.  Pages are allocated and freed from the local cache 
+ * inside a critical section without taking pallocLock.  An empty cache is 
+ * refilled from the buddy allocator up to the low watermark and a cache that 
+ * grows past the high watermark is drained back down to the low watermark.  
+ * Each cache also holds a small batch of pre-zeroed pages.
+ */
+typedef struct PAllocCache
+{
+    uint64_t			count;
+    struct FreeListHead		pages;
+    uint64_t			zcount;
+    struct FreeListHead		zpages;
+    // Statistics
+    uint64_t			allocs;
+    uint64_t			zallocs;
+    uint64_t			frees;
+    uint64_t			refills;
+    uint64_t			drains;
+} CACHELINE_ALIGNED PAllocCache;
+
+PAllocCache pallocCache[MAX_CPUS];
 
 /*
  * Initializes the page allocator
@@ -55,7 +123,18 @@ PAlloc_Init()
 
     Spinlock_Init(&pallocLock, "PAlloc Lock", SPINLOCK_TYPE_NORMAL);
 
-    LIST_INIT(&freeList);
+    for (int o = 0; o <= PALLOC_MAX_ORDER; o++) {
+	LIST_INIT(&freeList[o]);
+	freeBlocks[o] = 0;
+    }
+    for (int c = 0; c < MAX_CPUS; c++) {
+	pallocCache[c].count = 0;
+	LIST_INIT(&pallocCache[c].pages);
+	pallocCache[c].zcount = 0;
+	LIST_INIT(&pallocCache[c].zpages);
+    }
+    LIST_INIT(&zeroList);
+    zeroPages = 0;
     pageInfoXMem = NULL;
     pageInfoTable = NULL;
 }
@@ -83,6 +162,133 @@ PAlloc_LateInit()
     // Free old pages
 }
 
+/**
+ * PAllocGetInfo --
+ *
+ * Lookup the PageInfo structure for a given physical address.
+ */
+static inline PageInfo *
+PAllocGetInfo(void *pg)
+{
+    uintptr_t entry = (uintptr_t)DMVA2PA(pg) / PGSIZE;
+    return &pageInfoTable[entry];
+}
+
+/**
+ * PAllocPFNToPage --
+ *
+ * Convert a page frame number to its address in the direct map.
+ */
+static inline FreePage *
+PAllocPFNToPage(uint64_t pfn)
+{
+    return (FreePage *)DMPA2VA(pfn * PGSIZE);
+}
+
+/**
+ * PAllocBuddyFree --
+ *
+ * Return a block to the buddy allocator and coalesce it with its buddies.  The 
+ * pallocLock must be held.
+ *
+ * @param [in] pfn Page frame number of the first page in the block.
+ * @param [in] order Order of the block.
+ */
+static void
+PAllocBuddyFree(uint64_t pfn, uint64_t order)
+{
+    FreePage *pg;
+
+    ASSERT(Spinlock_IsHeld(&pallocLock));
+    ASSERT((pfn & ((1ULL << order) - 1)) == 0);
+
+    freePages += 1ULL << order;
+
+    while (order < PALLOC_MAX_ORDER) {
+	uint64_t buddy = pfn ^ (1ULL << order);
+	PageInfo *binfo;
+
+	if (buddy >= pageInfoEntries)
+	    break;
+
+	binfo = &pageInfoTable[buddy];
+	if (!(binfo->flags & PAGEINFO_FLAG_FREE) || binfo->order != order)
+	    break;
+
+	// Merge with our buddy
+	pg = PAllocPFNToPage(buddy);
+	ASSERT(pg->magic == FREEPAGE_MAGIC_FREE);
+	LIST_REMOVE(pg, entries);
+	freeBlocks[order]--;
+	binfo->flags &= ~PAGEINFO_FLAG_FREE;
+
+	pfn &= ~(1ULL << order);
+	order++;
+    }
+
+    pageInfoTable[pfn].flags |= PAGEINFO_FLAG_FREE;
+    pageInfoTable[pfn].order = order;
+
+    pg = PAllocPFNToPage(pfn);
+    pg->magic = FREEPAGE_MAGIC_FREE;
+    LIST_INSERT_HEAD(&freeList[order], pg, entries);
+    freeBlocks[order]++;
+}
+
+/**
+ * PAllocBuddyAlloc --
+ *
+ * Allocate a block from the buddy allocator, splitting a larger block if 
+ * necessary.  The pallocLock must be held.
+ *
+ * @param [in] order Order of the block to allocate.
+ *
+ * @retval NULL if no block of the requested order is available.
+ * @return First page of the block.
+ */
+static FreePage *
+PAllocBuddyAlloc(uint64_t order)
+{
+    uint64_t o;
+    uint64_t pfn;
+    FreePage *pg;
+
+    ASSERT(Spinlock_IsHeld(&pallocLock));
+
+    for (o = order; o <= PALLOC_MAX_ORDER; o++) {
+	if (!LIST_EMPTY(&freeList[o]))
+	    break;
+    }
+    if (o > PALLOC_MAX_ORDER)
+	return NULL;
+
+    pg = LIST_FIRST(&freeList[o]);
+    ASSERT(pg->magic == FREEPAGE_MAGIC_FREE);
+    LIST_REMOVE(pg, entries);
+    freeBlocks[o]--;
+
+    pfn = DMVA2PA((uintptr_t)pg) / PGSIZE;
+    pageInfoTable[pfn].flags &= ~PAGEINFO_FLAG_FREE;
+    pageInfoTable[pfn].order = order;
+
+    // Split the block and return the upper halves to the free lists
+    while (o > order) {
+	FreePage *half;
+
+	o--;
+	half = PAllocPFNToPage(pfn + (1ULL << o));
+	half->magic = FREEPAGE_MAGIC_FREE;
+	pageInfoTable[pfn + (1ULL << o)].flags |= PAGEINFO_FLAG_FREE;
+	pageInfoTable[pfn + (1ULL << o)].order = o;
+	LIST_INSERT_HEAD(&freeList[o], half, entries);
+	freeBlocks[o]++;
+    }
+
+    freePages -= 1ULL << order;
+
+    return pg;
+}
+
 /**
  * PAlloc_AddRegion --
  *
@@ -92,7 +298,7 @@ void
 PAlloc_AddRegion(uintptr_t start, uintptr_t len)
 {
     uintptr_t i;
-    FreePage *pg;
+    uint64_t pfn, endPFN;
 
     if ((start % PGSIZE) != 0)
 	Panic("Region start is not page aligned!");
@@ -113,16 +319,17 @@ PAlloc_AddRegion(uintptr_t start, uintptr_t len)
 	uintptr_t end = base + len;
 
 	pageInfoLength = ROUNDUP(end / PGSIZE * sizeof(PageInfo), PGSIZE);
+	pageInfoEntries = end / PGSIZE;
 	pageInfoTable = (PageInfo *)start;
 
 	start += pageInfoLength;
 	len -= pageInfoLength;
 
 	for (i = 0; i < (base / PGSIZE); i++) {
-	    pageInfoTable[i].refCount = 1;
+	    pageInfoTable[i] = (PageInfo){ .refCount = 1 };
 	}
 	for (i = (base / PGSIZE); i < (end / PGSIZE); i++) {
-	    pageInfoTable[i].refCount = 0;
+	    pageInfoTable[i] = (PageInfo){ .refCount = 0 };
 	}
 	for (i = 0; i < (pageInfoLength / PGSIZE); i++) {
 	    pageInfoTable[i + (base / PGSIZE)].refCount = 1;
@@ -145,69 +352,377 @@ PAlloc_AddRegion(uintptr_t start, uintptr_t len)
 
 	// Initialize new pages
 	for (i = (base / PGSIZE); i < (end / PGSIZE); i++) {
-	    pageInfoTable[i].refCount = 0;
+	    pageInfoTable[i] = (PageInfo){ .refCount = 0 };
 	}
+
+	Spinlock_Lock(&pallocLock);
+	if (newLength > pageInfoLength)
+	    pageInfoLength = newLength;
+	if ((end / PGSIZE) > pageInfoEntries)
+	    pageInfoEntries = end / PGSIZE;
+	Spinlock_Unlock(&pallocLock);
     }
 
+    /*
+     * Free the region as the largest naturally aligned blocks that fit.
+     */
+    pfn = DMVA2PA(start) / PGSIZE;
+    endPFN = pfn + len / PGSIZE;
+
     Spinlock_Lock(&pallocLock);
-    for (i = 0; i < len; i += PGSIZE)
-    {
-	pg = (void *)(start + i);
-	pg->magic = FREEPAGE_MAGIC_FREE;
+    while (pfn < endPFN) {
+	uint64_t order = PALLOC_MAX_ORDER;
 
-	totalPages++;
-	freePages++;
+	while ((pfn & ((1ULL << order) - 1)) != 0 ||
+	       (pfn + (1ULL << order)) > endPFN)
+	    order--;
 
-	LIST_INSERT_HEAD(&freeList, pg, entries);
+	totalPages += 1ULL << order;
+	PAllocBuddyFree(pfn, order);
+	pfn += 1ULL << order;
     }
     Spinlock_Unlock(&pallocLock);
 }
 
 /**
- * PAllocGetInfo --
+ * PAllocCacheRefill --
  *
- * Lookup the PageInfo structure for a given physical address.
+ * Move a batch of pages from the buddy allocator into a per-CPU cache.  Must be 
+ * called inside a critical section.
+ *
+ * @param [in] cache Per-CPU cache to refill.
  */
-static inline PageInfo *
-PAllocGetInfo(void *pg)
+static void
+PAllocCacheRefill(PAllocCache *cache)
 {
-    uintptr_t entry = (uintptr_t)DMVA2PA(pg) / PGSIZE;
-    return &pageInfoTable[entry];
+    FreePage *pg;
+    uint64_t batch = SYSCTL_GETINT(palloc_cache_low);
+
+    if (batch == 0)
+	batch = 1;
+
+    Spinlock_Lock(&pallocLock);
+    while (cache->count < batch) {
+	pg = PAllocBuddyAlloc(0);
+	if (pg == NULL)
+	    break;
+
+	LIST_INSERT_HEAD(&cache->pages, pg, entries);
+	cache->count++;
+    }
+    // Fall back to the zeroed pages if the buddy allocator is empty
+    while (cache->count < batch && zeroPages != 0) {
+	pg = LIST_FIRST(&zeroList);
+	LIST_REMOVE(pg, entries);
+	zeroPages--;
+
+	LIST_INSERT_HEAD(&cache->pages, pg, entries);
+	cache->count++;
+    }
+    cache->refills++;
+    Spinlock_Unlock(&pallocLock);
+}
+
+/**
+ * PAllocCacheRefillZero --
+ *
+ * Move a batch of pre-zeroed pages into a per-CPU cache.  Must be called inside 
+ * a critical section.
+ *
+ * @param [in] cache Per-CPU cache to refill.
+ */
+static void
+PAllocCacheRefillZero(PAllocCache *cache)
+{
+    FreePage *pg;
+    uint64_t batch = SYSCTL_GETINT(palloc_cache_low);
+
+    if (batch == 0)
+	batch = 1;
+
+    Spinlock_Lock(&pallocLock);
+    while (cache->zcount < batch && zeroPages != 0) {
+	pg = LIST_FIRST(&zeroList);
+	LIST_REMOVE(pg, entries);
+	zeroPages--;
+
+	LIST_INSERT_HEAD(&cache->zpages, pg, entries);
+	cache->zcount++;
+    }
+    Spinlock_Unlock(&pallocLock);
+}
+
+/**
+ * PAllocCacheDrain --
+ *
+ * Return pages from a per-CPU cache to the buddy allocator until the cache 
+ * holds count pages.  Must be called inside a critical section.
+ *
+ * @param [in] cache Per-CPU cache to drain.
+ * @param [in] count Number of pages to leave in the cache.
+ */
+static void
+PAllocCacheDrain(PAllocCache *cache, uint64_t count)
+{
+    FreePage *pg;
+
+    Spinlock_Lock(&pallocLock);
+    while (cache->count > count) {
+	pg = LIST_FIRST(&cache->pages);
+	LIST_REMOVE(pg, entries);
+	cache->count--;
+
+	PAllocBuddyFree(DMVA2PA((uintptr_t)pg) / PGSIZE, 0);
+    }
+    cache->drains++;
+    Spinlock_Unlock(&pallocLock);
+}
+
+/**
+ * PAlloc_AddReclaimHook --
+ *
+ * Register a callback that is invoked to free memory when the page allocator 
+ * is out of pages.  The hook returns the number of pages it released.
+ *
+ * @param [in] hook Reclaim callback.
+ */
+void
+PAlloc_AddReclaimHook(PAllocReclaimHook hook)
+{
+    Spinlock_Lock(&pallocLock);
+    ASSERT(reclaimHookCount < PALLOC_MAX_RECLAIM_HOOKS);
+    reclaimHooks[reclaimHookCount++] = hook;
+    Spinlock_Unlock(&pallocLock);
+}
+
+/**
+ * PAllocReclaim --
+ *
+ * Run the reclaim hooks.  Hooks take locks of their own and may shootdown TLB 
+ * entries on other CPUs, so they are only run if the caller holds no 
+ * spinlocks.
+ *
+ * @return Number of pages returned to the allocator.
+ */
+static uint64_t
+PAllocReclaim()
+{
+    int i;
+    uint64_t pages = 0;
+
+    if (Critical_Level() != 0)
+	return 0;
+
+    for (i = 0; i < reclaimHookCount; i++) {
+	pages += (reclaimHooks[i])();
+    }
+
+    __sync_fetch_and_add(&reclaimCalls, 1);
+    __sync_fetch_and_add(&reclaimPages, pages);
+
+    return pages;
+}
+
+/**
+ * PAllocCacheGet --
+ *
+ * Take a page from the local CPU's page cache.
+ *
+ * @param [in] zero Prefer pre-zeroed pages.
+ * @param [out] zeroed Set if the returned page was pre-zeroed.
+ *
+ * @retval NULL if no memory is available.
+ * @return Free page.
+ */
+static FreePage *
+PAllocCacheGet(bool zero, bool *zeroed)
+{
+    FreePage *pg;
+    PAllocCache *cache;
+
+    Critical_Enter();
+    cache = &pallocCache[CPU()];
+    if (zero && cache->zcount == 0 && zeroPages != 0)
+	PAllocCacheRefillZero(cache);
+
+    if (zero && cache->zcount != 0) {
+	pg = LIST_FIRST(&cache->zpages);
+	LIST_REMOVE(pg, entries);
+	cache->zcount--;
+	cache->zallocs++;
+	*zeroed = true;
+    } else {
+	if (cache->count == 0)
+	    PAllocCacheRefill(cache);
+
+	if (cache->count == 0 && cache->zcount != 0) {
+	    // Use the zeroed pages if nothing else is available
+	    pg = LIST_FIRST(&cache->zpages);
+	    LIST_REMOVE(pg, entries);
+	    cache->zcount--;
+	    *zeroed = true;
+	} else if (cache->count != 0) {
+	    pg = LIST_FIRST(&cache->pages);
+	    LIST_REMOVE(pg, entries);
+	    cache->count--;
+	    *zeroed = false;
+	} else {
+	    Critical_Exit();
+	    return NULL;
+	}
+    }
+    cache->allocs++;
+    Critical_Exit();
+
+    return pg;
+}
+
+/**
+ * PAllocGetPage --
+ *
+ * Allocate a free page running the reclaim hooks if we are out of memory.
+ *
+ * @param [in] zero Prefer pre-zeroed pages.
+ * @param [out] zeroed Set if the returned page was pre-zeroed.
+ *
+ * @retval NULL if no memory is available.
+ * @return Free page.
+ */
+static FreePage *
+PAllocGetPage(bool zero, bool *zeroed)
+{
+    FreePage *pg;
+
+    pg = PAllocCacheGet(zero, zeroed);
+    if (pg == NULL && PAllocReclaim() != 0)
+	pg = PAllocCacheGet(zero, zeroed);
+    if (pg == NULL)
+	return NULL;
+
+    ASSERT(pg->magic == FREEPAGE_MAGIC_FREE);
+
+    /*
+     * Kick the zero thread once the pool falls below half of its target.
+     */
+    if (zeroSleeping && zeroPages < SYSCTL_GETINT(palloc_zero_target) / 2) {
+	zeroSleeping = false;
+	WaitChannel_Wake(&zeroChan);
+    }
+
+    return pg;
+}
+
+/**
+ * PAllocInitPage --
+ *
+ * Setup the PageInfo structure of a newly allocated page.
+ */
+static void
+PAllocInitPage(FreePage *pg)
+{
+    PageInfo *info = PAllocGetInfo(pg);
+
+    ASSERT(info != NULL);
+    ASSERT(info->refCount == 0);
+    info->refCount = 1;
+    info->order = 0;
+
+    pg->magic = FREEPAGE_MAGIC_INUSE;
 }
 
 /**
  * PAlloc_AllocPage --
  *
  * Allocate a physical page and return the page's address in the Kernel's ident 
- * mapped memory region.
+ * mapped memory region.  Pre-zeroed pages are used when available otherwise 
+ * the page is cleared before returning.
  *
  * @retval NULL if no memory is available.
  * @return Newly allocated physical page.
  */
 void *
 PAlloc_AllocPage()
+{
+    bool zeroed;
+    FreePage *pg = PAllocGetPage(true, &zeroed);
+
+    if (pg == NULL)
+	return NULL;
+
+    PAllocInitPage(pg);
+
+    if (zeroed)
+	memset(pg, 0, sizeof(*pg));
+    else
+	memset(pg, 0, PGSIZE);
+
+    return (void *)pg;
+}
+
+/**
+ * PAlloc_AllocPageNoZero --
+ *
+ * Allocate a physical page without clearing it.  This is for callers that 
+ * overwrite the contents of the page anyway.
+ *
+ * @retval NULL if no memory is available.
+ * @return Newly allocated physical page with undefined contents.
+ */
+void *
+PAlloc_AllocPageNoZero()
+{
+    bool zeroed;
+    FreePage *pg = PAllocGetPage(false, &zeroed);
+
+    if (pg == NULL)
+	return NULL;
+
+    PAllocInitPage(pg);
+
+    return (void *)pg;
+}
+
+/**
+ * PAlloc_AllocPages --
+ *
+ * Allocate 2^order physically contiguous pages aligned to the size of the 
+ * allocation.  The pages are released as a single unit by calling 
+ * PAlloc_Release on the first page.
+ *
+ * @param [in] order Order of the allocation.
+ *
+ * @retval NULL if no contiguous block is available.
+ * @return First page of the newly allocated block.
+ */
+void *
+PAlloc_AllocPages(int order)
 {
     PageInfo *info;
     FreePage *pg;
 
+    ASSERT(order >= 0 && order <= PALLOC_MAX_ORDER);
+
+    if (order == 0)
+	return PAlloc_AllocPage();
+
     Spinlock_Lock(&pallocLock);
-    pg = LIST_FIRST(&freeList);
-    ASSERT(pg != NULL);
-    LIST_REMOVE(pg, entries);
+    pg = PAllocBuddyAlloc(order);
+    Spinlock_Unlock(&pallocLock);
 
-    ASSERT(pg->magic == FREEPAGE_MAGIC_FREE);
+    if (pg == NULL && PAllocReclaim() != 0) {
+	Spinlock_Lock(&pallocLock);
+	pg = PAllocBuddyAlloc(order);
+	Spinlock_Unlock(&pallocLock);
+    }
+
+    if (pg == NULL)
+	return NULL;
 
     info = PAllocGetInfo(pg);
-    ASSERT(info != NULL);
     ASSERT(info->refCount == 0);
-    info->refCount++;
+    info->refCount = 1;
 
-    pg->magic = FREEPAGE_MAGIC_INUSE;
-
-    freePages--;
-    Spinlock_Unlock(&pallocLock);
-
-    memset(pg, 0, PGSIZE);
+    memset(pg, 0, PGSIZE << order);
 
     return (void *)pg;
 }
@@ -215,28 +730,42 @@ PAlloc_AllocPage()
 /**
  * PAllocFreePage --
  *
- * Free a page.
+ * Free a page into the local CPU's page cache.  Multi-page blocks are returned 
+ * directly to the buddy allocator.
  */
 static void
 PAllocFreePage(void *region)
 {
     FreePage *pg = (FreePage *)region;
+    PageInfo *info = PAllocGetInfo(pg);
+    PAllocCache *cache;
 
     ASSERT(((uintptr_t)region % PGSIZE) == 0);
 
-    LIST_INSERT_HEAD(&freeList, pg, entries);
-
 #ifndef NDEBUG
     // Application can write this magic, but for
     // debug builds we can use this as a double free check.
     ASSERT(pg->magic != FREEPAGE_MAGIC_FREE);
-
-    PageInfo *info = PAllocGetInfo(pg);
     ASSERT(info->refCount == 0);
 #endif
 
+    if (info->order != 0) {
+	Spinlock_Lock(&pallocLock);
+	PAllocBuddyFree(DMVA2PA((uintptr_t)pg) / PGSIZE, info->order);
+	Spinlock_Unlock(&pallocLock);
+	return;
+    }
+
     pg->magic = FREEPAGE_MAGIC_FREE;
-    freePages++;
+
+    Critical_Enter();
+    cache = &pallocCache[CPU()];
+    LIST_INSERT_HEAD(&cache->pages, pg, entries);
+    cache->count++;
+    cache->frees++;
+    if (cache->count > SYSCTL_GETINT(palloc_cache_high))
+	PAllocCacheDrain(cache, SYSCTL_GETINT(palloc_cache_low));
+    Critical_Exit();
 }
 
 /**
@@ -249,10 +778,8 @@ PAlloc_Retain(void *pg)
 {
     PageInfo *info = PAllocGetInfo(pg);
 
-    Spinlock_Lock(&pallocLock);
     ASSERT(info->refCount != 0);
-    info->refCount++;
-    Spinlock_Unlock(&pallocLock);
+    __sync_fetch_and_add(&info->refCount, 1);
 }
 
 /**
@@ -266,20 +793,138 @@ PAlloc_Release(void *pg)
 {
     PageInfo *info = PAllocGetInfo(pg);
 
-    Spinlock_Lock(&pallocLock);
     ASSERT(info->refCount != 0);
-    info->refCount--;
-    if (info->refCount == 0)
+    if (__sync_sub_and_fetch(&info->refCount, 1) == 0)
 	PAllocFreePage(pg);
-    Spinlock_Unlock(&pallocLock);
+}
+
+/**
+ * PAlloc_RefCount --
+ *
+ * Return the reference count of a physical page.  This is used to avoid 
+ * copying copy on write pages that are no longer shared.
+ */
+uint64_t
+PAlloc_RefCount(void *pg)
+{
+    return PAllocGetInfo(pg)->refCount;
+}
+
+/**
+ * PAlloc_Split --
+ *
+ * Turn a block from PAlloc_AllocPages into independent pages that are each 
+ * released with PAlloc_Release.  The caller must hold the only reference.  The 
+ * contents of the pages are left untouched.
+ */
+void
+PAlloc_Split(void *pg)
+{
+    uint64_t i;
+    PageInfo *info = PAllocGetInfo(pg);
+    uint64_t pages = 1ULL << info->order;
+
+    ASSERT(info->refCount == 1);
+
+    for (i = 0; i < pages; i++) {
+	info[i].refCount = 1;
+	info[i].flags = 0;
+	info[i].order = 0;
+    }
+}
+
+/**
+ * PAllocZeroThread --
+ *
+ * Kernel thread that keeps the pool of pre-zeroed pages at the target size.  
+ * Pages are cleared with non-temporal stores so that we do not pollute the 
+ * caches.  The thread sleeps until the allocator drains the pool to half of its 
+ * target.
+ */
+static void
+PAllocZeroThread(void *arg)
+{
+    FreePage *pg;
+
+    while (1) {
+	while (zeroPages < SYSCTL_GETINT(palloc_zero_target)) {
+	    Spinlock_Lock(&pallocLock);
+	    pg = PAllocBuddyAlloc(0);
+	    Spinlock_Unlock(&pallocLock);
+	    if (pg == NULL)
+		break;
+
+	    pagezero_nt(pg);
+	    pg->magic = FREEPAGE_MAGIC_FREE;
+
+	    Spinlock_Lock(&pallocLock);
+	    LIST_INSERT_HEAD(&zeroList, pg, entries);
+	    zeroPages++;
+	    Spinlock_Unlock(&pallocLock);
+
+	    // Yield periodically so that we only soak up spare cycles
+	    if ((++zeroTotal % 16) == 0)
+		Sched_Scheduler();
+	}
+
+	WaitChannel_Lock(&zeroChan);
+	zeroSleeping = true;
+	WaitChannel_Sleep(&zeroChan);
+    }
+}
+
+/**
+ * PAlloc_StartZeroThread --
+ *
+ * Start the background page zeroing thread.
+ */
+void
+PAlloc_StartZeroThread()
+{
+    Thread *thr;
+
+    WaitChannel_Init(&zeroChan, "PAlloc Zero");
+
+    thr = Thread_KThreadCreate(&PAllocZeroThread, NULL);
+    if (thr == NULL) {
+	kprintf("PAlloc: Couldn't create zero thread!\n");
+	return;
+    }
+    Sched_SetPriority(thr, PRIO_IDLE);
+    Sched_SetRunnable(thr);
 }
 
 static void
 Debug_PAllocStats(int argc, const char *argv[])
 {
+    int c;
+    uint64_t cachedPages = 0;
+
+    for (c = 0; c < MAX_CPUS; c++)
+	cachedPages += pallocCache[c].count + pallocCache[c].zcount;
+
     kprintf("Total Pages: %llu\n", totalPages);
-    kprintf("Allocated Pages: %llu\n", totalPages - freePages);
+    kprintf("Allocated Pages: %llu\n",
+	    totalPages - freePages - cachedPages - zeroPages);
     kprintf("Free Pages: %llu\n", freePages);
+    kprintf("Cached Pages: %llu\n", cachedPages);
+    kprintf("Zeroed Pages: %llu (%llu zeroed in total)\n", zeroPages, zeroTotal);
+    kprintf("Reclaimed Pages: %llu (%llu calls)\n", reclaimPages, reclaimCalls);
+
+    for (c = 0; c <= PALLOC_MAX_ORDER; c++) {
+	kprintf("Order %2d: %llu free blocks\n", c, freeBlocks[c]);
+    }
+
+    for (c = 0; c < MAX_CPUS; c++) {
+	PAllocCache *cache = &pallocCache[c];
+
+	if (cache->allocs == 0 && cache->frees == 0)
+	    continue;
+
+	kprintf("CPU %d: Cached %llu/%llu Allocs %llu (%llu zeroed) Frees %llu Refills %llu Drains %llu\n",
+		c, cache->count, cache->zcount, cache->allocs, cache->zallocs,
+		cache->frees, cache->refills, cache->drains);
+    }
 }
 
 REGISTER_DBGCMD(pallocstats, "Page allocator statistics", Debug_PAllocStats);
@@ -287,12 +932,15 @@ REGISTER_DBGCMD(pallocstats, "Page allocator statistics", Debug_PAllocStats);
 static void
 Debug_PAllocDump(int argc, const char *argv[])
 {
+    int o;
     struct FreePage *it;
 
-    LIST_FOREACH(it, &freeList, entries) {
-	if (it->magic != FREEPAGE_MAGIC_FREE)
-	    kprintf("Magic Corrupted! (%lx)\n", it->magic);
-	kprintf("Free %lx\n", (uintptr_t)it);
+    for (o = 0; o <= PALLOC_MAX_ORDER; o++) {
+	LIST_FOREACH(it, &freeList[o], entries) {
+	    if (it->magic != FREEPAGE_MAGIC_FREE)
+		kprintf("Magic Corrupted! (%lx)\n", it->magic);
+	    kprintf("Free %lx (order %d)\n", (uintptr_t)it, o);
+	}
     }
 }
 
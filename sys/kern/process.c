@@ -22,7 +22,6 @@
 #include <machine/trap.h>
 #include <machine/pmap.h>
 
-extern Thread *curProc[MAX_CPUS];
 
 // Process List
 Spinlock procLock;
@@ -101,6 +100,12 @@ Process_Create(Process *parent, const char *title)
     return proc;
 }
 
+static void
+ProcessFree(void *arg)
+{
+    Slab_Free(&processSlab, arg);
+}
+
 /**
  * Process_Destroy --
  *
@@ -128,13 +133,36 @@ Process_Destroy(Process *proc)
     TAILQ_REMOVE(&processList, proc, processList);
     Spinlock_Unlock(&procLock);
 
-    Slab_Free(&processSlab, proc);
+    // Process_Lookup may still be walking past us
+    Epoch_Defer(&proc->epochEntry, ProcessFree, proc);
+}
+
+/**
+ * ProcessTryRetain --
+ *
+ * Take a reference unless the process has already dropped its last one.
+ */
+static bool
+ProcessTryRetain(Process *proc)
+{
+    uint64_t refCount;
+
+    do {
+	refCount = proc->refCount;
+	if (refCount == 0)
+	    return false;
+    } while (!__sync_bool_compare_and_swap(&proc->refCount, refCount,
+					   refCount + 1));
+
+    return true;
 }
 
 /**
  * Process_Lookup --
  *
- * Lookup a process by PID and increment its reference count.
+ * Lookup a process by PID and increment its reference count.  The process list 
+ * is walked without taking procLock, removed processes are freed only after an 
+ * epoch grace period.
  *
  * @param [in] pid Process ID to search for.
  *
@@ -147,15 +175,15 @@ Process_Lookup(uint64_t pid)
     Process *p;
     Process *proc = NULL;
 
-    Spinlock_Lock(&procLock);
+    Epoch_Enter();
     TAILQ_FOREACH(p, &processList, processList) {
-	if (p->pid == pid) {
-	    Process_Retain(p);
+	// Skip processes that are being destroyed
+	if (p->pid == pid && ProcessTryRetain(p)) {
 	    proc = p;
 	    break;
 	}
     }
-    Spinlock_Unlock(&procLock);
+    Epoch_Exit();
 
     return proc;
 }
@@ -290,7 +318,7 @@ REGISTER_DBGCMD(processes, "Display list of processes", Debug_Processes);
 static void
 Debug_ProcInfo(int argc, const char *argv[])
 {
-    Thread *thr = curProc[CPU()];
+    Thread *thr = PERCPU_GET(curProc);
 
     kprintf("Current Process State:\n");
     Process_Dump(thr->proc);
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/cdefs.h>
+#include <sys/kassert.h>
+#include <sys/kconfig.h>
+#include <sys/kdebug.h>
+#include <sys/mp.h>
+#include <sys/queue.h>
+#include <sys/thread.h>
+#include <sys/spinlock.h>
+#include <sys/waitchannel.h>
+#include <sys/rwlock.h>
+
+#include <machine/amd64.h>
+#include <machine/amd64op.h>
+
+/**
+ * RWReaders --
+ *
+ * Sum the per-CPU reader counts.  Once a writer has announced itself new
+ * readers back off, so the counts only drop and a zero sum means every reader
+ * has left.  Sleeping readers may release on another CPU than they acquired
+ * on, so individual counts may be negative.
+ */
+static int64_t
+RWReaders(RWReaderCount *readers)
+{
+    int c;
+    int64_t sum = 0;
+
+    for (c = 0; c < MAX_CPUS; c++) {
+	sum += readers[c].count;
+    }
+
+    return sum;
+}
+
+/*
+ * RWLock
+ */
+
+void
+RWLock_Init(RWLock *rw, const char *name)
+{
+    int c;
+
+    rw->writers = 0;
+    rw->owned = 0;
+    WaitChannel_Init(&rw->readChan, name);
+    WaitChannel_Init(&rw->writeChan, name);
+    for (c = 0; c < MAX_CPUS; c++) {
+	rw->readers[c].count = 0;
+    }
+}
+
+void
+RWLock_Destroy(RWLock *rw)
+{
+    ASSERT(rw->writers == 0 && RWReaders(rw->readers) == 0);
+
+    WaitChannel_Destroy(&rw->readChan);
+    WaitChannel_Destroy(&rw->writeChan);
+}
+
+/**
+ * RWLock_ReadLock --
+ *
+ * Acquire a shared lock, sleeping while a writer holds or waits for the lock.
+ */
+void
+RWLock_ReadLock(RWLock *rw) __NO_LOCK_ANALYSIS
+{
+    RWReaderCount *rc;
+
+    ASSERT(Critical_Level() == 0);
+
+    while (1) {
+	/*
+	 * Backing off must decrement the same count we incremented, otherwise
+	 * a writer summing the counts could miss an active reader.
+	 */
+	Critical_Enter();
+	rc = &rw->readers[CPU()];
+	__sync_fetch_and_add(&rc->count, 1);
+	if (rw->writers == 0) {
+	    Critical_Exit();
+	    return;
+	}
+	__sync_fetch_and_sub(&rc->count, 1);
+	Critical_Exit();
+
+	/*
+	 * A writer waiting for readers to drain may have seen our count and 
+	 * gone to sleep.  While a writer owns the lock its unlock does the 
+	 * wakeup instead.
+	 */
+	if (!rw->owned)
+	    WaitChannel_WakeAll(&rw->writeChan);
+
+	WaitChannel_Lock(&rw->readChan);
+	if (rw->writers != 0) {
+	    WaitChannel_Sleep(&rw->readChan);
+	} else {
+	    WaitChannel_Unlock(&rw->readChan);
+	}
+    }
+}
+
+/**
+ * RWLock_ReadUnlock --
+ *
+ * Release a shared lock, waking a writer waiting for readers to drain.
+ */
+void
+RWLock_ReadUnlock(RWLock *rw)
+{
+    // We may have migrated since acquiring so only the sum is meaningful
+    __sync_fetch_and_sub(&rw->readers[CPU()].count, 1);
+
+    if (rw->writers != 0)
+	WaitChannel_WakeAll(&rw->writeChan);
+}
+
+/**
+ * RWLock_WriteLock --
+ *
+ * Acquire an exclusive lock.  Pending writers take priority over new readers.
+ */
+void
+RWLock_WriteLock(RWLock *rw) __NO_LOCK_ANALYSIS
+{
+    ASSERT(Critical_Level() == 0);
+
+    // The locked add orders the announcement before summing the readers
+    __sync_fetch_and_add(&rw->writers, 1);
+
+    WaitChannel_Lock(&rw->writeChan);
+    while (rw->owned || RWReaders(rw->readers) != 0) {
+	WaitChannel_Sleep(&rw->writeChan);
+	WaitChannel_Lock(&rw->writeChan);
+    }
+    rw->owned = 1;
+    WaitChannel_Unlock(&rw->writeChan);
+}
+
+/**
+ * RWLock_WriteUnlock --
+ *
+ * Release an exclusive lock.  Pending writers are woken first, readers are 
+ * only woken by the last writer.
+ */
+void
+RWLock_WriteUnlock(RWLock *rw) __NO_LOCK_ANALYSIS
+{
+    uint64_t writers;
+
+    WaitChannel_Lock(&rw->writeChan);
+    ASSERT(rw->owned);
+    rw->owned = 0;
+    writers = __sync_sub_and_fetch(&rw->writers, 1);
+    WaitChannel_Unlock(&rw->writeChan);
+
+    if (writers != 0) {
+	WaitChannel_WakeAll(&rw->writeChan);
+    } else {
+	WaitChannel_WakeAll(&rw->readChan);
+    }
+}
+
@@ -10,6 +10,8 @@
 #include <errno.h>
 #include <sys/syscall.h>
 
+#include <sys/clockevent.h>
+#include <sys/epoch.h>
 #include <sys/kassert.h>
 #include <sys/kconfig.h>
 #include <sys/kdebug.h>
@@ -17,28 +19,26 @@
 #include <sys/ktime.h>
 #include <sys/mp.h>
 #include <sys/spinlock.h>
+#include <sys/sysctl.h>
 #include <sys/thread.h>
 
 #include <machine/trap.h>
 #include <machine/pmap.h>
+#include <machine/mp.h>
 
 // Scheduler Queues
 /**
- * Scheduler lock that protects all queues.
+ * Per-CPU scheduler queues.  Each queue has its own lock that protects the 
+ * runnable and wait queues for that CPU as well as curProc for that CPU.  The 
+ * current thread lives in the per-CPU data.
  */
-Spinlock schedLock;
-/**
- * All threads currently waiting.
- */
-ThreadQueue waitQueue;
-/**
- * All runnable threads.
- */
-ThreadQueue runnableQueue;
-/**
- * Current thread executing on a given CPU.
+SchedQueue runQueue[MAX_CPUS];
+
+/*
+ * CPUs running their idle thread.  Idle CPUs do not tick, so they must be sent 
+ * a wakeup IPI when they are given work.
  */
-Thread *curProc[MAX_CPUS];
+static volatile CPUMask schedIdleCPUs;
 
 /*
  * Scheduler Functions
@@ -55,28 +55,182 @@ Thread *curProc[MAX_CPUS];
 Thread *
 Sched_Current()
 {
-    Spinlock_Lock(&schedLock);
+    Thread *thr;
 
-    Thread *thr = curProc[CPU()];
+    /*
+     * curProc is only modified by the local CPU with interrupts disabled and 
+     * is read with a single instruction, so migration cannot hand us another 
+     * CPU's thread.
+     */
+    thr = PERCPU_GET(curProc);
     Thread_Retain(thr);
 
-    Spinlock_Unlock(&schedLock);
-
     return thr;
 }
 
+/**
+ * SchedLockLocal --
+ *
+ * Lock the scheduler queue of the current CPU.  We enter a critical section 
+ * before reading the CPU number so that we cannot migrate before the lock is 
+ * held.
+ *
+ * @return Returns the locked scheduler queue.
+ */
+static SchedQueue *
+SchedLockLocal() __NO_LOCK_ANALYSIS
+{
+    SchedQueue *rq;
+
+    Critical_Enter();
+    rq = &runQueue[CPU()];
+    Spinlock_Lock(&rq->lock);
+    Critical_Exit();
+
+    return rq;
+}
+
+/**
+ * SchedLockThread --
+ *
+ * Lock the scheduler queue that owns a thread.  SchedMigrate updates lastCPU 
+ * while holding the source queue lock so we retry if the thread moved.
+ *
+ * @return Returns the locked scheduler queue.
+ */
+static SchedQueue *
+SchedLockThread(Thread *thr) __NO_LOCK_ANALYSIS
+{
+    int cpu;
+    SchedQueue *rq;
+
+    while (1) {
+	cpu = thr->lastCPU;
+	rq = &runQueue[cpu];
+	Spinlock_Lock(&rq->lock);
+	if (thr->lastCPU == cpu)
+	    return rq;
+	Spinlock_Unlock(&rq->lock);
+    }
+}
+
+/**
+ * SchedEnqueue --
+ *
+ * Insert a thread at the tail of the runnable queue for its level.
+ */
+static void
+SchedEnqueue(SchedQueue *rq, Thread *thr)
+{
+    ASSERT(!thr->queued);
+
+    TAILQ_INSERT_TAIL(&rq->runnable[thr->level], thr, schedQueue);
+    thr->queued = true;
+    rq->length++;
+}
+
+/**
+ * SchedDequeue --
+ *
+ * Remove a thread from the runnable queue.
+ */
+static void
+SchedDequeue(SchedQueue *rq, Thread *thr)
+{
+    ASSERT(thr->queued);
+
+    TAILQ_REMOVE(&rq->runnable[thr->level], thr, schedQueue);
+    thr->queued = false;
+    rq->length--;
+}
+
+/**
+ * SchedFirst --
+ *
+ * @return Returns the most important runnable thread or NULL.
+ */
+static Thread *
+SchedFirst(SchedQueue *rq)
+{
+    int l;
+
+    for (l = 0; l < SCHED_QUEUES; l++) {
+	if (!TAILQ_EMPTY(&rq->runnable[l]))
+	    return TAILQ_FIRST(&rq->runnable[l]);
+    }
+
+    return NULL;
+}
+
+/**
+ * SchedSetLevel --
+ *
+ * Move a thread that is not on a runnable queue to a new level with a fresh 
+ * time slice.
+ */
+static void
+SchedSetLevel(Thread *thr, int level)
+{
+    thr->level = level;
+    thr->quantum = SCHED_QUANTUM(level);
+}
+
+/**
+ * SchedBoost --
+ *
+ * Move every thread on this CPU back to the highest level its priority allows 
+ * so that CPU bound threads that sank to the bottom cannot be starved.
+ */
+static void
+SchedBoost(SchedQueue *rq)
+{
+    int l, top;
+    Thread *thr, *thrTemp;
+    Thread *cur = PERCPU_GET(curProc);
+
+    for (l = 1; l < SCHED_LEVELS; l++) {
+	TAILQ_FOREACH_SAFE(thr, &rq->runnable[l], schedQueue, thrTemp) {
+	    top = SCHED_TOPLEVEL(thr->priority);
+	    if (top >= l)
+		continue;
+
+	    SchedDequeue(rq, thr);
+	    SchedSetLevel(thr, top);
+	    SchedEnqueue(rq, thr);
+	}
+    }
+
+    TAILQ_FOREACH(thr, &rq->wait, schedQueue) {
+	SchedSetLevel(thr, SCHED_TOPLEVEL(thr->priority));
+    }
+
+    if (cur != rq->idle && !cur->queued)
+	SchedSetLevel(cur, SCHED_TOPLEVEL(cur->priority));
+}
+
 /**
  * Sched_SetRunnable --
  *
  * Set the thread to the runnable state and move it from the wait queue if 
- * necessary to the runnable queue.
+ * necessary to the runnable queue.  Threads are placed on the queue of the CPU 
+ * they last ran on to keep caches warm, new threads start on the current CPU.
  *
  * @param [in] thr Thread to be set as runnable.
  */
 void
 Sched_SetRunnable(Thread *thr)
 {
-    Spinlock_Lock(&schedLock);
+    int cpu;
+    bool wakeup = false;
+    Thread *cur;
+    SchedQueue *rq;
+
+    Critical_Enter();
+    if (thr->schedState == SCHED_STATE_NULL)
+	thr->lastCPU = CPU();
+    cpu = thr->lastCPU;
+    rq = &runQueue[cpu];
+    Spinlock_Lock(&rq->lock);
 
     if (thr->proc->procState == PROC_STATE_NULL)
 	thr->proc->procState = PROC_STATE_READY;
@@ -84,12 +238,31 @@ Sched_SetRunnable(Thread *thr)
     if (thr->schedState == SCHED_STATE_WAITING) {
 	thr->waitTime += KTime_GetEpochNS() - thr->waitStart;
 	thr->waitStart = 0;
-	TAILQ_REMOVE(&waitQueue, thr, schedQueue);
+	TAILQ_REMOVE(&rq->wait, thr, schedQueue);
+
+	// Threads that block on I/O move up a level
+	if (thr->level > SCHED_TOPLEVEL(thr->priority) &&
+	    thr->level != SCHED_LEVEL_IDLE)
+	    SchedSetLevel(thr, thr->level - 1);
     }
     thr->schedState = SCHED_STATE_RUNNABLE;
-    TAILQ_INSERT_TAIL(&runnableQueue, thr, schedQueue);
+    SchedEnqueue(rq, thr);
+
+    // Switch at the next interrupt if this thread is more important
+    cur = percpu[cpu].curProc;
+    if (cur == rq->idle || (cur != NULL && thr->level < cur->level))
+	rq->preempt = true;
 
-    Spinlock_Unlock(&schedLock);
+    // Idle CPUs are not ticking so we need to interrupt them
+    if (cur == rq->idle && cpu != CPU())
+	wakeup = true;
+
+    Spinlock_Unlock(&rq->lock);
+
+    // Still in a critical section so we cannot have migrated onto cpu
+    if (wakeup)
+	MP_Wakeup(cpu);
+    Critical_Exit();
 }
 
 /**
@@ -103,15 +276,79 @@ Sched_SetRunnable(Thread *thr)
 void
 Sched_SetWaiting(Thread *thr)
 {
-    Spinlock_Lock(&schedLock);
+    SchedQueue *rq = SchedLockLocal();
 
     ASSERT(thr->schedState == SCHED_STATE_RUNNING);
+    ASSERT(thr->lastCPU == CPU());
 
     thr->schedState = SCHED_STATE_WAITING;
-    TAILQ_INSERT_TAIL(&waitQueue, thr, schedQueue);
+    TAILQ_INSERT_TAIL(&rq->wait, thr, schedQueue);
     thr->waitStart = KTime_GetEpochNS();
 
-    Spinlock_Unlock(&schedLock);
+    Spinlock_Unlock(&rq->lock);
+}
+
+/**
+ * Sched_SetIdle --
+ *
+ * Set the thread as the idle thread for the current CPU.  The idle thread is 
+ * never placed on the runnable queue and only runs when the queue is empty.
+ *
+ * @param [in] thr Thread to be used as the idle thread.
+ */
+void
+Sched_SetIdle(Thread *thr)
+{
+    SchedQueue *rq = SchedLockLocal();
+
+    ASSERT(rq->idle == NULL);
+
+    rq->idle = thr;
+    thr->lastCPU = CPU();
+    thr->priority = PRIO_IDLE;
+    SchedSetLevel(thr, SCHED_LEVEL_IDLE);
+    if (thr->schedState == SCHED_STATE_NULL)
+	thr->schedState = SCHED_STATE_RUNNABLE;
+
+    // Application processors boot into their idle thread
+    if (PERCPU_GET(curProc) == thr)
+	__sync_fetch_and_or(&schedIdleCPUs, CPUMASK_CPU(CPU()));
+
+    Spinlock_Unlock(&rq->lock);
+}
+
+/**
+ * Sched_SetPriority --
+ *
+ * Change the priority of a thread.  The thread restarts at the highest level 
+ * allowed by its new priority.
+ *
+ * @param [in] thr Thread to change.
+ * @param [in] priority New priority between PRIO_IDLE and PRIO_MAX.
+ *
+ * @return Returns the previous priority.
+ */
+int
+Sched_SetPriority(Thread *thr, int priority)
+{
+    int old;
+    bool queued;
+    SchedQueue *rq;
+
+    ASSERT(priority >= PRIO_IDLE && priority <= PRIO_MAX);
+
+    rq = SchedLockThread(thr);
+    old = thr->priority;
+    queued = thr->queued;
+    if (queued)
+	SchedDequeue(rq, thr);
+    thr->priority = priority;
+    SchedSetLevel(thr, SCHED_TOPLEVEL(priority));
+    if (queued)
+	SchedEnqueue(rq, thr);
+    Spinlock_Unlock(&rq->lock);
+
+    return old;
 }
 
 /**
@@ -149,9 +386,9 @@ Sched_SetZombie(Thread *thr)
      * Set as zombie just before releasing the zombieProcLock in case we had to 
      * sleep to acquire the zombieProcLock.
      */
-    Spinlock_Lock(&schedLock);
+    SchedQueue *rq = SchedLockLocal();
     thr->schedState = SCHED_STATE_ZOMBIE;
-    Spinlock_Unlock(&schedLock);
+    Spinlock_Unlock(&rq->lock);
 
     Spinlock_Lock(&proc->lock);
     TAILQ_INSERT_TAIL(&proc->zombieQueue, thr, schedQueue);
@@ -166,7 +403,7 @@ Sched_SetZombie(Thread *thr)
  *
  * Switch between threads.  During the creation of kernel threads (and by proxy 
  * user threads) we may not return through this code path and thus the kernel 
- * thread initialization function must release the scheduler lock.
+ * thread initialization function must release the scheduler queue lock.
  *
  * @param [in] oldthr Current thread we are switching from.
  * @param [in] newthr Thread to switch to.
@@ -180,48 +417,353 @@ Sched_Switch(Thread *oldthr, Thread *newthr)
     Thread_SwitchArch(oldthr, newthr);
 }
 
+/**
+ * SchedMigrate --
+ *
+ * Move up to count runnable threads from the tail of one CPU's queues to 
+ * another, starting with the most important level.  Only a single queue lock 
+ * is held at a time so that two CPUs stealing from each other cannot 
+ * deadlock.  A thread that is still running on the source CPU (i.e., it was 
+ * woken before it switched out) is skipped.
+ *
+ * @param [in] from CPU to take threads from.
+ * @param [in] to CPU to give threads to.
+ * @param [in] count Maximum number of threads to move.
+ *
+ * @return Number of threads migrated.
+ */
+static uint64_t
+SchedMigrate(int from, int to, uint64_t count)
+{
+    int l;
+    uint64_t moved = 0;
+    Thread *thr;
+    Thread *thrTemp;
+    ThreadQueue batch;
+    SchedQueue *src = &runQueue[from];
+    SchedQueue *dst = &runQueue[to];
+
+    TAILQ_INIT(&batch);
+
+    Spinlock_Lock(&src->lock);
+    for (l = 0; l < SCHED_QUEUES && moved < count; l++) {
+	TAILQ_FOREACH_REVERSE_SAFE(thr, &src->runnable[l], ThreadQueue,
+				   schedQueue, thrTemp) {
+	    if (moved == count)
+		break;
+	    if (thr == percpu[from].curProc)
+		continue;
+
+	    SchedDequeue(src, thr);
+	    thr->lastCPU = to;
+	    TAILQ_INSERT_TAIL(&batch, thr, schedQueue);
+	    moved++;
+	}
+    }
+    Spinlock_Unlock(&src->lock);
+
+    if (moved == 0)
+	return 0;
+
+    Spinlock_Lock(&dst->lock);
+    while ((thr = TAILQ_FIRST(&batch)) != NULL) {
+	TAILQ_REMOVE(&batch, thr, schedQueue);
+	SchedEnqueue(dst, thr);
+    }
+    dst->migrations += moved;
+    Spinlock_Unlock(&dst->lock);
+
+    return moved;
+}
+
+/**
+ * SchedBusiest --
+ *
+ * Find the CPU with the longest runnable queue.  The queue lengths are read 
+ * without locks so the result is only a hint.
+ *
+ * @param [in] self CPU to exclude from the search.
+ *
+ * @return CPU number of the busiest CPU or -1 if all other queues are empty.
+ */
+static int
+SchedBusiest(int self)
+{
+    int c;
+    int busiest = -1;
+    uint64_t maxLength = 0;
+
+    for (c = 0; c < MAX_CPUS; c++) {
+	if (c == self)
+	    continue;
+	if (runQueue[c].length > maxLength) {
+	    maxLength = runQueue[c].length;
+	    busiest = c;
+	}
+    }
+
+    return busiest;
+}
+
+/**
+ * SchedSteal --
+ *
+ * Called when the local CPU has nothing to run but its idle thread.  Steal a 
+ * single thread from the busiest CPU.
+ *
+ * @param [in] cpu Current CPU.
+ */
+static void
+SchedSteal(int cpu)
+{
+    int victim = SchedBusiest(cpu);
+
+    if (victim == -1)
+	return;
+
+    if (SchedMigrate(victim, cpu, 1) != 0)
+	runQueue[cpu].steals++;
+}
+
+/**
+ * SchedBalance --
+ *
+ * Periodic load balancing.  Pull half of the difference between the busiest 
+ * queue and our own queue if the imbalance is more than a single thread.
+ *
+ * @param [in] cpu Current CPU.
+ */
+static void
+SchedBalance(int cpu)
+{
+    int victim = SchedBusiest(cpu);
+    uint64_t local = runQueue[cpu].length;
+    uint64_t remote;
+
+    if (victim == -1)
+	return;
+
+    remote = runQueue[victim].length;
+    if (remote > local + 1)
+	SchedMigrate(victim, cpu, (remote - local) / 2);
+}
+
+/**
+ * SchedKickIdle --
+ *
+ * Wake up an idle CPU so that it tries to steal work.  Idle CPUs do not tick 
+ * so they would otherwise never notice that other queues are overloaded.
+ */
+static void
+SchedKickIdle()
+{
+    int c;
+    CPUMask idle = schedIdleCPUs & ~CPUMASK_CPU(CPU());
+    SchedQueue *rq;
+
+    if (idle == 0)
+	return;
+
+    c = __builtin_ctzll(idle);
+    rq = &runQueue[c];
+
+    Spinlock_Lock(&rq->lock);
+    rq->preempt = true;
+    Spinlock_Unlock(&rq->lock);
+
+    MP_Wakeup(c);
+}
+
 /**
  * Sched_Scheduler --
  *
- * Run our round robin scheduler to find the process and switch to it.
+ * Pick the most important runnable thread on the local CPU and switch to it, 
+ * threads within a level are scheduled round robin.  A running thread keeps 
+ * the CPU if everything else is less important.  If the local queue is empty 
+ * we try to steal work from other CPUs before falling back to the idle thread.
  */
 void
-Sched_Scheduler()
+Sched_Scheduler() __NO_LOCK_ANALYSIS
 {
+    int cpu;
     Thread *prev;
     Thread *next;
+    SchedQueue *rq;
+
+    // Nothing may hold references from an epoch read section across a switch
+    Epoch_Quiescent();
+
+    Critical_Enter();
+    cpu = CPU();
+    rq = &runQueue[cpu];
+    prev = PERCPU_GET(curProc);
 
-    Spinlock_Lock(&schedLock);
+    /*
+     * Work stealing and balancing happens before we acquire our own queue 
+     * lock as SchedMigrate never holds two queue locks at once.
+     */
+    if (rq->length == 0 &&
+	(prev == rq->idle || prev->schedState != SCHED_STATE_RUNNING)) {
+	SchedSteal(cpu);
+    } else if (++rq->balanceTicks >= SYSCTL_GETINT(sched_balance)) {
+	rq->balanceTicks = 0;
+	SchedBalance(cpu);
+    }
+
+    Spinlock_Lock(&rq->lock);
+    Critical_Exit();
+
+    rq->preempt = false;
 
     // Select next thread
-    next = TAILQ_FIRST(&runnableQueue);
+    next = SchedFirst(rq);
     if (!next) {
 	/*
-	 * There may be no other runnable processes on this core.  This is a 
-	 * good opportunity to migrate threads.  We should never hit this case 
-	 * once the OS is up and running because of the idle threads, but just 
-	 * in case we should assert that we never return to a zombie or waiting 
-	 * thread.
+	 * There are no other runnable threads on this core.  Keep running the 
+	 * current thread if it can run, otherwise run the idle thread.  We 
+	 * should never return to a zombie or waiting thread.
 	 */
-	ASSERT(curProc[CPU()]->schedState == SCHED_STATE_RUNNING);
-	Spinlock_Unlock(&schedLock);
-	return;
+	if (prev->schedState == SCHED_STATE_RUNNING) {
+	    Spinlock_Unlock(&rq->lock);
+	    return;
+	}
+	next = rq->idle;
+	ASSERT(next != NULL);
+    } else {
+	if (prev->schedState == SCHED_STATE_RUNNING && prev != rq->idle &&
+	    next->level > prev->level) {
+	    Spinlock_Unlock(&rq->lock);
+	    return;
+	}
+	SchedDequeue(rq, next);
     }
     ASSERT(next->schedState == SCHED_STATE_RUNNABLE);
-    TAILQ_REMOVE(&runnableQueue, next, schedQueue);
 
-    prev = curProc[CPU()];
-    curProc[CPU()] = next;
+    /*
+     * The current thread may have been woken up before it had a chance to 
+     * switch out.
+     */
+    if (next == prev) {
+	next->schedState = SCHED_STATE_RUNNING;
+	Spinlock_Unlock(&rq->lock);
+	return;
+    }
+
+    PERCPU_SET(curProc, next);
     next->schedState = SCHED_STATE_RUNNING;
+    next->lastCPU = cpu;
     next->ctxSwitches++;
 
+    if (next == rq->idle) {
+	__sync_fetch_and_or(&schedIdleCPUs, CPUMASK_CPU(cpu));
+    } else if (prev == rq->idle) {
+	__sync_fetch_and_and(&schedIdleCPUs, ~CPUMASK_CPU(cpu));
+	ClockEvent_Resume();
+    }
+
     if (prev->schedState == SCHED_STATE_RUNNING) {
 	prev->schedState = SCHED_STATE_RUNNABLE;
-	TAILQ_INSERT_TAIL(&runnableQueue, prev, schedQueue);
+	if (prev != rq->idle)
+	    SchedEnqueue(rq, prev);
     }
 
     Sched_Switch(prev, next);
 
-    Spinlock_Unlock(&schedLock);
+    /*
+     * We may have been migrated so we must release the queue lock of the CPU 
+     * we are now running on.
+     */
+    Spinlock_Unlock(&runQueue[CPU()].lock);
 }
 
+/**
+ * Sched_Tick --
+ *
+ * Called from the timer interrupt.  Charge the tick to the running thread, 
+ * demote it if it used up its time slice and reschedule if it must give up the 
+ * CPU.
+ */
+void
+Sched_Tick()
+{
+    bool resched = false;
+    Thread *cur;
+    SchedQueue *rq;
+
+    // Read sections disable interrupts so a tick is always a quiescent point
+    Epoch_Quiescent();
+
+    rq = SchedLockLocal();
+
+    cur = PERCPU_GET(curProc);
+
+    if (++rq->boostTicks >= SYSCTL_GETINT(sched_boost)) {
+	rq->boostTicks = 0;
+	SchedBoost(rq);
+    }
+
+    if (cur == rq->idle || cur->schedState != SCHED_STATE_RUNNING) {
+	resched = true;
+    } else if (--cur->quantum <= 0) {
+	if (cur->level < SCHED_LEVELS - 1)
+	    cur->level++;
+	cur->quantum = SCHED_QUANTUM(cur->level);
+	resched = true;
+    } else if (rq->preempt) {
+	resched = true;
+    }
+
+    Spinlock_Unlock(&rq->lock);
+
+    // Let an idle CPU steal the threads waiting here
+    if (rq->length != 0 && schedIdleCPUs != 0)
+	SchedKickIdle();
+
+    if (resched)
+	Sched_Scheduler();
+}
+
+/**
+ * Sched_CheckPreempt --
+ *
+ * Called on the way out of device interrupts.  Switch right away if the 
+ * handler woke up a thread that is more important than the current one.
+ */
+void
+Sched_CheckPreempt()
+{
+    if (runQueue[CPU()].preempt)
+	Sched_Scheduler();
+}
+
+static void
+Debug_RunQueues(int argc, const char *argv[])
+{
+    int c, l;
+
+    for (c = 0; c < MAX_CPUS; c++) {
+	SchedQueue *rq = &runQueue[c];
+
+	if (percpu[c].curProc == NULL)
+	    continue;
+
+	kprintf("CPU %d: Length: %llu Steals: %llu Migrations: %llu\n",
+		c, rq->length, rq->steals, rq->migrations);
+	kprintf("    Current: %llu (Level %d) Idle: %llu\n",
+		percpu[c].curProc->tid, percpu[c].curProc->level,
+		rq->idle ? rq->idle->tid : 0);
+	kprintf("    Levels:");
+	for (l = 0; l < SCHED_QUEUES; l++) {
+	    uint64_t n = 0;
+	    Thread *thr;
+
+	    TAILQ_FOREACH(thr, &rq->runnable[l], schedQueue)
+		n++;
+	    kprintf(" %llu", n);
+	}
+	kprintf("\n");
+    }
+}
+
+REGISTER_DBGCMD(runqueues, "Display per-CPU scheduler queues", Debug_RunQueues);
+
@@ -16,7 +16,7 @@
 #include <sys/semaphore.h>
 #include <sys/thread.h>
 
-Spinlock semaListLock = { 0, 0, 0, 0, 0, 0, 0, 0, "Semaphore List" };
+Spinlock semaListLock = SPINLOCK_INITIALIZER("Semaphore List", SPINLOCK_TYPE_NORMAL);
 LIST_HEAD(SemaListHead, Semaphore) semaList = LIST_HEAD_INITIALIZER(semaList);
 
 extern uint64_t ticksPerSecond;
@@ -48,14 +48,13 @@ Semaphore_Destroy(Semaphore *sema)
 void
 Semaphore_Acquire(Semaphore *sema)
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
 
     while (1) {
 	Spinlock_Lock(&sema->lock);
 	if (sema->count > 0) {
 	    sema->count -= 1;
 	    Spinlock_Unlock(&sema->lock);
-	    Thread_Release(cur);
 	    return;
 	}
 
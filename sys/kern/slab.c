@@ -9,14 +9,24 @@
 
 #include <sys/cdefs.h>
 #include <sys/kassert.h>
+#include <sys/kconfig.h>
 #include <sys/kdebug.h>
 #include <sys/queue.h>
 #include <sys/kmem.h>
+#include <sys/mp.h>
 
 #include <machine/pmap.h>
 
 LIST_HEAD(SlabListHead, Slab) slabList = LIST_HEAD_INITIALIZER(slabList);
 
+/*
+ * Magazines are allocated from their own slab that bypasses the magazine 
+ * layer.
+ */
+static Slab magazineSlab;
+
+static uint64_t SlabReclaimAll();
+
 /**
  * Slab_Init --
  *
@@ -30,7 +40,17 @@ LIST_HEAD(SlabListHead, Slab) slabList = LIST_HEAD_INITIALIZER(slabList);
 void
 Slab_Init(Slab *slab, const char *name, uintptr_t objsz, uintptr_t align)
 {
+    int c;
+    uintptr_t realObjSz = ROUNDUP(objsz, align);
+    uintptr_t hdrSz = ROUNDUP(sizeof(SlabChunk), align);
+
     ASSERT(objsz >= sizeof(SlabElement));
+    ASSERT(align <= PGSIZE && (align & (align - 1)) == 0);
+
+    if (slab != &magazineSlab && magazineSlab.xmem == NULL) {
+	Slab_Init(&magazineSlab, "Slab Magazines", sizeof(SlabMagazine), 16);
+	PAlloc_AddReclaimHook(&SlabReclaimAll);
+    }
 
     slab->objsz = objsz;
     slab->align = align;
@@ -39,7 +59,25 @@ Slab_Init(Slab *slab, const char *name, uintptr_t objsz, uintptr_t align)
     slab->freeObjs = 0;
     slab->allocs = 0;
     slab->frees = 0;
-    LIST_INIT(&slab->freeList);
+    slab->reclaimed = 0;
+
+    slab->chunkSize = ROUNDUP(hdrSz + realObjSz * 64, PGSIZE);
+    if (slab->chunkSize < 4 * PGSIZE) {
+	slab->chunkSize = 4 * PGSIZE;
+    }
+    LIST_INIT(&slab->partialChunks);
+    LIST_INIT(&slab->freeChunks);
+    slab->reclaiming = false;
+    slab->holes = 0;
+
+    slab->magazines = (slab != &magazineSlab);
+    LIST_INIT(&slab->fullMagazines);
+    LIST_INIT(&slab->emptyMagazines);
+    slab->fullCount = 0;
+    slab->emptyCount = 0;
+    for (c = 0; c < MAX_CPUS; c++) {
+	slab->cpuCache[c] = (SlabCPUCache){ .loaded = NULL };
+    }
 
     ASSERT(slab->xmem != NULL);
 
@@ -53,7 +91,8 @@ Slab_Init(Slab *slab, const char *name, uintptr_t objsz, uintptr_t align)
 /**
  * SlabExtend --
  *
- *	Grow the slab to allocate new objects.
+ *	Grow the slab by one chunk to allocate new objects.  Holes left by 
+ *	reclaimed chunks are reused before the XMem region is grown.
  *
  *	@param [in] slab Slab that we want to expand.
  *	@retval -1 Failed to expand the slab.
@@ -63,39 +102,135 @@ int
 SlabExtend(Slab *slab)
 {
     uintptr_t base = XMem_GetBase(slab->xmem);
-    uintptr_t len = XMem_GetLength(slab->xmem);
-    uintptr_t inc;
+    uintptr_t off;
     uintptr_t realObjSz = ROUNDUP(slab->objsz, slab->align);
+    uintptr_t hdrSz = ROUNDUP(sizeof(SlabChunk), slab->align);
+    SlabChunk *chunk;
 
-    inc = ROUNDUP(realObjSz * 64, PGSIZE);
-    if (inc < 4 * PGSIZE) {
-	inc = 4 * PGSIZE;
+    if (slab->holes != 0) {
+	off = slab->hole[slab->holes - 1];
+	if (!XMem_Populate(slab->xmem, off, slab->chunkSize)) {
+	    kprintf("Slab: Cannot populate XMem region!\n");
+	    return -1;
+	}
+	slab->holes--;
+    } else {
+	off = XMem_GetLength(slab->xmem);
+	if (!XMem_Allocate(slab->xmem, off + slab->chunkSize)) {
+	    kprintf("Slab: Cannot grow XMem region!\n");
+	    return -1;
+	}
     }
 
-    if (!XMem_Allocate(slab->xmem, len + inc)) {
-	kprintf("Slab: Cannot grow XMem region!\n");
-	return -1;
-    }
+    chunk = (SlabChunk *)(base + off);
+    chunk->objs = (slab->chunkSize - hdrSz) / realObjSz;
+    chunk->freeObjs = chunk->objs;
+    LIST_INIT(&chunk->freeList);
 
     // Add empty objects to linked list
     uintptr_t i;
-    uintptr_t objs = inc / realObjSz;
-    for (i = 0; i < objs; i++) {
-	SlabElement *elem = (SlabElement *)(base + len + i * realObjSz);
+    for (i = 0; i < chunk->objs; i++) {
+	SlabElement *elem = (SlabElement *)(base + off + hdrSz + i * realObjSz);
 
-	LIST_INSERT_HEAD(&slab->freeList, elem, free);
+	LIST_INSERT_HEAD(&chunk->freeList, elem, free);
     }
 
-    slab->objs += objs;
-    slab->freeObjs += objs;
+    LIST_INSERT_HEAD(&slab->freeChunks, chunk, link);
+    slab->objs += chunk->objs;
+    slab->freeObjs += chunk->objs;
 
     return 0;
 }
 
+/**
+ * SlabObjToChunk --
+ *
+ *	Find the chunk that contains an object.
+ */
+static inline SlabChunk *
+SlabObjToChunk(Slab *slab, void *obj)
+{
+    uintptr_t base = XMem_GetBase(slab->xmem);
+    uintptr_t off = (uintptr_t)obj - base;
+
+    return (SlabChunk *)(base + off - (off % slab->chunkSize));
+}
+
+/**
+ * SlabAllocObj --
+ *
+ *	Allocate an object from the slab layer.  The slab lock must be held.
+ *
+ *	@param [in] slab Slab that the object belongs to.
+ *	@retval NULL Could not allocate an object.
+ *	@return Pointer to the allocated object.
+ */
+static void *
+SlabAllocObj(Slab *slab)
+{
+    SlabElement *elem;
+    SlabChunk *chunk;
+
+    // Fill partially used chunks first so that free chunks can be reclaimed
+    chunk = LIST_FIRST(&slab->partialChunks);
+    if (chunk == NULL) {
+	if (LIST_EMPTY(&slab->freeChunks) && SlabExtend(slab) < 0)
+	    return NULL;
+	chunk = LIST_FIRST(&slab->freeChunks);
+    }
+
+    elem = LIST_FIRST(&chunk->freeList);
+    ASSERT(elem != NULL);
+    LIST_REMOVE(elem, free);
+
+    LIST_REMOVE(chunk, link);
+    chunk->freeObjs--;
+    if (chunk->freeObjs != 0)
+	LIST_INSERT_HEAD(&slab->partialChunks, chunk, link);
+
+    slab->allocs++;
+    slab->freeObjs--;
+
+    return (void *)elem;
+}
+
+/**
+ * SlabFreeObj --
+ *
+ *	Return an object to the slab layer.  The slab lock must be held.
+ *
+ *	@param [in] slab Slab that the object belongs to.
+ *	@param [in] region Object to free.
+ */
+static void
+SlabFreeObj(Slab *slab, void *region)
+{
+    SlabElement *elem = (SlabElement *)region;
+    SlabChunk *chunk = SlabObjToChunk(slab, region);
+
+    ASSERT(chunk->freeObjs < chunk->objs);
+
+    // Full chunks are not on any list
+    if (chunk->freeObjs != 0)
+	LIST_REMOVE(chunk, link);
+
+    LIST_INSERT_HEAD(&chunk->freeList, elem, free);
+    chunk->freeObjs++;
+    if (chunk->freeObjs == chunk->objs)
+	LIST_INSERT_HEAD(&slab->freeChunks, chunk, link);
+    else
+	LIST_INSERT_HEAD(&slab->partialChunks, chunk, link);
+
+    slab->frees++;
+    slab->freeObjs++;
+}
+
 /**
  * Slab_Alloc --
  *
- *	Free a slab object.
+ *	Allocate a slab object.  The object is taken from the current CPU's 
+ *	magazines if possible, then from a full magazine in the depot and 
+ *	finally from the slab layer itself.
  *
  *	@param [in] slab Slab that the object belongs to.
  *	@retval NULL Could not allocate an object.
@@ -104,29 +239,72 @@ SlabExtend(Slab *slab)
 void *
 Slab_Alloc(Slab *slab)
 {
-    SlabElement *elem;
+    void *obj;
+    SlabCPUCache *cc;
+    SlabMagazine *mag;
+
+    if (!slab->magazines) {
+	Spinlock_Lock(&slab->lock);
+	obj = SlabAllocObj(slab);
+	Spinlock_Unlock(&slab->lock);
+
+	return obj;
+    }
+
+    Critical_Enter();
+    cc = &slab->cpuCache[CPU()];
+    cc->allocs++;
+
+    // Fast path: allocate from the loaded or previous magazine
+    if (cc->loaded != NULL && cc->loaded->rounds > 0) {
+	obj = cc->loaded->objs[--cc->loaded->rounds];
+	cc->allocHits++;
+	Critical_Exit();
+	return obj;
+    }
+    if (cc->previous != NULL && cc->previous->rounds > 0) {
+	mag = cc->loaded;
+	cc->loaded = cc->previous;
+	cc->previous = mag;
+
+	obj = cc->loaded->objs[--cc->loaded->rounds];
+	cc->allocHits++;
+	Critical_Exit();
+	return obj;
+    }
 
     Spinlock_Lock(&slab->lock);
 
-    if (slab->freeObjs == 0)
-	SlabExtend(slab);
+    // Exchange our empty magazine for a full one from the depot
+    mag = LIST_FIRST(&slab->fullMagazines);
+    if (mag != NULL) {
+	LIST_REMOVE(mag, link);
+	slab->fullCount--;
 
-    elem = LIST_FIRST(&slab->freeList);
-    if (elem != NULL) {
-	LIST_REMOVE(elem, free);
-	slab->allocs++;
-	slab->freeObjs--;
+	if (cc->previous != NULL) {
+	    LIST_INSERT_HEAD(&slab->emptyMagazines, cc->previous, link);
+	    slab->emptyCount++;
+	}
+	cc->previous = cc->loaded;
+	cc->loaded = mag;
+
+	obj = mag->objs[--mag->rounds];
+    } else {
+	obj = SlabAllocObj(slab);
     }
 
     Spinlock_Unlock(&slab->lock);
+    Critical_Exit();
 
-    return (void *)elem;
+    return obj;
 }
 
 /**
  * Slab_Free --
  *
- *	Free a slab object.
+ *	Free a slab object.  The object is placed into the current CPU's 
+ *	magazines if possible, otherwise we exchange a full magazine for an 
+ *	empty one in the depot or return the object to the slab layer.
  *
  *	@param [in] slab Slab that the object belongs to.
  *	@param [in] region Object to free.
@@ -134,25 +312,200 @@ Slab_Alloc(Slab *slab)
 void
 Slab_Free(Slab *slab, void *region)
 {
+    SlabCPUCache *cc;
+    SlabMagazine *mag;
+
+    if (!slab->magazines) {
+	Spinlock_Lock(&slab->lock);
+	SlabFreeObj(slab, region);
+	Spinlock_Unlock(&slab->lock);
+	return;
+    }
+
+    Critical_Enter();
+    cc = &slab->cpuCache[CPU()];
+    cc->frees++;
+
+    // Fast path: free into the loaded or previous magazine
+    if (cc->loaded != NULL && cc->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+	cc->loaded->objs[cc->loaded->rounds++] = region;
+	cc->freeHits++;
+	Critical_Exit();
+	return;
+    }
+    if (cc->previous != NULL && cc->previous->rounds == 0) {
+	mag = cc->loaded;
+	cc->loaded = cc->previous;
+	cc->previous = mag;
+
+	cc->loaded->objs[cc->loaded->rounds++] = region;
+	cc->freeHits++;
+	Critical_Exit();
+	return;
+    }
+
     Spinlock_Lock(&slab->lock);
 
-    SlabElement *elem = (SlabElement *)region;
-    LIST_INSERT_HEAD(&slab->freeList, elem, free);
-    slab->frees++;
-    slab->freeObjs++;
+    // Exchange our full magazine for an empty one
+    mag = LIST_FIRST(&slab->emptyMagazines);
+    if (mag != NULL) {
+	LIST_REMOVE(mag, link);
+	slab->emptyCount--;
+    } else {
+	mag = (SlabMagazine *)Slab_Alloc(&magazineSlab);
+	if (mag != NULL)
+	    mag->rounds = 0;
+    }
+
+    if (mag != NULL) {
+	if (cc->previous != NULL) {
+	    LIST_INSERT_HEAD(&slab->fullMagazines, cc->previous, link);
+	    slab->fullCount++;
+	}
+	cc->previous = cc->loaded;
+	cc->loaded = mag;
+
+	mag->objs[mag->rounds++] = region;
+    } else {
+	SlabFreeObj(slab, region);
+    }
+
+    Spinlock_Unlock(&slab->lock);
+    Critical_Exit();
+}
+
+/**
+ * Slab_Reclaim --
+ *
+ *	Return memory held by a slab to the page allocator.  Objects cached in 
+ *	the depot are returned to their chunks, then chunks with no allocated 
+ *	objects are unmapped.  The unmapped chunks are remembered as holes and 
+ *	reused when the slab grows again.  This must not be called with 
+ *	spinlocks held.
+ *
+ *	@param [in] slab Slab to reclaim memory from.
+ *	@return Number of pages returned to the page allocator.
+ */
+uint64_t
+Slab_Reclaim(Slab *slab)
+{
+    int i, n;
+    uint64_t pages = 0;
+    uintptr_t base = XMem_GetBase(slab->xmem);
+    uintptr_t off[SLAB_MAX_HOLES];
+    SlabChunk *chunk;
+    SlabMagazine *mag;
+    SlabMagazineHead mags;
+
+    LIST_INIT(&mags);
+
+    Spinlock_Lock(&slab->lock);
+    if (slab->reclaiming) {
+	Spinlock_Unlock(&slab->lock);
+	return 0;
+    }
+    slab->reclaiming = true;
+
+    // Drain the depot
+    while ((mag = LIST_FIRST(&slab->fullMagazines)) != NULL) {
+	LIST_REMOVE(mag, link);
+	slab->fullCount--;
+
+	while (mag->rounds > 0) {
+	    SlabFreeObj(slab, mag->objs[--mag->rounds]);
+	}
+	LIST_INSERT_HEAD(&mags, mag, link);
+    }
+    while ((mag = LIST_FIRST(&slab->emptyMagazines)) != NULL) {
+	LIST_REMOVE(mag, link);
+	slab->emptyCount--;
+	LIST_INSERT_HEAD(&mags, mag, link);
+    }
+
+    // Detach free chunks while we have room to remember the holes
+    n = 0;
+    while (n < SLAB_MAX_HOLES - slab->holes) {
+	chunk = LIST_FIRST(&slab->freeChunks);
+	if (chunk == NULL)
+	    break;
+
+	LIST_REMOVE(chunk, link);
+	slab->objs -= chunk->objs;
+	slab->freeObjs -= chunk->objs;
+	off[n++] = (uintptr_t)chunk - base;
+    }
+    Spinlock_Unlock(&slab->lock);
+
+    while ((mag = LIST_FIRST(&mags)) != NULL) {
+	LIST_REMOVE(mag, link);
+	Slab_Free(&magazineSlab, mag);
+    }
 
+    // Unmapping requires a TLB shootdown so it is done without the lock
+    for (i = 0; i < n; i++) {
+	pages += XMem_Free(slab->xmem, off[i], slab->chunkSize);
+    }
+
+    Spinlock_Lock(&slab->lock);
+    for (i = 0; i < n; i++) {
+	slab->hole[slab->holes++] = off[i];
+    }
+    slab->reclaimed += n;
+    slab->reclaiming = false;
     Spinlock_Unlock(&slab->lock);
+
+    return pages;
+}
+
+/**
+ * SlabReclaimAll --
+ *
+ *	Page allocator reclaim hook that reclaims memory from every slab.  The 
+ *	magazine slab is reclaimed last as the other slabs release their 
+ *	magazines into it.
+ */
+static uint64_t
+SlabReclaimAll()
+{
+    Slab *slab;
+    uint64_t pages = 0;
+
+    LIST_FOREACH(slab, &slabList, slabList) {
+	if (slab != &magazineSlab)
+	    pages += Slab_Reclaim(slab);
+    }
+    pages += Slab_Reclaim(&magazineSlab);
+
+    return pages;
 }
 
 static void
 Debug_Slabs(int argc, const char *argv[])
 {
+    int c;
     Slab *slab;
 
-    kprintf("%-36s %-10s %-10s %-10s\n", "Slab Name", "Alloc", "Free", "Total");
+    kprintf("%-36s %-10s %-10s %-10s %-10s\n", "Slab Name", "Alloc", "Free",
+	    "Total", "Reclaimed");
     LIST_FOREACH(slab, &slabList, slabList) {
-	kprintf("%-36s %-10lld %-10lld %-10lld\n", slab->name,
-		slab->objs - slab->freeObjs, slab->freeObjs, slab->objs);
+	kprintf("%-36s %-10lld %-10lld %-10lld %lld\n", slab->name,
+		slab->objs - slab->freeObjs, slab->freeObjs, slab->objs,
+		slab->reclaimed);
+	kprintf("    Depot %lld/%lld Holes %lld\n",
+		slab->fullCount, slab->emptyCount, slab->holes);
+
+	for (c = 0; c < MAX_CPUS; c++) {
+	    SlabCPUCache *cc = &slab->cpuCache[c];
+
+	    if (cc->allocs == 0 && cc->frees == 0)
+		continue;
+
+	    kprintf("    CPU %-2d Alloc Hits %lld/%lld (%lld%%) Free Hits %lld/%lld (%lld%%)\n",
+		    c, cc->allocHits, cc->allocs,
+		    cc->allocs ? (cc->allocHits * 100) / cc->allocs : 0,
+		    cc->freeHits, cc->frees,
+		    cc->frees ? (cc->freeHits * 100) / cc->frees : 0);
+	}
     }
 }
 
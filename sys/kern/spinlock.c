@@ -18,14 +18,12 @@
 #include <machine/amd64.h>
 #include <machine/amd64op.h>
 
-Spinlock lockListLock = {
-    0, 0, 0, 0, 0, 0, 0,
-    SPINLOCK_TYPE_NORMAL,
-    "SPINLOCK LIST",
-};
+Spinlock lockListLock = SPINLOCK_INITIALIZER("SPINLOCK LIST",
+					      SPINLOCK_TYPE_NORMAL);
 LIST_HEAD(LockListHead, Spinlock) lockList = LIST_HEAD_INITIALIZER(lockList);
 
-TAILQ_HEAD(LockStack, Spinlock) lockStack[MAX_CPUS];
+/* Number of polling rounds between deadlock checks */
+#define SPINLOCK_CHECKSPINS	0x10000
 
 extern uint64_t ticksPerSecond;
 
@@ -35,20 +33,23 @@ Spinlock_EarlyInit()
     int c;
 
     for (c = 0; c < MAX_CPUS; c++) {
-	TAILQ_INIT(&lockStack[c]);
+	TAILQ_INIT(&percpu[c].lockStack);
     }
 }
 
 void
 Spinlock_Init(Spinlock *lock, const char *name, uint64_t type)
 {
-    lock->lock = 0;
-    lock->cpu = 0;
-    lock->count = 0;
+    lock->next = 0;
+    lock->owner = 0;
+    lock->cpu = SPINLOCK_NOCPU;
     lock->rCount = 0;
+    lock->type = type;
+#ifdef SPINLOCK_STATS
+    lock->count = 0;
     lock->lockTime = 0;
     lock->waitTime = 0;
-    lock->type = type;
+#endif
 
     strncpy(&lock->name[0], name, SPINLOCK_NAMELEN);
 
@@ -65,39 +66,80 @@ Spinlock_Destroy(Spinlock *lock)
     Spinlock_Unlock(&lockListLock);
 }
 
+/**
+ * SpinlockWait --
+ *
+ * Slow path of Spinlock_Lock that waits for our ticket to be served.  Each 
+ * round backs off in proportion to the number of waiters ahead of us so that 
+ * CPUs further back in the queue stay off the lock's cache line.
+ *
+ * @param [in] lock Spinlock being acquired.
+ * @param [in] ticket Ticket we drew.
+ */
+static void
+SpinlockWait(Spinlock *lock, uint32_t ticket)
+{
+    uint32_t owner;
+    uint32_t i;
+    uint64_t spins = 0;
+    uint64_t startTSC = Time_GetTSC();
+
+    while ((owner = atomic_load_acq_uint32(&lock->owner)) != ticket) {
+	for (i = ticket - owner; i != 0; i--) {
+	    pause();
+	}
+
+	if ((++spins % SPINLOCK_CHECKSPINS) == 0 && ticksPerSecond != 0 &&
+	    (Time_GetTSC() - startTSC) / ticksPerSecond > 1) {
+	    kprintf("Spinlock_Lock(%s): waiting for over a second!\n", lock->name);
+	    breakpoint();
+	}
+    }
+}
+
 /**
  * Spinlock_Lock --
  *
  * Spin until we acquire the spinlock.  This will also disable interrupts to 
- * prevent deadlocking with interrupt handlers.
+ * prevent deadlocking with interrupt handlers.  Waiters are served in FIFO 
+ * order.
  */
 void
 Spinlock_Lock(Spinlock *lock) __NO_LOCK_ANALYSIS
 {
+    uint32_t ticket;
+#ifdef SPINLOCK_STATS
     uint64_t startTSC;
+#endif
+
     Critical_Enter();
 
-    startTSC = Time_GetTSC();
-    while (atomic_swap_uint64(&lock->lock, 1) == 1)
-    {
-	if (lock->type == SPINLOCK_TYPE_RECURSIVE && lock->cpu == CPU()) {
-	    break;
-	}
-	if ((Time_GetTSC() - startTSC) / ticksPerSecond > 1) {
-	    kprintf("Spinlock_Lock(%s): waiting for over a second!\n", lock->name);
-	    breakpoint();
-	}
+    if (lock->type == SPINLOCK_TYPE_RECURSIVE && lock->cpu == CPU()) {
+	lock->rCount++;
+#ifdef SPINLOCK_STATS
+	lock->count++;
+#endif
+	return;
     }
-    lock->waitTime += Time_GetTSC() - startTSC;
+
+#ifdef SPINLOCK_STATS
+    startTSC = Time_GetTSC();
+#endif
+
+    ticket = atomic_fetchadd_uint32(&lock->next, 1);
+    if (atomic_load_acq_uint32(&lock->owner) != ticket)
+	SpinlockWait(lock, ticket);
 
     lock->cpu = CPU();
-    lock->count++;
+    lock->rCount = 1;
 
-    lock->rCount++;
-    if (lock->rCount == 1)
-	lock->lockedTSC = Time_GetTSC();
+#ifdef SPINLOCK_STATS
+    lock->count++;
+    lock->lockedTSC = Time_GetTSC();
+    lock->waitTime += lock->lockedTSC - startTSC;
 
-    TAILQ_INSERT_TAIL(&lockStack[CPU()], lock, lockStack);
+    TAILQ_INSERT_TAIL(PERCPU_PTR(lockStack), lock, lockStack);
+#endif
 }
 
 /**
@@ -110,13 +152,14 @@ Spinlock_Unlock(Spinlock *lock) __NO_LOCK_ANALYSIS
 {
     ASSERT(lock->cpu == CPU());
 
-    TAILQ_REMOVE(&lockStack[CPU()], lock, lockStack);
-
     lock->rCount--;
     if (lock->rCount == 0) {
-	lock->cpu = 0;
+#ifdef SPINLOCK_STATS
+	TAILQ_REMOVE(PERCPU_PTR(lockStack), lock, lockStack);
 	lock->lockTime += Time_GetTSC() - lock->lockedTSC;
-	atomic_set_uint64(&lock->lock, 0);
+#endif
+	lock->cpu = SPINLOCK_NOCPU;
+	atomic_store_rel_uint32(&lock->owner, lock->owner + 1);
     }
 
     Critical_Exit();
@@ -125,7 +168,7 @@ Spinlock_Unlock(Spinlock *lock) __NO_LOCK_ANALYSIS
 bool
 Spinlock_IsHeld(Spinlock *lock)
 {
-    return (lock->cpu == CPU()) && (lock->lock == 1);
+    return (lock->cpu == CPU()) && (lock->next != lock->owner);
 }
 
 void
@@ -135,12 +178,24 @@ Debug_Spinlocks(int argc, const char *argv[])
 
     Spinlock_Lock(&lockListLock);
 
+#ifdef SPINLOCK_STATS
     kprintf("%-36s Locked CPU    Count     WaitTime     LockTime\n", "Lock Name");
+#else
+    kprintf("%-36s Locked CPU Waiters\n", "Lock Name");
+#endif
     LIST_FOREACH(lock, &lockList, lockList)
     {
-	kprintf("%-36s %6llu %3llu %8llu %12llu %12llu\n", lock->name,
-		lock->lock, lock->cpu, lock->count,
+	uint32_t held = lock->next - lock->owner;
+	int cpu = (lock->cpu == SPINLOCK_NOCPU) ? -1 : (int)lock->cpu;
+
+#ifdef SPINLOCK_STATS
+	kprintf("%-36s %6u %3d %8llu %12llu %12llu\n", lock->name,
+		held != 0, cpu, lock->count,
 		lock->waitTime, lock->lockTime);
+#else
+	kprintf("%-36s %6u %3d %7u\n", lock->name,
+		held != 0, cpu, held ? held - 1 : 0);
+#endif
     }
 
     Spinlock_Unlock(&lockListLock);
@@ -151,13 +206,17 @@ REGISTER_DBGCMD(spinlocks, "Display list of spinlocks", Debug_Spinlocks);
 void
 Debug_LockStack(int argc, const char *argv[])
 {
+#ifdef SPINLOCK_STATS
     int c = CPU();
     Spinlock *lock;
 
     kprintf("Lock Stack:\n");
-    TAILQ_FOREACH(lock, &lockStack[c], lockStack) {
+    TAILQ_FOREACH(lock, &percpu[c].lockStack, lockStack) {
 	kprintf("    %s\n", lock->name);
     }
+#else
+    kprintf("Lock stacks require a DEBUG or PERF build\n");
+#endif
 }
 
 REGISTER_DBGCMD(lockstack, "Display stack of held spinlocks", Debug_LockStack);
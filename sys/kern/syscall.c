@@ -14,6 +14,7 @@
 #include <sys/ktime.h>
 #include <sys/ktimer.h>
 #include <sys/thread.h>
+#include <sys/futex.h>
 #include <sys/loader.h>
 #include <sys/syscall.h>
 #include <sys/disk.h>
@@ -21,6 +22,8 @@
 #include <sys/vfsuio.h>
 #include <sys/nic.h>
 #include <sys/sysctl.h>
+#include <sys/mman.h>
+#include <sys/vm.h>
 
 Handle *Console_OpenHandle();
 
@@ -33,18 +36,16 @@ Syscall_Time()
 uint64_t
 Syscall_GetPID()
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     uint64_t pid = cur->proc->pid;
 
-    Thread_Release(cur);
-
     return pid;
 }
 
 void
 Syscall_Exit(uint64_t status)
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
 
     // Request each thread to exit
 
@@ -55,7 +56,6 @@ Syscall_Exit(uint64_t status)
 
     // Exit this thread
     Sched_SetZombie(cur);
-    Thread_Release(cur);
     Sched_Scheduler();
 
     // Should not return
@@ -82,20 +82,22 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
 
     Log(syscall, "Spawn(%s)\n", exeName);
 
-    kargBuffer = PAlloc_AllocPage();
+    // Argument pointers followed by up to 8 strings of 256 bytes
+    kargBuffer = Malloc_Alloc(kernelHeap, 8 * sizeof(uintptr_t) + 8 * 256);
     if (!kargBuffer)
         return SYSCALL_PACK(ENOMEM, 0);
 
     int idx = 0;
-    uintptr_t *localArgArray = (uintptr_t *)(kargBuffer + sizeof(uintptr_t));
+    uintptr_t *localArgArray = (uintptr_t *)kargBuffer;
     char *strStore = kargBuffer + 8 * sizeof(uintptr_t);
+    memset(localArgArray, 0, 8 * sizeof(uintptr_t));
     while (idx < 8) {
         uintptr_t userArgPtr;
         ret = Copy_In(user_argv + idx * sizeof(uintptr_t),
                       &userArgPtr,
                       sizeof(uintptr_t));
         if (ret != 0) {
-            PAlloc_Release(kargBuffer);
+            Malloc_Free(kernelHeap, kargBuffer);
             return SYSCALL_PACK(ret, 0);
         }
         if (userArgPtr == 0)
@@ -103,7 +105,7 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
 
         ret = Copy_StrIn(userArgPtr, strStore, 256);
         if (ret != 0) {
-            PAlloc_Release(kargBuffer);
+            Malloc_Free(kernelHeap, kargBuffer);
             return SYSCALL_PACK(ret, 0);
         }
         localArgArray[idx] = (uintptr_t)strStore;
@@ -111,16 +113,16 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
         idx++;
     }
 
-    elfHdrPage = PAlloc_AllocPage();
+    elfHdrPage = PAlloc_AllocPageNoZero();
     if (!elfHdrPage) {
-        PAlloc_Release(kargBuffer);
+        Malloc_Free(kernelHeap, kargBuffer);
         return SYSCALL_PACK(ENOMEM, 0);
     }
 
     execVnode = VFS_Lookup(exeName);
     if (VFS_Open(execVnode) < 0) {
         PAlloc_Release(elfHdrPage);
-        PAlloc_Release(kargBuffer);
+        Malloc_Free(kernelHeap, kargBuffer);
         return SYSCALL_PACK(EINVAL, 0);
     }
     VFS_Read(execVnode, elfHdrPage, 0, 1024);
@@ -128,15 +130,26 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
     if (!Loader_CheckHeader(elfHdrPage)) {
         VFS_Close(execVnode);
         PAlloc_Release(elfHdrPage);
-        PAlloc_Release(kargBuffer);
+        Malloc_Free(kernelHeap, kargBuffer);
         return SYSCALL_PACK(EINVAL, 0);
     }
 
     // Create proc and thread 
-    curThr = Sched_Current();
+    curThr = Sched_CurrentBorrow();
     newProc = Process_Create(curThr->proc, exeName);
-    newThr = Thread_Create(newProc);
-    Thread_Release(curThr);
+    newThr = newProc ? Thread_Create(newProc) : NULL;
+    if (!newThr) {
+        if (newProc) {
+            Spinlock_Lock(&curThr->proc->lock);
+            TAILQ_REMOVE(&curThr->proc->childrenList, newProc, siblingList);
+            Spinlock_Unlock(&curThr->proc->lock);
+            Process_Release(newProc);
+        }
+        VFS_Close(execVnode);
+        PAlloc_Release(elfHdrPage);
+        Malloc_Free(kernelHeap, kargBuffer);
+        return SYSCALL_PACK(ENOMEM, 0);
+    }
     Log(syscall, "SPAWN %lx\n", newThr);
 
     //  io handles 
@@ -147,7 +160,19 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
     h = Console_OpenHandle();
     Handle_Add(newProc, h);
 
-    Loader_Load(newThr, execVnode, elfHdrPage, 1024);
+    if (!Loader_Load(newThr, execVnode, elfHdrPage, 1024)) {
+        // The thread never ran, unlink the child and drop our references
+        Spinlock_Lock(&curThr->proc->lock);
+        TAILQ_REMOVE(&curThr->proc->childrenList, newProc, siblingList);
+        Spinlock_Unlock(&curThr->proc->lock);
+        Thread_Release(newThr);
+        Process_Release(newProc);
+
+        VFS_Close(execVnode);
+        PAlloc_Release(elfHdrPage);
+        Malloc_Free(kernelHeap, kargBuffer);
+        return SYSCALL_PACK(ENOMEM, 0);
+    }
 
     Thread_SetupUThread(newThr, newProc->entrypoint, MEM_USERSPACE_STKTOP - PGSIZE);
     uintptr_t argPageUserVA = MEM_USERSPACE_STKTOP - PGSIZE;
@@ -156,7 +181,7 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
     char *childStrArea = childArgPage + 8 * sizeof(uintptr_t);
     int argc = 0;
     int currentOffset = 0;
-    uintptr_t *kernelArgArray = (uintptr_t *)(kargBuffer + sizeof(uintptr_t));
+    uintptr_t *kernelArgArray = (uintptr_t *)kargBuffer;
     for (int i = 0; i < 8; i++) {
         if (kernelArgArray[i] == 0)
             break;
@@ -168,6 +193,7 @@ Syscall_Spawn(uint64_t user_path, uint64_t user_argv)
         argc++;
     }
     childArgArray[0] = argc;
+    Malloc_Free(kernelHeap, kargBuffer);
 
     Sched_SetRunnable(newThr);
     return SYSCALL_PACK(0, newProc->pid);
@@ -177,10 +203,9 @@ uint64_t
 Syscall_Wait(uint64_t pid)
 {
     uint64_t status;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
 
     status = Process_Wait(cur->proc, pid);
-    Thread_Release(cur);
 
     return status;
 }
@@ -188,13 +213,17 @@ Syscall_Wait(uint64_t pid)
 uint64_t
 Syscall_MMap(uint64_t addr, uint64_t len, uint64_t prot)
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     bool status;
+    uint64_t flags = 0;
+
+    // The protection and MAP_* flags are passed together
+    if (prot & MAP_POPULATE)
+	flags |= VM_MAP_POPULATE;
 
-    status = PMap_AllocMap(cur->space, addr, len, PTE_W);
-    Thread_Release(cur);
+    status = VM_Map(cur->space, addr, len,
+		    prot & (PROT_READ|PROT_WRITE|PROT_EXEC), flags);
     if (!status) {
-	// XXX: Need to unmap PMap_Unmap(cur->space, addr, pgs);
 	return 0;
     } else {
 	return addr;
@@ -204,43 +233,48 @@ Syscall_MMap(uint64_t addr, uint64_t len, uint64_t prot)
 uint64_t
 Syscall_MUnmap(uint64_t addr, uint64_t len)
 {
-    Thread *cur = Sched_Current();
-    uint64_t p;
+    Thread *cur;
+    int status;
 
-    for (p = 0; p < len; p += PGSIZE)
-    {
-	// Free page
-    }
+    if ((addr % PGSIZE) != 0 || len == 0)
+	return SYSCALL_PACK(EINVAL, 0);
 
-    PMap_Unmap(cur->space, addr, len /= PGSIZE);
-    Thread_Release(cur);
+    cur = Sched_CurrentBorrow();
+    status = VM_Unmap(cur->space, addr, len);
 
-    return 0;
+    return SYSCALL_PACK(status, 0);
 }
 
 uint64_t
 Syscall_MProtect(uint64_t addr, uint64_t len, uint64_t prot)
 {
-    //Thread *cur = Sched_Current();
-    NOT_IMPLEMENTED();
-    return 0;
+    Thread *cur;
+    int status;
+
+    if ((addr % PGSIZE) != 0 || len == 0 ||
+	(prot & ~(uint64_t)(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0)
+	return SYSCALL_PACK(EINVAL, 0);
+
+    cur = Sched_CurrentBorrow();
+    status = VM_Protect(cur->space, addr, len, prot);
+
+    return SYSCALL_PACK(status, 0);
 }
 
 uint64_t
 Syscall_Read(uint64_t fd, uint64_t addr, uint64_t off, uint64_t length)
 {
     uint64_t status;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     Handle *handle = Handle_Lookup(cur->proc, fd);
 
     if (handle == NULL) {
 	status = -EBADF;
     } else {
 	status = (handle->read)(handle, (void *)addr, off, length);
+	Handle_Release(handle);
     }
 
-    Thread_Release(cur);
-
     return status;
 }
 
@@ -248,17 +282,16 @@ uint64_t
 Syscall_Write(uint64_t fd, uint64_t addr, uint64_t off, uint64_t length)
 {
     uint64_t status;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     Handle *handle = Handle_Lookup(cur->proc, fd);
 
     if (handle == NULL) {
 	status = -EBADF;
     } else {
 	status = (handle->write)(handle, (void *)addr, off, length);
+	Handle_Release(handle);
     }
 
-    Thread_Release(cur);
-
     return status;
 }
 
@@ -266,17 +299,16 @@ uint64_t
 Syscall_Flush(uint64_t fd)
 {
     uint64_t status;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     Handle *handle = Handle_Lookup(cur->proc, fd);
 
     if (handle == NULL) {
 	status = -EBADF;
     } else {
 	status = (handle->flush)(handle);
+	Handle_Release(handle);
     }
 
-    Thread_Release(cur);
-
     return status;
 }
 
@@ -287,13 +319,12 @@ uint64_t
 Syscall_Open(uint64_t user_path, uint64_t flags)
 {
     uint64_t handleNo;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     int status;
     char path[256];
 
     status = Copy_StrIn(user_path, &path, sizeof(path));
     if (status != 0) {
-	Thread_Release(cur);
 	return status;
     }
 
@@ -301,23 +332,19 @@ Syscall_Open(uint64_t user_path, uint64_t flags)
 	if (strcmp("/dev/console", path) == 0) {
 	    Handle *handle = Console_OpenHandle();
 	    handleNo = Handle_Add(cur->proc, handle);
-	    Thread_Release(cur);
 	    return handleNo;
 	}
 
-	Thread_Release(cur);
 	return -ENOENT;
     }
 
     Handle *handle;
     status = VFSUIO_Open(path, &handle);
     if (status != 0) {
-	Thread_Release(cur);
 	return status;
     }
 
     handleNo = Handle_Add(cur->proc, handle);
-    Thread_Release(cur);
     return handleNo;
 }
 
@@ -325,17 +352,16 @@ uint64_t
 Syscall_Close(uint64_t fd)
 {
     uint64_t status;
-    Thread *cur = Sched_Current();
-    Handle *handle = Handle_Lookup(cur->proc, fd);
+    Thread *cur = Sched_CurrentBorrow();
+    Handle *handle = Handle_Remove(cur->proc, fd);
 
     if (handle == NULL) {
 	status = -EBADF;
     } else {
-	status = (handle->close)(handle);
+	// Closes the handle unless a concurrent system call is still using it
+	status = Handle_Release(handle);
     }
 
-    Thread_Release(cur);
-
     return status;
 }
 
@@ -369,51 +395,47 @@ uint64_t
 Syscall_ReadDir(uint64_t fd, char *user_buf, size_t len, uintptr_t user_off)
 {
     int status, rstatus;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     Handle *handle = Handle_Lookup(cur->proc, fd);
     uint64_t offset;
 
     if (handle == NULL) {
-	Thread_Release(cur);
 	return -EBADF;
     }
 
     status = Copy_In(user_off, &offset, sizeof(offset));
     if (status != 0) {
-	Thread_Release(cur);
-	return status;
+	goto done;
     }
 
     if (handle->type != HANDLE_TYPE_FILE) {
-	Thread_Release(cur);
-	return -ENOTDIR;
+	status = -ENOTDIR;
+	goto done;
     }
 
     rstatus = VFS_ReadDir(handle->vnode, user_buf, len, &offset);
     if (rstatus < 0) {
-	Thread_Release(cur);
-	return rstatus;
+	status = rstatus;
+	goto done;
     }
 
     status = Copy_Out(&offset, user_off, sizeof(offset));
-    if (status != 0) {
-	Thread_Release(cur);
-	return status;
+    if (status == 0) {
+	status = rstatus;
     }
 
-    Thread_Release(cur);
-
-    return rstatus;
+done:
+    Handle_Release(handle);
+    return status;
 }
 
 uint64_t
 Syscall_ThreadCreate(uint64_t rip, uint64_t arg)
 {
     uint64_t threadId;
-    Thread *curThread = Sched_Current();
+    Thread *curThread = Sched_CurrentBorrow();
     Thread *newThread = Thread_UThreadCreate(curThread, rip, arg);
 
-    Thread_Release(curThread);
     if (newThread == NULL) {
 	return SYSCALL_PACK(ENOMEM, 0);
     }
@@ -427,25 +449,22 @@ Syscall_ThreadCreate(uint64_t rip, uint64_t arg)
 uint64_t
 Syscall_GetTID()
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
     uint64_t tid = cur->tid;
 
-    Thread_Release(cur);
-
     return tid;
 }
 
 void
 Syscall_ThreadExit(uint64_t status)
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
 
     // Encode this like POSIX
     cur->exitValue = status;
 
     Sched_SetZombie(cur);
     Semaphore_Release(&cur->proc->zombieSemaphore);
-    Thread_Release(cur);
     Sched_Scheduler();
 
     // Should not return
@@ -466,24 +485,30 @@ ThreadWakeupHelper(void *arg)
 uint64_t
 Syscall_ThreadSleep(uint64_t time)
 {
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
 
-    // If the sleep time is zero just yield
+    // Sleep time is in nanoseconds, if it is zero just yield
     if (time != 0) {
+	// The timer holds a reference until it fires
 	Thread_Retain(cur);
+
+	/*
+	 * The timer fires on this CPU, so keeping interrupts off until we are 
+	 * on the wait queue ensures the callback sees timerEvt and wakes us.
+	 */
+	Critical_Enter();
 	cur->timerEvt = KTimer_Create(time, ThreadWakeupHelper, cur);
 	if (cur->timerEvt == NULL) {
-	    Thread_Release(cur);
+	    Critical_Exit();
 	    Thread_Release(cur);
 	    return -ENOMEM;
 	}
 
 	Sched_SetWaiting(cur);
+	Critical_Exit();
     }
     Sched_Scheduler();
 
-    Thread_Release(cur);
-
     return 0;
 }
 
@@ -491,7 +516,7 @@ uint64_t
 Syscall_ThreadWait(uint64_t tid)
 {
     uint64_t status;
-    Thread *cur = Sched_Current();
+    Thread *cur = Sched_CurrentBorrow();
 
     /*
      * Acquire the zombie semaphore see if the specified thread has exited or 
@@ -506,7 +531,6 @@ Syscall_ThreadWait(uint64_t tid)
 	Semaphore_Acquire(&cur->proc->zombieSemaphore);
 	status = Thread_Wait(cur, tid);
 	if (SYSCALL_ERRCODE(status) != EAGAIN) {
-	    Thread_Release(cur);
 	    return status;
 	}
 	Semaphore_Release(&cur->proc->zombieSemaphore);
@@ -514,6 +538,50 @@ Syscall_ThreadWait(uint64_t tid)
     }
 }
 
+uint64_t
+Syscall_ThreadPriority(uint64_t tid, uint64_t priority)
+{
+    int old;
+    Thread *cur = Sched_CurrentBorrow();
+    Thread *thr;
+
+    if ((int)priority != PRIO_QUERY &&
+	((int)priority < PRIO_IDLE || (int)priority > PRIO_MAX))
+	return SYSCALL_PACK(EINVAL, 0);
+
+    if (tid == 0 || tid == cur->tid) {
+	thr = cur;
+    } else {
+	thr = Thread_Lookup(cur->proc, tid);
+	if (thr == NULL)
+	    return SYSCALL_PACK(ESRCH, 0);
+    }
+
+    if ((int)priority == PRIO_QUERY) {
+	old = thr->priority;
+    } else {
+	old = Sched_SetPriority(thr, priority);
+    }
+
+    if (thr != cur)
+	Thread_Release(thr);
+
+    return SYSCALL_PACK(0, old);
+}
+
+uint64_t
+Syscall_Futex(uint64_t addr, uint64_t op, uint64_t val, uint64_t timeout)
+{
+    switch (op) {
+	case FUTEX_WAIT:
+	    return SYSCALL_PACK(Futex_Wait(addr, val, timeout), 0);
+	case FUTEX_WAKE:
+	    return SYSCALL_PACK(0, Futex_Wake(addr, val));
+	default:
+	    return SYSCALL_PACK(EINVAL, 0);
+    }
+}
+
 uint64_t
 Syscall_NICStat(uint64_t nicNo, uint64_t user_stat)
 {
@@ -526,6 +594,7 @@ Syscall_NICStat(uint64_t nicNo, uint64_t user_stat)
     }
 
     status = Copy_Out(nic, user_stat, sizeof(NIC));
+    NIC_Release(nic);
     if (status != 0) {
 	return status;
     }
@@ -554,6 +623,8 @@ Syscall_NICSend(uint64_t nicNo, uint64_t user_mbuf)
     (nic->tx)(nic, &mbuf, NULL, NULL);
     // Unpin Memory
 
+    NIC_Release(nic);
+
     return 0;
 }
 
@@ -578,6 +649,8 @@ Syscall_NICRecv(uint64_t nicNo, uint64_t user_mbuf)
     (nic->rx)(nic, &mbuf, NULL, NULL);
     // Unpin Memory
 
+    NIC_Release(nic);
+
     return 0;
 }
 
@@ -730,6 +803,10 @@ Syscall_Entry(uint64_t syscall, uint64_t a1, uint64_t a2,
 	    return Syscall_ThreadSleep(a1);
 	case SYSCALL_THREADWAIT:
 	    return Syscall_ThreadWait(a1);
+	case SYSCALL_THREADPRIORITY:
+	    return Syscall_ThreadPriority(a1, a2);
+	case SYSCALL_FUTEX:
+	    return Syscall_Futex(a1, a2, a3, a4);
 	case SYSCALL_NICSTAT:
 	    return Syscall_NICStat(a1, a2);
 	case SYSCALL_NICSEND:
@@ -15,9 +15,11 @@
 #include <sys/kdebug.h>
 #include <sys/kmem.h>
 #include <sys/ktime.h>
+#include <sys/mman.h>
 #include <sys/mp.h>
 #include <sys/spinlock.h>
 #include <sys/thread.h>
+#include <sys/vm.h>
 
 #include <machine/trap.h>
 #include <machine/pmap.h>
@@ -30,10 +32,7 @@
  */
 
 /* Globals declared in sched.c */
-extern Spinlock schedLock;
-extern ThreadQueue waitQueue;
-extern ThreadQueue runnableQueue;
-extern Thread *curProc[MAX_CPUS];
+extern SchedQueue runQueue[MAX_CPUS];
 
 /* Globals declared in process.c */
 extern Spinlock procLock;
@@ -58,10 +57,13 @@ Thread_Init()
     Slab_Init(&threadSlab, "Thread Objects", sizeof(Thread), 16);
 
     Spinlock_Init(&procLock, "Process List Lock", SPINLOCK_TYPE_NORMAL);
-    Spinlock_Init(&schedLock, "Scheduler Lock", SPINLOCK_TYPE_RECURSIVE);
-
-    TAILQ_INIT(&waitQueue);
-    TAILQ_INIT(&runnableQueue);
+    for (int c = 0; c < MAX_CPUS; c++) {
+	Spinlock_Init(&runQueue[c].lock, "Scheduler Queue",
+		      SPINLOCK_TYPE_RECURSIVE);
+	for (int l = 0; l < SCHED_QUEUES; l++)
+	    TAILQ_INIT(&runQueue[c].runnable[l]);
+	TAILQ_INIT(&runQueue[c].wait);
+    }
     TAILQ_INIT(&processList);
 
     Handle_GlobalInit();
@@ -71,8 +73,9 @@ Thread_Init()
 
     // Create an thread object for current context
     Process *proc = Process_Create(NULL, "init");
-    curProc[0] = Thread_Create(proc);
-    curProc[0]->schedState = SCHED_STATE_RUNNING;
+    percpu[0].curProc = Thread_Create(proc);
+    percpu[0].curProc->schedState = SCHED_STATE_RUNNING;
+    percpu[0].curProc->lastCPU = 0;
 }
 
 void
@@ -81,11 +84,15 @@ Thread_InitAP()
     Thread *apthr = Thread_Create(kernelProcess);
 
     apthr->schedState = SCHED_STATE_RUNNING;
+    apthr->lastCPU = CPU();
 
     //PAlloc_Release((void *)thr->kstack);
     //thr->kstack = 0;
 
-    curProc[CPU()] = apthr;
+    PERCPU_SET(curProc, apthr);
+
+    // The AP boot thread becomes the idle thread for this CPU
+    Sched_SetIdle(apthr);
 }
 
 /*
@@ -123,6 +130,9 @@ Thread_Create(Process *proc)
     Spinlock_Unlock(&proc->lock);
 
     thr->schedState = SCHED_STATE_NULL;
+    thr->priority = PRIO_NORMAL;
+    thr->level = SCHED_TOPLEVEL(PRIO_NORMAL);
+    thr->quantum = SCHED_QUANTUM(thr->level);
     thr->timerEvt = NULL;
     thr->refCount = 1;
 
@@ -164,6 +174,9 @@ Thread_UThreadCreate(Thread *oldThr, uint64_t rip, uint64_t arg)
 
     thr->space = oldThr->space;
     thr->schedState = SCHED_STATE_NULL;
+    thr->priority = oldThr->priority;
+    thr->level = SCHED_TOPLEVEL(thr->priority);
+    thr->quantum = SCHED_QUANTUM(thr->level);
     thr->refCount = 1;
 
     Spinlock_Lock(&proc->lock);
@@ -171,8 +184,13 @@ Thread_UThreadCreate(Thread *oldThr, uint64_t rip, uint64_t arg)
     proc->ustackNext += MEM_USERSPACE_STKLEN;
     Spinlock_Unlock(&proc->lock);
 
-    PMap_AllocMap(thr->space, thr->ustack, MEM_USERSPACE_STKLEN, PTE_W);
-    // XXX: Check failure
+    // Thread stacks are demand paged
+    if (!VM_Map(thr->space, thr->ustack, MEM_USERSPACE_STKLEN,
+		PROT_READ|PROT_WRITE, 0)) {
+	PAlloc_Release((void *)thr->kstack);
+	Slab_Free(&threadSlab, thr);
+	return NULL;
+    }
 
     Thread_InitArch(thr);
     // Initialize queue
@@ -191,6 +209,12 @@ Thread_UThreadCreate(Thread *oldThr, uint64_t rip, uint64_t arg)
     return thr;
 }
 
+static void
+ThreadFree(void *arg)
+{
+    Slab_Free(&threadSlab, arg);
+}
+
 static void
 Thread_Destroy(Thread *thr)
 {
@@ -200,6 +224,8 @@ Thread_Destroy(Thread *thr)
     ASSERT(proc->pid != 1);
 
     // Free userspace stack
+    if (thr->ustack != 0)
+	VM_Unmap(thr->space, thr->ustack, MEM_USERSPACE_STKLEN);
 
     Spinlock_Lock(&proc->lock);
     proc->threads--;
@@ -212,13 +238,36 @@ Thread_Destroy(Thread *thr)
     // Release process handle
     Process_Release(thr->proc);
 
-    Slab_Free(&threadSlab, thr);
+    // Thread_Lookup may still be walking past us
+    Epoch_Defer(&thr->epochEntry, ThreadFree, thr);
+}
+
+/**
+ * ThreadTryRetain --
+ *
+ * Take a reference unless the thread has already dropped its last one.
+ */
+static bool
+ThreadTryRetain(Thread *thr)
+{
+    uint64_t refCount;
+
+    do {
+	refCount = thr->refCount;
+	if (refCount == 0)
+	    return false;
+    } while (!__sync_bool_compare_and_swap(&thr->refCount, refCount,
+					   refCount + 1));
+
+    return true;
 }
 
 /**
  * Thread_Lookup --
  *
- * Lookup a thread by TID and increment its reference count.
+ * Lookup a thread by TID and increment its reference count.  The thread list 
+ * is walked without taking the process lock, removed threads are freed only 
+ * after an epoch grace period.
  *
  * @param [in] proc Process within which to find a specific thread.
  * @param [in] tid Thread ID of the thread to find.
@@ -231,15 +280,15 @@ Thread_Lookup(Process *proc, uint64_t tid)
     Thread *t;
     Thread *thr = NULL;
 
-    Spinlock_Lock(&proc->lock);
+    Epoch_Enter();
     TAILQ_FOREACH(t, &proc->threadList, threadList) {
-	if (t->tid == tid) {
-	    Thread_Retain(t);
+	// Skip threads that are being destroyed
+	if (t->tid == tid && ThreadTryRetain(t)) {
 	    thr = t;
 	    break;
 	}
     }
-    Spinlock_Unlock(&proc->lock);
+    Epoch_Exit();
 
     return thr;
 }
@@ -313,9 +362,9 @@ extern TaskStateSegment64 TSS[MAX_CPUS];
 void
 ThreadKThreadEntry(TrapFrame *tf) __NO_LOCK_ANALYSIS
 {
-    TSS[CPU()].rsp0 = curProc[CPU()]->kstack + 4096;
+    TSS[CPU()].rsp0 = PERCPU_GET(curProc)->kstack + 4096;
 
-    Spinlock_Unlock(&schedLock);
+    Spinlock_Unlock(&runQueue[CPU()].lock);
 
     Trap_Pop(tf);
 }
@@ -341,6 +390,8 @@ Thread_Dump(Thread *thr)
     kprintf("tid        %llu\n", thr->tid);
     kprintf("refCount   %d\n", thr->refCount);
     kprintf("state      %s\n", states[thr->schedState]);
+    kprintf("lastcpu    %d\n", thr->lastCPU);
+    kprintf("priority   %d (level %d)\n", thr->priority, thr->level);
     kprintf("ctxswtch   %llu\n", thr->ctxSwitches);
     kprintf("utime      %llu\n", thr->userTime);
     kprintf("ktime      %llu\n", thr->kernTime);
@@ -358,21 +409,25 @@ Debug_Threads(int argc, const char *argv[])
     //Spinlock_Lock(&threadLock);
 
     for (int i = 0; i < MAX_CPUS; i++) {
-	thr = curProc[i];
+	thr = percpu[i].curProc;
 	if (thr) {
 	    kprintf("Running Thread CPU %d: %d(%016llx) %d\n", i, thr->tid, thr, thr->ctxSwitches);
 	    Thread_Dump(thr);
 	}
     }
-    TAILQ_FOREACH(thr, &runnableQueue, schedQueue)
-    {
-	kprintf("Runnable Thread: %d(%016llx) %d\n", thr->tid, thr, thr->ctxSwitches);
-	Thread_Dump(thr);
-    }
-    TAILQ_FOREACH(thr, &waitQueue, schedQueue)
-    {
-	kprintf("Waiting Thread: %d(%016llx) %d\n", thr->tid, thr, thr->ctxSwitches);
-	Thread_Dump(thr);
+    for (int i = 0; i < MAX_CPUS; i++) {
+	for (int l = 0; l < SCHED_QUEUES; l++) {
+	    TAILQ_FOREACH(thr, &runQueue[i].runnable[l], schedQueue)
+	    {
+		kprintf("Runnable Thread CPU %d: %d(%016llx) %d\n", i, thr->tid, thr, thr->ctxSwitches);
+		Thread_Dump(thr);
+	    }
+	}
+	TAILQ_FOREACH(thr, &runQueue[i].wait, schedQueue)
+	{
+	    kprintf("Waiting Thread CPU %d: %d(%016llx) %d\n", i, thr->tid, thr, thr->ctxSwitches);
+	    Thread_Dump(thr);
+	}
     }
 
     //Spinlock_Unlock(&threadLock);
@@ -383,7 +438,7 @@ REGISTER_DBGCMD(threads, "Display list of threads", Debug_Threads);
 static void
 Debug_ThreadInfo(int argc, const char *argv[])
 {
-    Thread *thr = curProc[CPU()];
+    Thread *thr = PERCPU_GET(curProc);
 
     kprintf("Current Thread State:\n");
     Thread_Dump(thr);
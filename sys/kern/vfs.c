@@ -14,6 +14,8 @@
 #include <sys/disk.h>
 #include <sys/vfs.h>
 #include <sys/handle.h>
+#include <sys/thread.h>
+#include <sys/loader.h>
 
 extern VFS *O2FS_Mount(Disk *root);
 
@@ -96,7 +98,9 @@ VFS_Lookup(const char *path)
 
 	oldNode = curNode;
 	curNode = NULL;
+	RWLock_ReadLock(&oldNode->lock);
 	status = oldNode->op->lookup(oldNode, &curNode, curName);
+	RWLock_ReadUnlock(&oldNode->lock);
 	if (status < 0) {
 	    // Release
 	    return NULL;
@@ -127,7 +131,9 @@ VFS_Stat(const char *path, struct stat *sb)
     if (vn == NULL)
 	return -ENOENT;
 
+    RWLock_ReadLock(&vn->lock);
     vn->op->stat(vn, sb);
+    RWLock_ReadUnlock(&vn->lock);
 
     // Release
 
@@ -179,7 +185,13 @@ VFS_Close(VNode *fn)
 int
 VFS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
 {
-    return fn->op->read(fn, buf, off, len);
+    int status;
+
+    RWLock_ReadLock(&fn->lock);
+    status = fn->op->read(fn, buf, off, len);
+    RWLock_ReadUnlock(&fn->lock);
+
+    return status;
 }
 
 /**
@@ -197,7 +209,19 @@ VFS_Read(VNode *fn, void *buf, uint64_t off, uint64_t len)
 int
 VFS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
 {
-    return fn->op->write(fn, buf, off, len);
+    int status;
+
+    RWLock_WriteLock(&fn->lock);
+    status = fn->op->write(fn, buf, off, len);
+    /*
+     * Cached executable images must not outlive their contents.  We still hold 
+     * the lock so no loader can read the new contents before this.
+     */
+    if (status >= 0)
+	Loader_Invalidate(fn);
+    RWLock_WriteUnlock(&fn->lock);
+
+    return status;
 }
 
 /**
@@ -215,6 +239,12 @@ VFS_Write(VNode *fn, void *buf, uint64_t off, uint64_t len)
 int
 VFS_ReadDir(VNode *fn, void *buf, uint64_t len, uint64_t *off)
 {
-    return fn->op->readdir(fn, buf, len, off);
+    int status;
+
+    RWLock_ReadLock(&fn->lock);
+    status = fn->op->readdir(fn, buf, len, off);
+    RWLock_ReadUnlock(&fn->lock);
+
+    return status;
 }
 
@@ -47,7 +47,7 @@ VFSUIO_Close(Handle *handle)
     ASSERT(handle->type == HANDLE_TYPE_FILE);
 
     status = VFS_Close(handle->vnode);
-    Handle_Free(handle);
+    Handle_Retire(handle);
 
     return status;
 }
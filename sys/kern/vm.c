@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2013-2023 Ali Mashtizadeh
+ * All rights reserved.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <errno.h>
+
+#include <sys/kassert.h>
+#include <sys/kdebug.h>
+#include <sys/kmem.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/sysctl.h>
+#include <sys/vm.h>
+
+#include <machine/amd64.h>
+#include <machine/pmap.h>
+
+static Slab regionSlab;
+static uint64_t vmFaults;
+static uint64_t vmFaultsFailed;
+static uint64_t vmCOWFaults;
+static uint64_t vmClones;
+
+DEFINE_SLAB(VMRegion, &regionSlab);
+
+void
+VM_Init()
+{
+    Slab_Init(&regionSlab, "VMRegion Objects", sizeof(VMRegion), 16);
+}
+
+/**
+ * VM_InitAS --
+ *
+ * Initialize the region list of a new address space.
+ */
+void
+VM_InitAS(AS *as)
+{
+    Spinlock_Init(&as->regionLock, "AS Region Lock", SPINLOCK_TYPE_NORMAL);
+    TAILQ_INIT(&as->regions);
+}
+
+/**
+ * VM_DestroyAS --
+ *
+ * Free the regions of an address space.  The pages themselves are released
+ * along with the page tables.
+ */
+void
+VM_DestroyAS(AS *as)
+{
+    VMRegion *r;
+
+    Spinlock_Lock(&as->regionLock);
+    while ((r = TAILQ_FIRST(&as->regions)) != NULL) {
+	TAILQ_REMOVE(&as->regions, r, regionList);
+	VMRegion_Free(r);
+    }
+    Spinlock_Unlock(&as->regionLock);
+
+    Spinlock_Destroy(&as->regionLock);
+}
+
+/**
+ * VMLookupProt --
+ *
+ * Find the protection of a virtual address.  Regions mapped with 
+ * VM_MAP_OVERLAP may overlap (e.g. ELF segments sharing a page) in which case 
+ * the permissions are combined.  The region lock must be held.
+ *
+ * @retval false The address is not inside any region.
+ */
+static bool
+VMLookupProt(AS *as, uintptr_t va, uint64_t *prot)
+{
+    bool found = false;
+    VMRegion *r;
+
+    *prot = PROT_NONE;
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	// Sorted by start address
+	if (r->start > va)
+	    break;
+
+	if (va < r->end) {
+	    *prot |= r->prot;
+	    found = true;
+	}
+    }
+
+    return found;
+}
+
+static uint64_t
+VMProtToPTE(uint64_t prot)
+{
+    uint64_t flags = 0;
+
+    if (prot & PROT_WRITE)
+	flags |= PTE_W;
+    if ((prot & PROT_EXEC) == 0)
+	flags |= PTE_NX;
+
+    return flags;
+}
+
+/**
+ * VMInsertRegion --
+ *
+ * Insert a region into the sorted region list.  The region lock must be held.
+ */
+static void
+VMInsertRegion(AS *as, VMRegion *r)
+{
+    VMRegion *it;
+
+    TAILQ_FOREACH(it, &as->regions, regionList) {
+	if (it->start > r->start)
+	    break;
+    }
+    if (it != NULL)
+	TAILQ_INSERT_BEFORE(it, r, regionList);
+    else
+	TAILQ_INSERT_TAIL(&as->regions, r, regionList);
+}
+
+/**
+ * VMRangeFree --
+ *
+ * Check that no region overlaps a range.  The region lock must be held.
+ */
+static bool
+VMRangeFree(AS *as, uintptr_t start, uintptr_t end)
+{
+    VMRegion *r;
+
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	if (r->start >= end)
+	    break;
+	if (r->end > start)
+	    return false;
+    }
+
+    return true;
+}
+
+/**
+ * VMLargeEligible --
+ *
+ * Check if the 2MB page containing an address may be backed by a large page.  
+ * The whole large page must lie inside every region that overlaps it so the 
+ * protection is uniform and no memory outside the mapping is exposed.  The 
+ * region lock must be held.
+ */
+static bool
+VMLargeEligible(AS *as, uintptr_t va)
+{
+    uintptr_t base = va & ~(uintptr_t)LARGE_PGMASK;
+    uintptr_t end = base + LARGE_PGSIZE;
+    bool found = false;
+    VMRegion *r;
+
+    if (!SYSCTL_GETBOOL(vm_largepages))
+	return false;
+
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	if (r->start >= end)
+	    break;
+	if (r->end <= base)
+	    continue;
+	if (r->start > base || r->end < end)
+	    return false;
+	found = true;
+    }
+
+    return found;
+}
+
+/**
+ * VMAllocPage --
+ *
+ * Back the page containing an address with memory, preferring a 2MB page when 
+ * the mapping allows it.  The region lock must be held.
+ *
+ * @retval 0 Out of memory.
+ * @return Size of the page that backs the address.
+ */
+static uintptr_t
+VMAllocPage(AS *as, uintptr_t va, uint64_t prot)
+{
+    if (VMLargeEligible(as, va) &&
+	PMap_AllocMapLarge(as, va & ~(uintptr_t)LARGE_PGMASK, VMProtToPTE(prot)))
+	return LARGE_PGSIZE;
+
+    /*
+     * PMap_AllocMap skips pages that are already present, which happens
+     * when two threads fault on the same page.
+     */
+    if (!PMap_AllocMap(as, va & ~(uintptr_t)PGMASK, PGSIZE, VMProtToPTE(prot)))
+	return 0;
+
+    return PGSIZE;
+}
+
+/**
+ * VM_Map --
+ *
+ * Add a region to a user address space.  Memory is not allocated until the
+ * pages are touched unless VM_MAP_POPULATE is passed.  The range must not 
+ * overlap an existing region unless VM_MAP_OVERLAP is passed, which the loader 
+ * uses for segments that share a page.  The two flags cannot be combined as a 
+ * failed populate could not tell our pages apart from those of the other 
+ * regions.
+ *
+ * @param [in] as Address space.
+ * @param [in] start Start of the region (rounded down to a page).
+ * @param [in] len Length of the region (rounded up to a page).
+ * @param [in] prot Protection bits (PROT_*).
+ * @param [in] flags VM_MAP_* flags.
+ *
+ * @retval true On success
+ * @retval false Invalid or overlapping range, or out of memory.
+ */
+bool
+VM_Map(AS *as, uintptr_t start, uintptr_t len, uint64_t prot, uint64_t flags)
+{
+    uintptr_t end = ROUNDUP(start + len, PGSIZE);
+    VMRegion *r;
+
+    ASSERT((flags & (VM_MAP_POPULATE|VM_MAP_OVERLAP)) !=
+	   (VM_MAP_POPULATE|VM_MAP_OVERLAP));
+
+    start = start & ~(uintptr_t)PGMASK;
+    if (len == 0 || end <= start || end > MEM_USERSPACE_TOP)
+	return false;
+
+    r = VMRegion_Alloc();
+    if (!r)
+	return false;
+
+    r->start = start;
+    r->end = end;
+    r->prot = prot;
+    r->maxProt = PROT_READ|PROT_WRITE|PROT_EXEC;
+
+    Spinlock_Lock(&as->regionLock);
+    if (!(flags & VM_MAP_OVERLAP) && !VMRangeFree(as, start, end)) {
+	Spinlock_Unlock(&as->regionLock);
+	VMRegion_Free(r);
+	return false;
+    }
+    VMInsertRegion(as, r);
+    Spinlock_Unlock(&as->regionLock);
+
+    // The range only holds our region so this cannot remove anything else
+    if ((flags & VM_MAP_POPULATE) && !VM_Populate(as, start, end - start)) {
+	VM_Unmap(as, start, end - start);
+	return false;
+    }
+
+    return true;
+}
+
+/**
+ * VM_MapShared --
+ *
+ * Map a kernel page read-only into a user address space.  The page is shared 
+ * with the kernel and other processes (e.g. the time page) so the region can 
+ * never be made writable.
+ *
+ * @param [in] as Address space.
+ * @param [in] va Page aligned user address.
+ * @param [in] pg Page allocated with PAlloc, a reference is taken.
+ *
+ * @retval true On success
+ * @retval false On failure
+ */
+bool
+VM_MapShared(AS *as, uintptr_t va, void *pg)
+{
+    bool status;
+    VMRegion *r;
+
+    if ((va & PGMASK) || va + PGSIZE > MEM_USERSPACE_TOP)
+	return false;
+
+    r = VMRegion_Alloc();
+    if (!r)
+	return false;
+
+    r->start = va;
+    r->end = va + PGSIZE;
+    r->prot = PROT_READ;
+    r->maxProt = PROT_READ;
+
+    Spinlock_Lock(&as->regionLock);
+    if (!VMRangeFree(as, va, va + PGSIZE)) {
+	Spinlock_Unlock(&as->regionLock);
+	VMRegion_Free(r);
+	return false;
+    }
+    VMInsertRegion(as, r);
+    status = PMap_MapShared(as, va, pg, VMProtToPTE(PROT_READ));
+    Spinlock_Unlock(&as->regionLock);
+
+    if (!status)
+	VM_Unmap(as, va, PGSIZE);
+
+    return status;
+}
+
+/**
+ * VM_Populate --
+ *
+ * Allocate all pages of a range that is already covered by regions.  This is
+ * used by the loader and the kernel to touch user memory through the direct
+ * map.
+ *
+ * @retval true On success
+ * @retval false The range is not mapped or we ran out of memory.
+ */
+bool
+VM_Populate(AS *as, uintptr_t start, uintptr_t len)
+{
+    uintptr_t va;
+    uintptr_t end = ROUNDUP(start + len, PGSIZE);
+    uintptr_t size;
+    uint64_t prot;
+
+    Spinlock_Lock(&as->regionLock);
+    va = start & ~(uintptr_t)PGMASK;
+    while (va < end) {
+	size = 0;
+	if (VMLookupProt(as, va, &prot))
+	    size = VMAllocPage(as, va, prot);
+	if (size == 0) {
+	    Spinlock_Unlock(&as->regionLock);
+	    return false;
+	}
+
+	va = (va & ~(size - 1)) + size;
+    }
+    Spinlock_Unlock(&as->regionLock);
+
+    return true;
+}
+
+/**
+ * VMSplit --
+ *
+ * Split the regions that straddle an address so that no region crosses it.  
+ * The region lock must be held.
+ *
+ * @retval false Out of memory, regions split so far are left split.
+ */
+static bool
+VMSplit(AS *as, uintptr_t addr)
+{
+    VMRegion *r;
+    VMRegion *n;
+
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	// The new half sorts after r and ends the walk
+	if (r->start >= addr)
+	    break;
+	if (r->end <= addr)
+	    continue;
+
+	n = VMRegion_Alloc();
+	if (!n)
+	    return false;
+
+	n->start = addr;
+	n->end = r->end;
+	n->prot = r->prot;
+	n->maxProt = r->maxProt;
+	r->end = addr;
+	VMInsertRegion(as, n);
+    }
+
+    return true;
+}
+
+/**
+ * VMPrepareRange --
+ *
+ * Demote large pages that straddle the ends of a range and split the regions 
+ * at the ends of the range.  The region lock must be held.
+ */
+static bool
+VMPrepareRange(AS *as, uintptr_t start, uintptr_t end, PMapShootdown *sd)
+{
+    if ((start & LARGE_PGMASK) && !PMap_Demote(as, start, sd))
+	return false;
+    if ((end & LARGE_PGMASK) && !PMap_Demote(as, end, sd))
+	return false;
+
+    return VMSplit(as, start) && VMSplit(as, end);
+}
+
+/**
+ * VM_Unmap --
+ *
+ * Remove a range from an address space and release its pages and any page 
+ * tables that become empty.  Must not be called with spinlocks held.
+ *
+ * @param [in] as Address space.
+ * @param [in] start Page aligned start of the range.
+ * @param [in] len Length of the range (rounded up to a page).
+ *
+ * @retval 0 On success
+ * @retval EINVAL The range is unaligned or outside of user space.
+ * @retval ENOMEM Out of memory splitting a large page or a region.
+ */
+int
+VM_Unmap(AS *as, uintptr_t start, uintptr_t len)
+{
+    uintptr_t end = ROUNDUP(start + len, PGSIZE);
+    uintptr_t va;
+    VMRegion *r;
+    VMRegion *tmp;
+    PMapShootdown sd;
+
+    if ((start & PGMASK) || len == 0 || end <= start ||
+	end > MEM_USERSPACE_TOP)
+	return EINVAL;
+
+    PMap_ShootdownInit(&sd, as);
+
+    Spinlock_Lock(&as->regionLock);
+    if (!VMPrepareRange(as, start, end, &sd)) {
+	Spinlock_Unlock(&as->regionLock);
+	PMap_ShootdownFlush(&sd);
+	return ENOMEM;
+    }
+
+    TAILQ_FOREACH_SAFE(r, &as->regions, regionList, tmp) {
+	if (r->start >= end)
+	    break;
+	if (r->start >= start && r->end <= end) {
+	    TAILQ_REMOVE(&as->regions, r, regionList);
+	    VMRegion_Free(r);
+	}
+    }
+    Spinlock_Unlock(&as->regionLock);
+
+    /*
+     * The regions are gone so no fault can repopulate the range.  Pages are 
+     * released in batches as the shootdown can only be sent without locks.
+     */
+    va = start;
+    do {
+	Spinlock_Lock(&as->regionLock);
+	va = PMap_Unmap(as, va, end, &sd);
+	Spinlock_Unlock(&as->regionLock);
+	PMap_ShootdownFlush(&sd);
+    } while (va < end);
+
+    return 0;
+}
+
+/**
+ * VM_Protect --
+ *
+ * Change the protection of a range that is entirely covered by regions.  Must 
+ * not be called with spinlocks held.
+ *
+ * @param [in] as Address space.
+ * @param [in] start Page aligned start of the range.
+ * @param [in] len Length of the range (rounded up to a page).
+ * @param [in] prot New protection bits (PROT_*).
+ *
+ * @retval 0 On success
+ * @retval EINVAL The range is unaligned, outside of user space or not mapped.
+ * @retval EACCES The protection exceeds what a region allows.
+ * @retval ENOMEM Out of memory splitting a large page or a region.
+ */
+int
+VM_Protect(AS *as, uintptr_t start, uintptr_t len, uint64_t prot)
+{
+    uintptr_t end = ROUNDUP(start + len, PGSIZE);
+    uintptr_t covered = start;
+    bool allowed = true;
+    uint64_t flags;
+    VMRegion *r;
+    PMapShootdown sd;
+
+    if ((start & PGMASK) || len == 0 || end <= start ||
+	end > MEM_USERSPACE_TOP)
+	return EINVAL;
+
+    // Without read access the pages are only accessible to the kernel
+    if (prot == PROT_NONE)
+	flags = PTE_NX;
+    else
+	flags = VMProtToPTE(prot) | PTE_U;
+
+    PMap_ShootdownInit(&sd, as);
+
+    Spinlock_Lock(&as->regionLock);
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	if (r->start > covered || r->start >= end)
+	    break;
+	if (r->end <= start)
+	    continue;
+	// Shared pages can never be made writable
+	if ((prot & ~r->maxProt) != 0)
+	    allowed = false;
+	if (r->end > covered)
+	    covered = r->end;
+    }
+    if (covered < end || !allowed) {
+	Spinlock_Unlock(&as->regionLock);
+	return covered < end ? EINVAL : EACCES;
+    }
+    if (!VMPrepareRange(as, start, end, &sd)) {
+	Spinlock_Unlock(&as->regionLock);
+	PMap_ShootdownFlush(&sd);
+	return ENOMEM;
+    }
+
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	if (r->start >= end)
+	    break;
+	if (r->start >= start && r->end <= end)
+	    r->prot = prot;
+    }
+
+    PMap_Protect(as, start, end, flags, &sd);
+    Spinlock_Unlock(&as->regionLock);
+
+    PMap_ShootdownFlush(&sd);
+
+    return 0;
+}
+
+/**
+ * VM_CloneAS --
+ *
+ * Clone the regions and pages of an address space into a newly created 
+ * address space.  Pages are shared copy on write, so this only copies page 
+ * tables.  Must not be called with spinlocks held as the source TLBs may need 
+ * to be flushed on other CPUs.
+ *
+ * @param [in] dst New address space without any regions.
+ * @param [in] src Address space to clone.
+ *
+ * @retval true On success
+ * @retval false Out of memory, the caller should destroy dst.
+ */
+bool
+VM_CloneAS(AS *dst, AS *src)
+{
+    bool status = true;
+    VMRegion *r;
+    VMRegion *copy;
+
+    ASSERT(TAILQ_EMPTY(&dst->regions));
+
+    Spinlock_Lock(&src->regionLock);
+    Spinlock_Lock(&dst->regionLock);
+    TAILQ_FOREACH(r, &src->regions, regionList) {
+	copy = VMRegion_Alloc();
+	if (!copy) {
+	    status = false;
+	    break;
+	}
+
+	copy->start = r->start;
+	copy->end = r->end;
+	copy->prot = r->prot;
+	copy->maxProt = r->maxProt;
+	TAILQ_INSERT_TAIL(&dst->regions, copy, regionList);
+    }
+    if (status)
+	status = PMap_CloneAS(dst, src);
+    Spinlock_Unlock(&dst->regionLock);
+    Spinlock_Unlock(&src->regionLock);
+
+    // Writable pages in the source are now read-only
+    PMap_Shootdown(src, 0, MEM_USERSPACE_TOP / PGSIZE);
+
+    __sync_fetch_and_add(&vmClones, 1);
+
+    return status;
+}
+
+/**
+ * VM_Fault --
+ *
+ * Handle a page fault on a user address by allocating a zeroed page if the
+ * address lies inside a region that permits the access.  Regions that cover a
+ * whole aligned 2MB range are backed by large pages when contiguous memory is
+ * available.  Write faults on present pages break copy on write sharing.
+ *
+ * @param [in] as Address space that faulted.
+ * @param [in] va Faulting virtual address.
+ * @param [in] flags VM_FAULT_* flags describing the access.
+ *
+ * @retval true The fault was resolved and the access can be retried.
+ * @retval false The access is invalid.
+ */
+bool
+VM_Fault(AS *as, uintptr_t va, uint64_t flags)
+{
+    uint64_t prot;
+    bool status = false;
+    bool cow = false;
+    PMapShootdown sd;
+
+    if (va >= MEM_USERSPACE_TOP)
+	return false;
+
+    va = va & ~(uintptr_t)PGMASK;
+
+    PMap_ShootdownInit(&sd, as);
+    Spinlock_Lock(&as->regionLock);
+    if (!VMLookupProt(as, va, &prot) || prot == PROT_NONE)
+	goto done;
+    if ((flags & VM_FAULT_WRITE) && (prot & PROT_WRITE) == 0)
+	goto done;
+
+    if (flags & VM_FAULT_PROT) {
+	// Only writes to copy on write pages are resolvable
+	if (flags & VM_FAULT_WRITE) {
+	    status = PMap_CopyOnWrite(as, va, &sd);
+	    cow = status;
+	}
+    } else {
+	status = (VMAllocPage(as, va, prot) != 0);
+    }
+
+done:
+    Spinlock_Unlock(&as->regionLock);
+
+    /*
+     * Other threads of this process may still have the old read-only page in 
+     * their TLBs, a copied page is only freed once they are flushed.
+     */
+    PMap_ShootdownFlush(&sd);
+    if (cow)
+	__sync_fetch_and_add(&vmCOWFaults, 1);
+
+    __sync_fetch_and_add(status ? &vmFaults : &vmFaultsFailed, 1);
+
+    return status;
+}
+
+static void
+Debug_VMRegions(int argc, const char *argv[])
+{
+    AS *as = PMap_CurrentAS();
+    VMRegion *r;
+
+    kprintf("Demand Faults: %llu (%llu failed)\n", vmFaults, vmFaultsFailed);
+    kprintf("COW Faults: %llu, Clones: %llu\n", vmCOWFaults, vmClones);
+    kprintf("%-16s %-16s %s\n", "Start", "End", "Prot");
+    TAILQ_FOREACH(r, &as->regions, regionList) {
+	kprintf("%016llx %016llx %c%c%c\n", r->start, r->end,
+		(r->prot & PROT_READ) ? 'r' : '-',
+		(r->prot & PROT_WRITE) ? 'w' : '-',
+		(r->prot & PROT_EXEC) ? 'x' : '-');
+    }
+}
+
+REGISTER_DBGCMD(vmregions, "Display VM regions of the current address space",
+		Debug_VMRegions);
+
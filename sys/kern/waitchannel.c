@@ -59,6 +59,17 @@ WaitChannel_Lock(WaitChannel *wchan)
     Spinlock_Lock(&wchan->lock);
 }
 
+/**
+ * WaitChannel_Unlock --
+ *
+ * Releases the wait channel lock without sleeping.
+ */
+void
+WaitChannel_Unlock(WaitChannel *wchan)
+{
+    Spinlock_Unlock(&wchan->lock);
+}
+
 /**
  * WaitChannel_Sleep --
  *
@@ -89,10 +100,27 @@ WaitChannel_Sleep(WaitChannel *wchan)
  */
 void
 WaitChannel_Wake(WaitChannel *wchan)
+{
+    Spinlock_Lock(&wchan->lock);
+    WaitChannel_WakeLocked(wchan);
+    Spinlock_Unlock(&wchan->lock);
+}
+
+/**
+ * WaitChannel_WakeLocked --
+ *
+ * Wake up a single thread while the caller holds the wait channel lock.  This 
+ * lets the caller inspect the head of the queue before it is woken.
+ *
+ * Side Effects:
+ * Releases the thread reference once complete.
+ */
+void
+WaitChannel_WakeLocked(WaitChannel *wchan)
 {
     Thread *thr;
 
-    Spinlock_Lock(&wchan->lock);
+    ASSERT(Spinlock_IsHeld(&wchan->lock));
 
     thr = TAILQ_FIRST(&wchan->chanQueue);
     if (thr != NULL) {
@@ -100,8 +128,6 @@ WaitChannel_Wake(WaitChannel *wchan)
 	Sched_SetRunnable(thr);
 	Thread_Release(thr);
     }
-
-    Spinlock_Unlock(&wchan->lock);
 }
 
 /**
@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#define SPARSE_BASE	0x600000000ULL
+#define SPARSE_LEN	(256 * 1024 * 1024)
+#define POPULATE_BASE	0x700000000ULL
+#define POPULATE_LEN	(64 * 1024)
+#define PAGE_SIZE	4096
+#define SPARSE_STRIDE	(32 * 1024 * 1024)
+#define LARGE_ALLOC	(4 * 1024 * 1024 - 64)
+#define LARGE_ITERS	64
+
+int
+main(int argc, const char *argv[])
+{
+    uint64_t i;
+    char *sparse;
+    char *populated;
+
+    printf("MMap Test\n");
+
+    /*
+     * Only the pages we touch in this large mapping should be allocated.
+     */
+    sparse = mmap((void *)SPARSE_BASE, SPARSE_LEN, PROT_READ|PROT_WRITE,
+		  MAP_ANON|MAP_FIXED, -1, 0);
+    if (sparse != (char *)SPARSE_BASE) {
+	printf("Sparse mmap failed!\n");
+	return 1;
+    }
+
+    for (i = 0; i < SPARSE_LEN; i += SPARSE_STRIDE) {
+	if (sparse[i] != 0) {
+	    printf("Page not zeroed at offset %llx!\n", i);
+	    return 1;
+	}
+	sparse[i] = (char)(i >> 20);
+    }
+    for (i = 0; i < SPARSE_LEN; i += SPARSE_STRIDE) {
+	if (sparse[i] != (char)(i >> 20)) {
+	    printf("Bad data at offset %llx!\n", i);
+	    return 1;
+	}
+    }
+
+    populated = mmap((void *)POPULATE_BASE, POPULATE_LEN, PROT_READ|PROT_WRITE,
+		     MAP_ANON|MAP_FIXED|MAP_POPULATE, -1, 0);
+    if (populated != (char *)POPULATE_BASE) {
+	printf("Populated mmap failed!\n");
+	return 1;
+    }
+
+    for (i = 0; i < POPULATE_LEN; i += PAGE_SIZE) {
+	if (populated[i] != 0) {
+	    printf("Page not zeroed at offset %llx!\n", i);
+	    return 1;
+	}
+    }
+
+    /*
+     * Unmapped memory must come back zeroed when it is mapped again.
+     */
+    if (munmap(sparse, SPARSE_LEN) != 0) {
+	printf("Sparse munmap failed!\n");
+	return 1;
+    }
+    sparse = mmap((void *)SPARSE_BASE, SPARSE_LEN, PROT_READ|PROT_WRITE,
+		  MAP_ANON|MAP_FIXED, -1, 0);
+    for (i = 0; i < SPARSE_LEN; i += SPARSE_STRIDE) {
+	if (sparse[i] != 0) {
+	    printf("Page not zeroed after remap at offset %llx!\n", i);
+	    return 1;
+	}
+    }
+
+    /*
+     * Partially unmap and reprotect the populated mapping.
+     */
+    populated[0] = 1;
+    populated[POPULATE_LEN - 1] = 2;
+    if (munmap(populated + PAGE_SIZE, POPULATE_LEN - 2 * PAGE_SIZE) != 0 ||
+	mprotect(populated, PAGE_SIZE, PROT_READ) != 0 ||
+	mprotect(populated, PAGE_SIZE, PROT_READ|PROT_WRITE) != 0) {
+	printf("Partial munmap/mprotect failed!\n");
+	return 1;
+    }
+    if (mprotect(populated + PAGE_SIZE, PAGE_SIZE, PROT_READ) == 0) {
+	printf("mprotect succeeded on an unmapped page!\n");
+	return 1;
+    }
+    populated[0]++;
+    if (populated[0] != 2 || populated[POPULATE_LEN - 1] != 2) {
+	printf("Bad data after partial munmap!\n");
+	return 1;
+    }
+
+    /*
+     * Large allocations must be returned to the kernel when freed, otherwise 
+     * this runs out of memory.
+     */
+    for (i = 0; i < LARGE_ITERS; i++) {
+	char *buf = malloc(LARGE_ALLOC);
+	if (buf == NULL) {
+	    printf("Large malloc failed after %lld iterations!\n", i);
+	    return 1;
+	}
+	memset(buf, 0x5A, LARGE_ALLOC);
+	free(buf);
+    }
+
+    printf("Success!\n");
+
+    return 0;
+}
+
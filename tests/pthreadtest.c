@@ -4,7 +4,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
 #include <pthread.h>
+#include <syscall.h>
 
 #define test_assert(_expr) \
     if (!(_expr)) { \
@@ -63,6 +65,8 @@ main(int argc, const char *argv[])
     int status;
     pthread_t thr;
     void *result;
+    uint64_t now;
+    struct timespec ts;
 
     printf("PThread Test\n");
 
@@ -139,6 +143,19 @@ main(int argc, const char *argv[])
     test_assert(status == 0);
     printf("\n");
 
+    printf("timed condition variable test: ");
+    status = pthread_cond_init(&cnd, NULL);
+    test_assert(status == 0);
+    now = OSTime() + 10000000;
+    ts.tv_sec = now / 1000000000;
+    ts.tv_nsec = now % 1000000000;
+    status = pthread_cond_timedwait(&cnd, NULL, &ts);
+    test_assert(status == ETIMEDOUT);
+    test_assert(OSTime() >= now);
+    status = pthread_cond_destroy(&cnd);
+    test_assert(status == 0);
+    printf("OK\n");
+
     printf("Success!\n");
 
     return 0;